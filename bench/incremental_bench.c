@@ -0,0 +1,192 @@
+/*
+    Incremental Compilation Benchmark for PL/0
+    Author: Ryan Doherty
+
+    Generates a large program, then makes small edits to it one after
+    another the way an editor would, and compares how long it takes to get
+    a runnable program from each edit with an incremental session against
+    compiling from scratch. Every incrementally compiled program is run and
+    has to print the same as the one compiled from scratch.
+
+    usage: incremental_bench [procedures]
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "pl0.h"
+
+// About 58 lines each, so the default makes a 100k line program
+#define DEFAULT_PROCEDURES 1750
+#define NUM_EDITS 4
+
+typedef struct text {
+    char *chars;
+    long length;
+    long capacity;
+} text;
+
+typedef struct output {
+    int64_t sum;
+    int count;
+} output;
+
+char *edit_names[NUM_EDITS] = {"change a constant", "add a statement", "no change", "add a procedure"};
+
+double now();
+void append(text *source, const char *format, ...);
+char *generate(int procedures, int edit);
+int count_lines(char *source);
+void capture_write(void *context, int64_t value);
+int run(pl0_program *program, output *result);
+
+int main(int argc, char **argv) {
+    int procedures = argc > 1 ? atoi(argv[1]) : DEFAULT_PROCEDURES;
+    char error[256];
+
+    char *source = generate(procedures, -1);
+    printf("program: %d lines, %d procedures\n", count_lines(source), procedures);
+
+    pl0_incremental *session = pl0_incremental_create(0);
+    double start = now();
+    pl0_program *program = pl0_incremental_compile(session, source, error, sizeof(error));
+    if (program == NULL) {
+        printf("%s\n", error);
+        return 1;
+    }
+    printf("first compile: %.1f ms\n", (now() - start) * 1000);
+    pl0_program_free(program);
+    free(source);
+
+    printf("%-20s %12s %12s %10s %10s\n", "edit", "full ms", "incr ms", "reused", "generated");
+    int wrong = 0;
+    for (int edit = 0; edit < NUM_EDITS; ++edit) {
+        // Edits pile up like they would in an editor
+        source = generate(procedures, edit);
+
+        start = now();
+        pl0_program *full = pl0_compile(source, 0, error, sizeof(error));
+        double full_time = now() - start;
+
+        start = now();
+        program = pl0_incremental_compile(session, source, error, sizeof(error));
+        double incremental_time = now() - start;
+        if (full == NULL || program == NULL) {
+            printf("%s\n", error);
+            return 1;
+        }
+        int reused;
+        int generated;
+        pl0_incremental_stats(session, &reused, &generated);
+        printf("%-20s %12.1f %12.1f %10d %10d\n", edit_names[edit], full_time * 1000, incremental_time * 1000,
+               reused, generated);
+
+        output expected;
+        output actual;
+        if (!run(full, &expected) || !run(program, &actual) || expected.sum != actual.sum ||
+            expected.count != actual.count) {
+            printf("  the incremental compile printed something different\n");
+            wrong++;
+        }
+        pl0_program_free(full);
+        pl0_program_free(program);
+        free(source);
+    }
+    pl0_incremental_free(session);
+    return wrong > 0;
+}
+
+// Every procedure bumps the globals through a few loops, every tenth has a
+// nested helper, and main calls them all. Edits up to the given one are made.
+char *generate(int procedures, int edit) {
+    text source = {NULL, 0, 0};
+    append(&source, "var g, h;\n");
+    for (int p = 0; p < procedures; ++p) {
+        if (edit >= 3 && p == procedures / 2) {
+            append(&source, "procedure extra;\n    begin g := g + 7 end;\n");
+        }
+        append(&source, "procedure p%d;\n", p);
+        append(&source, "    const k%d := %d;\n", p, p % 97);
+        append(&source, "    var a%d, b%d, c%d;\n", p, p, p);
+        if (p % 10 == 0) {
+            append(&source, "    procedure q%d;\n", p);
+            append(&source, "        begin h := h + a%d / 5 end;\n", p);
+        }
+        append(&source, "    begin\n");
+        append(&source, "        a%d := g; b%d := 0; c%d := k%d;\n", p, p, p, p);
+        for (int loop = 0; loop < 10; ++loop) {
+            int factor = edit >= 0 && p == procedures / 2 && loop == 3 ? 11 : (p + loop) % 9 + 1;
+            append(&source, "        while b%d < %d do begin\n", p, loop + 3);
+            append(&source, "            a%d := a%d + b%d * %d - c%d / 3;\n", p, p, p, factor, p);
+            append(&source, "            if odd a%d then g := g + 1 else h := h + a%d / 7;\n", p, p);
+            append(&source, "            b%d := b%d + 1\n", p, p);
+            append(&source, "        end;\n");
+        }
+        if (edit >= 1 && p == procedures / 3) {
+            append(&source, "        g := g + 3;\n");
+        }
+        if (p % 10 == 0) {
+            append(&source, "        call q%d;\n", p);
+        }
+        if (p > 0) {
+            append(&source, "        if g < 0 then call p%d;\n", p - 1);
+        }
+        append(&source, "        g := g - g / 1000 * 1000\n");
+        append(&source, "    end;\n");
+    }
+    append(&source, "begin\n    g := 1; h := 0;\n");
+    for (int p = 0; p < procedures; ++p) {
+        append(&source, "    call p%d;\n", p);
+    }
+    if (edit >= 3) {
+        append(&source, "    call extra;\n");
+    }
+    append(&source, "    write g; write h\nend.\n");
+    return source.chars;
+}
+
+void append(text *source, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (source->length + length + 1 > source->capacity) {
+        source->capacity = 2 * (source->length + length + 1);
+        source->chars = realloc(source->chars, source->capacity);
+    }
+    va_start(args, format);
+    vsnprintf(source->chars + source->length, length + 1, format, args);
+    va_end(args);
+    source->length += length;
+}
+
+int count_lines(char *source) {
+    int lines = 0;
+    for (char *c = source; *c; ++c) {
+        lines += *c == '\n';
+    }
+    return lines;
+}
+
+void capture_write(void *context, int64_t value) {
+    output *result = context;
+    result->sum = result->sum * 31 + value;
+    result->count++;
+}
+
+int run(pl0_program *program, output *result) {
+    result->sum = 0;
+    result->count = 0;
+    pl0_host host = {result, NULL, capture_write};
+    pl0_vm *vm = pl0_instantiate(program, &host);
+    pl0_status status = pl0_run(vm, -1);
+    pl0_vm_free(vm);
+    return status == PL0_HALTED;
+}
+
+double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
@@ -0,0 +1,192 @@
+/*
+    Scheduler Benchmark for PL/0
+    Author: Ryan Doherty
+
+    Runs many small PL/0 programs at once on the scheduler and reports
+    throughput and latency from scheduling a job to its completion.
+    A third of the jobs read input that only arrives after they've been
+    parked, like a script waiting on a request.
+
+    usage: scheduler_bench [jobs] [threads] [slice]
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "pl0.h"
+
+#define DEFAULT_JOBS 10000
+
+char *sources[] = {
+    // Short counting loop
+    "var i, sum;\n"
+    "begin\n"
+    "    i := 0; sum := 0;\n"
+    "    while i < 500 do begin sum := sum + i * i % 7; i := i + 1 end;\n"
+    "    write sum\n"
+    "end.",
+    // Nested procedures and calls
+    "var n, f;\n"
+    "procedure fact;\n"
+    "    var k;\n"
+    "    begin\n"
+    "        if n > 1 then begin k := n; n := n - 1; call fact; f := f * k end else f := 1\n"
+    "    end;\n"
+    "begin n := 10; call fact; write f end.",
+    // Waits for input
+    "var x, i;\n"
+    "begin\n"
+    "    read x; i := 0;\n"
+    "    while i < 100 do begin x := x + i; i := i + 1 end;\n"
+    "    write x\n"
+    "end.",
+};
+#define NUM_SOURCES 3
+#define READER 2
+
+typedef struct job {
+    pl0_vm *vm;
+    int has_input;
+    int64_t output;
+    double scheduled;
+    double finished;
+} job;
+
+pl0_scheduler *scheduler;
+// Jobs parked on a read that the main thread still has to answer
+pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+job **pending;
+int num_pending;
+int completed;
+pthread_mutex_t completed_lock = PTHREAD_MUTEX_INITIALIZER;
+
+double now();
+int job_read(void *context, int64_t *value);
+void job_write(void *context, int64_t value);
+void job_done(void *context, pl0_vm *vm, pl0_status status);
+int compare_doubles(const void *a, const void *b);
+
+int main(int argc, char **argv) {
+    int num_jobs = argc > 1 ? atoi(argv[1]) : DEFAULT_JOBS;
+    int threads = argc > 2 ? atoi(argv[2]) : 0;
+    long slice = argc > 3 ? atol(argv[3]) : 0;
+
+    pl0_program *programs[NUM_SOURCES];
+    for (int i = 0; i < NUM_SOURCES; ++i) {
+        char error[256];
+        programs[i] = pl0_compile(sources[i], 0, error, sizeof(error));
+        if (programs[i] == NULL) {
+            printf("%s\n", error);
+            return 1;
+        }
+    }
+
+    job *jobs = calloc(num_jobs, sizeof(job));
+    pending = malloc(num_jobs * sizeof(job *));
+    for (int i = 0; i < num_jobs; ++i) {
+        pl0_host host = {&jobs[i], job_read, job_write};
+        jobs[i].vm = pl0_instantiate(programs[i % NUM_SOURCES], &host);
+    }
+
+    scheduler = pl0_scheduler_create(threads, slice, job_done, NULL);
+    double start = now();
+    for (int i = 0; i < num_jobs; ++i) {
+        jobs[i].scheduled = now();
+        pl0_schedule(scheduler, jobs[i].vm);
+    }
+
+    // Answer reads as they come in until everything is done
+    job **answering = malloc(num_jobs * sizeof(job *));
+    while (1) {
+        pthread_mutex_lock(&completed_lock);
+        int done = completed == num_jobs;
+        pthread_mutex_unlock(&completed_lock);
+        if (done) {
+            break;
+        }
+        pthread_mutex_lock(&pending_lock);
+        int count = num_pending;
+        memcpy(answering, pending, count * sizeof(job *));
+        num_pending = 0;
+        pthread_mutex_unlock(&pending_lock);
+        for (int i = 0; i < count; ++i) {
+            __atomic_store_n(&answering[i]->has_input, 1, __ATOMIC_RELEASE);
+            pl0_wake(scheduler, answering[i]->vm);
+        }
+        if (count == 0) {
+            usleep(50);
+        }
+    }
+    pl0_scheduler_wait(scheduler);
+    double elapsed = now() - start;
+
+    double *latencies = malloc(num_jobs * sizeof(double));
+    int wrong = 0;
+    for (int i = 0; i < num_jobs; ++i) {
+        latencies[i] = (jobs[i].finished - jobs[i].scheduled) * 1000;
+        if (jobs[i].output != jobs[i % NUM_SOURCES].output) {
+            wrong++;
+        }
+    }
+    qsort(latencies, num_jobs, sizeof(double), compare_doubles);
+    printf("jobs: %d  elapsed: %.3f s  throughput: %.0f jobs/s\n", num_jobs, elapsed, num_jobs / elapsed);
+    printf("latency ms  p50: %.3f  p90: %.3f  p99: %.3f  p99.9: %.3f  max: %.3f\n",
+           latencies[num_jobs / 2], latencies[num_jobs * 9 / 10], latencies[num_jobs * 99 / 100],
+           latencies[num_jobs * 999 / 1000], latencies[num_jobs - 1]);
+    if (wrong > 0) {
+        printf("%d jobs gave the wrong answer\n", wrong);
+    }
+
+    pl0_scheduler_free(scheduler);
+    for (int i = 0; i < num_jobs; ++i) {
+        pl0_vm_free(jobs[i].vm);
+    }
+    for (int i = 0; i < NUM_SOURCES; ++i) {
+        pl0_program_free(programs[i]);
+    }
+    free(latencies);
+    free(answering);
+    free(pending);
+    free(jobs);
+    return wrong > 0;
+}
+
+double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int job_read(void *context, int64_t *value) {
+    job *self = context;
+    if (!__atomic_load_n(&self->has_input, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&pending_lock);
+        pending[num_pending++] = self;
+        pthread_mutex_unlock(&pending_lock);
+        return -1;
+    }
+    *value = 42;
+    return 1;
+}
+
+void job_write(void *context, int64_t value) {
+    ((job *) context)->output = value;
+}
+
+void job_done(void *context, pl0_vm *vm, pl0_status status) {
+    (void) context;
+    (void) status;
+    job *self = pl0_vm_context(vm);
+    self->finished = now();
+    pthread_mutex_lock(&completed_lock);
+    completed++;
+    pthread_mutex_unlock(&completed_lock);
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double first = *(double *) a;
+    double second = *(double *) b;
+    return (first > second) - (first < second);
+}
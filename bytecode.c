@@ -0,0 +1,85 @@
+/*
+    Bytecode Format for PL/0
+    Author: Ryan Doherty
+
+    Reads and writes generated instruction arrays in a compact
+    binary format so they can be stored on disk and loaded again
+    without running the lexer, parser or code generator.
+
+    Layout (in host byte order):
+    header: magic | format version | mode flags | instruction count (32-bit each)
+    then per instruction: op | l (32-bit) | m (64-bit), where the m of
+    a jump or call is the index of the instruction it goes to
+    The mode flags record the word size and overflow behaviour the
+    program was compiled for (MODE_INT64, MODE_TRAP).
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "compiler.h"
+
+#define BYTECODE_MAGIC 0x43304c50 // "PL0C"
+#define BYTECODE_VERSION 5
+
+int write_bytecode(FILE *file, instruction *code, int code_length, int flags) {
+    int32_t header[4] = {BYTECODE_MAGIC, BYTECODE_VERSION, flags, code_length};
+    if (fwrite(header, sizeof(int32_t), 4, file) != 4) {
+        return 0;
+    }
+    return write_instructions(file, code, code_length);
+}
+
+instruction *read_bytecode(FILE *file, int *code_length, int *flags) {
+    int32_t header[4];
+    if (fread(header, sizeof(int32_t), 4, file) != 4) {
+        return NULL;
+    }
+    // Anything we didn't write ourselves (or an older format) is rejected
+    if (header[0] != BYTECODE_MAGIC || header[1] != BYTECODE_VERSION || header[3] < 0) {
+        return NULL;
+    }
+    // Don't trust the count with an allocation until the file is known to be that long
+    long start = ftell(file);
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, start, SEEK_SET);
+    if (start < 0 || 16 * (int64_t) header[3] > size - start) {
+        return NULL;
+    }
+
+    instruction *code = malloc((header[3] + 1) * sizeof(instruction));
+    if (!read_instructions(file, code, header[3])) {
+        free(code);
+        return NULL;
+    }
+    *flags = header[2];
+    *code_length = header[3];
+    return code;
+}
+
+// Instructions are op | l (32-bit) | m (64-bit), object modules use the same encoding
+int write_instructions(FILE *file, instruction *code, int code_length) {
+    for (int i = 0; i < code_length; ++i) {
+        int32_t fields[2] = {code[i].opcode, code[i].l};
+        int64_t m = code[i].m;
+        if (fwrite(fields, sizeof(int32_t), 2, file) != 2 || fwrite(&m, sizeof(int64_t), 1, file) != 1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Returns 0 if the file ends first
+int read_instructions(FILE *file, instruction *code, int code_length) {
+    for (int i = 0; i < code_length; ++i) {
+        int32_t fields[2];
+        int64_t m;
+        if (fread(fields, sizeof(int32_t), 2, file) != 2 || fread(&m, sizeof(int64_t), 1, file) != 1) {
+            return 0;
+        }
+        code[i].opcode = fields[0];
+        code[i].l = fields[1];
+        code[i].m = m;
+    }
+    return 1;
+}
@@ -0,0 +1,245 @@
+/*
+    Compilation Cache for PL/0
+    Author: Ryan Doherty
+
+    Stores generated code on disk keyed by a hash of the source text
+    (worked out by the caller, so it can be hashed as it's read),
+    the compiler version and the options that affect code generation.
+    When the same program is compiled again the driver loads the cached
+    instructions and skips the lexer, parser and code generator.
+
+    An entry's file name is a hash of all three, and the entry starts with
+    the source hash and the version and options themselves so a lookup
+    whose name collides with another program's doesn't load its code:
+    source hash (64-bit) | key length (32-bit) | version '\0' options '\0'
+    and then the bytecode (see bytecode.c).
+
+    Several processes may share one cache directory. Entries are written
+    to a private temporary file and then renamed into place, so readers
+    only ever see complete files. Once the directory grows past its size
+    limit the least recently used entries are deleted.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include "compiler.h"
+
+#define CACHE_SUFFIX ".pl0c"
+// Temporary files older than this were left behind by a crashed process
+#define CACHE_STALE_SECONDS 3600
+
+typedef struct cache_entry {
+    char *path;
+    long size;
+    time_t used;
+} cache_entry;
+
+void cache_path(char *cache_dir, uint64_t source_hash, char *options, char *path, size_t path_size);
+int cache_key(char *options, char *key, size_t key_size);
+int read_entry_key(FILE *file, uint64_t source_hash, char *options);
+int make_cache_dir(char *cache_dir);
+void evict_cache(char *cache_dir, long max_size);
+int compare_entries(const void *a, const void *b);
+
+instruction *cache_lookup(char *cache_dir, uint64_t source_hash, char *options, int *code_length, int flags) {
+    char path[4096];
+    cache_path(cache_dir, source_hash, options, path, sizeof(path));
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    int cached_flags;
+    instruction *code = NULL;
+    if (read_entry_key(file, source_hash, options)) {
+        code = read_bytecode(file, code_length, &cached_flags);
+    }
+    fclose(file);
+    if (code != NULL && cached_flags != flags) {
+        free(code);
+        return NULL;
+    }
+
+    // Touch the entry so eviction treats it as recently used
+    if (code != NULL) {
+        utime(path, NULL);
+    }
+    return code;
+}
+
+void cache_store(char *cache_dir, uint64_t source_hash, char *options, instruction *code, int code_length, int flags,
+                 long max_size) {
+    if (!make_cache_dir(cache_dir)) {
+        return;
+    }
+    char path[4096];
+    char temp_path[4200];
+    cache_path(cache_dir, source_hash, options, path, sizeof(path));
+    // Each process writes its own temp file so concurrent stores never interleave
+    snprintf(temp_path, sizeof(temp_path), "%s.%ld.tmp", path, (long) getpid());
+
+    FILE *file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        return;
+    }
+    char key[4096];
+    int key_length = cache_key(options, key, sizeof(key));
+    int32_t stored_length = key_length;
+    int written = key_length > 0 && fwrite(&source_hash, sizeof(source_hash), 1, file) == 1 &&
+                  fwrite(&stored_length, sizeof(stored_length), 1, file) == 1 &&
+                  fwrite(key, 1, key_length, file) == (size_t) key_length &&
+                  write_bytecode(file, code, code_length, flags);
+    if (fclose(file) != 0 || !written) {
+        unlink(temp_path);
+        return;
+    }
+    // rename() is atomic so a reader sees either the old entry or the new one
+    if (rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return;
+    }
+    evict_cache(cache_dir, max_size);
+}
+
+// 64-bit FNV-1a
+uint64_t hash_bytes(uint64_t hash, char *bytes, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char) bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Mixes in a whole word at once, for hashing code and lexemes where bytes at a time is too slow
+uint64_t hash_word(uint64_t hash, uint64_t word) {
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    return hash ^ (hash >> 29);
+}
+
+void cache_path(char *cache_dir, uint64_t source_hash, char *options, char *path, size_t path_size) {
+    // Include the terminators so "ab" + "c" doesn't hash the same as "a" + "bc"
+    uint64_t hash = HASH_SEED;
+    hash = hash_bytes(hash, COMPILER_VERSION, strlen(COMPILER_VERSION) + 1);
+    hash = hash_bytes(hash, options, strlen(options) + 1);
+    hash = hash_bytes(hash, (char *) &source_hash, sizeof(source_hash));
+    snprintf(path, path_size, "%s/%016llx" CACHE_SUFFIX, cache_dir, (unsigned long long) hash);
+}
+
+// What an entry was stored for besides its source, returns its length or 0 if
+// it doesn't fit
+int cache_key(char *options, char *key, size_t key_size) {
+    int length = snprintf(key, key_size, "%s%c%s", COMPILER_VERSION, '\0', options) + 1;
+    return length < (int) key_size ? length : 0;
+}
+
+// Returns 1 if the entry was stored for this source and these options, leaving
+// the file at its bytecode
+int read_entry_key(FILE *file, uint64_t source_hash, char *options) {
+    char key[4096];
+    char stored[4096];
+    int key_length = cache_key(options, key, sizeof(key));
+    uint64_t stored_hash;
+    int32_t stored_length;
+    if (fread(&stored_hash, sizeof(stored_hash), 1, file) != 1 ||
+        fread(&stored_length, sizeof(stored_length), 1, file) != 1) {
+        return 0;
+    }
+    return stored_hash == source_hash && stored_length == key_length && key_length > 0 &&
+           fread(stored, 1, key_length, file) == (size_t) key_length && memcmp(stored, key, key_length) == 0;
+}
+
+int make_cache_dir(char *cache_dir) {
+    // Create every missing directory along the path like mkdir -p
+    char path[4096];
+    snprintf(path, sizeof(path), "%s", cache_dir);
+    for (char *c = path + 1; *c; ++c) {
+        if (*c == '/') {
+            *c = '\0';
+            if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+                return 0;
+            }
+            *c = '/';
+        }
+    }
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+        return 0;
+    }
+    return 1;
+}
+
+void evict_cache(char *cache_dir, long max_size) {
+    DIR *dir = opendir(cache_dir);
+    if (dir == NULL) {
+        return;
+    }
+
+    int num_entries = 0;
+    int capacity = 64;
+    cache_entry *entries = malloc(capacity * sizeof(cache_entry));
+    long total_size = 0;
+    time_t now = time(NULL);
+
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(dir)) != NULL) {
+        char *name = dir_entry->d_name;
+        size_t length = strlen(name);
+        int is_entry = length > strlen(CACHE_SUFFIX) && strcmp(name + length - strlen(CACHE_SUFFIX), CACHE_SUFFIX) == 0;
+        int is_temp = length > 4 && strcmp(name + length - 4, ".tmp") == 0;
+        if (!is_entry && !is_temp) {
+            continue;
+        }
+
+        char *path = malloc(strlen(cache_dir) + length + 2);
+        sprintf(path, "%s/%s", cache_dir, name);
+        struct stat info;
+        // Another process may have evicted it already
+        if (stat(path, &info) != 0) {
+            free(path);
+            continue;
+        }
+        if (is_temp) {
+            // Only clean up temp files nobody could still be writing
+            if (now - info.st_mtime > CACHE_STALE_SECONDS) {
+                unlink(path);
+            }
+            free(path);
+            continue;
+        }
+
+        if (num_entries == capacity) {
+            capacity *= 2;
+            entries = realloc(entries, capacity * sizeof(cache_entry));
+        }
+        entries[num_entries].path = path;
+        entries[num_entries].size = info.st_size;
+        entries[num_entries].used = info.st_mtime;
+        total_size += info.st_size;
+        num_entries++;
+    }
+    closedir(dir);
+
+    // Delete least recently used entries until we fit
+    qsort(entries, num_entries, sizeof(cache_entry), compare_entries);
+    for (int i = 0; i < num_entries; ++i) {
+        if (total_size > max_size) {
+            // Failing here just means someone else removed it first
+            unlink(entries[i].path);
+            total_size -= entries[i].size;
+        }
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+int compare_entries(const void *a, const void *b) {
+    time_t first = ((cache_entry *) a)->used;
+    time_t second = ((cache_entry *) b)->used;
+    return (first > second) - (first < second);
+}
@@ -7,6 +7,15 @@
     and generates code from the parse tree into object code
     that can run on vm.c/HW1 completing the code needed to
     run PL/0 code on our virtual machines.
+
+    The declarations are walked first to work out what's in scope where.
+    Each procedure's statement is then generated on its own into its own
+    code, several at a time on big programs, and link_code() puts them
+    together and fills in the calls once it knows where everything starts.
+
+    A lazy compile (generate_lazy()) only generates main up front and keeps
+    the walked declarations, so the rest can be generated one procedure at
+    a time as they're first called (see lazy.c).
 */
 
 #include <stdlib.h>
@@ -14,50 +23,268 @@
 #include <string.h>
 #include "compiler.h"
 
-instruction *code;
-lexeme *token_list;
+// A procedure's statement, which is generated on its own into its own code
+// once every declaration has been seen, see block_gen()
+typedef struct codegen_block {
+    int proc_index; // its procedure's symbol, 0 for main
+    int level;
+    int params;     // the first variables, which the caller's arguments are moved into
+    int returns;    // a function, its value goes in the last slot of its frame
+    int frame_size;
+    int statement;  // index of the statement's first token
+    int sym_limit;  // symbols from here on are declared after the statement
+    instruction *code;
+    int length;
+    object_module fixups; // relocations for an object module, relative to code
+    char error[64];
+} codegen_block;
+
+// Only read while statements are being generated, so the threads share them
+token_stream *token_list;
 symbol *symbol_table;
+name_index codegen_names;
+// Set for incremental compiles, see incremental.c
+memo_table *codegen_memo;
+// Set when compiling a module to link later, see object.c
+object_module *codegen_object;
+// For each symbol, the procedure whose block declares it and the index of
+// the first symbol after that block, see in_scope()
+int *scope_start;
+int *scope_end;
+codegen_block *blocks;
+int num_blocks;
+int block_capacity;
 
-int code_index = 0;
-int token_index = 0;
+// Each thread has its own, they're for the statement it's generating
+_Thread_local instruction *code;
+_Thread_local int code_capacity;
+_Thread_local int code_index = 0;
+_Thread_local int token_index = 0;
+_Thread_local int level = 0;
+_Thread_local codegen_block *current_block;
+
+// Only used while walking the declarations
 int sym_index = 0;
-int level = 0;
+int scope_owner = 0;
+
+// What a lazy compile keeps of the walked declarations for generating the
+// procedures later, along with the tokens and symbols they point into
+struct codegen_state {
+    token_stream *tokens;
+    symbol *symbols;
+    name_index names;
+    int *scope_start;
+    int *scope_end;
+    codegen_block *blocks;
+    int num_blocks;
+    int *block_at; // per instruction of the code as compiled, the block whose stub starts there or -1
+};
 
 lexeme get_token();
 lexeme next_token(int num_times);
-void unmark_symbol(char *ident_name, int kind);
-void mark_level(int start_index, int end_index);
-int find_ident(char *ident_name, int type);
-int scoped_find_ident(char* name, int kind);
-void gen_code(int op, int l, int m);
-void printcode();
+void unmark_symbol(int ident_name, int kind);
+int find_ident(int ident_name, int type);
+int in_scope(int index);
+int scoped_find_ident(int name, int kind);
+void gen_code(int op, int l, int64_t m);
+int skip_statement(int start);
+int statement_end(codegen_block *block, uint64_t *key);
+uint64_t hash_reference(uint64_t hash, int index);
+int reuse_block(uint64_t key, int end);
+void remember_block(uint64_t key, int end);
+void add_block(int proc_index, int params, int frame_size);
+void walk_declarations(token_stream *tokens, symbol *symbols, memo_table *memo, object_module *module);
+void statement_block_gen(void *context, int item);
+void check_block(int b);
+instruction *link_code(int *code_length);
+void free_codegen();
 
 void program_gen();
+void gen_reference(int opcode, int index);
+void gen_indexed(int opcode, int index, int subscript_start);
+void gen_call(int index);
+int closing_bracket(int start);
 void block_gen();
+int extern_gen();
+int param_gen();
 void statement_gen();
 int const_gen();
 int var_gen();
 int proc_gen();
 void expression_gen();
 
-// Character representations of instruction codes
-typedef enum {
-    LIT = 1, OPR, LOD, STO, CAL, INC, JMP, JPC, SYS
-} instruction_type;
+// memo is NULL unless this is an incremental compile, module is NULL unless the code
+// is going into an object module and gets the relocations the linker needs
+instruction *generate_code(token_stream *tokens, symbol *symbols, int *code_length, memo_table *memo,
+                           object_module *module) {
+    walk_declarations(tokens, symbols, memo, module);
+
+    // Statements only read the tokens and symbols, so big programs generate
+    // them on several threads. Sessions aren't safe to share so incremental
+    // compiles use just this one.
+    parallel_for(num_blocks, codegen_memo != NULL ? 1 : parallel_threads(token_index), statement_block_gen, NULL);
+    for (int b = 0; b < num_blocks; ++b) {
+        // Report the error the first procedure with one would have stopped at
+        check_block(b);
+    }
+    instruction *linked = link_code(code_length);
+    free_codegen();
+    return linked;
+}
+
+// Generates main and in place of every other procedure a stub that only
+// reserves its frame and returns, which is all the verifier needs to know
+// about a procedure to check calls to it:
+//     JMP main; stub; stub; ...; main
+// state keeps what's needed to generate the procedures with
+// generate_procedure() and takes over the tokens and symbols. A program
+// with externs is generated whole instead (state is NULL), since only
+// generating every statement finds the ones that were never defined.
+instruction *generate_lazy(token_stream *tokens, symbol *symbols, int *code_length, codegen_state **state) {
+    for (int i = 0; symbols[i].kind != 0; ++i) {
+        if (symbols[i].external) {
+            *state = NULL;
+            return generate_code(tokens, symbols, code_length, NULL, NULL);
+        }
+    }
+    walk_declarations(tokens, symbols, NULL, NULL);
+    // Main's statement comes after every procedure's
+    int main_block = num_blocks - 1;
+    statement_block_gen(NULL, main_block);
+    check_block(main_block);
+
+    int length = 1;
+    for (int b = 0; b < main_block; ++b) {
+        symbol_table[blocks[b].proc_index].val = length;
+        length += blocks[b].returns ? 3 : 2;
+    }
+    symbol_table[0].val = length;
+    length += blocks[main_block].length;
+    instruction *linked = malloc(length * sizeof(instruction));
+    int *block_at = malloc(length * sizeof(int));
+    for (int i = 0; i < length; ++i) {
+        block_at[i] = -1;
+    }
+    linked[0] = (instruction) {JMP, 0, symbol_table[0].val};
+    for (int b = 0; b < main_block; ++b) {
+        int start = (int) symbol_table[blocks[b].proc_index].val;
+        block_at[start] = b;
+        // A function's stub returns its value slot like the function does
+        linked[start] = (instruction) {INC, blocks[b].params, blocks[b].frame_size};
+        if (blocks[b].returns) {
+            linked[start + 1] = (instruction) {LOD, 0, blocks[b].frame_size - 1};
+            linked[start + 2] = (instruction) {OPR, 0, 14};
+        } else {
+            linked[start + 1] = (instruction) {OPR, 0, 0};
+        }
+    }
+    int start = (int) symbol_table[0].val;
+    for (int i = 0; i < blocks[main_block].length; ++i) {
+        instruction ir = blocks[main_block].code[i];
+        if (ir.opcode == JMP || ir.opcode == JPC) {
+            ir.m += start;
+        } else if (ir.opcode == CAL) {
+            ir.m = symbol_table[ir.m].val;
+        }
+        linked[start + i] = ir;
+    }
+    free(blocks[main_block].code);
+    blocks[main_block].code = NULL;
+
+    codegen_state *kept = malloc(sizeof(codegen_state));
+    *kept = (codegen_state) {token_list, symbol_table, codegen_names, scope_start, scope_end, blocks, num_blocks,
+                             block_at};
+    *state = kept;
+    *code_length = length;
+    return linked;
+}
+
+// Generates the procedure whose stub generate_lazy() put at stub, with its
+// jumps relative to its first instruction and its calls to the stubs.
+// Returns NULL if there's no stub there.
+instruction *generate_procedure(codegen_state *state, int stub, int *length) {
+    int b = state->block_at[stub];
+    if (b < 0) {
+        return NULL;
+    }
+    token_list = state->tokens;
+    symbol_table = state->symbols;
+    codegen_names = state->names;
+    codegen_memo = NULL;
+    codegen_object = NULL;
+    scope_start = state->scope_start;
+    scope_end = state->scope_end;
+    blocks = state->blocks;
+    num_blocks = state->num_blocks;
+    statement_block_gen(NULL, b);
+    instruction *generated = blocks[b].code;
+    blocks[b].code = NULL;
+    for (int i = 0; i < blocks[b].length; ++i) {
+        if (generated[i].opcode == CAL) {
+            generated[i].m = symbol_table[generated[i].m].val;
+        }
+    }
+    *length = blocks[b].length;
+    return generated;
+}
 
-instruction *generate_code(lexeme *tokens, symbol *symbols) {
-    code = malloc(500 * sizeof(instruction));
+void free_codegen_state(codegen_state *state) {
+    if (state == NULL) {
+        return;
+    }
+    token_list = state->tokens;
+    symbol_table = state->symbols;
+    codegen_names = state->names;
+    scope_start = state->scope_start;
+    scope_end = state->scope_end;
+    blocks = state->blocks;
+    num_blocks = state->num_blocks;
+    free_codegen();
+    free(state->block_at);
+    free(state->symbols);
+    free_tokens(state->tokens);
+    free(state);
+}
+
+// Works out what's in scope where and notes each procedure's statement as a block
+void walk_declarations(token_stream *tokens, symbol *symbols, memo_table *memo, object_module *module) {
+    token_index = 0;
     symbol_table = symbols;
     token_list = tokens;
+    codegen_memo = memo;
+    codegen_object = module;
+    int num_symbols = 0;
+    name_index_init(&codegen_names);
+    for (; symbol_table[num_symbols].kind != 0; ++num_symbols) {
+        name_index_add(&codegen_names, symbol_table[num_symbols].name, num_symbols);
+    }
+    // Symbols the declarations don't get to are never in scope
+    scope_start = malloc((num_symbols + 1) * sizeof(int));
+    scope_end = malloc((num_symbols + 1) * sizeof(int));
+    for (int i = 0; i < num_symbols; ++i) {
+        scope_start[i] = num_symbols;
+        scope_end[i] = 0;
+    }
+    blocks = NULL;
+    num_blocks = 0;
+    block_capacity = 0;
     // Initialize level to be negative since block_gen()
     // increments level each time
     level = -1;
     sym_index = 0;
+    scope_owner = 0;
 
     program_gen();
+}
 
-    printcode();
-    return code;
+// Stops the compile with the error generating the block ran into, if it did
+void check_block(int b) {
+    if (blocks[b].error[0] != '\0') {
+        static char message[64];
+        strcpy(message, blocks[b].error);
+        free_codegen();
+        compile_error(message);
+    }
 }
 
 void condition_gen() {
@@ -101,15 +328,27 @@ void condition_gen() {
 
 void factor_gen() {
     lexeme token = get_token();
-    if (token.type == identsym){
-        int index = scoped_find_ident(token.name, 4);
+    if (token.type == identsym && token_list->types[token_index + 1] == lparentsym){
+        // A function call leaves the value the function returns
+        int index = scoped_find_ident(token.value, 3);
+        next_token(1);
+        gen_call(index);
+    } else if (token.type == identsym){
+        int index = scoped_find_ident(token.value, 4);
         // Put the value onto the stack if it's a const
         if (symbol_table[index].kind == 1){
             gen_code(LIT, 0, symbol_table[index].val);
         }
+        // Load an array element with the index the subscript leaves on the stack
+        else if (symbol_table[index].length > 0){
+            next_token(2);
+            int subscript_start = code_index;
+            expression_gen();
+            gen_indexed(LODX, index, subscript_start);
+        }
         // Load variable from its level
         else if (symbol_table[index].kind == 2){
-            gen_code(LOD, level - symbol_table[index].level, symbol_table[index].addr);
+            gen_reference(LOD, index);
         }
         next_token(1);
     } else if (token.type == numbersym){
@@ -127,7 +366,7 @@ void factor_gen() {
 
 void term_prime_gen() {
     // Generate code for mult/div/modulus
-    lexeme token = token_list[token_index];
+    lexeme token = get_token();
     if (token.type == multsym){
         next_token(1);
         factor_gen();
@@ -155,7 +394,7 @@ void term_gen() {
 void expression_prime_gen() {
     // Implement order of operations by generating the terms (higher precedence)
     // before the +/- operations
-    lexeme token = token_list[token_index];
+    lexeme token = get_token();
     if (token.type == plussym){
         next_token(1);
         term_gen();
@@ -171,7 +410,7 @@ void expression_prime_gen() {
 
 void expression_gen() {
     // Handle positive/negative then generate the rest of the expression as a list
-    lexeme token = token_list[token_index];
+    lexeme token = get_token();
     if (token.type == plussym){
         next_token(1);
         term_gen();
@@ -179,8 +418,9 @@ void expression_gen() {
     } else if (token.type == minussym){
         next_token(1);
         term_gen();
-        // Negate value
+        // Negate value, only the first term is negated
         gen_code(OPR, 0, 1);
+        expression_prime_gen();
     } else {
         term_gen();
         expression_prime_gen();
@@ -189,29 +429,49 @@ void expression_gen() {
 
 void statement_list_gen(){
     // Keep generating statement code until we hit a line not ending with ;
-    lexeme token = get_token();
-    if (token.type == semicolonsym){
+    // A loop rather than recursion so long statement lists can't overflow the stack
+    while (get_token().type == semicolonsym){
         next_token(1);
         statement_gen();
-        statement_list_gen();
     }
 }
 
 void statement_gen(){
-    lexeme token = token_list[token_index];
+    lexeme token = get_token();
     if (token.type == identsym){
         // Assignment stores the valwith ue generated by the expression code into the address
         // of the closest var in scope
-        int index = scoped_find_ident(token.name, 2);
-        next_token(2);
-        expression_gen();
-        gen_code(STO, level - symbol_table[index].level, symbol_table[index].addr);
+        int index = scoped_find_ident(token.value, 2);
+        if (symbol_table[index].length > 0) {
+            // STOX wants the value under the index, so the expression after
+            // the := is generated before the subscript in front of it
+            int subscript = token_index + 2;
+            token_index = closing_bracket(token_index + 1) + 2;
+            expression_gen();
+            int statement_end = token_index;
+            token_index = subscript;
+            int subscript_start = code_index;
+            expression_gen();
+            gen_indexed(STOX, index, subscript_start);
+            token_index = statement_end;
+        } else {
+            next_token(2);
+            expression_gen();
+            gen_reference(STO, index);
+        }
     } else if (token.type == callsym){
         // Call the procedure whose code index is stored in its val property
         token = next_token(1);
-        int index = scoped_find_ident(token.name, 3);
+        int index = scoped_find_ident(token.value, 3);
+        next_token(1);
+        gen_call(index);
+    } else if (token.type == returnsym){
+        // The value goes in the function's last slot and the jump to the end
+        // is filled in once that's known, see statement_block_gen()
         next_token(1);
-        gen_code(CAL, level - symbol_table[index].level, symbol_table[index].val * 3);
+        expression_gen();
+        gen_code(STO, 0, current_block->frame_size - 1);
+        gen_code(JMP, 0, -1);
     } else if (token.type == writesym){
         // Write the result of the given expression to the screen
         next_token(1);
@@ -220,10 +480,18 @@ void statement_gen(){
     } else if (token.type == readsym){
         // Read from the system then store into the closest in scope variable
         token = next_token(1);
-        int index = scoped_find_ident(token.name, 2);
-        next_token(1);
+        int index = scoped_find_ident(token.value, 2);
+        token = next_token(1);
         gen_code(SYS, 0, 2);
-        gen_code(STO, level - symbol_table[index].level, symbol_table[index].addr);
+        if (token.type == lbracketsym) {
+            next_token(1);
+            int subscript_start = code_index;
+            expression_gen();
+            gen_indexed(STOX, index, subscript_start);
+            next_token(1);
+        } else {
+            gen_reference(STO, index);
+        }
     } else if (token.type == beginsym){
         // Generate a statement then continue if the statement ends with a ;
         next_token(1);
@@ -251,12 +519,12 @@ void statement_gen(){
             next_token(1);
             int jmp_index = code_index;
             gen_code(JMP, 0, 0);
-            code[jpc_index].m = code_index * 3;
+            code[jpc_index].m = code_index;
             statement_gen();
-            code[jmp_index].m = code_index * 3;
+            code[jmp_index].m = code_index;
         } else {
             // Otherwise set the JPC to after the if branch
-            code[jpc_index].m = code_index * 3;
+            code[jpc_index].m = code_index;
         }
     } else if (token.type == whilesym){
         next_token(1);
@@ -271,9 +539,9 @@ void statement_gen(){
         // these statements
         statement_gen();
         // Jump back to start of loop if condition is true
-        gen_code(JMP, 0, jmp_index * 3);
+        gen_code(JMP, 0, jmp_index);
         // Jump out of loop if condition is false
-        code[jpc_index].m = code_index * 3;
+        code[jpc_index].m = code_index;
     }
 }
 
@@ -281,36 +549,74 @@ int proc_gen() {
     int num_procs = 1;
     lexeme token = next_token(1);
     // Unmark procedure
-    unmark_symbol(token.name, 3);
-    next_token(2);
-    // Generate its code
+    unmark_symbol(token.value, 3);
+    next_token(1);
+    // Note its parameters, declarations and where its statement is
     block_gen();
     token = next_token(1);
-    // Return after its code is executed
-    gen_code(OPR, 0, 0);
     // Recursively generate multiple procedures and keep track of how many
-    if (token.type == procsym){
+    if (token.type == procsym || token.type == functionsym){
         num_procs += proc_gen();
     }
     return num_procs;
 }
 
+int extern_gen() {
+    // Unmark each name after extern var or extern procedure
+    int num_externs = 0;
+    int kind = next_token(1).type == varsym ? 2 : 3;
+    lexeme token;
+    do {
+        unmark_symbol(next_token(1).value, kind);
+        num_externs++;
+        token = next_token(1);
+        // An extern procedure's parameters only give their number
+        if (token.type == lparentsym) {
+            while (token.type != rparentsym) {
+                token = next_token(1);
+            }
+            token = next_token(1);
+        }
+    } while (token.type == commasym);
+    return num_externs;
+}
+
+int param_gen() {
+    // Unmark the parameters from the ( to the ) and count them
+    int num_params = 0;
+    lexeme token = next_token(1);
+    while (token.type == identsym) {
+        unmark_symbol(token.value, 2);
+        num_params++;
+        token = next_token(1);
+        if (token.type == commasym) {
+            token = next_token(1);
+        }
+    }
+    return num_params;
+}
+
 int var_gen() {
-    // Recursively unmark and count num of vars
-    int num_vars = 1;
+    // Recursively unmark and count the slots the vars take
+    int num_slots = 1;
     lexeme token = next_token(1);
-    unmark_symbol(token.name, 2);
+    unmark_symbol(token.value, 2);
     token = next_token(1);
+    if (token.type == lbracketsym){
+        // An array takes a slot for each element, skip its [length]
+        num_slots = symbol_table[sym_index - 1].length;
+        token = next_token(3);
+    }
     if (token.type == commasym){
-        num_vars += var_gen();
+        num_slots += var_gen();
     }
-    return num_vars;
+    return num_slots;
 }
 
 int const_list_gen(){
     // Recursively unmark a list of constants
     int num_consts = 1;
-    unmark_symbol(next_token(1).name, 1);
+    unmark_symbol(next_token(1).value, 1);
     lexeme token = next_token(3);
     if (token.type == commasym){
         num_consts += const_list_gen();
@@ -322,7 +628,7 @@ int const_gen() {
     // Unmark const and recursively count the following in the list if there are any
     int num_consts = 1;
     lexeme token = next_token(1);
-    unmark_symbol(token.name, 1);
+    unmark_symbol(token.value, 1);
     token = next_token(3);
     if (token.type == commasym){
         num_consts += const_list_gen();
@@ -334,101 +640,282 @@ void block_gen() {
     // Keep track of the procedures index
     // which is 1 less since unmark advances sym_index
     int proc_index = sym_index - 1;
+    int parent = scope_owner;
+    scope_owner = proc_index;
     // Increment level to implement scoping
     level++;
     lexeme token = get_token();
-    int num_consts = 0;
+    // A procedure's heading ends with its parameters (if it has any) and a ;
+    int num_params = 0;
+    if (proc_index != 0) {
+        if (token.type == lparentsym) {
+            num_params = param_gen();
+            next_token(1);
+        }
+        token = next_token(1);
+    }
+    while (token.type == externsym) {
+        extern_gen();
+        token = next_token(1);
+    }
     if (token.type == constsym) {
-        num_consts = const_gen();
+        const_gen();
         token = next_token(1);
     }
-    int num_vars = 0;
+    int num_slots = 0;
     if (token.type == varsym) {
-        num_vars = var_gen();
+        num_slots = var_gen();
         token = next_token(1);
     }
-    int num_procs = 0;
-    if (token.type == procsym) {
-        num_procs = proc_gen();
-    }
-    // Store the start of this procedure's code in its
-    // val property to jump to later
-    symbol_table[proc_index].val = code_index;
-    // Allocate space for this procedure's variables in this level
-    gen_code(INC, 0, num_vars + 3);
-    // Generate this procedure's code
-    statement_gen();
-    // Mark this level's variables/consts/procedures once they can't be used
-    // to implement scoping
-    mark_level(proc_index + 1, proc_index + 1 + num_consts + num_vars + num_procs);
+    if (token.type == procsym || token.type == functionsym) {
+        proc_gen();
+    }
+    // The statement is generated once every procedure has been seen, it
+    // allocates space for this procedure's variables in this level and a
+    // function's value after them
+    add_block(proc_index, num_params, num_params + num_slots + 3 + symbol_table[proc_index].returns);
+    token_index = skip_statement(token_index);
+    // This level's variables/consts/procedures can't be used once it's done
+    for (int i = proc_index; i < sym_index; ++i) {
+        if (scope_start[i] == proc_index) {
+            scope_end[i] = sym_index;
+        }
+    }
+    scope_owner = parent;
     // Decrement level when done for scope
     level--;
 }
 
 void program_gen() {
-    // Unmark main
-    unmark_symbol("main", 3);
-    // Generate a jump which gets updated to the start of main's code
-    // after all other code is generated
-    gen_code(JMP, 0, 0);
+    // Unmark main (always the first symbol), its code goes last
+    unmark_symbol(symbol_table[0].name, 3);
     block_gen();
-    // Halt when program is done
-    gen_code(SYS, 0, 3);
-    code[0].m = symbol_table[0].val * 3;
+}
+
+void add_block(int proc_index, int params, int frame_size) {
+    if (num_blocks == block_capacity) {
+        block_capacity = block_capacity == 0 ? 64 : 2 * block_capacity;
+        blocks = realloc(blocks, block_capacity * sizeof(codegen_block));
+    }
+    codegen_block *block = &blocks[num_blocks++];
+    memset(block, 0, sizeof(codegen_block));
+    block->proc_index = proc_index;
+    block->level = level;
+    block->params = params;
+    block->returns = symbol_table[proc_index].returns;
+    block->frame_size = frame_size;
+    block->statement = token_index;
+    block->sym_limit = sym_index;
+}
+
+// Generates one procedure's code from its INC to its return (main's to the
+// halt) with jumps relative to its first instruction and each CAL's m the
+// symbol it calls. Runs on any thread, see parallel_for().
+void statement_block_gen(void *context, int item) {
+    (void) context;
+    codegen_block *block = &blocks[item];
+    current_block = block;
+    code_capacity = 64;
+    code = malloc(code_capacity * sizeof(instruction));
+    code_index = 0;
+    token_index = block->statement;
+    level = block->level;
+    // An incremental compile reuses the code from last time if nothing it depends on changed
+    uint64_t key;
+    int end = codegen_memo != NULL ? statement_end(block, &key) : -1;
+    if (end == -1 || !reuse_block(key, end)) {
+        // Allocate space for this procedure's variables in this level,
+        // the arguments it was called with are moved into the first ones
+        gen_code(INC, block->params, block->frame_size);
+        // Generate this procedure's code
+        statement_gen();
+        if (block->returns) {
+            // A function that gets to its end without a return returns 0,
+            // and every return jumps to where the value is loaded
+            gen_code(LIT, 0, 0);
+            gen_code(STO, 0, block->frame_size - 1);
+            for (int i = 0; i < code_index; ++i) {
+                if (code[i].opcode == JMP && code[i].m == -1) {
+                    code[i].m = code_index;
+                }
+            }
+        }
+        if (end != -1) {
+            remember_block(key, end);
+        }
+    }
+    // Return after its code is executed, halt when the program is done
+    if (block->proc_index == 0) {
+        gen_code(SYS, 0, 3);
+    } else if (block->returns) {
+        gen_code(LOD, 0, block->frame_size - 1);
+        gen_code(OPR, 0, 14);
+    } else {
+        gen_code(OPR, 0, 0);
+    }
+    block->code = code;
+    block->length = code_index;
+}
+
+// Lays the procedures out in the order their statements came in, behind a
+// jump to main which is last, now that it's known where each one starts
+instruction *link_code(int *code_length) {
+    int length = 1;
+    for (int b = 0; b < num_blocks; ++b) {
+        // Store the start of each procedure's code in its val property
+        symbol_table[blocks[b].proc_index].val = length;
+        length += blocks[b].length;
+    }
+    instruction *linked = malloc(length * sizeof(instruction));
+    linked[0] = (instruction) {JMP, 0, symbol_table[0].val};
+    for (int b = 0; b < num_blocks; ++b) {
+        int start = (int) symbol_table[blocks[b].proc_index].val;
+        for (int i = 0; i < blocks[b].length; ++i) {
+            instruction ir = blocks[b].code[i];
+            if (ir.opcode == JMP || ir.opcode == JPC) {
+                ir.m += start;
+            } else if (ir.opcode == CAL) {
+                ir.m = symbol_table[ir.m].val;
+            }
+            linked[start + i] = ir;
+        }
+        for (int r = 0; r < blocks[b].fixups.num_relocations; ++r) {
+            relocation *fix = &blocks[b].fixups.relocations[r];
+            add_relocation(codegen_object, fix->index + start, fix->kind, fix->name)->call = fix->call;
+        }
+    }
+    *code_length = length;
+    return linked;
+}
+
+void free_codegen() {
+    for (int b = 0; b < num_blocks; ++b) {
+        free(blocks[b].code);
+        free(blocks[b].fixups.relocations);
+    }
+    free(blocks);
+    free(scope_start);
+    free(scope_end);
+    name_index_free(&codegen_names);
+}
+
+// Emits a LOD, STO, LODX, STOX or CAL of the symbol at index. For an object module it also
+// notes what the linker has to fix: calls move with the module's code, globals
+// with its globals and externs are filled in from whichever module exports them.
+void gen_reference(int opcode, int index) {
+    symbol *target = &symbol_table[index];
+    if (target->external && codegen_object == NULL && current_block->error[0] == '\0') {
+        snprintf(current_block->error, sizeof(current_block->error), "Linker Error: Undefined Symbol %s",
+                 name_text(&token_list->names, target->name));
+    }
+    if (codegen_object != NULL) {
+        int kind = 0;
+        if (target->external) {
+            kind = opcode == CAL ? RELOC_EXTERN_PROC : RELOC_EXTERN_VAR;
+        } else if (opcode == CAL) {
+            kind = RELOC_CODE;
+        } else if (target->level == 0) {
+            kind = RELOC_GLOBAL;
+        }
+        if (kind != 0) {
+            relocation *added = add_relocation(&current_block->fixups, code_index, kind, target->name);
+            // The linker makes sure the procedure it finds takes as many arguments
+            added->call = (call_signature) {target->params, target->returns};
+        }
+    }
+    // Calls are to the symbol until link_code() knows where it starts
+    gen_code(opcode, level - target->level, opcode == CAL ? index : target->addr);
+}
+
+// Emits a call to the procedure at index with the (expression, ...) at token_index
+// pushed in order as its arguments, leaving token_index after the )
+void gen_call(int index) {
+    if (get_token().type == lparentsym) {
+        lexeme token = next_token(1);
+        while (token.type != rparentsym) {
+            expression_gen();
+            token = get_token();
+            if (token.type == commasym) {
+                token = next_token(1);
+            }
+        }
+        next_token(1);
+    }
+    gen_reference(CAL, index);
+}
+
+// Emits the LODX or STOX of an element of the array at index, its subscript's
+// code starts at subscript_start. The CHK in front halts the machine on an
+// index outside the array, a constant index that's inside doesn't need one.
+void gen_indexed(int opcode, int index, int subscript_start) {
+    int length = symbol_table[index].length;
+    int constant = code_index == subscript_start + 1 && code[subscript_start].opcode == LIT;
+    if (!constant || code[subscript_start].m < 0 || code[subscript_start].m >= length) {
+        gen_code(CHK, 0, length);
+    }
+    gen_reference(opcode, index);
+}
+
+// The index of the ] that closes the [ at start
+int closing_bracket(int start) {
+    int depth = 0;
+    int i = start;
+    for (; token_list->types[i] != 0; ++i) {
+        if (token_list->types[i] == lbracketsym) {
+            depth++;
+        } else if (token_list->types[i] == rbracketsym && --depth == 0) {
+            break;
+        }
+    }
+    return i;
 }
 
 lexeme get_token() {
-    return token_list[token_index];
+    return (lexeme) {token_list->types[token_index], token_list->values[token_index]};
 }
 
 lexeme next_token(int num_times) {
     // Increments the token_index and returns that token
-    lexeme type;
-    for (int i = 0; i < num_times; ++i) {
-        token_index++;
-        type = token_list[token_index];
-    }
-    return type;
+    token_index += num_times;
+    return get_token();
 }
 
-void unmark_symbol(char *ident_name, int kind) {
+void unmark_symbol(int ident_name, int kind) {
+    // It's in scope from here until the end of the block declaring it
     int index = find_ident(ident_name, kind);
     if (index != -1) {
-        symbol_table[index].mark = 0;
+        scope_start[index] = scope_owner;
         sym_index++;
     }
 }
 
-void mark_level(int start_index, int end_index) {
-    symbol* temp_symbol;
-    for (int i = start_index; i < end_index; ++i) {
-        temp_symbol = &symbol_table[i];
-        temp_symbol->mark = 1;
-    }
-}
-
-int find_ident(char *ident_name, int type) {
+int find_ident(int ident_name, int type) {
     // Finds first marked symbol with a matching type
     // since symbols after sym_index are marked
-    int index = sym_index;
-    symbol temp_symbol = symbol_table[index];
-    while (temp_symbol.kind != -1 && strcmp(temp_symbol.name, "") != 0) {
-        if (strcmp(symbol_table[index].name, ident_name) == 0 && symbol_table[index].kind == type) {
-            return index;
+    int index = -1;
+    for (int i = name_index_first(&codegen_names, ident_name); i >= sym_index; i = codegen_names.next[i]) {
+        if (symbol_table[i].kind == type) {
+            index = i;
         }
-        index++;
-        temp_symbol = symbol_table[index];
     }
-    return -1;
+    return index;
+}
+
+// Whether the statement being generated can see the symbol: it has to be declared
+// before the statement, by the statement's procedure or one it's nested in
+int in_scope(int index) {
+    int proc_index = current_block->proc_index;
+    return index < current_block->sym_limit && scope_start[index] <= proc_index && proc_index < scope_end[index];
 }
 
-int scoped_find_ident(char* name, int kind){
+int scoped_find_ident(int name, int kind){
     // Find the matching symbol closest in scope
     int index = -1;
     int closest_level = -1;
-    for (int i = 0; i < sym_index; ++i) {
-        if (symbol_table[i].kind == -1){
-            return -1;
+    // Newest first, so >= keeps the oldest of the matches on the same level
+    for (int i = name_index_first(&codegen_names, name); i != -1; i = codegen_names.next[i]) {
+        if (!in_scope(i)) {
+            continue;
         }
         // Match either vars or consts if kind = 4 or just same kind otherwise
         int right_kind;
@@ -438,10 +925,8 @@ int scoped_find_ident(char* name, int kind){
             right_kind = symbol_table[i].kind == kind;
         }
         // Find match with highest level
-        // out of scope variables would be marked so only
-        // in scope variables will match
-        if (strcmp(symbol_table[i].name, name) == 0 && right_kind) {
-            if (symbol_table[i].level > closest_level && !symbol_table[i].mark){
+        if (right_kind) {
+            if (symbol_table[i].level >= closest_level){
                 index = i;
                 closest_level = symbol_table[i].level;
             }
@@ -450,17 +935,149 @@ int scoped_find_ident(char* name, int kind){
     return index;
 }
 
-void gen_code(int op, int l, int m) {
+// Returns the index of the ; or . after the statement starting at start.
+// Statements only contain a ; or . inside begin and end.
+int skip_statement(int start) {
+    token_type *types = token_list->types;
+    int depth = 0;
+    int i = start;
+    for (; types[i] != 0; ++i) {
+        if (depth == 0 && (types[i] == semicolonsym || types[i] == periodsym)) {
+            break;
+        } else if (types[i] == beginsym) {
+            depth++;
+        } else if (types[i] == endsym) {
+            depth--;
+        }
+    }
+    return i;
+}
+
+// Finds where the statement starting at token_index ends (its ; or .) and hashes
+// it into key along with what each name in it refers to, which is all its code
+// depends on. Statements only contain a ; or . inside begin and end.
+int statement_end(codegen_block *block, uint64_t *key) {
+    uint64_t hash = hash_word(HASH_SEED, block->frame_size);
+    hash = hash_word(hash, block->params);
+    hash = hash_word(hash, block->returns);
+    token_type *types = token_list->types;
+    int depth = 0;
+    int i = token_index;
+    for (; types[i] != 0; ++i) {
+        lexeme token = {types[i], token_list->values[i]};
+        if (depth == 0 && (token.type == semicolonsym || token.type == periodsym)) {
+            break;
+        }
+        if (token.type == beginsym) {
+            depth++;
+        } else if (token.type == endsym) {
+            depth--;
+        }
+        hash = hash_word(hash, token.type);
+        if (token.type == numbersym) {
+            hash = hash_word(hash, token.value);
+        } else if (token.type == identsym) {
+            // The text rather than the index, which can change from one compile to the next
+            char *name = name_text(&token_list->names, token.value);
+            hash = hash_bytes(hash, name, strlen(name) + 1);
+            // Calls are looked up again when the code is reused, so only their name counts
+            if (types[i - 1] != callsym && types[i + 1] != lparentsym) {
+                // Assignments and reads look for a variable, which is the same
+                // symbol unless a constant hides it
+                int index = scoped_find_ident(token.value, 4);
+                hash = hash_reference(hash, index);
+                if (index == -1 || symbol_table[index].kind != 2) {
+                    hash = hash_reference(hash, scoped_find_ident(token.value, 2));
+                }
+            }
+        }
+    }
+    *key = hash;
+    return i;
+}
+
+// Hashes what the code for a name depends on: its kind, how many levels up it
+// is and its address or value
+uint64_t hash_reference(uint64_t hash, int index) {
+    if (index == -1) {
+        return hash_word(hash, -1);
+    }
+    symbol *declared = &symbol_table[index];
+    hash = hash_word(hash, declared->kind);
+    hash = hash_word(hash, level - declared->level);
+    hash = hash_word(hash, declared->length);
+    return hash_word(hash, declared->kind == 1 ? declared->val : declared->addr);
+}
+
+// Copies in the procedure's code from an earlier compile, returns 0 if there isn't any
+int reuse_block(uint64_t key, int end) {
+    memo_entry *entry = memo_find(codegen_memo, key);
+    if (entry == NULL) {
+        return 0;
+    }
+    char *callee = entry->callees;
+    for (int i = 0; i < entry->length; ++i) {
+        instruction ir = entry->code[i];
+        if (ir.opcode == CAL) {
+            // The callee is the same procedure as before but may have moved.
+            // The key has its name so this compile's tokens have it too.
+            int index = scoped_find_ident(find_name(&token_list->names, callee), 3);
+            callee += strlen(callee) + 1;
+            ir.l = level - symbol_table[index].level;
+            ir.m = index;
+        }
+        gen_code(ir.opcode, ir.l, ir.m);
+    }
+    token_index = end;
+    return 1;
+}
+
+// Keeps the procedure's code for the next compile and the name each call was to.
+// Its jumps are relative to its start already.
+void remember_block(uint64_t key, int end) {
+    if (token_index != end) {
+        return;
+    }
+    int length = code_index;
+    instruction *block = malloc(length * sizeof(instruction));
+    int num_callees = 0;
+    int callees_length = 0;
+    for (int i = 0; i < length; ++i) {
+        block[i] = code[i];
+        if (block[i].opcode == CAL) {
+            callees_length += strlen(name_text(&token_list->names, symbol_table[code[i].m].name)) + 1;
+            block[i].m = 0;
+            num_callees++;
+        }
+    }
+    // Until link_code() a CAL's m is the symbol it calls, which has the name
+    char *callees = malloc(callees_length + 1);
+    char *callee = callees;
+    for (int i = 0; i < length; ++i) {
+        if (code[i].opcode == CAL) {
+            char *name = name_text(&token_list->names, symbol_table[code[i].m].name);
+            strcpy(callee, name);
+            callee += strlen(name) + 1;
+        }
+    }
+    memo_add(codegen_memo, key, block, length, callees, num_callees);
+}
+
+void gen_code(int op, int l, int64_t m) {
+    if (code_index == code_capacity) {
+        code_capacity *= 2;
+        code = realloc(code, code_capacity * sizeof(instruction));
+    }
     code[code_index].opcode = op;
     code[code_index].l = l;
     code[code_index].m = m;
     code_index++;
 }
 
-void printcode() {
+void printcode(instruction *code, int code_length) {
     int i;
     printf("Line\tOP Code\tOP Name\tL\tM\n");
-    for (i = 0; i < code_index; i++) {
+    for (i = 0; i < code_length; i++) {
         printf("%d\t", i);
         printf("%d\t", code[i].opcode);
         switch (code[i].opcode) {
@@ -511,6 +1128,9 @@ void printcode() {
                     case 13:
                         printf("GEQ\t");
                         break;
+                    case 14:
+                        printf("RTV\t");
+                        break;
                     default:
                         printf("err\t");
                         break;
@@ -550,10 +1170,22 @@ void printcode() {
                         break;
                 }
                 break;
+            case 10:
+                printf("TCL\t");
+                break;
+            case 11:
+                printf("LODX\t");
+                break;
+            case 12:
+                printf("STOX\t");
+                break;
+            case 13:
+                printf("CHK\t");
+                break;
             default:
                 printf("err\t");
                 break;
         }
-        printf("%d\t%d\n", code[i].l, code[i].m);
+        printf("%d\t%lld\n", code[i].l, (long long) code[i].m);
     }
 }
\ No newline at end of file
@@ -1,33 +1,349 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#define COMPILER_VERSION "1.4"
+
+// Machine mode flags recorded in the bytecode header
+#define MODE_INT64 1 // 64-bit words instead of 32-bit
+#define MODE_TRAP 2  // Halt on overflow instead of wrapping around
+#define MODE_TIERED 4 // Left unoptimized, the machine optimizes what runs often (tier.c)
+#define MODE_LAZY 8   // Procedures are generated when they're first called (lazy.c), never in bytecode
+
+// Stack words given to every machine, the parser keeps each frame within it
+#define VM_STACK_SIZE 2048
+
+// Largest procedure body (in instructions) the inliner will copy into a caller
+#define DEFAULT_INLINE_THRESHOLD 12
+
 typedef enum token_type {
 	oddsym = 1, eqlsym, neqsym, lessym, leqsym, gtrsym, geqsym, 
 	modsym, multsym, slashsym, plussym, minussym,
 	lparentsym, rparentsym, commasym, periodsym, semicolonsym, 
 	becomessym, beginsym, endsym, ifsym, thensym, elsesym,
 	whilesym, dosym, callsym, writesym, readsym, constsym, 
-	varsym, procsym, identsym, numbersym,
+	varsym, procsym, identsym, numbersym, externsym,
+	lbracketsym, rbracketsym, functionsym, returnsym,
 } token_type;
 
+// Identifiers are interned by the lexer: each different name is stored once
+// and everything after the lexer knows it by its index in the table
+typedef struct name_table {
+	char *text;    // every name, each followed by a '\0'
+	int text_length;
+	int text_capacity;
+	int *starts;   // where each name starts in text
+	int count;
+	int capacity;
+	int *slots;    // open addressed by hash, -1 for empty
+	int num_slots;
+} name_table;
+
+// One lexeme as the parser pulls it from the lexer
 typedef struct lexeme {
-	char name[12];
-	int value;
 	token_type type;
+	int64_t value; // a number's value or an identifier's name
 } lexeme;
 
+// Every lexeme of a program as parallel arrays, followed by an end marker of type 0
+typedef struct token_stream {
+	token_type *types;
+	int64_t *values;
+	int count;
+	name_table names;
+} token_stream;
+
 typedef struct symbol {
-	int kind;
-	char name[12];
-	int val;
+	int kind; // 0 after the last symbol
+	int name;
+	int64_t val;
 	int level;
 	int addr;
+	int length;   // an array's number of elements, 0 for everything else
+	int params;   // a procedure's number of parameters
+	int returns;  // a procedure declared with function, which returns a value
 	int mark;
+	int external; // declared with extern, defined in another module
 } symbol;
 
+// Chains together the symbols with each name, newest first, so looking a
+// name up only visits those
+typedef struct name_index {
+	int *heads; // by name, -1 if nothing has it
+	int num_heads;
+	int *next;
+	int capacity;
+} name_index;
+
 typedef struct instruction {
 	int opcode;
 	int l;
-	int m;
+	int64_t m;
 } instruction;
 
-lexeme *lexanalyzer(char *input);
-symbol *parse(lexeme *input);
-instruction *generate_code(lexeme *tokens, symbol *symbols);
\ No newline at end of file
+// The declarations a lazy compile walked, see generate_lazy()
+typedef struct codegen_state codegen_state;
+
+// Code kept from an earlier compile, found by a hash of what it was made from
+typedef struct memo_entry {
+	uint64_t key;
+	instruction *code;  // NULL for an empty slot
+	int length;
+	char *callees;      // for generated procedures, the name each CAL calls in order, each ending in '\0'
+	int num_callees;
+	int used;           // since the last memo_sweep()
+} memo_entry;
+
+typedef struct memo_table {
+	memo_entry *entries;
+	int capacity;
+	int count;
+	int hits;
+	int misses;
+} memo_table;
+
+// Character representations of instruction codes
+typedef enum {
+	LIT = 1, OPR, LOD, STO, CAL, INC, JMP, JPC, SYS, TCL, LODX, STOX, CHK
+} instruction_type;
+
+// A procedure's code is contiguous, from its INC to its return
+// (or to the final halt for main)
+typedef struct procedure {
+	int start;
+	int end;
+} procedure;
+
+// What a call to a procedure takes off the stack and leaves there, see procedure_signature()
+typedef struct call_signature {
+	int params;  // arguments the caller pushes, the callee's INC moves them into its frame
+	int returns; // 1 if it ends with OPR 0, 14 and leaves a value, 0 for OPR 0, 0
+} call_signature;
+
+// How often each instruction ran in profiled runs of the code (profile.c)
+typedef struct code_profile {
+	uint64_t *executed; // times each instruction ran
+	uint64_t *taken;    // times each JPC jumped
+} code_profile;
+
+// An optimized copy of a procedure that tier.c added after a program's code.
+// A call copy takes over from the procedure when it's called, a loop copy
+// starts by jumping to one of its loops and takes over the running frame there.
+// lazy.c adds a lazy program's procedures as call copies of their stubs.
+typedef struct procedure_copy {
+	int start;
+	int end;
+	int original; // start of the procedure it's a copy of
+	int target;   // where it takes over, the original's start for a call copy and a loop for a loop copy
+} procedure_copy;
+
+// A procedure's code on its own, see split_blocks()
+typedef struct code_block {
+	instruction *code;
+	int start;
+	int length;
+	int is_procedure;
+} code_block;
+
+// What the linker adds to an instruction's m in an object module
+#define RELOC_CODE 1        // an instruction address in the module, moves with its code
+#define RELOC_GLOBAL 2      // one of the module's own globals, moves with its globals
+#define RELOC_EXTERN_VAR 3  // a global another module exports, found by name
+#define RELOC_EXTERN_PROC 4 // a procedure another module exports, found by name
+
+typedef struct relocation {
+	int index; // the instruction to patch
+	int kind;
+	int name;  // in the module's names for the extern kinds, -1 otherwise
+	call_signature call; // what an extern procedure was declared to take and leave
+} relocation;
+
+// A global (kind 2, value is its address in main's frame) or procedure
+// (kind 3, value is its first instruction) other modules can use
+typedef struct module_export {
+	int name; // in the module's names
+	int kind;
+	int64_t value;
+} module_export;
+
+// A separately compiled module, laid out like a whole program before linking
+typedef struct object_module {
+	instruction *code;
+	int code_length;
+	int flags;
+	int num_globals; // main's frame less the three links
+	relocation *relocations;
+	int num_relocations;
+	int relocation_capacity;
+	module_export *exports;
+	int num_exports;
+	name_table names;
+} object_module;
+
+// What the verifier works out about a program, arrays have one entry per instruction
+typedef struct verified_code {
+	int *depths;    // stack depth above the frame base before it runs, -1 if unreachable
+	int *procedure; // start of the procedure it's in (the original for a copy), -1 if unreachable
+	int *parent;    // for procedure starts, the start of its static parent (-1 for main)
+	int max_frame;  // the deepest any frame gets
+} verified_code;
+
+// One procedure in static single assignment form, see ir.c
+typedef enum ir_op {
+	IR_CONST = 1, IR_OPR, IR_LOAD, IR_STORE, IR_CALL, IR_TAIL_CALL, IR_READ, IR_WRITE, IR_PHI,
+	IR_LOADX, IR_STOREX, IR_CALL_VALUE
+} ir_op;
+
+// How a basic block ends
+typedef enum ir_exit {
+	IR_JUMP = 1, IR_BRANCH, IR_RETURN, IR_HALT
+} ir_exit;
+
+typedef struct ir_value {
+	ir_op op;
+	int l;         // the level of a load, store or call, the operation of an OPR
+	int64_t m;     // the constant, address, callee or a phi's variable
+	int args[2];   // operands in the order they were pushed
+	int length;    // the bound an indexed load or store is checked against, 0 if it needn't be,
+	               // or how many arguments a call passes
+	int *phi_args; // a phi's value from each predecessor, or a call's arguments
+	int block;     // -1 for constants
+	int home;      // the promoted variable it was stored to or read from, 0 for none
+	int forward;   // the value that replaced it, -1 if it hasn't been
+	int dead;
+} ir_value;
+
+typedef struct ir_block {
+	int start;   // its first instruction in the original code
+	int *values; // in program order, phis aren't included
+	int num_values;
+	int *phis;
+	int num_phis;
+	int *preds;
+	int num_preds;
+	int succs[2]; // where a branch jumps, then where it falls through
+	int num_succs;
+	ir_exit exit;
+	int cond;     // the value a branch tests or a function returns, -1 for other blocks
+	int reachable;
+} ir_block;
+
+typedef struct ir_procedure {
+	ir_value *values;
+	int num_values;
+	int capacity;
+	ir_block *blocks; // in code order, blocks[0] starts with the INC
+	int num_blocks;
+	int *order;       // the reachable blocks in reverse postorder
+	int num_order;
+	int frame;        // the INC, links included
+	int params;       // the INC's L, slots 3 on are the arguments it was called with
+	char *escaped;    // per frame slot, seen by nested procedures so it stays in memory
+	instruction last; // the final return (with or without a value), or main's halt
+	int is_main;
+	int flags;
+} ir_procedure;
+
+// Reports a lexer or parser error and abandons the compile, it doesn't return
+void compile_error(char *message);
+
+// Fills buffer with up to size bytes of source and returns how many, 0 at the end
+typedef long (*source_reader)(void *context, char *buffer, long size);
+
+token_stream *lexanalyzer(char *input, int flags);
+void lex_begin(source_reader read, void *context, int flags);
+lexeme lex_next();
+name_table *lex_names();
+token_stream *lex_finish();
+void lex_abort();
+void free_tokens(token_stream *tokens);
+void name_table_init(name_table *names);
+int intern_name(name_table *names, char *name, int length);
+int find_name(name_table *names, char *name);
+char *name_text(name_table *names, int name);
+void name_table_free(name_table *names);
+long string_reader(void *context, char *buffer, long size);
+long file_reader(void *context, char *buffer, long size);
+symbol *parse();
+void parse_abort();
+void name_index_init(name_index *index);
+void name_index_add(name_index *index, int name, int symbol);
+int name_index_first(name_index *index, int name);
+void name_index_free(name_index *index);
+instruction *generate_code(token_stream *tokens, symbol *symbols, int *code_length, memo_table *memo,
+                           object_module *module);
+instruction *generate_lazy(token_stream *tokens, symbol *symbols, int *code_length, codegen_state **state);
+instruction *generate_procedure(codegen_state *state, int stub, int *length);
+void free_codegen_state(codegen_state *state);
+void printcode(instruction *code, int code_length);
+
+int find_procedures(instruction *code, int code_length, procedure *procs);
+int find_base_procedures(instruction *code, int base_length, int code_length, procedure *procs);
+int procedure_containing(procedure *procs, int num_procs, int index);
+int indexed_extent(instruction *code, int index);
+call_signature procedure_signature(instruction *code, procedure proc);
+code_block *split_blocks(instruction *code, int code_length, int *num_blocks, int *main_block);
+instruction *link_blocks(code_block *blocks, int num_blocks, int main_block, int *code_length);
+instruction *inline_procedures(instruction *code, int *code_length, int threshold);
+instruction *inline_calls(instruction *code, int *code_length, int threshold, char *sites, int *changed);
+instruction *optimize_loops(instruction *code, int *code_length, int flags);
+instruction *optimize_block_loops(instruction *code, int *code_length, int flags);
+int inverted_relation(int op);
+instruction *eliminate_dead_code(instruction *code, int *code_length, int flags);
+instruction *optimize_tail_calls(instruction *code, int *code_length);
+void make_tail_calls(instruction *code, int code_length, int from);
+instruction *optimize_ssa(instruction *code, int *code_length, int flags, int cse);
+char **find_escaped(code_block *blocks, int num_blocks, int main_block);
+instruction *promote_variables(instruction *code, int code_length, char *escaped, call_signature *callees,
+                               int is_main, int flags, int cse, int *new_length);
+ir_procedure *build_ir(instruction *code, int code_length, char *escaped, call_signature *callees, int is_main,
+                       int flags);
+void simplify_ir(ir_procedure *proc);
+void remove_dead_values(ir_procedure *proc);
+instruction *lower_ir(ir_procedure *proc, int *code_length);
+void free_ir(ir_procedure *proc);
+int ir_find(ir_procedure *proc, int value);
+void resolve_operands(ir_procedure *proc);
+int is_live(ir_procedure *proc, int value);
+int same_value(ir_procedure *proc, int a, int b);
+int value_operands(ir_value *value, int **operands);
+void count_uses(ir_procedure *proc, int *uses, int *user);
+void append_int(int **list, int *count, int item);
+void number_values(ir_procedure *proc);
+int fold(int op, int64_t a, int64_t b, int flags, int64_t *result);
+int verify_program(instruction *code, int code_length, procedure_copy *copies, int num_copies, int stack_size,
+                   verified_code *verified, const char **error);
+
+uint64_t hash_code(instruction *code, int code_length);
+code_profile *read_profile(const char *path, instruction *code, int code_length, const char **error);
+void free_profile(code_profile *profile);
+instruction *optimize_with_profile(instruction *code, int *code_length, code_profile *profile, int *inlined);
+
+void set_compile_threads(int threads);
+int parallel_threads(long work);
+void parallel_for(int count, int threads, void (*work)(void *context, int item), void *context);
+
+int write_bytecode(FILE *file, instruction *code, int code_length, int flags);
+instruction *read_bytecode(FILE *file, int *code_length, int *flags);
+int write_instructions(FILE *file, instruction *code, int code_length);
+int read_instructions(FILE *file, instruction *code, int code_length);
+
+object_module *compile_object(token_stream *tokens, symbol *symbols, int flags);
+relocation *add_relocation(object_module *module, int index, int kind, int name);
+int is_object_file(FILE *file);
+int write_object(FILE *file, object_module *module);
+object_module *read_object(FILE *file);
+void free_object(object_module *module);
+instruction *link_modules(object_module **modules, int num_modules, int *code_length, char *error, int error_size);
+
+// Starting value for hash_bytes() and hash_word()
+#define HASH_SEED 0xcbf29ce484222325ULL
+uint64_t hash_bytes(uint64_t hash, char *bytes, size_t length);
+uint64_t hash_word(uint64_t hash, uint64_t word);
+memo_entry *memo_find(memo_table *table, uint64_t key);
+memo_entry *memo_add(memo_table *table, uint64_t key, instruction *code, int length, char *callees,
+                     int num_callees);
+void memo_sweep(memo_table *table);
+void memo_free(memo_table *table);
+instruction *cache_lookup(char *cache_dir, uint64_t source_hash, char *options, int *code_length, int flags);
+void cache_store(char *cache_dir, uint64_t source_hash, char *options, instruction *code, int code_length, int flags,
+                 long max_size);
@@ -0,0 +1,250 @@
+/*
+    Dead Code Elimination for PL/0
+    Author: Ryan Doherty
+
+    The code generator emits every declared procedure and a frame slot
+    for every declared variable whether the program uses them or not.
+    This pass works on the whole program at once:
+
+    - Dead procedures: procedures are walked from main over call edges
+      and anything main can never reach is dropped, along with procedures
+      only called from dead ones. Inlining often leaves its callees here.
+    - Dead variables: a slot that no reachable LOD ever reads and that's
+      not in an array or a parameter is removed from its frame and the
+      frame's INC shrinks. Stores to it go away
+      along with the expression that computed the value, as long as the
+      expression can't fail. Stores whose value has to be computed anyway
+      (a read, or arithmetic that can trap) go to one scratch slot instead.
+
+    The remaining slots are renumbered from 3 and jumps into removed code
+    move to the next instruction kept. Removing a store can leave another
+    variable unread so the pass is repeated until nothing changes.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include "compiler.h"
+
+#define MAX_DEAD_CODE_ROUNDS 8
+
+instruction *dead_code_round(instruction *code, int *code_length, int flags, int *changed);
+int dead_store_start(instruction *code, int store, int start, int *is_target, int flags);
+
+instruction *eliminate_dead_code(instruction *code, int *code_length, int flags) {
+    int changed = 1;
+    for (int round = 0; round < MAX_DEAD_CODE_ROUNDS && changed; ++round) {
+        changed = 0;
+        code = dead_code_round(code, code_length, flags, &changed);
+    }
+    return code;
+}
+
+instruction *dead_code_round(instruction *code, int *code_length, int flags, int *changed) {
+    int length = *code_length;
+    procedure *procs = malloc(length * sizeof(procedure));
+    int num_procs = find_procedures(code, length, procs);
+
+    // Walk the call graph from main, the order doubles as the work queue
+    int *reached = calloc(num_procs, sizeof(int));
+    int *parent = malloc(num_procs * sizeof(int));
+    int *order = malloc(num_procs * sizeof(int));
+    int main_proc = procedure_containing(procs, num_procs, code[0].m);
+    reached[main_proc] = 1;
+    parent[main_proc] = -1;
+    order[0] = main_proc;
+    int num_reached = 1;
+    for (int next = 0; next < num_reached; ++next) {
+        int p = order[next];
+        for (int i = procs[p].start; i <= procs[p].end; ++i) {
+            if (code[i].opcode != CAL) {
+                continue;
+            }
+            int callee = procedure_containing(procs, num_procs, code[i].m);
+            if (!reached[callee]) {
+                // The callee's parent is the procedure l static links up from the caller
+                int up = p;
+                for (int l = code[i].l; l > 0; --l) {
+                    up = parent[up];
+                }
+                reached[callee] = 1;
+                parent[callee] = up;
+                order[num_reached++] = callee;
+            }
+        }
+    }
+
+    // Every frame slot gets an entry, slots[p] is where procedure p's start
+    int *slots = malloc(num_procs * sizeof(int));
+    int num_slots = 0;
+    for (int p = 0; p < num_procs; ++p) {
+        slots[p] = num_slots;
+        num_slots += reached[p] ? (int) code[procs[p].start].m : 0;
+    }
+    int *is_read = calloc(num_slots + 1, sizeof(int));
+    int *is_target = calloc(length + 1, sizeof(int));
+    // The procedure each instruction belongs to and, for variables, the frame it addresses
+    int *owner = malloc(length * sizeof(int));
+    int *frame = malloc(length * sizeof(int));
+    for (int i = 0; i < length; ++i) {
+        owner[i] = -1;
+        frame[i] = -1;
+    }
+    for (int p = 0; p < num_procs; ++p) {
+        if (!reached[p]) {
+            continue;
+        }
+        for (int i = procs[p].start; i <= procs[p].end; ++i) {
+            owner[i] = p;
+            instruction ir = code[i];
+            if (ir.opcode == LOD || ir.opcode == STO || ir.opcode == LODX || ir.opcode == STOX) {
+                int up = p;
+                for (int l = ir.l; l > 0; --l) {
+                    up = parent[up];
+                }
+                frame[i] = up;
+                if (ir.opcode == LOD) {
+                    is_read[slots[up] + ir.m] = 1;
+                } else if (ir.opcode != STO) {
+                    // Arrays are kept whole so their elements stay next to each other
+                    int extent = indexed_extent(code, i);
+                    for (int m = 0; m < extent; ++m) {
+                        is_read[slots[up] + ir.m + m] = 1;
+                    }
+                }
+            } else if (ir.opcode == JMP || ir.opcode == JPC) {
+                is_target[ir.m] = 1;
+            } else if (ir.opcode == INC) {
+                // The caller fills in the parameters, they keep the first slots
+                for (int m = 3; m < 3 + ir.l; ++m) {
+                    is_read[slots[p] + m] = 1;
+                }
+            }
+        }
+    }
+
+    // Drop dead stores, or point them at the scratch slot when their value can't be dropped
+    int *removed = calloc(length, sizeof(int));
+    int *needs_scratch = calloc(num_procs, sizeof(int));
+    for (int i = 0; i < length; ++i) {
+        if (code[i].opcode != STO || frame[i] < 0 || is_read[slots[frame[i]] + code[i].m]) {
+            continue;
+        }
+        int start = dead_store_start(code, i, procs[owner[i]].start, is_target, flags);
+        if (start >= 0) {
+            for (int j = start; j <= i; ++j) {
+                removed[j] = 1;
+            }
+        } else {
+            needs_scratch[frame[i]] = 1;
+        }
+    }
+
+    // Number the slots that are still read, then the scratch slot after them
+    int *new_offset = malloc((num_slots + 1) * sizeof(int));
+    int *new_frame = calloc(num_procs, sizeof(int));
+    for (int p = 0; p < num_procs; ++p) {
+        if (!reached[p]) {
+            continue;
+        }
+        int size = (int) code[procs[p].start].m;
+        int next_offset = 3;
+        for (int m = 0; m < size; ++m) {
+            new_offset[slots[p] + m] = m < 3 ? m : (is_read[slots[p] + m] ? next_offset++ : -1);
+        }
+        int scratch = next_offset;
+        if (needs_scratch[p]) {
+            next_offset++;
+        }
+        for (int m = 3; m < size; ++m) {
+            if (new_offset[slots[p] + m] < 0) {
+                new_offset[slots[p] + m] = scratch;
+            }
+        }
+        new_frame[p] = next_offset;
+        if (next_offset != size) {
+            *changed = 1;
+        }
+    }
+
+    // Map each old instruction to its new index, removed code maps to the next one kept
+    int *map = malloc((length + 1) * sizeof(int));
+    int new_length = 0;
+    for (int i = 0; i < length; ++i) {
+        map[i] = new_length;
+        if (i == 0 || (owner[i] >= 0 && !removed[i])) {
+            new_length++;
+        }
+    }
+    map[length] = new_length;
+    if (new_length != length) {
+        *changed = 1;
+    }
+
+    instruction *new_code = malloc((new_length + 1) * sizeof(instruction));
+    int index = 0;
+    for (int i = 0; i < length; ++i) {
+        if (i != 0 && (owner[i] < 0 || removed[i])) {
+            continue;
+        }
+        instruction ir = code[i];
+        if (ir.opcode == JMP || ir.opcode == JPC || ir.opcode == CAL) {
+            ir.m = map[ir.m];
+        } else if (ir.opcode == LOD || ir.opcode == STO || ir.opcode == LODX || ir.opcode == STOX) {
+            ir.m = new_offset[slots[frame[i]] + ir.m];
+        } else if (ir.opcode == INC && i == procs[owner[i]].start) {
+            ir.m = new_frame[owner[i]];
+        }
+        new_code[index++] = ir;
+    }
+
+    *code_length = new_length;
+    free(procs);
+    free(reached);
+    free(parent);
+    free(order);
+    free(slots);
+    free(is_read);
+    free(is_target);
+    free(owner);
+    free(frame);
+    free(removed);
+    free(needs_scratch);
+    free(new_offset);
+    free(new_frame);
+    free(map);
+    free(code);
+    return new_code;
+}
+
+// Finds the straight line expression whose value the store at index pops.
+// Returns its first instruction, or -1 if it can't be removed because it
+// might fail, has other effects, or something jumps into the middle of it.
+int dead_store_start(instruction *code, int store, int start, int *is_target, int flags) {
+    // Words the instructions after i still need from below
+    int needed = 1;
+    if (is_target[store]) {
+        return -1;
+    }
+    for (int i = store - 1; i > start; --i) {
+        instruction ir = code[i];
+        if (ir.opcode == LIT || ir.opcode == LOD) {
+            needed--;
+        } else if (ir.opcode == OPR && ir.m >= 1 && ir.m <= 13 && ir.m != 5 && ir.m != 7) {
+            // NEG, ADD, SUB and MUL can only fail when overflow traps
+            if ((flags & MODE_TRAP) && ir.m <= 4) {
+                return -1;
+            }
+            if (ir.m != 1 && ir.m != 6) {
+                needed++;
+            }
+        } else {
+            return -1;
+        }
+        if (needed == 0) {
+            return i;
+        }
+        if (is_target[i]) {
+            return -1;
+        }
+    }
+    return -1;
+}
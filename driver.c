@@ -1,52 +1,319 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "compiler.h"
 
+// Default limit on the total size of the compilation cache
+#define DEFAULT_CACHE_SIZE (64L * 1024 * 1024)
+
+uint64_t hash_source(FILE *file);
+char *default_cache_dir();
+void write_output(char *path, instruction *code, int code_length, int flags);
+object_module *load_module(char *path, int flags);
+instruction *link_files(char **paths, int num_paths, int flags, int *code_length);
+
 int main(int argc, char **argv) {
-    FILE *file;
-    char *inputfile;
-    char c;
-    lexeme *list;
+    FILE *inputfile;
+    char *filename = NULL;
+    // Sources and object modules to link, filename is set when there's only one
+    char **inputs = malloc(argc * sizeof(char *));
+    int num_inputs = 0;
+    int compile_only = 0;
+    token_stream *list;
     symbol *table;
     instruction *code;
-    int i;
+    int code_length;
+    char *output = NULL;
+    int flags = 0;
+
+    int use_cache = 1;
+    char *cache_dir = default_cache_dir();
+    long cache_size = DEFAULT_CACHE_SIZE;
+    int inline_threshold = DEFAULT_INLINE_THRESHOLD;
+    int loop_opt = 1;
+    int dead_code = 1;
+    int ssa = 1;
+    int cse = 1;
+    int tail_calls = 1;
+    char *profile_path = NULL;
+    // Options that change the generated code must be part of the cache key
+    char options[256];
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--no-cache") == 0) {
+            use_cache = 0;
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            cache_size = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--inline-threshold") == 0 && i + 1 < argc) {
+            inline_threshold = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            set_compile_threads(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--no-loop-opt") == 0) {
+            loop_opt = 0;
+        } else if (strcmp(argv[i], "--no-dce") == 0) {
+            dead_code = 0;
+        } else if (strcmp(argv[i], "--no-ssa") == 0) {
+            ssa = 0;
+        } else if (strcmp(argv[i], "--no-cse") == 0) {
+            cse = 0;
+        } else if (strcmp(argv[i], "--no-tail-calls") == 0) {
+            tail_calls = 0;
+        } else if (strcmp(argv[i], "--int64") == 0) {
+            flags |= MODE_INT64;
+        } else if (strcmp(argv[i], "--profile-use") == 0 && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else if (strcmp(argv[i], "--tiered") == 0) {
+            flags |= MODE_TIERED;
+        } else if (strcmp(argv[i], "--overflow") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "trap") == 0) {
+                flags |= MODE_TRAP;
+            } else if (strcmp(argv[i], "wrap") == 0) {
+                flags &= ~MODE_TRAP;
+            } else {
+                printf("Error : overflow must be wrap or trap\n");
+                return 0;
+            }
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0) {
+            compile_only = 1;
+        } else if (argv[i][0] == '-') {
+            printf("Error : unknown option %s\n", argv[i]);
+            return 0;
+        } else {
+            inputs[num_inputs++] = argv[i];
+        }
+    }
+
+    snprintf(options, sizeof(options), "inline=%d loops=%d dce=%d ssa=%d cse=%d tail=%d mode=%d",
+             inline_threshold, loop_opt, dead_code, ssa, cse, tail_calls, flags);
 
-    if (argc < 2) {
+    if (num_inputs == 0) {
         printf("Error : please include the file name");
         return 0;
     }
 
-    file = fopen(argv[1], "r");
-    inputfile = malloc(500 * sizeof(char));
-    i = 0;
+    // Compile a module for linking later
+    if (compile_only) {
+        if (num_inputs != 1 || output == NULL) {
+            printf("Error : -c compiles one file and needs -o\n");
+            return 0;
+        }
+        object_module *module = load_module(inputs[0], flags);
+        if (module == NULL) {
+            return 0;
+        }
+        printcode(module->code, module->code_length);
+        FILE *file = fopen(output, "wb");
+        if (file == NULL || !write_object(file, module)) {
+            printf("Error : can't write %s\n", output);
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+        free_object(module);
+        free(inputs);
+        return 0;
+    }
 
-    c = fgetc(file);
-    while (1) {
-        inputfile[i++] = c;
-        c = fgetc(file);
-        if (c == EOF)
-            break;
+    // Several files, or an object module, are linked into one program
+    if (num_inputs == 1) {
+        inputfile = fopen(inputs[0], "rb");
+        if (inputfile == NULL) {
+            printf("Error : can't open %s\n", inputs[0]);
+            return 0;
+        }
+        if (!is_object_file(inputfile)) {
+            filename = inputs[0];
+        }
+        fclose(inputfile);
     }
-    inputfile[i] = '\0';
+    uint64_t source_hash = 0;
+    int cached = 0;
+    if (filename == NULL) {
+        code = link_files(inputs, num_inputs, flags, &code_length);
+        if (code == NULL) {
+            return 0;
+        }
+    } else {
+        inputfile = fopen(filename, "r");
+        if (inputfile == NULL) {
+            printf("Error : can't open %s\n", filename);
+            return 0;
+        }
 
-    list = lexanalyzer(inputfile);
-    if (list == NULL) {
-        free(inputfile);
-        return 0;
+        // Skip compilation entirely if we've already compiled this exact source
+        if (use_cache) {
+            source_hash = hash_source(inputfile);
+            code = cache_lookup(cache_dir, source_hash, options, &code_length, flags);
+            cached = code != NULL;
+            rewind(inputfile);
+        }
+
+        if (!cached) {
+            // The parser pulls lexemes as it goes, reading the file a window at a time
+            lex_begin(file_reader, inputfile, flags);
+            table = parse();
+            list = lex_finish();
+
+            code = generate_code(list, table, &code_length, NULL, NULL);
+            free_tokens(list);
+            free(table);
+        }
+        fclose(inputfile);
     }
 
-    table = parse(list);
-    if (table == NULL) {
-        free(inputfile);
-        free(list);
-        return 0;
+    // The machine optimizes a tiered program's hot spots itself (tier.c)
+    if (flags & MODE_TIERED) {
+        inline_threshold = 0;
+        dead_code = 0;
+        ssa = 0;
+        loop_opt = 0;
+    }
+    if (!cached) {
+        code = inline_procedures(code, &code_length, inline_threshold);
+        if (dead_code) {
+            code = eliminate_dead_code(code, &code_length, flags);
+        }
+        if (ssa) {
+            code = optimize_ssa(code, &code_length, flags, cse);
+        }
+        if (loop_opt) {
+            code = optimize_loops(code, &code_length, flags);
+        }
+        if (tail_calls) {
+            code = optimize_tail_calls(code, &code_length);
+        }
+        // Linked programs aren't cached, the modules are what's compiled once
+        if (use_cache && filename != NULL) {
+            cache_store(cache_dir, source_hash, options, code, code_length, flags, cache_size);
+        }
     }
 
-    code = generate_code(list, table);
+    // The code so far is what the profile was counted on, so it's cached
+    // without the profile and the profile is applied to it every time
+    if (profile_path != NULL) {
+        const char *error;
+        code_profile *profile = read_profile(profile_path, code, code_length, &error);
+        if (profile == NULL) {
+            printf("Warning : %s, compiling without it\n", error);
+        } else {
+            int inlined;
+            code = optimize_with_profile(code, &code_length, profile, &inlined);
+            free_profile(profile);
+            // Inlined bodies get the same clean up as the rest of the program
+            if (inlined && ssa) {
+                code = optimize_ssa(code, &code_length, flags, cse);
+            }
+            if (inlined && loop_opt) {
+                code = optimize_loops(code, &code_length, flags);
+            }
+            if (inlined && tail_calls) {
+                code = optimize_tail_calls(code, &code_length);
+            }
+        }
+    }
+    printcode(code, code_length);
+    write_output(output, code, code_length, flags);
 
-    free(list);
-    free(inputfile);
-    free(table);
+    free(inputs);
     free(code);
     return 0;
-}
\ No newline at end of file
+}
+
+// Compiles a source file as a module, or reads a module compiled earlier
+object_module *load_module(char *path, int flags) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Error : can't open %s\n", path);
+        return NULL;
+    }
+    object_module *module;
+    if (is_object_file(file)) {
+        module = read_object(file);
+        if (module == NULL) {
+            printf("Error : %s isn't a valid object module\n", path);
+        } else if (module->flags != flags) {
+            printf("Error : %s was compiled with different --int64, --overflow or --tiered options\n", path);
+            free_object(module);
+            module = NULL;
+        }
+    } else {
+        lex_begin(file_reader, file, flags);
+        symbol *table = parse();
+        token_stream *list = lex_finish();
+        module = compile_object(list, table, flags);
+        free_tokens(list);
+        free(table);
+    }
+    fclose(file);
+    return module;
+}
+
+instruction *link_files(char **paths, int num_paths, int flags, int *code_length) {
+    object_module **modules = malloc(num_paths * sizeof(object_module *));
+    instruction *code = NULL;
+    int num_modules = 0;
+    while (num_modules < num_paths && (modules[num_modules] = load_module(paths[num_modules], flags)) != NULL) {
+        num_modules++;
+    }
+    if (num_modules == num_paths) {
+        char error[256];
+        code = link_modules(modules, num_modules, code_length, error, sizeof(error));
+        if (code == NULL) {
+            printf("%s\n", error);
+        }
+    }
+    for (int k = 0; k < num_modules; ++k) {
+        free_object(modules[k]);
+    }
+    free(modules);
+    return code;
+}
+
+// Hashes the source a chunk at a time so it never has to be read in whole
+uint64_t hash_source(FILE *file) {
+    char buffer[65536];
+    uint64_t hash = HASH_SEED;
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        hash = hash_bytes(hash, buffer, count);
+    }
+    return hash;
+}
+
+char *default_cache_dir() {
+    static char path[4096];
+    char *dir = getenv("PL0_CACHE_DIR");
+    if (dir != NULL) {
+        return dir;
+    }
+    dir = getenv("XDG_CACHE_HOME");
+    if (dir != NULL) {
+        snprintf(path, sizeof(path), "%s/pl0", dir);
+        return path;
+    }
+    dir = getenv("HOME");
+    if (dir != NULL) {
+        snprintf(path, sizeof(path), "%s/.cache/pl0", dir);
+        return path;
+    }
+    return ".pl0cache";
+}
+
+// Writes the bytecode file run by the vm when an output file was requested
+void write_output(char *path, instruction *code, int code_length, int flags) {
+    if (path == NULL) {
+        return;
+    }
+    FILE *file = fopen(path, "wb");
+    if (file == NULL || !write_bytecode(file, code, code_length, flags)) {
+        printf("Error : can't write %s\n", path);
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+}
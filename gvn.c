@@ -0,0 +1,451 @@
+/*
+    Value Numbering for PL/0
+    Author: Ryan Doherty
+
+    Finds values in a procedure's SSA form (ir.c) that are sure to be the
+    same number as one computed earlier and reuses that one instead.
+
+    - Operations: two OPRs are the same if they do the same thing to the
+      same operands, in either order for + * == and <>. One is reused
+      where the other dominates it, so this works across blocks as well
+      as inside them (global value numbering, walking the blocks in
+      reverse postorder).
+    - Memory: a load of a variable that stayed in memory is the value last
+      loaded from or stored to it, as long as nothing could have written
+      it in between. The frames a procedure sees at different levels are
+      different frames, so a store only changes what's known about its
+      own variable (an indexed one about the array's), but a call could
+      change any of them. What's known on
+      entry to a block is what every path into it agrees on, worked out
+      around loops until it settles.
+
+    Reusing a value isn't free on a stack machine with no way to copy
+    the top of the stack: the value has to be stored to a slot and loaded
+    back for each use. So a repeated computation is only replaced when
+    that's shorter than computing it again, biggest expressions first
+    since replacing them makes the repeats inside them go away too. A load
+    that turns out to be a constant is always replaced, folding can then
+    use it.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "compiler.h"
+
+// The memory tables hold blocks times variables, procedures that would need
+// more entries than this only have their operations numbered
+#define MAX_MEMORY_TABLE (1L << 22)
+
+// What number_values() keeps while it runs
+typedef struct numbering {
+    ir_procedure *proc;
+    int *rpo;        // each block's index in reverse postorder, -1 if unreachable
+    int *idom;       // each block's immediate dominator
+    int *leader;     // the earlier value each value is the same as, or itself
+    int *source;     // for loads, the value the variable is known to hold, -1 if it isn't
+    int *table;      // open addressing hash table of values, -1 for empty
+    int table_size;
+} numbering;
+
+// One set of values that are the same number, for ordering by cost
+typedef struct value_class {
+    int cost;
+    int leader;
+} value_class;
+
+void find_dominators(numbering *numbers);
+int dominates(numbering *numbers, int a, int b);
+void find_sources(numbering *numbers);
+int memory_key(numbering *numbers, int value, int **keys, int *num_keys);
+void number_operations(numbering *numbers);
+uint64_t hash_operation(numbering *numbers, int value);
+int same_operand(numbering *numbers, int a, int b);
+int same_operation(numbering *numbers, int a, int b);
+int is_commutative(int op);
+void replace_values(numbering *numbers);
+int compare_classes(const void *a, const void *b);
+void drop_uses(numbering *numbers, int value, int *uses);
+
+void number_values(ir_procedure *proc) {
+    remove_dead_values(proc);
+    numbering numbers = {.proc = proc};
+    numbers.rpo = malloc(proc->num_blocks * sizeof(int));
+    numbers.idom = malloc(proc->num_blocks * sizeof(int));
+    numbers.leader = malloc(proc->num_values * sizeof(int));
+    numbers.source = malloc(proc->num_values * sizeof(int));
+    for (int v = 0; v < proc->num_values; ++v) {
+        numbers.leader[v] = v;
+        numbers.source[v] = -1;
+    }
+    numbers.table_size = 64;
+    while (numbers.table_size < 2 * proc->num_values) {
+        numbers.table_size *= 2;
+    }
+    numbers.table = malloc(numbers.table_size * sizeof(int));
+
+    find_dominators(&numbers);
+    find_sources(&numbers);
+    number_operations(&numbers);
+    replace_values(&numbers);
+    resolve_operands(proc);
+
+    free(numbers.rpo);
+    free(numbers.idom);
+    free(numbers.leader);
+    free(numbers.source);
+    free(numbers.table);
+}
+
+// Cooper, Harvey and Kennedy's iterative dominators over the reverse postorder
+void find_dominators(numbering *numbers) {
+    ir_procedure *proc = numbers->proc;
+    for (int b = 0; b < proc->num_blocks; ++b) {
+        numbers->rpo[b] = -1;
+        numbers->idom[b] = -1;
+    }
+    for (int k = 0; k < proc->num_order; ++k) {
+        numbers->rpo[proc->order[k]] = k;
+    }
+    numbers->idom[proc->order[0]] = proc->order[0];
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int k = 1; k < proc->num_order; ++k) {
+            ir_block *block = &proc->blocks[proc->order[k]];
+            int idom = -1;
+            for (int p = 0; p < block->num_preds; ++p) {
+                int pred = block->preds[p];
+                if (numbers->idom[pred] == -1) {
+                    continue;
+                }
+                if (idom == -1) {
+                    idom = pred;
+                    continue;
+                }
+                // Walk both up the tree until they meet
+                int a = pred;
+                while (a != idom) {
+                    while (numbers->rpo[a] > numbers->rpo[idom]) {
+                        a = numbers->idom[a];
+                    }
+                    while (numbers->rpo[idom] > numbers->rpo[a]) {
+                        idom = numbers->idom[idom];
+                    }
+                }
+            }
+            if (numbers->idom[proc->order[k]] != idom) {
+                numbers->idom[proc->order[k]] = idom;
+                changed = 1;
+            }
+        }
+    }
+}
+
+// Whether every path to block b goes through block a
+int dominates(numbering *numbers, int a, int b) {
+    while (numbers->rpo[b] > numbers->rpo[a]) {
+        b = numbers->idom[b];
+    }
+    return a == b;
+}
+
+// Works out which loads read a value that's already known, a forward
+// dataflow over what each variable in memory holds at the end of each block
+void find_sources(numbering *numbers) {
+    ir_procedure *proc = numbers->proc;
+    int *key = malloc(proc->num_values * sizeof(int));
+    int *keys = NULL;
+    int num_keys = 0;
+    memset(numbers->table, -1, numbers->table_size * sizeof(int));
+    for (int k = 0; k < proc->num_order; ++k) {
+        ir_block *block = &proc->blocks[proc->order[k]];
+        for (int i = 0; i < block->num_values; ++i) {
+            int v = block->values[i];
+            if (is_live(proc, v) && (proc->values[v].op == IR_LOAD || proc->values[v].op == IR_STORE)) {
+                key[v] = memory_key(numbers, v, &keys, &num_keys);
+            }
+        }
+    }
+    if (num_keys == 0 || (long) proc->num_blocks * num_keys > MAX_MEMORY_TABLE) {
+        free(key);
+        free(keys);
+        return;
+    }
+
+    // Each block's variables on the way out, -1 where nothing is known
+    int *known = malloc((long) proc->num_blocks * num_keys * sizeof(int));
+    char *visited = calloc(proc->num_blocks, 1);
+    int *map = malloc(num_keys * sizeof(int));
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int k = 0; k < proc->num_order; ++k) {
+            int b = proc->order[k];
+            ir_block *block = &proc->blocks[b];
+            // Blocks not seen yet (along loops, the first time round) don't
+            // take anything away, so loops that leave a variable alone keep it
+            int first = 1;
+            for (int p = 0; p < block->num_preds; ++p) {
+                int *out = &known[(long) block->preds[p] * num_keys];
+                if (!visited[block->preds[p]]) {
+                    continue;
+                }
+                for (int n = 0; n < num_keys; ++n) {
+                    map[n] = first || map[n] == out[n] ? out[n] : -1;
+                }
+                first = 0;
+            }
+            if (first) {
+                memset(map, -1, num_keys * sizeof(int));
+            }
+            for (int i = 0; i < block->num_values; ++i) {
+                int v = block->values[i];
+                ir_value *value = &proc->values[v];
+                if (!is_live(proc, v)) {
+                    continue;
+                }
+                switch (value->op) {
+                    case IR_LOAD:
+                        numbers->source[v] = map[key[v]];
+                        if (map[key[v]] == -1) {
+                            map[key[v]] = v;
+                        }
+                        break;
+                    case IR_STORE:
+                        map[key[v]] = value->args[0];
+                        break;
+                    case IR_STOREX:
+                        // Inlined procedures can share slots, so an array's
+                        // element can be another procedure's variable
+                        for (int n = 0; n < num_keys; ++n) {
+                            ir_value *other = &proc->values[keys[n]];
+                            if (other->l == value->l && other->m >= value->m && other->m < value->m + value->length) {
+                                map[n] = -1;
+                            }
+                        }
+                        break;
+                    case IR_CALL:
+                    case IR_CALL_VALUE:
+                    case IR_TAIL_CALL:
+                        memset(map, -1, num_keys * sizeof(int));
+                        break;
+                    default:
+                        break;
+                }
+            }
+            int *out = &known[(long) b * num_keys];
+            if (!visited[b] || memcmp(out, map, num_keys * sizeof(int)) != 0) {
+                memcpy(out, map, num_keys * sizeof(int));
+                visited[b] = 1;
+                changed = 1;
+            }
+        }
+    }
+    free(key);
+    free(keys);
+    free(known);
+    free(visited);
+    free(map);
+}
+
+// The index of the variable a load or store uses, adding it to keys (a
+// load or store of each variable) if it's new
+int memory_key(numbering *numbers, int value, int **keys, int *num_keys) {
+    ir_procedure *proc = numbers->proc;
+    ir_value *v = &proc->values[value];
+    uint64_t hash = ((uint64_t) v->l * 0x9E3779B97F4A7C15ULL) ^ (uint64_t) v->m * 0xC2B2AE3D27D4EB4FULL;
+    int slot = (int) (hash & (numbers->table_size - 1));
+    while (numbers->table[slot] != -1) {
+        ir_value *other = &proc->values[(*keys)[numbers->table[slot]]];
+        if (other->l == v->l && other->m == v->m) {
+            return numbers->table[slot];
+        }
+        slot = (slot + 1) & (numbers->table_size - 1);
+    }
+    numbers->table[slot] = *num_keys;
+    append_int(keys, num_keys, value);
+    return *num_keys - 1;
+}
+
+// Gives each operation the earlier one it's the same as, if one dominates it
+void number_operations(numbering *numbers) {
+    ir_procedure *proc = numbers->proc;
+    memset(numbers->table, -1, numbers->table_size * sizeof(int));
+    for (int k = 0; k < proc->num_order; ++k) {
+        ir_block *block = &proc->blocks[proc->order[k]];
+        for (int i = 0; i < block->num_values; ++i) {
+            int v = block->values[i];
+            ir_value *value = &proc->values[v];
+            if (!is_live(proc, v)) {
+                continue;
+            }
+            if (value->op == IR_LOAD && numbers->source[v] != -1) {
+                numbers->leader[v] = numbers->leader[numbers->source[v]];
+                continue;
+            }
+            if (value->op != IR_OPR) {
+                continue;
+            }
+            int slot = (int) (hash_operation(numbers, v) & (numbers->table_size - 1));
+            while (numbers->table[slot] != -1 && !same_operation(numbers, numbers->table[slot], v)) {
+                slot = (slot + 1) & (numbers->table_size - 1);
+            }
+            int other = numbers->table[slot];
+            if (other != -1 && dominates(numbers, proc->values[other].block, value->block)) {
+                numbers->leader[v] = other;
+            } else {
+                // Later blocks this one dominates are more likely to find it
+                numbers->table[slot] = v;
+            }
+        }
+    }
+}
+
+uint64_t hash_operation(numbering *numbers, int value) {
+    ir_procedure *proc = numbers->proc;
+    ir_value *v = &proc->values[value];
+    uint64_t hash = (uint64_t) v->l * 0x9E3779B97F4A7C15ULL;
+    uint64_t operands = 0;
+    for (int a = 0; a < 2; ++a) {
+        int arg = v->args[a];
+        uint64_t h = arg == -1                         ? 0
+                     : proc->values[arg].op == IR_CONST ? (uint64_t) proc->values[arg].m * 0xC2B2AE3D27D4EB4FULL + 1
+                                                        : (uint64_t) numbers->leader[arg] * 0x165667B19E3779F9ULL + 2;
+        // Adding is the same either way round, which the commutative ones need
+        operands = is_commutative(v->l) ? operands + h : operands * 31 + h;
+    }
+    return hash ^ operands ^ (operands >> 29);
+}
+
+// Whether two operands are sure to be the same number
+int same_operand(numbering *numbers, int a, int b) {
+    ir_procedure *proc = numbers->proc;
+    if (a == -1 || b == -1) {
+        return a == b;
+    }
+    if (proc->values[a].op == IR_CONST || proc->values[b].op == IR_CONST) {
+        return same_value(proc, a, b);
+    }
+    return numbers->leader[a] == numbers->leader[b];
+}
+
+int same_operation(numbering *numbers, int a, int b) {
+    ir_value *x = &numbers->proc->values[a];
+    ir_value *y = &numbers->proc->values[b];
+    if (x->l != y->l) {
+        return 0;
+    }
+    if (same_operand(numbers, x->args[0], y->args[0]) && same_operand(numbers, x->args[1], y->args[1])) {
+        return 1;
+    }
+    return is_commutative(x->l) && same_operand(numbers, x->args[0], y->args[1]) &&
+           same_operand(numbers, x->args[1], y->args[0]);
+}
+
+// ADD, MULtiply, EQuaL and NotEQual
+int is_commutative(int op) {
+    return op == 2 || op == 4 || op == 8 || op == 9;
+}
+
+// Replaces repeated values with their leader where that makes the code shorter
+void replace_values(numbering *numbers) {
+    ir_procedure *proc = numbers->proc;
+    int *uses = calloc(proc->num_values, sizeof(int));
+    count_uses(proc, uses, NULL);
+
+    // What computing each value again costs in instructions. An operand
+    // used only here is computed in place, anything else is one load.
+    int *cost = malloc(proc->num_values * sizeof(int));
+    for (int v = 0; v < proc->num_values; ++v) {
+        cost[v] = 1;
+    }
+    for (int k = 0; k < proc->num_order; ++k) {
+        ir_block *block = &proc->blocks[proc->order[k]];
+        for (int i = 0; i < block->num_values; ++i) {
+            int v = block->values[i];
+            ir_value *value = &proc->values[v];
+            for (int a = 0; a < 2 && value->op == IR_OPR; ++a) {
+                int arg = value->args[a];
+                if (arg != -1) {
+                    cost[v] += proc->values[arg].op == IR_OPR && uses[arg] == 1 ? cost[arg] : 1;
+                }
+            }
+        }
+    }
+
+    // Members of each class, chained from their leader
+    int *first = malloc(proc->num_values * sizeof(int));
+    int *next = malloc(proc->num_values * sizeof(int));
+    value_class *classes = malloc((proc->num_values + 1) * sizeof(value_class));
+    int num_classes = 0;
+    for (int v = 0; v < proc->num_values; ++v) {
+        first[v] = -1;
+    }
+    for (int v = 0; v < proc->num_values; ++v) {
+        int leader = numbers->leader[v];
+        if (leader == v || !is_live(proc, v) || uses[v] == 0) {
+            continue;
+        }
+        if (first[leader] == -1) {
+            classes[num_classes++] = (value_class) {proc->values[leader].op == IR_CONST ? 0 : cost[leader], leader};
+        }
+        next[v] = first[leader];
+        first[leader] = v;
+    }
+    qsort(classes, num_classes, sizeof(value_class), compare_classes);
+
+    for (int c = 0; c < num_classes; ++c) {
+        int leader = classes[c].leader;
+        ir_value *value = &proc->values[leader];
+        // A value that's on the stack now has to be stored and then loaded for
+        // its first use, each repeat saves all but the one load replacing it
+        int saved = value->op != IR_PHI && uses[leader] == 1 ? -2 : 0;
+        for (int m = first[leader]; m != -1; m = next[m]) {
+            if (uses[m] > 0) {
+                saved += cost[m] - 1;
+            }
+        }
+        if (saved <= 0 && value->op != IR_CONST) {
+            continue;
+        }
+        for (int m = first[leader]; m != -1; m = next[m]) {
+            if (uses[m] > 0 && is_live(proc, m)) {
+                proc->values[m].forward = leader;
+                uses[leader] += uses[m];
+                drop_uses(numbers, m, uses);
+            }
+        }
+    }
+    free(uses);
+    free(cost);
+    free(first);
+    free(next);
+    free(classes);
+}
+
+// Most expensive first
+int compare_classes(const void *a, const void *b) {
+    const value_class *x = a;
+    const value_class *y = b;
+    if (x->cost != y->cost) {
+        return x->cost < y->cost ? 1 : -1;
+    }
+    return x->leader - y->leader;
+}
+
+// Takes away the uses of a value that's been replaced. Operands left unused
+// that are themselves repeats go to their leader, or they'd have to stay for
+// the sake of an error the leader already checks for.
+void drop_uses(numbering *numbers, int value, int *uses) {
+    ir_procedure *proc = numbers->proc;
+    int *operands;
+    int count = value_operands(&proc->values[value], &operands);
+    uses[value] = 0;
+    for (int a = 0; a < count; ++a) {
+        int arg = operands[a];
+        if (--uses[arg] == 0 && numbers->leader[arg] != arg && is_live(proc, arg)) {
+            proc->values[arg].forward = numbers->leader[arg];
+            drop_uses(numbers, arg, uses);
+        }
+    }
+}
@@ -0,0 +1,403 @@
+/*
+    Incremental Compilation for PL/0
+    Author: Ryan Doherty
+
+    Editors and hot reloading compile the same program over and over with
+    small changes. A pl0_incremental session keeps the code generated for
+    each procedure so the next compile only regenerates what changed.
+
+    - The code generator looks each procedure up by a hash of its frame size,
+      parameters and whether it's a function, its statement's tokens and
+      what each name in them refers to (kind, how many levels up, address or
+      constant value). A hit is copied in with its jumps moved to where the
+      block now starts and its calls resolved again by name, so callers don't
+      change when the procedures they call move and declaring something new
+      only regenerates the procedures that use it.
+    - Each procedure's promotion to SSA is looked up by a hash of the code
+      it's given, which of its frame slots nested procedures use and what
+      calling each procedure it calls takes and leaves on the stack.
+    - Each procedure's loop optimization is looked up by a hash of the code
+      it's given. Both are only redone for procedures whose code changed
+      (including callers of a changed procedure that was inlined into them).
+    - Parsing, inlining, dead code elimination and verification still run
+      over the whole program each time, and they're most of what a compile
+      after a small edit spends, so it takes a good part of the time one
+      from scratch does rather than a small fraction of it. incremental_bench
+      measures both on a 100k line program.
+
+    Only what the latest compile used is kept, so memory follows the size of
+    the program rather than the number of edits.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "vm.h"
+
+#define MEMO_MIN_CAPACITY 64
+
+// The procedures incremental_loops() has to optimize, see parallel_for()
+typedef struct missing_loops {
+    code_block *blocks;
+    int *blocks_to_do;
+    int count;
+    int flags;
+    code_block *optimized; // one for each of blocks_to_do
+} missing_loops;
+
+// The procedures incremental_ssa() has to promote, see parallel_for()
+typedef struct missing_ssa {
+    code_block *blocks;
+    int main_block;
+    char **escaped;
+    call_signature *callees;
+    int *blocks_to_do;
+    int count;
+    int flags;
+    int cse;
+    code_block *promoted; // one for each of blocks_to_do
+} missing_ssa;
+
+memo_entry *memo_insert(memo_table *table, memo_entry entry);
+uint64_t block_key(instruction *code, int length);
+void optimize_missing_loops(void *context, int item);
+void reuse_loops(code_block *block, memo_entry *entry);
+int block_callees(code_block *block, int *callees);
+uint64_t ssa_key(code_block *block, char *escaped, call_signature *signatures, int is_main, int flags, int cse);
+void promote_missing(void *context, int item);
+void reuse_ssa(code_block *block, memo_entry *entry);
+
+pl0_incremental *pl0_incremental_create(int flags) {
+    pl0_incremental *session = calloc(1, sizeof(pl0_incremental));
+    session->flags = flags;
+    return session;
+}
+
+void pl0_incremental_free(pl0_incremental *session) {
+    if (session == NULL) {
+        return;
+    }
+    memo_free(&session->blocks);
+    memo_free(&session->ssa);
+    memo_free(&session->loops);
+    free(session);
+}
+
+void pl0_incremental_stats(pl0_incremental *session, int *reused, int *generated) {
+    *reused = session->blocks.hits;
+    *generated = session->blocks.misses;
+}
+
+// Runs optimize_ssa() on each procedure that isn't in the session already
+instruction *incremental_ssa(pl0_incremental *session, instruction *code, int *code_length, int cse) {
+    int num_blocks;
+    int main_block;
+    code_block *blocks = split_blocks(code, *code_length, &num_blocks, &main_block);
+    free(code);
+    // What each procedure's promotion depends on outside its own code
+    char **escaped = find_escaped(blocks, num_blocks, main_block);
+    call_signature *signatures = malloc((num_blocks + 1) * sizeof(call_signature));
+    for (int b = 0; b < num_blocks; ++b) {
+        procedure whole = {0, blocks[b].length - 1};
+        signatures[b] = procedure_signature(blocks[b].code, whole);
+    }
+    missing_ssa missing = {.blocks = blocks, .main_block = main_block, .escaped = escaped, .callees = signatures,
+                           .blocks_to_do = malloc((num_blocks + 1) * sizeof(int)), .flags = session->flags,
+                           .cse = cse};
+    uint64_t *keys = malloc((num_blocks + 1) * sizeof(uint64_t));
+    long missing_work = 0;
+    for (int b = 0; b < num_blocks; ++b) {
+        if (!blocks[b].is_procedure || escaped[b] == NULL) {
+            continue;
+        }
+        keys[b] = ssa_key(&blocks[b], escaped[b], signatures, b == main_block, session->flags, cse);
+        memo_entry *entry = memo_find(&session->ssa, keys[b]);
+        if (entry == NULL) {
+            missing.blocks_to_do[missing.count++] = b;
+            missing_work += blocks[b].length;
+        } else {
+            reuse_ssa(&blocks[b], entry);
+        }
+    }
+    missing.promoted = malloc((num_blocks + 1) * sizeof(code_block));
+    parallel_for(missing.count, parallel_threads(missing_work), promote_missing, &missing);
+    for (int i = 0; i < missing.count; ++i) {
+        int b = missing.blocks_to_do[i];
+        memo_entry *entry = memo_add(&session->ssa, keys[b], missing.promoted[i].code, missing.promoted[i].length,
+                                     NULL, 0);
+        reuse_ssa(&blocks[b], entry);
+    }
+    memo_sweep(&session->ssa);
+    for (int b = 0; b < num_blocks; ++b) {
+        free(escaped[b]);
+    }
+    free(escaped);
+    free(signatures);
+    free(missing.blocks_to_do);
+    free(missing.promoted);
+    free(keys);
+    return link_blocks(blocks, num_blocks, main_block, code_length);
+}
+
+// Promotes a block the session didn't have. The session keeps its calls as
+// indexes into the block's callees (see block_callees()), the IR can lay its
+// code out differently so they aren't always in the same order.
+void promote_missing(void *context, int item) {
+    missing_ssa *missing = context;
+    int b = missing->blocks_to_do[item];
+    code_block *block = &missing->blocks[b];
+    int length;
+    instruction *code = promote_variables(block->code, block->length, missing->escaped[b], missing->callees,
+                                          b == missing->main_block, missing->flags, missing->cse, &length);
+    if (code == NULL) {
+        length = block->length;
+        code = malloc(length * sizeof(instruction));
+        memcpy(code, block->code, length * sizeof(instruction));
+    }
+    int *callees = malloc((block->length + 1) * sizeof(int));
+    block_callees(block, callees);
+    for (int i = 0; i < length; ++i) {
+        if (code[i].opcode == CAL || code[i].opcode == TCL) {
+            int c = 0;
+            while (callees[c] != code[i].m) {
+                c++;
+            }
+            code[i].m = c;
+        }
+    }
+    free(callees);
+    missing->promoted[item].code = code;
+    missing->promoted[item].length = length;
+}
+
+// Replaces the block's code with the session's promoted copy with the calls put back
+void reuse_ssa(code_block *block, memo_entry *entry) {
+    int *callees = malloc((block->length + 1) * sizeof(int));
+    block_callees(block, callees);
+    instruction *output = malloc(entry->length * sizeof(instruction));
+    for (int i = 0; i < entry->length; ++i) {
+        output[i] = entry->code[i];
+        if (output[i].opcode == CAL || output[i].opcode == TCL) {
+            output[i].m = callees[output[i].m];
+        }
+    }
+    free(callees);
+    free(block->code);
+    block->code = output;
+    block->length = entry->length;
+}
+
+// Lists the blocks the block calls, each once in the order it first calls them
+int block_callees(code_block *block, int *callees) {
+    int count = 0;
+    for (int i = 0; i < block->length; ++i) {
+        instruction ir = block->code[i];
+        if (ir.opcode != CAL && ir.opcode != TCL) {
+            continue;
+        }
+        int c = 0;
+        while (c < count && callees[c] != ir.m) {
+            c++;
+        }
+        if (c == count) {
+            callees[count++] = (int) ir.m;
+        }
+    }
+    return count;
+}
+
+// Hashes the block with its calls as indexes into its callees, what calling
+// each of those takes and leaves, and which of its frame slots escape
+uint64_t ssa_key(code_block *block, char *escaped, call_signature *signatures, int is_main, int flags, int cse) {
+    int *callees = malloc((block->length + 1) * sizeof(int));
+    int num_callees = block_callees(block, callees);
+    uint64_t hash = HASH_SEED;
+    for (int i = 0; i < block->length; ++i) {
+        instruction ir = block->code[i];
+        if (ir.opcode == CAL || ir.opcode == TCL) {
+            int c = 0;
+            while (callees[c] != ir.m) {
+                c++;
+            }
+            ir.m = c;
+        }
+        hash = hash_word(hash, (uint64_t) ir.opcode << 32 | (uint32_t) ir.l);
+        hash = hash_word(hash, ir.m);
+    }
+    for (int c = 0; c < num_callees; ++c) {
+        hash = hash_word(hash, (uint64_t) signatures[callees[c]].params << 32 | signatures[callees[c]].returns);
+    }
+    free(callees);
+    hash = hash_bytes(hash, escaped, block->code[0].m);
+    return hash_word(hash, (uint64_t) flags << 2 | is_main << 1 | cse);
+}
+
+// Runs the loop optimizer on each procedure that isn't in the session already
+instruction *incremental_loops(pl0_incremental *session, instruction *code, int *code_length) {
+    int num_blocks;
+    int main_block;
+    code_block *blocks = split_blocks(code, *code_length, &num_blocks, &main_block);
+    free(code);
+    // Optimizing is the only part worth spreading over threads, the session is
+    // looked up before and added to afterwards on this one
+    missing_loops missing = {.blocks = blocks, .blocks_to_do = malloc((num_blocks + 1) * sizeof(int)),
+                             .flags = session->flags};
+    uint64_t *keys = malloc((num_blocks + 1) * sizeof(uint64_t));
+    long missing_work = 0;
+    for (int b = 0; b < num_blocks; ++b) {
+        if (!blocks[b].is_procedure) {
+            continue;
+        }
+        // Calls are left out of the key and put back afterwards, the optimizer
+        // never moves them so they come out in the same order
+        keys[b] = block_key(blocks[b].code, blocks[b].length);
+        memo_entry *entry = memo_find(&session->loops, keys[b]);
+        if (entry == NULL) {
+            missing.blocks_to_do[missing.count++] = b;
+            missing_work += blocks[b].length;
+        } else {
+            reuse_loops(&blocks[b], entry);
+        }
+    }
+    missing.optimized = malloc((num_blocks + 1) * sizeof(code_block));
+    parallel_for(missing.count, parallel_threads(missing_work), optimize_missing_loops, &missing);
+    for (int i = 0; i < missing.count; ++i) {
+        int b = missing.blocks_to_do[i];
+        memo_entry *entry = memo_add(&session->loops, keys[b], missing.optimized[i].code,
+                                     missing.optimized[i].length, NULL, 0);
+        reuse_loops(&blocks[b], entry);
+    }
+    memo_sweep(&session->loops);
+    free(missing.blocks_to_do);
+    free(missing.optimized);
+    free(keys);
+    return link_blocks(blocks, num_blocks, main_block, code_length);
+}
+
+// Optimizes a copy of one block the session didn't have, the session keeps it
+void optimize_missing_loops(void *context, int item) {
+    missing_loops *missing = context;
+    code_block *block = &missing->blocks[missing->blocks_to_do[item]];
+    instruction *input = malloc(block->length * sizeof(instruction));
+    memcpy(input, block->code, block->length * sizeof(instruction));
+    int length = block->length;
+    missing->optimized[item].code = optimize_block_loops(input, &length, missing->flags);
+    missing->optimized[item].length = length;
+}
+
+// Replaces the block's code with the session's optimized copy with the calls put back
+void reuse_loops(code_block *block, memo_entry *entry) {
+    instruction *output = malloc(entry->length * sizeof(instruction));
+    int call = 0;
+    for (int i = 0; i < entry->length; ++i) {
+        output[i] = entry->code[i];
+        if (output[i].opcode == CAL) {
+            while (block->code[call].opcode != CAL) {
+                call++;
+            }
+            output[i].m = block->code[call++].m;
+        }
+    }
+    free(block->code);
+    block->code = output;
+    block->length = entry->length;
+}
+
+uint64_t block_key(instruction *code, int length) {
+    uint64_t hash = HASH_SEED;
+    for (int i = 0; i < length; ++i) {
+        hash = hash_word(hash, (uint64_t) code[i].opcode << 32 | (uint32_t) code[i].l);
+        hash = hash_word(hash, code[i].opcode == CAL ? 0 : code[i].m);
+    }
+    return hash;
+}
+
+// Returns the entry for key and marks it as used, or NULL
+memo_entry *memo_find(memo_table *table, uint64_t key) {
+    if (table->capacity == 0) {
+        table->misses++;
+        return NULL;
+    }
+    for (int i = key & (table->capacity - 1); table->entries[i].code != NULL; i = (i + 1) & (table->capacity - 1)) {
+        if (table->entries[i].key == key) {
+            table->entries[i].used = 1;
+            table->hits++;
+            return &table->entries[i];
+        }
+    }
+    table->misses++;
+    return NULL;
+}
+
+// Takes ownership of code and callees. The entry counts as used.
+memo_entry *memo_add(memo_table *table, uint64_t key, instruction *code, int length, char *callees,
+                     int num_callees) {
+    // Keep the table at most half full
+    if (2 * (table->count + 1) > table->capacity) {
+        memo_entry *old = table->entries;
+        int old_capacity = table->capacity;
+        table->capacity = old_capacity == 0 ? MEMO_MIN_CAPACITY : 2 * old_capacity;
+        table->entries = calloc(table->capacity, sizeof(memo_entry));
+        table->count = 0;
+        for (int i = 0; i < old_capacity; ++i) {
+            if (old[i].code != NULL) {
+                memo_insert(table, old[i]);
+            }
+        }
+        free(old);
+    }
+    memo_entry entry = {key, code, length, callees, num_callees, 1};
+    return memo_insert(table, entry);
+}
+
+memo_entry *memo_insert(memo_table *table, memo_entry entry) {
+    int i = entry.key & (table->capacity - 1);
+    while (table->entries[i].code != NULL) {
+        // The same code can be generated twice in one compile, keep the first
+        if (table->entries[i].key == entry.key) {
+            free(entry.code);
+            free(entry.callees);
+            return &table->entries[i];
+        }
+        i = (i + 1) & (table->capacity - 1);
+    }
+    table->entries[i] = entry;
+    table->count++;
+    return &table->entries[i];
+}
+
+// Drops the entries the last compile didn't use
+void memo_sweep(memo_table *table) {
+    memo_entry *old = table->entries;
+    int old_capacity = table->capacity;
+    int kept = 0;
+    for (int i = 0; i < old_capacity; ++i) {
+        kept += old[i].used;
+    }
+    table->capacity = MEMO_MIN_CAPACITY;
+    while (2 * kept > table->capacity) {
+        table->capacity *= 2;
+    }
+    table->entries = calloc(table->capacity, sizeof(memo_entry));
+    table->count = 0;
+    for (int i = 0; i < old_capacity; ++i) {
+        if (old[i].used) {
+            old[i].used = 0;
+            memo_insert(table, old[i]);
+        } else {
+            free(old[i].code);
+            free(old[i].callees);
+        }
+    }
+    free(old);
+}
+
+void memo_free(memo_table *table) {
+    for (int i = 0; i < table->capacity; ++i) {
+        free(table->entries[i].code);
+        free(table->entries[i].callees);
+    }
+    free(table->entries);
+    table->entries = NULL;
+    table->capacity = 0;
+    table->count = 0;
+}
@@ -0,0 +1,149 @@
+/*
+    Procedure Inliner for PL/0
+    Author: Ryan Doherty
+
+    Replaces calls to small leaf procedures (procedures that don't call
+    anything, so they can't be recursive) with a copy of their body.
+    This saves the CAL, the INC and the return along with the three
+    link words pushed on every call.
+
+    The callee's code is rewritten to run in the caller's frame:
+    - LOD/STO (and LODX/STOX) of the callee's locals (level 0) use extra slots added
+      to the end of the caller's frame
+    - LOD/STO at level l > 0 are relative to the callee's static link,
+      which is CAL's level L away from the caller, so they become L + l - 1
+    - Jumps inside the body are moved along with it
+    - The arguments the caller pushed are stored into the slots of the
+      callee's parameters first, and a function's body already ends by
+      loading its value, which is left on the stack like a call leaves it
+
+    Inlining a callee can turn its caller into a leaf so the pass is
+    repeated until nothing changes. With a profile, profile.c inlines the
+    hot calls to bigger leaves after tail calls are made, and a procedure
+    ending in a TCL isn't a leaf either.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include "compiler.h"
+
+#define MAX_INLINE_ROUNDS 8
+
+instruction *inline_procedures(instruction *code, int *code_length, int threshold) {
+    if (threshold <= 0) {
+        return code;
+    }
+    int changed = 1;
+    for (int round = 0; round < MAX_INLINE_ROUNDS && changed; ++round) {
+        changed = 0;
+        code = inline_calls(code, code_length, threshold, NULL, &changed);
+    }
+    return code;
+}
+
+// One round of inlining, only at the calls marked in sites unless it's NULL.
+// Sets changed if it inlined any.
+instruction *inline_calls(instruction *code, int *code_length, int threshold, char *sites, int *changed) {
+    int length = *code_length;
+    procedure *procs = malloc(length * sizeof(procedure));
+    int num_procs = find_procedures(code, length, procs);
+
+    // Decide which procedures are small enough leaves to inline
+    int *inlinable = calloc(num_procs, sizeof(int));
+    int main_start = code[0].m;
+    for (int p = 0; p < num_procs; ++p) {
+        int body_length = procs[p].end - procs[p].start - 1 + code[procs[p].start].l;
+        if (procs[p].start == main_start || body_length > threshold) {
+            continue;
+        }
+        inlinable[p] = 1;
+        for (int i = procs[p].start + 1; i < procs[p].end; ++i) {
+            if (code[i].opcode == CAL || code[i].opcode == TCL) {
+                inlinable[p] = 0;
+                break;
+            }
+        }
+    }
+
+    // Map each old instruction to its new index and work out how many
+    // extra frame slots each caller needs. Callee bodies never run at
+    // the same time so one set of slots per caller is shared by all of them.
+    int *map = malloc((length + 1) * sizeof(int));
+    int *callee = malloc(length * sizeof(int));
+    int *extra_slots = calloc(num_procs, sizeof(int));
+    int new_length = 0;
+    for (int i = 0; i < length; ++i) {
+        map[i] = new_length;
+        callee[i] = -1;
+        if (code[i].opcode == CAL) {
+            int p = procedure_containing(procs, num_procs, code[i].m);
+            int caller = procedure_containing(procs, num_procs, i);
+            if (p != -1 && caller != -1 && inlinable[p] && procs[p].start == code[i].m &&
+                (sites == NULL || sites[i])) {
+                callee[i] = p;
+                int locals = code[procs[p].start].m - 3;
+                if (locals > extra_slots[caller]) {
+                    extra_slots[caller] = locals;
+                }
+                new_length += procs[p].end - procs[p].start - 1 + code[procs[p].start].l;
+                continue;
+            }
+        }
+        new_length++;
+    }
+    map[length] = new_length;
+
+    instruction *new_code = malloc((new_length + 1) * sizeof(instruction));
+    int index = 0;
+    for (int i = 0; i < length; ++i) {
+        if (callee[i] == -1) {
+            new_code[index] = code[i];
+            if (code[i].opcode == JMP || code[i].opcode == JPC || code[i].opcode == CAL ||
+                code[i].opcode == TCL) {
+                new_code[index].m = map[code[i].m];
+            }
+            // Grow the caller's frame for the inlined locals
+            if (code[i].opcode == INC) {
+                int p = procedure_containing(procs, num_procs, i);
+                if (p != -1 && procs[p].start == i) {
+                    new_code[index].m += extra_slots[p];
+                }
+            }
+            index++;
+            continue;
+        }
+
+        procedure target = procs[callee[i]];
+        int caller = procedure_containing(procs, num_procs, i);
+        int first_local = code[procs[caller].start].m;
+        int params = code[target.start].l;
+        // The last argument is on top
+        for (int a = params - 1; a >= 0; --a) {
+            new_code[index++] = (instruction) {STO, 0, first_local + a};
+        }
+        int body_start = index;
+        for (int j = target.start + 1; j < target.end; ++j) {
+            instruction copy = code[j];
+            if (copy.opcode == LOD || copy.opcode == STO || copy.opcode == LODX || copy.opcode == STOX) {
+                if (copy.l == 0) {
+                    copy.m = first_local + copy.m - 3;
+                } else {
+                    copy.l = code[i].l + copy.l - 1;
+                }
+            } else if (copy.opcode == JMP || copy.opcode == JPC) {
+                // A jump to the callee's return lands just past the inlined body
+                copy.m = body_start + copy.m - target.start - 1;
+            }
+            new_code[index++] = copy;
+        }
+        *changed = 1;
+    }
+
+    *code_length = new_length;
+    free(procs);
+    free(inlinable);
+    free(map);
+    free(callee);
+    free(extra_slots);
+    free(code);
+    return new_code;
+}
@@ -0,0 +1,1467 @@
+/*
+    Intermediate Representation for PL/0
+    Author: Ryan Doherty
+
+    The code generator emits stack code straight from the parse, which is
+    a poor place to reason about values. build_ir() turns one procedure's
+    code (a block from split_blocks()) into a control-flow graph of basic
+    blocks whose instructions are in static single assignment form, and
+    lower_ir() turns that back into code.
+
+    - Building: each basic block is run abstractly, so the operand stack
+      holds value numbers instead of numbers. A call takes its arguments
+      off it and a call to a function puts its value back. Frame variables no nested
+      procedure can see are promoted: a store makes the stored value the
+      variable's current one and a load uses it, with phis where control
+      flow joins. This is Braun et al.'s construction, which goes block
+      by block and needs no dominance frontiers. Everything else stays a
+      load or store of memory, arrays included. An indexed load or store
+      keeps the bound its index was checked against and gets its CHK
+      back when lowered, unless the index has become a constant inside
+      the array.
+    - Simplifying: constant expressions are folded and phis that only ever
+      see one value are replaced by it, until neither finds any more.
+    - Lowering: instructions go back out in their original order, so side
+      effects keep theirs. A value used once, by the next instruction that
+      takes from the stack, stays on the stack. Other values get a frame
+      slot, the one of the variable they were stored to if it's free, so
+      unchanged code comes back much as it went in. Constants are pushed
+      where they're used. Phis become copies at the end of predecessors,
+      made through the stack (every load, then every store) so copies
+      that swap slots can't clobber each other.
+
+    Slots are handed out walking the blocks in reverse postorder, which
+    reaches every value's definition before its uses, so a value never
+    gets the slot of one that's still live.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "compiler.h"
+
+// The tables below hold blocks times variables (or values), procedures that
+// would need more entries than this are left as they are
+#define MAX_IR_TABLE (1L << 22)
+
+// Simplifying stops after this many rounds even if it's still finding work
+#define MAX_SIMPLIFY_ROUNDS 8
+
+// What build_ir() keeps while it runs
+typedef struct ir_builder {
+    ir_procedure *proc;
+    int *var_index; // per frame slot, its column in defs or -1 if it isn't promoted
+    int num_vars;
+    int *defs;      // each block's current value of each variable, -1 if not known yet
+    char *sealed;   // all of the block's predecessors have been built
+    char *filled;
+    int *entries;   // the values variables have on entry, they go first in the entry block
+    int num_entries;
+} ir_builder;
+
+// What lower_ir() keeps while it runs
+typedef struct ir_lowering {
+    ir_procedure *proc;
+    int *uses;
+    int *user;          // for values used once, the user (a value, num_values + block for a branch, -1 for a phi)
+    char *resident;     // kept on the stack between its definition and its use
+    char *early;        // its first operand is loaded before the code computing its second
+    int *start;         // for values on the stack, where the code computing them starts
+    int *position;      // index in its block's values
+    int *sid;           // numbering of values that need a slot, -1 for the rest
+    int *value_of;
+    int num_slot_values;
+    long words;         // in each liveness set
+    uint64_t *live_in;
+    uint64_t *live_out;
+    int *slot;
+    int frame;
+    instruction *code;
+    int length;
+    int capacity;
+    int *labels;        // where each block and then each edge block starts
+    int *patches;       // jumps still to be pointed at their label, pairs of instruction and label
+    int num_patches;
+} ir_lowering;
+
+int find_blocks(ir_procedure *proc, instruction *code, int code_length);
+void order_blocks(ir_procedure *proc);
+int build_values(ir_builder *builder, instruction *code, int code_length, call_signature *callees);
+int new_value(ir_procedure *proc, ir_op op, int l, int64_t m, int block);
+int constant(ir_procedure *proc, int64_t m);
+int operation(ir_builder *builder, int block, int op, int a, int b);
+int fold_operation(int op, int64_t a, int64_t b, int flags, int64_t *result);
+int read_variable(ir_builder *builder, int var, int block);
+int new_phi(ir_builder *builder, int var, int block);
+void add_phi_operands(ir_builder *builder, int phi);
+void seal_block(ir_builder *builder, int block);
+int remove_trivial_phis(ir_procedure *proc);
+int fold_values(ir_procedure *proc);
+int produces_value(ir_op op);
+int can_fail(ir_procedure *proc, int value);
+int index_in_bounds(ir_procedure *proc, ir_value *access);
+int predecessor_index(ir_block *block, int pred);
+void settle_stack(ir_lowering *lower, ir_block *block);
+int take_operands(ir_lowering *lower, int *stack, int *depth, int *operands, int count);
+int can_load_early(ir_lowering *lower, int value, int position, int block);
+void compute_liveness(ir_lowering *lower);
+void assign_slots(ir_lowering *lower);
+int choose_slot(ir_lowering *lower, int value, int *busy, int stamp, int *spare, int num_spare);
+int needs_copies(ir_lowering *lower, int from, int to);
+void emit(ir_lowering *lower, int opcode, int l, int64_t m);
+void emit_jump(ir_lowering *lower, int opcode, int label);
+void emit_operand(ir_lowering *lower, int value);
+void emit_value(ir_lowering *lower, int value);
+void emit_block_values(ir_lowering *lower, ir_block *block);
+void emit_copies(ir_lowering *lower, int from, int to);
+void emit_blocks(ir_lowering *lower);
+void free_lowering(ir_lowering *lower);
+
+// Builds the SSA form of a procedure's block from split_blocks(). escaped has a
+// flag for each of its frame slots, those set stay in memory, and callees the
+// signature of each block it could call. Returns NULL for code it doesn't
+// understand, which is left as it is.
+ir_procedure *build_ir(instruction *code, int code_length, char *escaped, call_signature *callees, int is_main,
+                       int flags) {
+    if (code_length < 2 || code[0].opcode != INC || code[0].m < 3 + code[0].l) {
+        return NULL;
+    }
+    ir_procedure *proc = calloc(1, sizeof(ir_procedure));
+    proc->frame = (int) code[0].m;
+    proc->params = code[0].l;
+    proc->escaped = malloc(proc->frame);
+    memcpy(proc->escaped, escaped, proc->frame);
+    proc->last = code[code_length - 1];
+    proc->is_main = is_main;
+    proc->flags = flags;
+    if (!find_blocks(proc, code, code_length)) {
+        free_ir(proc);
+        return NULL;
+    }
+    order_blocks(proc);
+
+    ir_builder builder = {.proc = proc};
+    builder.var_index = malloc(proc->frame * sizeof(int));
+    for (int a = 0; a < proc->frame; ++a) {
+        builder.var_index[a] = a >= 3 && !escaped[a] ? builder.num_vars++ : -1;
+    }
+    int built = 0;
+    if ((long) proc->num_blocks * builder.num_vars <= MAX_IR_TABLE) {
+        builder.defs = malloc(((long) proc->num_blocks * builder.num_vars + 1) * sizeof(int));
+        memset(builder.defs, -1, ((long) proc->num_blocks * builder.num_vars + 1) * sizeof(int));
+        builder.sealed = calloc(proc->num_blocks, 1);
+        builder.filled = calloc(proc->num_blocks, 1);
+        built = build_values(&builder, code, code_length, callees);
+    }
+    if (built) {
+        // Values on entry go before anything the entry block does
+        ir_block *entry = &proc->blocks[0];
+        for (int i = 0; i < entry->num_values; ++i) {
+            append_int(&builder.entries, &builder.num_entries, entry->values[i]);
+        }
+        free(entry->values);
+        entry->values = builder.entries;
+        entry->num_values = builder.num_entries;
+    } else {
+        free(builder.entries);
+    }
+    free(builder.var_index);
+    free(builder.defs);
+    free(builder.sealed);
+    free(builder.filled);
+    if (!built) {
+        free_ir(proc);
+        return NULL;
+    }
+    resolve_operands(proc);
+    return proc;
+}
+
+// Splits the code into basic blocks and links them up. Returns 0 if the
+// code isn't the shape the code generator makes.
+int find_blocks(ir_procedure *proc, instruction *code, int code_length) {
+    char *leader = calloc(code_length + 1, 1);
+    int ok = 1;
+    leader[0] = 1;
+    for (int i = 1; i < code_length && ok; ++i) {
+        instruction ir = code[i];
+        switch (ir.opcode) {
+            case JMP:
+            case JPC:
+                if (ir.m < 1 || ir.m >= code_length) {
+                    ok = 0;
+                    break;
+                }
+                leader[ir.m] = 1;
+                leader[i + 1] = 1;
+                break;
+            case OPR:
+                ok = ir.m >= 0 && ir.m <= 14;
+                leader[i + 1] |= ir.m == 0 || ir.m == 14;
+                break;
+            case SYS:
+                ok = ir.m >= 1 && ir.m <= 3;
+                leader[i + 1] |= ir.m == 3;
+                break;
+            case LOD:
+            case STO:
+                ok = ir.l > 0 || (ir.l == 0 && ir.m >= 3 && ir.m < proc->frame);
+                break;
+            case LODX:
+            case STOX: {
+                int extent = indexed_extent(code, i);
+                ok = extent > 0 && (ir.l > 0 || (ir.m >= 3 && ir.m <= proc->frame - extent));
+                break;
+            }
+            case CHK:
+                ok = ir.m >= 1 && i + 1 < code_length && (code[i + 1].opcode == LODX || code[i + 1].opcode == STOX);
+                break;
+            case LIT:
+            case CAL:
+            case TCL:
+                break;
+            default:
+                ok = 0;
+        }
+    }
+
+    int *block_at = malloc(code_length * sizeof(int));
+    for (int i = 0; i < code_length && ok; ++i) {
+        if (leader[i]) {
+            // Nothing jumps between an index and its array access
+            ok = code[i].opcode != LODX && code[i].opcode != STOX;
+            proc->num_blocks++;
+        }
+        block_at[i] = proc->num_blocks - 1;
+    }
+    proc->blocks = calloc(proc->num_blocks + 1, sizeof(ir_block));
+    for (int i = 0; i < code_length && ok; ++i) {
+        if (!leader[i]) {
+            continue;
+        }
+        int b = block_at[i];
+        ir_block *block = &proc->blocks[b];
+        block->start = i;
+        block->cond = -1;
+        int end = i;
+        while (end + 1 < code_length && !leader[end + 1]) {
+            end++;
+        }
+        instruction last = code[end];
+        int is_last = end == code_length - 1;
+        if (last.opcode == JMP) {
+            block->exit = IR_JUMP;
+            block->succs[block->num_succs++] = block_at[last.m];
+        } else if (last.opcode == JPC && !is_last) {
+            block->exit = IR_BRANCH;
+            block->succs[block->num_succs++] = block_at[last.m];
+            if (b + 1 != block->succs[0]) {
+                block->succs[block->num_succs++] = b + 1;
+            }
+        } else if (last.opcode == OPR && (last.m == 0 || last.m == 14)) {
+            block->exit = IR_RETURN;
+            ok = is_last;
+        } else if (last.opcode == SYS && last.m == 3) {
+            block->exit = IR_HALT;
+            ok = is_last;
+        } else if (!is_last) {
+            block->exit = IR_JUMP;
+            block->succs[block->num_succs++] = b + 1;
+        } else {
+            ok = 0;
+        }
+    }
+    free(leader);
+    free(block_at);
+    return ok;
+}
+
+// Finds the blocks reachable from the entry, their predecessors and reverse postorder
+void order_blocks(ir_procedure *proc) {
+    int num_blocks = proc->num_blocks;
+    int *postorder = malloc(num_blocks * sizeof(int));
+    int *stack = malloc(num_blocks * sizeof(int));
+    int *next_succ = calloc(num_blocks, sizeof(int));
+    int count = 0;
+    int depth = 0;
+    stack[depth++] = 0;
+    proc->blocks[0].reachable = 1;
+    while (depth > 0) {
+        ir_block *block = &proc->blocks[stack[depth - 1]];
+        if (next_succ[stack[depth - 1]] < block->num_succs) {
+            int succ = block->succs[next_succ[stack[depth - 1]]++];
+            if (!proc->blocks[succ].reachable) {
+                proc->blocks[succ].reachable = 1;
+                stack[depth++] = succ;
+            }
+        } else {
+            postorder[count++] = stack[--depth];
+        }
+    }
+    proc->order = malloc(count * sizeof(int));
+    proc->num_order = count;
+    for (int k = 0; k < count; ++k) {
+        proc->order[k] = postorder[count - 1 - k];
+    }
+    for (int b = 0; b < num_blocks; ++b) {
+        ir_block *block = &proc->blocks[b];
+        for (int s = 0; block->reachable && s < block->num_succs; ++s) {
+            ir_block *succ = &proc->blocks[block->succs[s]];
+            append_int(&succ->preds, &succ->num_preds, b);
+        }
+    }
+    free(postorder);
+    free(stack);
+    free(next_succ);
+}
+
+// Runs each block's code abstractly in reverse postorder, so a block's
+// predecessors come first except along loops. Returns 0 if the stack
+// doesn't balance.
+int build_values(ir_builder *builder, instruction *code, int code_length, call_signature *callees) {
+    ir_procedure *proc = builder->proc;
+    int *stack = malloc(code_length * sizeof(int));
+    int ok = 1;
+    seal_block(builder, 0);
+    for (int k = 0; k < proc->num_order && ok; ++k) {
+        int b = proc->order[k];
+        int end = b + 1 < proc->num_blocks ? proc->blocks[b + 1].start : code_length;
+        int depth = 0;
+        for (int i = proc->blocks[b].start; i < end && ok; ++i) {
+            instruction ir = code[i];
+            int value;
+            if (i == 0) {
+                continue;
+            }
+            switch (ir.opcode) {
+                case LIT:
+                    stack[depth++] = constant(proc, ir.m);
+                    break;
+                case OPR:
+                    if (ir.m == 0) {
+                        break;
+                    }
+                    // A function's value is used by its return
+                    if (ir.m == 14) {
+                        ok = depth >= 1;
+                        if (ok) {
+                            proc->blocks[b].cond = stack[--depth];
+                        }
+                        break;
+                    }
+                    if (ir.m == 1 || ir.m == 6) {
+                        ok = depth >= 1;
+                        if (ok) {
+                            stack[depth - 1] = operation(builder, b, (int) ir.m, stack[depth - 1], -1);
+                        }
+                    } else {
+                        ok = depth >= 2;
+                        if (ok) {
+                            depth--;
+                            stack[depth - 1] = operation(builder, b, (int) ir.m, stack[depth - 1], stack[depth]);
+                        }
+                    }
+                    break;
+                case LOD:
+                    if (ir.l == 0 && !proc->escaped[ir.m]) {
+                        stack[depth++] = read_variable(builder, (int) ir.m, b);
+                    } else {
+                        value = new_value(proc, IR_LOAD, ir.l, ir.m, b);
+                        append_int(&proc->blocks[b].values, &proc->blocks[b].num_values, value);
+                        stack[depth++] = value;
+                    }
+                    break;
+                case STO:
+                    ok = depth >= 1;
+                    if (!ok) {
+                        break;
+                    }
+                    value = stack[--depth];
+                    if (ir.l == 0 && !proc->escaped[ir.m]) {
+                        builder->defs[(long) b * builder->num_vars + builder->var_index[ir.m]] = value;
+                        if (proc->values[value].home == 0 && proc->values[value].op != IR_CONST) {
+                            proc->values[value].home = (int) ir.m;
+                        }
+                    } else {
+                        int store = new_value(proc, IR_STORE, ir.l, ir.m, b);
+                        proc->values[store].args[0] = value;
+                        append_int(&proc->blocks[b].values, &proc->blocks[b].num_values, store);
+                    }
+                    break;
+                case LODX:
+                    ok = depth >= 1;
+                    if (ok) {
+                        value = new_value(proc, IR_LOADX, ir.l, ir.m, b);
+                        proc->values[value].args[0] = stack[depth - 1];
+                        proc->values[value].length = indexed_extent(code, i);
+                        append_int(&proc->blocks[b].values, &proc->blocks[b].num_values, value);
+                        stack[depth - 1] = value;
+                    }
+                    break;
+                case STOX:
+                    ok = depth >= 2;
+                    if (ok) {
+                        depth -= 2;
+                        value = new_value(proc, IR_STOREX, ir.l, ir.m, b);
+                        proc->values[value].args[0] = stack[depth];
+                        proc->values[value].args[1] = stack[depth + 1];
+                        proc->values[value].length = indexed_extent(code, i);
+                        append_int(&proc->blocks[b].values, &proc->blocks[b].num_values, value);
+                    }
+                    break;
+                case CAL:
+                case TCL: {
+                    call_signature callee = callees[ir.m];
+                    ok = depth >= callee.params;
+                    if (!ok) {
+                        break;
+                    }
+                    int returns = ir.opcode == CAL && callee.returns;
+                    value = new_value(proc, ir.opcode == TCL ? IR_TAIL_CALL : returns ? IR_CALL_VALUE : IR_CALL,
+                                      ir.l, ir.m, b);
+                    // The arguments are kept like a phi's operands, the last one pushed last
+                    depth -= callee.params;
+                    proc->values[value].length = callee.params;
+                    if (callee.params > 0) {
+                        proc->values[value].phi_args = malloc(callee.params * sizeof(int));
+                        memcpy(proc->values[value].phi_args, stack + depth, callee.params * sizeof(int));
+                    }
+                    append_int(&proc->blocks[b].values, &proc->blocks[b].num_values, value);
+                    if (returns) {
+                        stack[depth++] = value;
+                    }
+                    break;
+                }
+                case JPC:
+                    ok = depth >= 1;
+                    if (ok) {
+                        proc->blocks[b].cond = stack[--depth];
+                    }
+                    break;
+                case SYS:
+                    if (ir.m == 1) {
+                        ok = depth >= 1;
+                        if (ok) {
+                            value = new_value(proc, IR_WRITE, 0, 0, b);
+                            proc->values[value].args[0] = stack[--depth];
+                            append_int(&proc->blocks[b].values, &proc->blocks[b].num_values, value);
+                        }
+                    } else if (ir.m == 2) {
+                        value = new_value(proc, IR_READ, 0, 0, b);
+                        append_int(&proc->blocks[b].values, &proc->blocks[b].num_values, value);
+                        stack[depth++] = value;
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        // Values never stay on the stack from one block to the next
+        ok = ok && depth == 0;
+        builder->filled[b] = 1;
+        ir_block *block = &proc->blocks[b];
+        for (int s = 0; s < block->num_succs; ++s) {
+            ir_block *succ = &proc->blocks[block->succs[s]];
+            int ready = !builder->sealed[block->succs[s]];
+            for (int p = 0; p < succ->num_preds && ready; ++p) {
+                ready = builder->filled[succ->preds[p]];
+            }
+            if (ready) {
+                seal_block(builder, block->succs[s]);
+            }
+        }
+    }
+    free(stack);
+    return ok;
+}
+
+int new_value(ir_procedure *proc, ir_op op, int l, int64_t m, int block) {
+    if (proc->num_values == proc->capacity) {
+        proc->capacity = proc->capacity * 2 + 64;
+        proc->values = realloc(proc->values, proc->capacity * sizeof(ir_value));
+    }
+    proc->values[proc->num_values] = (ir_value) {op, l, m, {-1, -1}, 0, NULL, block, 0, -1, 0};
+    return proc->num_values++;
+}
+
+int constant(ir_procedure *proc, int64_t m) {
+    return new_value(proc, IR_CONST, 0, m, -1);
+}
+
+// An OPR on a and b (-1 for the unary ones), folded if it can be
+int operation(ir_builder *builder, int block, int op, int a, int b) {
+    ir_procedure *proc = builder->proc;
+    int64_t result;
+    if (proc->values[a].op == IR_CONST && (b == -1 || proc->values[b].op == IR_CONST) &&
+        fold_operation(op, proc->values[a].m, b == -1 ? 0 : proc->values[b].m, proc->flags, &result)) {
+        return constant(proc, result);
+    }
+    int value = new_value(proc, IR_OPR, op, 0, block);
+    proc->values[value].args[0] = a;
+    proc->values[value].args[1] = b;
+    append_int(&proc->blocks[block].values, &proc->blocks[block].num_values, value);
+    return value;
+}
+
+// Evaluates any OPR but the return the way the machine would, see fold()
+int fold_operation(int op, int64_t a, int64_t b, int flags, int64_t *result) {
+    switch (op) {
+        case 1:
+            return fold(3, 0, a, flags, result);
+        case 6:
+            *result = !(a % 2);
+            return 1;
+        case 8:
+            *result = !(a == b);
+            return 1;
+        case 9:
+            *result = !(a != b);
+            return 1;
+        case 10:
+            *result = !(a < b);
+            return 1;
+        case 11:
+            *result = !(a <= b);
+            return 1;
+        case 12:
+            *result = !(a > b);
+            return 1;
+        case 13:
+            *result = !(a >= b);
+            return 1;
+        default:
+            return fold(op, a, b, flags, result);
+    }
+}
+
+// The value a promoted variable has at the end of block, as far as it's been built
+int read_variable(ir_builder *builder, int var, int block) {
+    ir_procedure *proc = builder->proc;
+    long def = (long) block * builder->num_vars + builder->var_index[var];
+    if (builder->defs[def] != -1) {
+        return ir_find(proc, builder->defs[def]);
+    }
+    int value;
+    ir_block *b = &proc->blocks[block];
+    if (!builder->sealed[block]) {
+        // Not every predecessor is known yet, the phi gets its operands when they are
+        value = new_phi(builder, var, block);
+    } else if (block == 0) {
+        // Main's variables start out as 0, everyone else's as whatever was on the stack
+        if (proc->is_main) {
+            value = constant(proc, 0);
+        } else {
+            value = new_value(proc, IR_LOAD, 0, var, 0);
+            proc->values[value].home = var;
+            append_int(&builder->entries, &builder->num_entries, value);
+        }
+    } else if (b->num_preds == 1) {
+        value = read_variable(builder, var, b->preds[0]);
+    } else {
+        // The phi is the variable's value before its operands are read, which ends loops
+        value = new_phi(builder, var, block);
+        builder->defs[def] = value;
+        add_phi_operands(builder, value);
+    }
+    builder->defs[def] = value;
+    return value;
+}
+
+int new_phi(ir_builder *builder, int var, int block) {
+    ir_procedure *proc = builder->proc;
+    int phi = new_value(proc, IR_PHI, 0, var, block);
+    proc->values[phi].home = var;
+    append_int(&proc->blocks[block].phis, &proc->blocks[block].num_phis, phi);
+    return phi;
+}
+
+void add_phi_operands(ir_builder *builder, int phi) {
+    ir_procedure *proc = builder->proc;
+    ir_block *block = &proc->blocks[proc->values[phi].block];
+    int num_preds = block->num_preds;
+    int *args = malloc(num_preds * sizeof(int));
+    for (int p = 0; p < num_preds; ++p) {
+        // Reading can add values, so the phi is found again afterwards
+        args[p] = read_variable(builder, (int) proc->values[phi].m, proc->blocks[proc->values[phi].block].preds[p]);
+    }
+    proc->values[phi].phi_args = args;
+}
+
+// Called once every predecessor of block has been built
+void seal_block(ir_builder *builder, int block) {
+    builder->sealed[block] = 1;
+    // Phis made while it wasn't sealed are still waiting for their operands,
+    // any added while they're found already have theirs
+    for (int i = 0; i < builder->proc->blocks[block].num_phis; ++i) {
+        int phi = builder->proc->blocks[block].phis[i];
+        if (builder->proc->values[phi].phi_args == NULL) {
+            add_phi_operands(builder, phi);
+        }
+    }
+}
+
+// Adds item to a list that grows in powers of two
+void append_int(int **list, int *count, int item) {
+    if ((*count & (*count - 1)) == 0) {
+        *list = realloc(*list, (*count == 0 ? 1 : 2 * *count) * sizeof(int));
+    }
+    (*list)[(*count)++] = item;
+}
+
+// Folds constants and removes phis that don't choose between anything.
+// Each can make more of the other possible so they take turns.
+void simplify_ir(ir_procedure *proc) {
+    int changed = 1;
+    for (int round = 0; round < MAX_SIMPLIFY_ROUNDS && changed; ++round) {
+        changed = remove_trivial_phis(proc);
+        resolve_operands(proc);
+        changed |= fold_values(proc);
+    }
+}
+
+// Whether a and b are sure to be the same number
+int same_value(ir_procedure *proc, int a, int b) {
+    return a == b || (proc->values[a].op == IR_CONST && proc->values[b].op == IR_CONST &&
+                      proc->values[a].m == proc->values[b].m);
+}
+
+// A phi whose operands are all one value (or itself, around a loop) is that value
+int remove_trivial_phis(ir_procedure *proc) {
+    int removed = 0;
+    for (int k = 0; k < proc->num_order; ++k) {
+        ir_block *block = &proc->blocks[proc->order[k]];
+        for (int i = 0; i < block->num_phis; ++i) {
+            int phi = block->phis[i];
+            if (proc->values[phi].forward != -1) {
+                continue;
+            }
+            int same = -1;
+            int trivial = 1;
+            for (int p = 0; p < block->num_preds && trivial; ++p) {
+                int arg = ir_find(proc, proc->values[phi].phi_args[p]);
+                if (arg == phi || (same != -1 && same_value(proc, arg, same))) {
+                    continue;
+                }
+                trivial = same == -1;
+                same = arg;
+            }
+            if (trivial && same != -1) {
+                proc->values[phi].forward = same;
+                removed = 1;
+            }
+        }
+    }
+    return removed;
+}
+
+// Turns operations on constants into constants
+int fold_values(ir_procedure *proc) {
+    int folded = 0;
+    for (int k = 0; k < proc->num_order; ++k) {
+        ir_block *block = &proc->blocks[proc->order[k]];
+        for (int i = 0; i < block->num_values; ++i) {
+            ir_value *value = &proc->values[block->values[i]];
+            int64_t result;
+            if (value->op != IR_OPR || proc->values[value->args[0]].op != IR_CONST ||
+                (value->args[1] != -1 && proc->values[value->args[1]].op != IR_CONST)) {
+                continue;
+            }
+            int64_t b = value->args[1] == -1 ? 0 : proc->values[value->args[1]].m;
+            if (fold_operation(value->l, proc->values[value->args[0]].m, b, proc->flags, &result)) {
+                value->op = IR_CONST;
+                value->m = result;
+                value->args[0] = -1;
+                value->args[1] = -1;
+                folded = 1;
+            }
+        }
+    }
+    return folded;
+}
+
+// Points every operand at the value that replaced it
+void resolve_operands(ir_procedure *proc) {
+    for (int k = 0; k < proc->num_order; ++k) {
+        ir_block *block = &proc->blocks[proc->order[k]];
+        for (int i = 0; i < block->num_phis; ++i) {
+            ir_value *phi = &proc->values[block->phis[i]];
+            for (int p = 0; p < block->num_preds && phi->phi_args != NULL; ++p) {
+                phi->phi_args[p] = ir_find(proc, phi->phi_args[p]);
+            }
+        }
+        for (int i = 0; i < block->num_values; ++i) {
+            int *operands;
+            int count = value_operands(&proc->values[block->values[i]], &operands);
+            for (int a = 0; a < count; ++a) {
+                operands[a] = ir_find(proc, operands[a]);
+            }
+        }
+        if (block->cond != -1) {
+            block->cond = ir_find(proc, block->cond);
+        }
+    }
+}
+
+// The value standing in for value now
+int ir_find(ir_procedure *proc, int value) {
+    int root = value;
+    while (proc->values[root].forward != -1) {
+        root = proc->values[root].forward;
+    }
+    while (value != root) {
+        int next = proc->values[value].forward;
+        proc->values[value].forward = root;
+        value = next;
+    }
+    return root;
+}
+
+// Drops values nothing uses, as long as computing them has no effect
+void remove_dead_values(ir_procedure *proc) {
+    resolve_operands(proc);
+    int *uses = calloc(proc->num_values, sizeof(int));
+    count_uses(proc, uses, NULL);
+    int *work = malloc(proc->num_values * sizeof(int));
+    int count = 0;
+    for (int v = 0; v < proc->num_values; ++v) {
+        if (is_live(proc, v) && uses[v] == 0 && produces_value(proc->values[v].op) && !can_fail(proc, v)) {
+            work[count++] = v;
+        }
+    }
+    while (count > 0) {
+        ir_value *value = &proc->values[work[--count]];
+        value->dead = 1;
+        int *args;
+        int num_operands = value_operands(value, &args);
+        if (value->op == IR_PHI) {
+            args = value->phi_args;
+            num_operands = proc->blocks[value->block].num_preds;
+        }
+        for (int a = 0; a < num_operands; ++a) {
+            if (--uses[args[a]] == 0 && is_live(proc, args[a]) && !can_fail(proc, args[a])) {
+                work[count++] = args[a];
+            }
+        }
+    }
+    free(uses);
+    free(work);
+}
+
+int is_live(ir_procedure *proc, int value) {
+    return !proc->values[value].dead && proc->values[value].forward == -1;
+}
+
+int produces_value(ir_op op) {
+    return op == IR_CONST || op == IR_OPR || op == IR_LOAD || op == IR_LOADX || op == IR_READ || op == IR_PHI ||
+           op == IR_CALL_VALUE;
+}
+
+// Whether computing the value could stop the machine or consume input, so it
+// has to happen even if nothing uses it
+int can_fail(ir_procedure *proc, int value) {
+    ir_value *v = &proc->values[value];
+    if (v->op == IR_READ || v->op == IR_CALL_VALUE) {
+        return 1;
+    }
+    if (v->op == IR_LOADX) {
+        return !index_in_bounds(proc, v);
+    }
+    if (v->op != IR_OPR) {
+        return 0;
+    }
+    if (v->l == 5 || v->l == 7) {
+        ir_value *divisor = &proc->values[v->args[1]];
+        return divisor->op != IR_CONST || divisor->m == 0 || divisor->m == -1;
+    }
+    return v->l <= 4 && (proc->flags & MODE_TRAP);
+}
+
+// Whether an indexed load or store's index is a constant inside the array
+int index_in_bounds(ir_procedure *proc, ir_value *access) {
+    ir_value *index = &proc->values[access->op == IR_LOADX ? access->args[0] : access->args[1]];
+    return index->op == IR_CONST && index->m >= 0 && index->m < access->length;
+}
+
+// The values an instruction takes off the stack, in the order they were pushed.
+// Points operands at them, they can be replaced through it.
+int value_operands(ir_value *value, int **operands) {
+    *operands = value->args;
+    switch (value->op) {
+        case IR_OPR:
+            return value->l == 1 || value->l == 6 ? 1 : 2;
+        case IR_STORE:
+        case IR_WRITE:
+        case IR_LOADX:
+            return 1;
+        case IR_STOREX:
+            return 2;
+        case IR_CALL:
+        case IR_CALL_VALUE:
+        case IR_TAIL_CALL:
+            *operands = value->phi_args;
+            return value->length;
+        default:
+            return 0;
+    }
+}
+
+// Counts the uses of every value by live instructions, phis, branches and returns. If
+// user isn't NULL it gets a user of each value, see ir_lowering.
+void count_uses(ir_procedure *proc, int *uses, int *user) {
+    int *operands;
+    for (int k = 0; k < proc->num_order; ++k) {
+        int b = proc->order[k];
+        ir_block *block = &proc->blocks[b];
+        for (int i = 0; i < block->num_phis; ++i) {
+            ir_value *phi = &proc->values[block->phis[i]];
+            if (!is_live(proc, block->phis[i])) {
+                continue;
+            }
+            for (int p = 0; p < block->num_preds; ++p) {
+                uses[phi->phi_args[p]]++;
+                if (user != NULL) {
+                    user[phi->phi_args[p]] = -1;
+                }
+            }
+        }
+        for (int i = 0; i < block->num_values; ++i) {
+            if (!is_live(proc, block->values[i])) {
+                continue;
+            }
+            int count = value_operands(&proc->values[block->values[i]], &operands);
+            for (int a = 0; a < count; ++a) {
+                uses[operands[a]]++;
+                if (user != NULL) {
+                    user[operands[a]] = block->values[i];
+                }
+            }
+        }
+        if (block->cond != -1) {
+            uses[block->cond]++;
+            if (user != NULL) {
+                user[block->cond] = proc->num_values + b;
+            }
+        }
+    }
+}
+
+int predecessor_index(ir_block *block, int pred) {
+    for (int p = 0; p < block->num_preds; ++p) {
+        if (block->preds[p] == pred) {
+            return p;
+        }
+    }
+    return -1;
+}
+
+// Turns the procedure back into code for a block from split_blocks(), or
+// returns NULL if it's too big to allocate slots for
+instruction *lower_ir(ir_procedure *proc, int *code_length) {
+    remove_dead_values(proc);
+    int num_values = proc->num_values;
+    ir_lowering lower = {.proc = proc};
+    lower.uses = calloc(num_values, sizeof(int));
+    lower.user = malloc(num_values * sizeof(int));
+    count_uses(proc, lower.uses, lower.user);
+
+    // Values used once in their own block start out on the stack, settle_stack()
+    // moves them to slots if that doesn't work out
+    lower.resident = calloc(num_values, 1);
+    for (int v = 0; v < num_values; ++v) {
+        ir_value *value = &proc->values[v];
+        int user = lower.user[v];
+        lower.resident[v] = is_live(proc, v) && value->op != IR_CONST && value->op != IR_PHI &&
+                            lower.uses[v] == 1 &&
+                            (user == num_values + value->block ||
+                             (user >= 0 && user < num_values && proc->values[user].block == value->block));
+    }
+    lower.early = calloc(num_values, 1);
+    lower.start = malloc(num_values * sizeof(int));
+    lower.position = malloc(num_values * sizeof(int));
+    for (int k = 0; k < proc->num_order; ++k) {
+        ir_block *block = &proc->blocks[proc->order[k]];
+        for (int i = 0; i < block->num_values; ++i) {
+            lower.position[block->values[i]] = i;
+        }
+        settle_stack(&lower, block);
+    }
+
+    lower.sid = malloc(num_values * sizeof(int));
+    lower.value_of = malloc(num_values * sizeof(int));
+    for (int v = 0; v < num_values; ++v) {
+        ir_op op = proc->values[v].op;
+        lower.sid[v] = -1;
+        if (is_live(proc, v) && produces_value(op) && op != IR_CONST && !lower.resident[v] &&
+            proc->values[v].block != -1) {
+            lower.sid[v] = lower.num_slot_values;
+            lower.value_of[lower.num_slot_values++] = v;
+        }
+    }
+    lower.words = (lower.num_slot_values + 63) / 64;
+    if (lower.words * proc->num_blocks > MAX_IR_TABLE) {
+        free_lowering(&lower);
+        return NULL;
+    }
+    lower.live_in = calloc(lower.words * proc->num_blocks + 1, sizeof(uint64_t));
+    lower.live_out = calloc(lower.words * proc->num_blocks + 1, sizeof(uint64_t));
+    compute_liveness(&lower);
+    assign_slots(&lower);
+    emit_blocks(&lower);
+
+    instruction *code = lower.code;
+    *code_length = lower.length;
+    lower.code = NULL;
+    free_lowering(&lower);
+    return code;
+}
+
+// Runs the block's stack like the code will, making sure every value kept on
+// the stack is right on top when its user takes it. Any that aren't are
+// moved to slots and it starts again.
+void settle_stack(ir_lowering *lower, ir_block *block) {
+    ir_procedure *proc = lower->proc;
+    int *stack = malloc((block->num_values + 1) * sizeof(int));
+    int *operands;
+    int settled = 0;
+    while (!settled) {
+        int depth = 0;
+        settled = 1;
+        for (int i = 0; i < block->num_values && settled; ++i) {
+            int v = block->values[i];
+            if (!is_live(proc, v) || proc->values[v].op == IR_CONST) {
+                continue;
+            }
+            int count = value_operands(&proc->values[v], &operands);
+            // Like the original code, a variable used before a value on the stack can be
+            // loaded before that value's code, as long as it's been computed by then
+            lower->early[v] = count == 2 && !lower->resident[operands[0]] && lower->resident[operands[1]] &&
+                              can_load_early(lower, operands[0], lower->start[operands[1]], proc->values[v].block);
+            settled = take_operands(lower, stack, &depth, operands + lower->early[v], count - lower->early[v]);
+            if (settled && lower->resident[v]) {
+                lower->start[v] = count > 0 && lower->resident[operands[0]] ? lower->start[operands[0]]
+                                  : lower->early[v]                          ? lower->start[operands[1]]
+                                                                             : i;
+                stack[depth++] = v;
+            }
+        }
+        if (settled && block->cond != -1) {
+            settled = take_operands(lower, stack, &depth, &block->cond, 1);
+        }
+        if (settled && depth > 0) {
+            lower->resident[stack[depth - 1]] = 0;
+            settled = 0;
+        }
+    }
+    free(stack);
+}
+
+// Whether value can be loaded at position in block, before its user
+int can_load_early(ir_lowering *lower, int value, int position, int block) {
+    ir_value *v = &lower->proc->values[value];
+    return v->op == IR_CONST || v->op == IR_PHI || v->block != block || lower->position[value] < position;
+}
+
+// Takes an instruction's operands off the simulated stack. Operands that stay
+// on the stack have to come before any that are loaded (or pushed, for
+// constants) so the order works out. Returns 0 after moving a value to a slot.
+int take_operands(ir_lowering *lower, int *stack, int *depth, int *operands, int count) {
+    int on_stack = 0;
+    while (on_stack < count && lower->resident[operands[on_stack]]) {
+        on_stack++;
+    }
+    for (int a = on_stack; a < count; ++a) {
+        if (lower->resident[operands[a]]) {
+            lower->resident[operands[a]] = 0;
+            return 0;
+        }
+    }
+    if (on_stack > *depth) {
+        lower->resident[operands[0]] = 0;
+        return 0;
+    }
+    for (int a = 0; a < on_stack; ++a) {
+        int in_way = stack[*depth - on_stack + a];
+        if (in_way != operands[a]) {
+            // Operands the wrong way round only need the deeper one moved,
+            // anything else in the way is left for its user to load
+            int swapped = count == 2 && in_way == operands[1 - a];
+            lower->resident[swapped ? in_way : stack[*depth - 1]] = 0;
+            return 0;
+        }
+    }
+    *depth -= on_stack;
+    return 1;
+}
+
+// Works out which slot values are live into and out of each block
+void compute_liveness(ir_lowering *lower) {
+    ir_procedure *proc = lower->proc;
+    long words = lower->words;
+    uint64_t *live = malloc((words + 1) * sizeof(uint64_t));
+    int *operands;
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        // Postorder, so most successors are done first
+        for (int k = proc->num_order - 1; k >= 0; --k) {
+            int b = proc->order[k];
+            ir_block *block = &proc->blocks[b];
+            uint64_t *out = &lower->live_out[b * words];
+            memset(out, 0, words * sizeof(uint64_t));
+            for (int s = 0; s < block->num_succs; ++s) {
+                ir_block *succ = &proc->blocks[block->succs[s]];
+                uint64_t *in = &lower->live_in[block->succs[s] * words];
+                for (long w = 0; w < words; ++w) {
+                    out[w] |= in[w];
+                }
+                int p = predecessor_index(succ, b);
+                for (int i = 0; i < succ->num_phis; ++i) {
+                    int phi = succ->phis[i];
+                    if (is_live(proc, phi) && lower->sid[proc->values[phi].phi_args[p]] != -1) {
+                        int id = lower->sid[proc->values[phi].phi_args[p]];
+                        out[id / 64] |= 1ULL << (id % 64);
+                    }
+                }
+            }
+            memcpy(live, out, words * sizeof(uint64_t));
+            if (block->cond != -1 && lower->sid[block->cond] != -1) {
+                live[lower->sid[block->cond] / 64] |= 1ULL << (lower->sid[block->cond] % 64);
+            }
+            for (int i = block->num_values - 1; i >= 0; --i) {
+                int v = block->values[i];
+                if (!is_live(proc, v)) {
+                    continue;
+                }
+                if (lower->sid[v] != -1) {
+                    live[lower->sid[v] / 64] &= ~(1ULL << (lower->sid[v] % 64));
+                }
+                int count = value_operands(&proc->values[v], &operands);
+                for (int a = 0; a < count; ++a) {
+                    int id = lower->sid[operands[a]];
+                    if (id != -1) {
+                        live[id / 64] |= 1ULL << (id % 64);
+                    }
+                }
+            }
+            for (int i = 0; i < block->num_phis; ++i) {
+                int id = lower->sid[block->phis[i]];
+                if (id != -1) {
+                    live[id / 64] &= ~(1ULL << (id % 64));
+                }
+            }
+            uint64_t *in = &lower->live_in[b * words];
+            if (memcmp(in, live, words * sizeof(uint64_t)) != 0) {
+                memcpy(in, live, words * sizeof(uint64_t));
+                changed = 1;
+            }
+        }
+    }
+    free(live);
+}
+
+// Gives every slot value a frame slot no value live at the same time has
+void assign_slots(ir_lowering *lower) {
+    ir_procedure *proc = lower->proc;
+    int num_slot_values = lower->num_slot_values;
+    int max_slots = proc->frame + num_slot_values + 1;
+    lower->frame = proc->frame;
+    lower->slot = malloc((proc->num_values + 1) * sizeof(int));
+    // busy[s] is the stamp of the block being assigned while s is taken
+    int *busy = calloc(max_slots, sizeof(int));
+    int *last_use = malloc((num_slot_values + 1) * sizeof(int));
+    int *last_stamp = calloc(num_slot_values + 1, sizeof(int));
+
+    // Slots of promoted variables no value wants to go home to are free for anything
+    char *claimed = calloc(proc->frame, 1);
+    for (int id = 0; id < num_slot_values; ++id) {
+        claimed[proc->values[lower->value_of[id]].home] = 1;
+    }
+    int *spare = malloc(proc->frame * sizeof(int));
+    int num_spare = 0;
+    for (int s = 3; s < proc->frame; ++s) {
+        if (!proc->escaped[s] && !claimed[s]) {
+            spare[num_spare++] = s;
+        }
+    }
+
+    int *operands;
+    for (int k = 0; k < proc->num_order; ++k) {
+        int b = proc->order[k];
+        ir_block *block = &proc->blocks[b];
+        int stamp = k + 1;
+        uint64_t *in = &lower->live_in[b * lower->words];
+        uint64_t *out = &lower->live_out[b * lower->words];
+        for (long w = 0; w < lower->words; ++w) {
+            for (uint64_t bits = in[w]; bits != 0; bits &= bits - 1) {
+                busy[lower->slot[lower->value_of[w * 64 + __builtin_ctzll(bits)]]] = stamp;
+            }
+        }
+        for (int i = 0; i < block->num_phis; ++i) {
+            int phi = block->phis[i];
+            if (lower->sid[phi] != -1) {
+                lower->slot[phi] = choose_slot(lower, phi, busy, stamp, spare, num_spare);
+                busy[lower->slot[phi]] = stamp;
+            }
+        }
+
+        // Where each value that dies in the block is used for the last time
+        if (block->cond != -1) {
+            int id = lower->sid[block->cond];
+            if (id != -1 && !(out[id / 64] >> (id % 64) & 1)) {
+                last_use[id] = block->num_values;
+                last_stamp[id] = stamp;
+            }
+        }
+        for (int i = block->num_values - 1; i >= 0; --i) {
+            if (!is_live(proc, block->values[i])) {
+                continue;
+            }
+            int count = value_operands(&proc->values[block->values[i]], &operands);
+            for (int a = 0; a < count; ++a) {
+                int id = lower->sid[operands[a]];
+                if (id != -1 && !(out[id / 64] >> (id % 64) & 1) && last_stamp[id] != stamp) {
+                    last_use[id] = i;
+                    last_stamp[id] = stamp;
+                }
+            }
+        }
+
+        for (int i = 0; i < block->num_values; ++i) {
+            int v = block->values[i];
+            if (!is_live(proc, v)) {
+                continue;
+            }
+            // Operands are loaded before the result is stored, so the result can have their slot
+            int count = value_operands(&proc->values[v], &operands);
+            for (int a = 0; a < count; ++a) {
+                int id = lower->sid[operands[a]];
+                if (id != -1 && last_stamp[id] == stamp && last_use[id] == i) {
+                    busy[lower->slot[operands[a]]] = 0;
+                }
+            }
+            if (lower->sid[v] != -1) {
+                lower->slot[v] = choose_slot(lower, v, busy, stamp, spare, num_spare);
+                busy[lower->slot[v]] = lower->uses[v] > 0 ? stamp : 0;
+            }
+        }
+    }
+    free(busy);
+    free(last_use);
+    free(last_stamp);
+    free(claimed);
+    free(spare);
+}
+
+// The value's own variable's slot if it's free, then a slot no variable
+// wants, then a new one at the end of the frame
+int choose_slot(ir_lowering *lower, int value, int *busy, int stamp, int *spare, int num_spare) {
+    int home = lower->proc->values[value].home;
+    if (home >= 3 && busy[home] != stamp) {
+        return home;
+    }
+    for (int i = 0; i < num_spare; ++i) {
+        if (busy[spare[i]] != stamp) {
+            return spare[i];
+        }
+    }
+    int s = lower->proc->frame;
+    while (busy[s] == stamp) {
+        s++;
+    }
+    if (s >= lower->frame) {
+        lower->frame = s + 1;
+    }
+    return s;
+}
+
+// Whether going from one block to another has to copy values into phi slots
+int needs_copies(ir_lowering *lower, int from, int to) {
+    ir_procedure *proc = lower->proc;
+    ir_block *block = &proc->blocks[to];
+    int p = predecessor_index(block, from);
+    for (int i = 0; i < block->num_phis; ++i) {
+        int phi = block->phis[i];
+        if (lower->sid[phi] == -1) {
+            continue;
+        }
+        int arg = proc->values[phi].phi_args[p];
+        if (proc->values[arg].op == IR_CONST || lower->slot[arg] != lower->slot[phi]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void emit(ir_lowering *lower, int opcode, int l, int64_t m) {
+    if (lower->length == lower->capacity) {
+        lower->capacity = lower->capacity * 2 + 64;
+        lower->code = realloc(lower->code, lower->capacity * sizeof(instruction));
+    }
+    lower->code[lower->length++] = (instruction) {opcode, l, m};
+}
+
+// Emits a jump whose target is filled in once the label's known
+void emit_jump(ir_lowering *lower, int opcode, int label) {
+    append_int(&lower->patches, &lower->num_patches, lower->length);
+    append_int(&lower->patches, &lower->num_patches, label);
+    emit(lower, opcode, 0, 0);
+}
+
+// Puts an operand on top of the stack unless it's already there
+void emit_operand(ir_lowering *lower, int value) {
+    ir_value *v = &lower->proc->values[value];
+    if (lower->resident[value]) {
+        return;
+    }
+    if (v->op == IR_CONST) {
+        emit(lower, LIT, 0, v->m);
+    } else {
+        emit(lower, LOD, 0, lower->slot[value]);
+    }
+}
+
+void emit_value(ir_lowering *lower, int value) {
+    ir_procedure *proc = lower->proc;
+    ir_value *v = &proc->values[value];
+    if (v->op == IR_CONST || v->op == IR_PHI) {
+        return;
+    }
+    // A variable's value on entry is already in its slot if it stays there
+    if (v->op == IR_LOAD && v->l == 0 && !proc->escaped[v->m] && lower->sid[value] != -1 &&
+        lower->slot[value] == v->m) {
+        return;
+    }
+    int *operands;
+    int count = value_operands(v, &operands);
+    for (int a = lower->early[value]; a < count; ++a) {
+        emit_operand(lower, operands[a]);
+    }
+    // The index is on top, the verifier wants its check right in front of the access
+    if ((v->op == IR_LOADX || v->op == IR_STOREX) && !index_in_bounds(proc, v)) {
+        emit(lower, CHK, 0, v->length);
+    }
+    switch (v->op) {
+        case IR_OPR:
+            emit(lower, OPR, 0, v->l);
+            break;
+        case IR_LOAD:
+            emit(lower, LOD, v->l, v->m);
+            break;
+        case IR_STORE:
+            emit(lower, STO, v->l, v->m);
+            break;
+        case IR_LOADX:
+            emit(lower, LODX, v->l, v->m);
+            break;
+        case IR_STOREX:
+            emit(lower, STOX, v->l, v->m);
+            break;
+        case IR_CALL:
+        case IR_CALL_VALUE:
+            emit(lower, CAL, v->l, v->m);
+            break;
+        case IR_TAIL_CALL:
+            emit(lower, TCL, v->l, v->m);
+            break;
+        case IR_READ:
+            emit(lower, SYS, 0, 2);
+            break;
+        case IR_WRITE:
+            emit(lower, SYS, 0, 1);
+            break;
+        default:
+            break;
+    }
+    if (lower->sid[value] != -1) {
+        emit(lower, STO, 0, lower->slot[value]);
+    }
+}
+
+// Emits the block's values in order, with the operands loaded early in
+// front of the code they were loaded ahead of
+void emit_block_values(ir_lowering *lower, ir_block *block) {
+    ir_procedure *proc = lower->proc;
+    // Early loads at each position, the last registered (the outermost user) first
+    int *first = malloc((block->num_values + 1) * sizeof(int));
+    int *next = malloc((block->num_values + 1) * sizeof(int));
+    for (int i = 0; i < block->num_values; ++i) {
+        first[i] = -1;
+    }
+    for (int i = 0; i < block->num_values; ++i) {
+        int v = block->values[i];
+        if (is_live(proc, v) && lower->early[v]) {
+            int *operands;
+            value_operands(&proc->values[v], &operands);
+            int at = lower->start[operands[1]];
+            next[i] = first[at];
+            first[at] = i;
+        }
+    }
+    for (int i = 0; i < block->num_values; ++i) {
+        for (int e = first[i]; e != -1; e = next[e]) {
+            int *operands;
+            value_operands(&proc->values[block->values[e]], &operands);
+            emit_operand(lower, operands[0]);
+        }
+        if (is_live(proc, block->values[i])) {
+            emit_value(lower, block->values[i]);
+        }
+    }
+    free(first);
+    free(next);
+}
+
+// Copies the phi operands for the edge between two blocks into the phis' slots.
+// All of them are loaded before any is stored so it works as a parallel copy.
+void emit_copies(ir_lowering *lower, int from, int to) {
+    ir_procedure *proc = lower->proc;
+    ir_block *block = &proc->blocks[to];
+    int p = predecessor_index(block, from);
+    int *targets = malloc((block->num_phis + 1) * sizeof(int));
+    int count = 0;
+    for (int i = 0; i < block->num_phis; ++i) {
+        int phi = block->phis[i];
+        if (lower->sid[phi] == -1) {
+            continue;
+        }
+        int arg = proc->values[phi].phi_args[p];
+        if (proc->values[arg].op == IR_CONST || lower->slot[arg] != lower->slot[phi]) {
+            emit_operand(lower, arg);
+            targets[count++] = lower->slot[phi];
+        }
+    }
+    while (count > 0) {
+        emit(lower, STO, 0, targets[--count]);
+    }
+    free(targets);
+}
+
+// Lays the blocks out in their original order. Copies for a branch's jump go
+// in an edge block just before its target, copies for the fall through go
+// right after the JPC.
+void emit_blocks(ir_lowering *lower) {
+    ir_procedure *proc = lower->proc;
+    int num_blocks = proc->num_blocks;
+    int *first_edge = malloc(num_blocks * sizeof(int));
+    int *edge_from = malloc(num_blocks * sizeof(int));
+    int *edge_next = malloc(num_blocks * sizeof(int));
+    int *branch_label = malloc(num_blocks * sizeof(int));
+    int num_edges = 0;
+    for (int b = 0; b < num_blocks; ++b) {
+        first_edge[b] = -1;
+    }
+    for (int b = 0; b < num_blocks; ++b) {
+        ir_block *block = &proc->blocks[b];
+        if (!block->reachable || block->exit != IR_BRANCH) {
+            continue;
+        }
+        int target = block->succs[0];
+        branch_label[b] = target;
+        if (block->num_succs == 2 && needs_copies(lower, b, target)) {
+            edge_from[num_edges] = b;
+            edge_next[num_edges] = first_edge[target];
+            first_edge[target] = num_edges;
+            branch_label[b] = num_blocks + num_edges++;
+        }
+    }
+    lower->labels = malloc((num_blocks + num_edges) * sizeof(int));
+
+    int next = 0;
+    for (int b = 0; b < num_blocks; b = next) {
+        ir_block *block = &proc->blocks[b];
+        next = b + 1;
+        while (next < num_blocks && !proc->blocks[next].reachable) {
+            next++;
+        }
+        if (!block->reachable) {
+            continue;
+        }
+        for (int e = first_edge[b]; e != -1; e = edge_next[e]) {
+            lower->labels[num_blocks + e] = lower->length;
+            emit_copies(lower, edge_from[e], b);
+            if (edge_next[e] != -1) {
+                emit_jump(lower, JMP, b);
+            }
+        }
+        lower->labels[b] = lower->length;
+        if (b == 0) {
+            emit(lower, INC, proc->params, lower->frame);
+        }
+        emit_block_values(lower, block);
+        // Falling into a block works unless edge blocks were put in front of it
+        int fall = block->num_succs > 0 ? block->succs[block->num_succs - 1] : -1;
+        switch (block->exit) {
+            case IR_JUMP:
+                emit_copies(lower, b, fall);
+                if (fall != next || first_edge[fall] != -1) {
+                    emit_jump(lower, JMP, fall);
+                }
+                break;
+            case IR_BRANCH:
+                emit_operand(lower, block->cond);
+                if (block->num_succs == 1) {
+                    emit_copies(lower, b, fall);
+                }
+                emit_jump(lower, JPC, branch_label[b]);
+                if (block->num_succs == 2) {
+                    emit_copies(lower, b, fall);
+                }
+                if (fall != next || first_edge[fall] != -1) {
+                    emit_jump(lower, JMP, fall);
+                }
+                break;
+            case IR_RETURN:
+                if (block->cond != -1) {
+                    emit_operand(lower, block->cond);
+                }
+                emit(lower, proc->last.opcode, proc->last.l, proc->last.m);
+                break;
+            case IR_HALT:
+                emit(lower, SYS, 0, 3);
+                break;
+        }
+    }
+    // A procedure that never gets to its return still has to end with one
+    if (!proc->blocks[num_blocks - 1].reachable) {
+        emit(lower, proc->last.opcode, proc->last.l, proc->last.m);
+    }
+    for (int i = 0; i < lower->num_patches; i += 2) {
+        lower->code[lower->patches[i]].m = lower->labels[lower->patches[i + 1]];
+    }
+    free(first_edge);
+    free(edge_from);
+    free(edge_next);
+    free(branch_label);
+}
+
+void free_lowering(ir_lowering *lower) {
+    free(lower->uses);
+    free(lower->user);
+    free(lower->resident);
+    free(lower->early);
+    free(lower->start);
+    free(lower->position);
+    free(lower->sid);
+    free(lower->value_of);
+    free(lower->live_in);
+    free(lower->live_out);
+    free(lower->slot);
+    free(lower->code);
+    free(lower->labels);
+    free(lower->patches);
+}
+
+void free_ir(ir_procedure *proc) {
+    for (int v = 0; v < proc->num_values; ++v) {
+        free(proc->values[v].phi_args);
+    }
+    for (int b = 0; b < proc->num_blocks; ++b) {
+        free(proc->blocks[b].values);
+        free(proc->blocks[b].phis);
+        free(proc->blocks[b].preds);
+    }
+    free(proc->values);
+    free(proc->blocks);
+    free(proc->order);
+    free(proc->escaped);
+    free(proc);
+}
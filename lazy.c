@@ -0,0 +1,158 @@
+/*
+    Lazy Code Generation for PL/0
+    Author: Ryan Doherty
+
+    A big program that only ever runs a few of its procedures spends most
+    of its start up generating and verifying code that never runs. A
+    program compiled with PL0_LAZY only has main generated up front, and a
+    stub in place of every other procedure (generate_lazy()). The tokens,
+    symbols and walked declarations are kept with the program.
+
+    Each stub's INC is packed as a LAZY_CALL. The first machine to call it
+    has lazy_up() generate the procedure, which is added to the end of the
+    program as a copy of the stub (see procedure_copy) in a new version of
+    the code, like tier.c adds its copies:
+    - the stub's word becomes a TIER_CALL to the procedure, for calls that
+      were packed before it was generated and wide ones
+    - packed calls to the stub, in the code as compiled and in procedures
+      generated before, go straight to the procedure
+    - its own calls to procedures already generated do too, and the rest
+      go to their stubs
+    The machine then carries on in the new version at the stub. A call is a
+    safe point to switch at, the new frame has nothing in it yet but its
+    links and arguments.
+
+    The stub reserves the frame the procedure will, so the verifier checks
+    calls to it and the procedures nested in it without the code, and each
+    version is verified before machines see it. Procedures aren't optimized
+    since the passes that pay off need the whole program, except for tail
+    calls, which programs count on for their stack space. A procedure can
+    use more stack than the ones before it, so the machine checks the
+    frame fits again after the call to it (which only made room for those).
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "vm.h"
+
+int add_procedure(pl0_program *program, int stub);
+
+// Takes over codegen and marks the stubs in the version's text, before any
+// machine runs it
+lazy_state *lazy_create(program_version *version, codegen_state *codegen) {
+    lazy_state *lazy = calloc(1, sizeof(lazy_state));
+    pthread_mutex_init(&lazy->lock, NULL);
+    lazy->base_length = version->code_length;
+    lazy->body_at = calloc(version->code_length, sizeof(int));
+    lazy->codegen = codegen;
+    // The stubs are everything between the jump and main, each ends at its return
+    int main_start = (int) version->code[0].m;
+    int stub = 1;
+    while (stub < main_start) {
+        version->text[stub] = PACK(LAZY_CALL, 0, 0);
+        int end = stub;
+        while (version->code[end].opcode != OPR) {
+            end++;
+        }
+        stub = end + 1;
+    }
+    hash_version(version);
+    return lazy;
+}
+
+// Called by a machine that called a stub. Other machines may be doing the
+// same, whoever's first generates the procedure.
+void lazy_up(pl0_program *program, int stub) {
+    lazy_state *lazy = program->lazy;
+    pthread_mutex_lock(&lazy->lock);
+    if (lazy->body_at[stub] == 0) {
+        lazy->body_at[stub] = add_procedure(program, stub);
+    }
+    pthread_mutex_unlock(&lazy->lock);
+}
+
+// Publishes a version of the code with the procedure at stub added and
+// returns where it starts, or -1 if it can't be
+int add_procedure(pl0_program *program, int stub) {
+    lazy_state *lazy = program->lazy;
+    // Versions are only published with the lock held, so this is the newest
+    program_version *version = current_version(program);
+    int length;
+    instruction *body = compile_procedure(lazy->codegen, stub, &length);
+    if (body == NULL) {
+        return -1;
+    }
+    int start = version->code_length;
+    if (start + length - 1 > PACKED_OPERAND_MAX) {
+        free(body);
+        return -1;
+    }
+
+    program_version *next = malloc(sizeof(program_version));
+    next->code_length = start + length;
+    next->code = malloc(next->code_length * sizeof(instruction));
+    memcpy(next->code, version->code, start * sizeof(instruction));
+    for (int i = 0; i < length; ++i) {
+        instruction ir = body[i];
+        if (ir.opcode == JMP || ir.opcode == JPC) {
+            ir.m += start;
+        }
+        next->code[start + i] = ir;
+    }
+    free(body);
+    make_tail_calls(next->code, next->code_length, start);
+    next->num_copies = version->num_copies + 1;
+    next->copies = malloc(next->num_copies * sizeof(procedure_copy));
+    if (version->num_copies > 0) {
+        memcpy(next->copies, version->copies, version->num_copies * sizeof(procedure_copy));
+    }
+    next->copies[version->num_copies] = (procedure_copy) {start, next->code_length - 1, stub, stub};
+
+    verified_code *verified = &next->verified;
+    verified->depths = malloc(next->code_length * sizeof(int));
+    verified->procedure = malloc(next->code_length * sizeof(int));
+    verified->parent = malloc(next->code_length * sizeof(int));
+    const char *error;
+    if (!verify_program(next->code, next->code_length, next->copies, next->num_copies, VM_STACK_SIZE, verified,
+                        &error)) {
+        free(next->code);
+        free(next->copies);
+        free(verified->depths);
+        free(verified->procedure);
+        free(verified->parent);
+        free(next);
+        return -1;
+    }
+
+    next->text = malloc((next->code_length + 1) * sizeof(uint32_t));
+    memcpy(next->text, version->text, start * sizeof(uint32_t));
+    next->wide = malloc((version->num_wide + 1) * sizeof(instruction));
+    if (version->num_wide > 0) {
+        memcpy(next->wide, version->wide, version->num_wide * sizeof(instruction));
+    }
+    next->num_wide = version->num_wide;
+    pack_code(next, start, program->flags);
+    next->text[stub] = PACK(TIER_CALL, 0, start);
+    lazy->body_at[stub] = start;
+    for (int i = 0; i < next->code_length; ++i) {
+        int opcode = PACKED_OPCODE(next->text[i]);
+        int m = PACKED_OPERAND(next->text[i]);
+        if ((opcode == CAL || opcode == TCL) && m < lazy->base_length && lazy->body_at[m] > 0) {
+            next->text[i] = PACK(opcode, PACKED_LEVEL(next->text[i]), lazy->body_at[m]);
+        }
+    }
+    hash_version(next);
+    next->older = version;
+    atomic_store_explicit(&program->current, next, memory_order_release);
+    return start;
+}
+
+void lazy_free(lazy_state *lazy) {
+    if (lazy == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&lazy->lock);
+    free(lazy->body_at);
+    free_codegen_state(lazy->codegen);
+    free(lazy);
+}
@@ -5,6 +5,15 @@
     This program implements a lexical analyzer for PL/0.
     It splits an input file into tokens and interprets the type of
     those tokens. This is a necessary step for making a compiler.
+
+    The parser pulls lexemes one at a time with lex_next() and the input
+    is read through a window as they're needed, so the source never
+    has to be in memory all at once. The lexemes are kept as parallel
+    arrays of types and values the code generator walks later.
+
+    Identifiers are interned straight out of the window: each different
+    name is copied once into a name table and every later phase knows it
+    by its index, so names are compared as integers and can be any length.
 */
 #include <stdlib.h>
 #include <stdio.h>
@@ -12,202 +21,273 @@
 #include <string.h>
 #include "compiler.h"
 
-typedef struct node {
-    char *token;
-    struct node *next;
-} token_node;
+// Starting size of the window the input is read through, it grows if a word doesn't fit
+#define LEX_BUFFER_SIZE 65536
+
+token_stream *stream;
+int stream_capacity;
+// Largest number literal, the largest word for the mode
+int64_t max_number;
 
-lexeme *list;
-int lex_index;
-int input_index;
+source_reader read_input;
+void *input_context;
+char *input_buffer;
+int buffer_size;
+int buffer_length;
+int buffer_index;
+int input_done;
+// Start of the word being read, kept in the window when it's refilled, -1 outside words
+int word_start;
 
 void printerror(int type);
 void printtokens();
 
-int lex_next_token(char *input);
+char peek_char(int ahead);
+lexeme lex_word();
+void grow_name_slots(name_table *names);
 
 int is_symbol(char c);
-int is_reserved(char *string);
+int is_reserved(char *string, int length);
 
 token_type symbol_type(char symbol);
-token_type reserved_type(char first_char, char second_char);
-
-lexeme *lexanalyzer(char *input) {
-    list = malloc(500 * sizeof(lexeme));
-    lex_index = 0;
-    input_index = 0;
-
-    token_node *token_list = NULL;
-    char *current_token = malloc(12);
-    int token_index = 0;
-
-    // Parse through each token in my token list
-    int has_lex_next_token = 1;
-    while (has_lex_next_token) {
-        int end_of_token = lex_next_token(input);
-        for (int j = input_index; j <= abs(end_of_token); ++j) {
-            current_token[token_index] = input[j];
-            token_index++;
-            if (end_of_token < 0 && j == abs(end_of_token)) {
-                has_lex_next_token = 0;
-                break;
-            }
-        }
+token_type reserved_type(char *word, int length);
 
-        // Make a list of tokens
-        token_node *new_token = malloc(sizeof(token_node));
-        new_token->token = current_token;
-        new_token->next = NULL;
-        if (token_list == NULL) {
-            token_list = new_token;
-        } else {
-            token_node *current_node = token_list;
-            while (current_node->next != NULL) {
-                current_node = current_node->next;
-            }
-            current_node->next = new_token;
-        }
-
-        token_index = 0;
-        current_token = malloc(11);
-        input_index = end_of_token + 1;
+// Lexes a whole string at once and returns its lexemes
+token_stream *lexanalyzer(char *input, int flags) {
+    lex_begin(string_reader, &input, flags);
+    while (lex_next().type != 0) {
     }
+    return lex_finish();
+}
 
-    lexeme *current_lexeme;
-    token_node *current_node = token_list;
-    while (current_node) {
-        current_lexeme = &list[lex_index];
-        token_type type = -1;
+// Starts lexing input pulled from read, nothing is read until the first lex_next()
+void lex_begin(source_reader read, void *context, int flags) {
+    max_number = flags & MODE_INT64 ? INT64_MAX : INT32_MAX;
+    // Zeroed so the lexeme after the last one is always an end marker of type 0
+    stream_capacity = 500;
+    stream = malloc(sizeof(token_stream));
+    stream->types = calloc(stream_capacity, sizeof(token_type));
+    stream->values = calloc(stream_capacity, sizeof(int64_t));
+    stream->count = 0;
+    name_table_init(&stream->names);
+    read_input = read;
+    input_context = context;
+    buffer_size = LEX_BUFFER_SIZE;
+    input_buffer = malloc(buffer_size);
+    buffer_length = 0;
+    buffer_index = 0;
+    input_done = 0;
+    word_start = -1;
+}
 
-        char first_char = current_node->token[0];
-        if (isspace(first_char) || iscntrl(first_char)) {
-            current_node = current_node->next;
+// Returns the next lexeme, or one of type 0 once the input runs out.
+// Every lexeme is also kept for the code generator.
+lexeme lex_next() {
+    lexeme current_lexeme = {0, 0};
+    token_type type = 0;
+    while (type == 0) {
+        char first_char = peek_char(0);
+        if (first_char == '\0') {
+            return current_lexeme;
+        }
+        if (isspace(first_char)) {
+            buffer_index++;
             continue;
-        } else if (is_symbol(first_char)) {
-            if (first_char == '/' && current_node->next != NULL && current_node->next->token[0] == '*') {
-                int comment_ends = 0;
-                while (current_node->next != NULL) {
-                    if (current_node->token[0] == '*') {
-                        if (current_node->next != NULL && current_node->next->token[0] == '/') {
-                            current_node = current_node->next;
-                            comment_ends = 1;
-                            break;
-                        }
-                    }
-                    current_node = current_node->next;
-                }
-                if (!comment_ends) {
+        }
+        if (!is_symbol(first_char)) {
+            current_lexeme = lex_word();
+            type = current_lexeme.type;
+            continue;
+        }
+
+        buffer_index++;
+        char next_char = peek_char(0);
+        if (first_char == '/' && next_char == '*') {
+            // The * that opens a comment can also be the start of the one that closes it
+            while (!(peek_char(0) == '*' && peek_char(1) == '/')) {
+                if (peek_char(0) == '\0') {
                     printerror(5);
-                    exit(0);
                 }
-                current_node = current_node->next;
-                continue;
+                buffer_index++;
             }
-            switch (first_char) {
-                case ':':
-                    if (current_node->next != NULL && current_node->next->token[0] == '=') {
-                        type = becomessym;
-                        current_node = current_node->next;
-                    }
-                    break;
-                case '=':
-                    if (current_node->next != NULL && current_node->next->token[0] == '=') {
-                        type = eqlsym;
-                        current_node = current_node->next;
-                    }
-                    break;
-                case '<':
-                    if (current_node->next != NULL) {
-                        if (current_node->next->token[0] == '>') {
-                            type = neqsym;
-                            current_node = current_node->next;
-                            break;
-                        } else if (current_node->next->token[0] == '=') {
-                            type = leqsym;
-                            current_node = current_node->next;
-                            break;
-                        }
-                    }
-                    // If it falls through use default branch
-                case '>':
-                    if (current_node->next != NULL && current_node->next->token[0] == '=') {
-                        type = geqsym;
-                        current_node = current_node->next;
-                        break;
-                    }
-                default:
-                    // Handles all the single symbol tokens
-                    type = symbol_type(first_char);
-                    break;
-            }
-        } else if (isalpha(first_char)) {
-            if (is_reserved(current_node->token)) {
-                type = reserved_type(first_char, current_node->token[1]);
-            } else {
-                if (strlen(current_node->token) < 12) {
-                    type = identsym;
-                    strcpy(current_lexeme->name, current_node->token);
-                } else {
-                    printerror(4);
-                    exit(0);
+            buffer_index += 2;
+            continue;
+        }
+        switch (first_char) {
+            case ':':
+                if (next_char != '=') {
+                    printerror(1);
                 }
-            }
-        } else if (isdigit(first_char)) {
-            int token_length = strlen(current_node->token);
-            for (int i = 0; i < token_length; ++i) {
-                if (!isdigit(current_node->token[i])) {
-                    printerror(2);
-                    exit(0);
-                } else if (i >= 5){
-                    printerror(3);
-                    exit(0);
+                type = becomessym;
+                break;
+            case '=':
+                if (next_char != '=') {
+                    printerror(1);
                 }
-            }
-            current_lexeme->value = atoi(current_node->token);
-            type = numbersym;
+                type = eqlsym;
+                break;
+            case '<':
+                if (next_char == '>') {
+                    type = neqsym;
+                } else if (next_char == '=') {
+                    type = leqsym;
+                }
+                break;
+            case '>':
+                if (next_char == '=') {
+                    type = geqsym;
+                }
+                break;
+        }
+        if (type != 0) {
+            buffer_index++;
         } else {
-            // If not a digit, letter, control char, or valid symbol, its an invalid symbol
-            printerror(1);
-            exit(0);
+            // Handles all the single symbol tokens
+            type = symbol_type(first_char);
         }
+        current_lexeme.type = type;
+    }
+
+    if (stream->count + 1 >= stream_capacity) {
+        stream->types = realloc(stream->types, 2 * stream_capacity * sizeof(token_type));
+        stream->values = realloc(stream->values, 2 * stream_capacity * sizeof(int64_t));
+        memset(stream->types + stream_capacity, 0, stream_capacity * sizeof(token_type));
+        memset(stream->values + stream_capacity, 0, stream_capacity * sizeof(int64_t));
+        stream_capacity *= 2;
+    }
+    stream->types[stream->count] = current_lexeme.type;
+    stream->values[stream->count] = current_lexeme.value;
+    stream->count++;
+    return current_lexeme;
+}
+
+// The names interned so far, the parser adds its own to them
+name_table *lex_names() {
+    return &stream->names;
+}
 
-        current_lexeme->type = type;
-        list[lex_index] = *current_lexeme;
-        lex_index++;
-        current_node = current_node->next;
+// Hands over every lexeme read so far, followed by an end marker
+token_stream *lex_finish() {
+    token_stream *tokens = stream;
+    free(input_buffer);
+    input_buffer = NULL;
+    stream = NULL;
+    return tokens;
+}
+
+// Frees everything after an error, it's safe to call more than once
+void lex_abort() {
+    free(input_buffer);
+    free_tokens(stream);
+    input_buffer = NULL;
+    stream = NULL;
+}
+
+void free_tokens(token_stream *tokens) {
+    if (tokens == NULL) {
+        return;
     }
-//    printtokens();
-    return list;
+    free(tokens->types);
+    free(tokens->values);
+    name_table_free(&tokens->names);
+    free(tokens);
 }
 
-// Returns index of end of the next token after the current input_index
-int lex_next_token(char *input) {
-    int end_index = input_index;
-    char current_char = input[end_index];
-    // If the first char is a token or space, return
-    // This makes spaces and symbols tokens in our initial list
-    // Spaces get removed and symbols get interpreted
-    if (isspace(current_char) || is_symbol(current_char)) {
-        return end_index;
+// Reads a run of letters and digits (or anything else that isn't a space or symbol)
+lexeme lex_word() {
+    lexeme current_lexeme = {0, 0};
+    word_start = buffer_index;
+    char c;
+    while ((c = peek_char(0)) != '\0' && !isspace(c) && !is_symbol(c)) {
+        buffer_index++;
+    }
+    // The word stays where it is in the window until the next peek_char()
+    char *word = input_buffer + word_start;
+    int length = buffer_index - word_start;
+    word_start = -1;
+
+    char first_char = word[0];
+    if (iscntrl(first_char)) {
+        // Type 0 tells lex_next() to skip it
+        return current_lexeme;
+    } else if (isalpha(first_char)) {
+        if (is_reserved(word, length)) {
+            current_lexeme.type = reserved_type(word, length);
+        } else {
+            current_lexeme.type = identsym;
+            current_lexeme.value = intern_name(&stream->names, word, length);
+        }
+    } else if (isdigit(first_char)) {
+        // Checked before each digit is added, so it's an error before the value can overflow
+        int64_t value = 0;
+        for (int i = 0; i < length; ++i) {
+            if (!isdigit(word[i])) {
+                printerror(2);
+            } else if (value > (max_number - (word[i] - '0')) / 10) {
+                printerror(3);
+            }
+            value = value * 10 + (word[i] - '0');
+        }
+        current_lexeme.value = value;
+        current_lexeme.type = numbersym;
+    } else {
+        // If not a digit, letter, control char, or valid symbol, its an invalid symbol
+        printerror(1);
     }
+    return current_lexeme;
+}
 
-    while (1) {
-        current_char = input[end_index];
-        if (current_char == '\0') {
-            // End index is negative if we hit the end of file on this token
-            return -(end_index);
-        } else if (isspace(current_char) || is_symbol(current_char)) {
-            return end_index - 1;
+// Looks ahead in the input, reading more once the window runs low. '\0' is the end.
+char peek_char(int ahead) {
+    if (buffer_index + ahead >= buffer_length && !input_done) {
+        // Move what's left (and the word being read) to the front and fill the rest of the window
+        int keep = word_start != -1 ? word_start : buffer_index;
+        memmove(input_buffer, input_buffer + keep, buffer_length - keep);
+        buffer_length -= keep;
+        buffer_index -= keep;
+        if (word_start != -1) {
+            word_start = 0;
+        }
+        if (buffer_length == buffer_size) {
+            buffer_size *= 2;
+            input_buffer = realloc(input_buffer, buffer_size);
+        }
+        while (buffer_length < buffer_size && !input_done) {
+            long count = read_input(input_context, input_buffer + buffer_length, buffer_size - buffer_length);
+            if (count <= 0) {
+                input_done = 1;
+            } else {
+                buffer_length += count;
+            }
         }
-        end_index++;
     }
+    if (buffer_index + ahead >= buffer_length) {
+        return '\0';
+    }
+    return input_buffer[buffer_index + ahead];
+}
+
+// Source readers for lex_begin(), the context is a char ** or a FILE *
+long string_reader(void *context, char *buffer, long size) {
+    char **cursor = context;
+    long count = 0;
+    while (count < size && (*cursor)[count] != '\0') {
+        buffer[count] = (*cursor)[count];
+        count++;
+    }
+    *cursor += count;
+    return count;
+}
+
+long file_reader(void *context, char *buffer, long size) {
+    return (long) fread(buffer, 1, size, context);
 }
 
 // Checks if string is a valid symbol
 int is_symbol(char c) {
-    char symbols[14] = {'<', '>', '=', ':', ';', ',', '.', '+', '-', '*', '/', '%', '(', ')'};
+    char symbols[16] = {'<', '>', '=', ':', ';', ',', '.', '+', '-', '*', '/', '%', '(', ')', '[', ']'};
     if (!isalpha(c) && !isdigit(c)) {
-        for (int i = 0; i < 14; ++i) {
+        for (int i = 0; i < 16; ++i) {
             if (c == symbols[i]) {
                 return 1;
             }
@@ -216,21 +296,102 @@ int is_symbol(char c) {
     return 0;
 }
 
-// Checks if string is a reserved word
-int is_reserved(char *string) {
-    char *reserved_words[14] = {
-            "begin", "call", "const", "do", "else", "end", "if",
-            "odd", "procedure", "read", "then", "var", "while", "write"
+// Checks if the word of this length (not terminated) is a reserved word
+int is_reserved(char *string, int length) {
+    char *reserved_words[17] = {
+            "begin", "call", "const", "do", "else", "end", "extern", "function", "if",
+            "odd", "procedure", "read", "return", "then", "var", "while", "write"
     };
     int reserved_word = 0;
-    for (int i = 0; i < 14; ++i) {
-        if (strcmp(string, reserved_words[i]) == 0) {
+    for (int i = 0; i < 17; ++i) {
+        if (strncmp(string, reserved_words[i], length) == 0 && reserved_words[i][length] == '\0') {
             reserved_word = 1;
         }
     }
     return reserved_word;
 }
 
+void name_table_init(name_table *names) {
+    memset(names, 0, sizeof(name_table));
+}
+
+// Doubles the hash slots (they start at 64) and puts every name back in them
+void grow_name_slots(name_table *names) {
+    free(names->slots);
+    names->num_slots = names->num_slots == 0 ? 64 : 2 * names->num_slots;
+    names->slots = malloc(names->num_slots * sizeof(int));
+    for (int i = 0; i < names->num_slots; ++i) {
+        names->slots[i] = -1;
+    }
+    for (int name = 0; name < names->count; ++name) {
+        char *text = names->text + names->starts[name];
+        int slot = hash_bytes(HASH_SEED, text, strlen(text)) & (names->num_slots - 1);
+        while (names->slots[slot] != -1) {
+            slot = (slot + 1) & (names->num_slots - 1);
+        }
+        names->slots[slot] = name;
+    }
+}
+
+// Returns the index of the name of this length (it doesn't have to be terminated),
+// adding it if it's new
+int intern_name(name_table *names, char *name, int length) {
+    // Kept at most half full so probes stay short
+    if (2 * (names->count + 1) > names->num_slots) {
+        grow_name_slots(names);
+    }
+    int slot = hash_bytes(HASH_SEED, name, length) & (names->num_slots - 1);
+    for (; names->slots[slot] != -1; slot = (slot + 1) & (names->num_slots - 1)) {
+        char *text = names->text + names->starts[names->slots[slot]];
+        if (strncmp(text, name, length) == 0 && text[length] == '\0') {
+            return names->slots[slot];
+        }
+    }
+
+    if (names->count == names->capacity) {
+        names->capacity = names->capacity == 0 ? 64 : 2 * names->capacity;
+        names->starts = realloc(names->starts, names->capacity * sizeof(int));
+    }
+    if (names->text_length + length + 1 > names->text_capacity) {
+        while (names->text_length + length + 1 > names->text_capacity) {
+            names->text_capacity = names->text_capacity == 0 ? 1024 : 2 * names->text_capacity;
+        }
+        names->text = realloc(names->text, names->text_capacity);
+    }
+    memcpy(names->text + names->text_length, name, length);
+    names->text[names->text_length + length] = '\0';
+    names->starts[names->count] = names->text_length;
+    names->text_length += length + 1;
+    names->slots[slot] = names->count;
+    return names->count++;
+}
+
+// Returns the index of the name, or -1 if it was never interned
+int find_name(name_table *names, char *name) {
+    if (names->count == 0) {
+        return -1;
+    }
+    int length = strlen(name);
+    int slot = hash_bytes(HASH_SEED, name, length) & (names->num_slots - 1);
+    for (; names->slots[slot] != -1; slot = (slot + 1) & (names->num_slots - 1)) {
+        if (strcmp(names->text + names->starts[names->slots[slot]], name) == 0) {
+            return names->slots[slot];
+        }
+    }
+    return -1;
+}
+
+char *name_text(name_table *names, int name) {
+    return names->text + names->starts[name];
+}
+
+void name_table_free(name_table *names) {
+    free(names->text);
+    free(names->starts);
+    free(names->slots);
+    memset(names, 0, sizeof(name_table));
+}
+
 // Return the type for the single character symbols
 token_type symbol_type(char symbol) {
     switch (symbol) {
@@ -246,6 +407,10 @@ token_type symbol_type(char symbol) {
             return lparentsym;
         case ')':
             return rparentsym;
+        case '[':
+            return lbracketsym;
+        case ']':
+            return rbracketsym;
         case '%':
             return modsym;
         case '<':
@@ -259,12 +424,15 @@ token_type symbol_type(char symbol) {
         case '.':
             return periodsym;
     }
+    // Only called for characters is_symbol() accepts
+    return 0;
 }
 
-// Return the type for each reserved word
-token_type reserved_type(char first_char, char second_char){
+// Return the type for each reserved word, is_reserved() has checked it's one
+token_type reserved_type(char *word, int length){
     token_type  type = 0;
-    switch (first_char) {
+    char second_char = length > 1 ? word[1] : '\0';
+    switch (word[0]) {
         case 'b':
             type = beginsym;
             break;
@@ -283,8 +451,13 @@ token_type reserved_type(char first_char, char second_char){
                 type = endsym;
             } else if (second_char == 'l') {
                 type = elsesym;
+            } else if (second_char == 'x') {
+                type = externsym;
             }
             break;
+        case 'f':
+            type = functionsym;
+            break;
         case 'i':
             type = ifsym;
             break;
@@ -295,7 +468,8 @@ token_type reserved_type(char first_char, char second_char){
             type = procsym;
             break;
         case 'r':
-            type = readsym;
+            // read and return share their first two letters
+            type = length == 4 ? readsym : returnsym;
             break;
         case 't':
             type = thensym;
@@ -318,8 +492,8 @@ void printtokens() {
     int i;
     printf("Lexeme Table:\n");
     printf("lexeme\t\ttoken type\n");
-    for (i = 0; i < lex_index; i++) {
-        switch (list[i].type) {
+    for (i = 0; i < stream->count; i++) {
+        switch (stream->types[i]) {
             case oddsym:
                 printf("%11s\t%d", "odd", oddsym);
                 break;
@@ -414,42 +588,56 @@ void printtokens() {
                 printf("%11s\t%d", "procedure", procsym);
                 break;
             case identsym:
-                printf("%11s\t%d", list[i].name, identsym);
+                printf("%11s\t%d", name_text(&stream->names, stream->values[i]), identsym);
                 break;
             case numbersym:
-                printf("%11d\t%d", list[i].value, numbersym);
+                printf("%11lld\t%d", (long long) stream->values[i], numbersym);
+                break;
+            case externsym:
+                printf("%11s\t%d", "extern", externsym);
+                break;
+            case functionsym:
+                printf("%11s\t%d", "function", functionsym);
+                break;
+            case returnsym:
+                printf("%11s\t%d", "return", returnsym);
+                break;
+            case lbracketsym:
+                printf("%11s\t%d", "[", lbracketsym);
+                break;
+            case rbracketsym:
+                printf("%11s\t%d", "]", rbracketsym);
                 break;
         }
         printf("\n");
     }
     printf("\n");
     printf("Token List:\n");
-    for (i = 0; i < lex_index; i++) {
-        if (list[i].type == numbersym)
-            printf("%d %d ", numbersym, list[i].value);
-        else if (list[i].type == identsym)
-            printf("%d %s ", identsym, list[i].name);
+    for (i = 0; i < stream->count; i++) {
+        if (stream->types[i] == numbersym)
+            printf("%d %lld ", numbersym, (long long) stream->values[i]);
+        else if (stream->types[i] == identsym)
+            printf("%d %s ", identsym, name_text(&stream->names, stream->values[i]));
         else
-            printf("%d ", list[i].type);
+            printf("%d ", stream->types[i]);
     }
     printf("\n");
-    list[lex_index++].type = -1;
 }
 
+// Reports the error and stops compiling, it doesn't return
 void printerror(int type) {
+    char *message;
     if (type == 1)
-        printf("Lexical Analyzer Error: Invalid Symbol\n");
+        message = "Lexical Analyzer Error: Invalid Symbol";
     else if (type == 2)
-        printf("Lexical Analyzer Error: Invalid Identifier\n");
+        message = "Lexical Analyzer Error: Invalid Identifier";
     else if (type == 3)
-        printf("Lexical Analyzer Error: Excessive Number Length\n");
-    else if (type == 4)
-        printf("Lexical Analyzer Error: Excessive Identifier Length\n");
+        message = "Lexical Analyzer Error: Number Too Large for the Word Size";
     else if (type == 5)
-        printf("Lexical Analyzer Error: Neverending Comment\n");
+        message = "Lexical Analyzer Error: Neverending Comment";
     else
-        printf("Implementation Error: Unrecognized Error Type\n");
+        message = "Implementation Error: Unrecognized Error Type";
 
-    free(list);
-    return;
+    lex_abort();
+    compile_error(message);
 }
\ No newline at end of file
@@ -0,0 +1,150 @@
+/*
+    Library Interface for PL/0
+    Author: Ryan Doherty
+
+    Compiles source text, or a file read a window at a time, into a
+    program handle for pl0.h. The lexer, parser and code generator keep
+    their state in globals, so compiles are serialized behind a lock.
+    Running programs needs no lock at all.
+
+    A lazy program keeps its parse to generate its procedures as they're
+    called (lazy.c), which takes the same lock.
+
+    Errors in the lexer and parser end in compile_error(). The command
+    line compiler prints them and exits like it always has, inside
+    pl0_compile() they jump back out and the compile returns NULL.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include "vm.h"
+
+_Static_assert(PL0_INT64 == MODE_INT64 && PL0_TRAP == MODE_TRAP && PL0_TIERED == MODE_TIERED &&
+                   PL0_LAZY == MODE_LAZY,
+               "pl0.h flags must match the machine modes");
+
+static pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set while pl0_compile() is running so errors return to it instead of exiting
+static jmp_buf *compile_recovery = NULL;
+static char compile_message[256];
+
+void compile_error(char *message) {
+    if (compile_recovery == NULL) {
+        printf("%s\n", message);
+        exit(0);
+    }
+    snprintf(compile_message, sizeof(compile_message), "%s", message);
+    longjmp(*compile_recovery, 1);
+}
+
+pl0_program *compile_source(source_reader read, void *context, int flags, pl0_incremental *session, char *error,
+                            int error_size);
+
+pl0_program *pl0_compile(const char *source, int flags, char *error, int error_size) {
+    char *cursor = (char *) source;
+    return compile_source(string_reader, &cursor, flags, NULL, error, error_size);
+}
+
+pl0_program *pl0_incremental_compile(pl0_incremental *session, const char *source, char *error, int error_size) {
+    char *cursor = (char *) source;
+    return compile_source(string_reader, &cursor, session->flags, session, error, error_size);
+}
+
+pl0_program *pl0_compile_file(const char *path, int flags, char *error, int error_size) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        if (error != NULL && error_size > 0) {
+            snprintf(error, error_size, "Can't open %s", path);
+        }
+        return NULL;
+    }
+    pl0_program *program = compile_source(file_reader, file, flags, NULL, error, error_size);
+    fclose(file);
+    return program;
+}
+
+// session is NULL unless it's an incremental compile
+pl0_program *compile_source(source_reader read, void *context, int flags, pl0_incremental *session, char *error,
+                            int error_size) {
+    jmp_buf recovery;
+    symbol *table = NULL;
+    int code_length;
+    pl0_program *program = NULL;
+    codegen_state *lazy = NULL;
+    // A lazy program is generated as it runs and can't be tiered as well
+    if (flags & MODE_LAZY) {
+        flags &= ~MODE_TIERED;
+    }
+
+    pthread_mutex_lock(&compile_lock);
+    compile_recovery = &recovery;
+    if (setjmp(recovery) == 0) {
+        // The parser pulls lexemes from the lexer as it needs them
+        lex_begin(read, context, flags);
+        table = parse();
+        token_stream *list = lex_finish();
+        instruction *code;
+        if (flags & MODE_LAZY && session == NULL) {
+            code = generate_lazy(list, table, &code_length, &lazy);
+        } else if (session == NULL) {
+            code = generate_code(list, table, &code_length, NULL, NULL);
+        } else {
+            session->blocks.hits = 0;
+            session->blocks.misses = 0;
+            code = generate_code(list, table, &code_length, &session->blocks, NULL);
+            memo_sweep(&session->blocks);
+        }
+        // A tiered program is optimized as it runs, where it's worth it, and
+        // a lazy one isn't (see lazy.c)
+        if (!(flags & MODE_TIERED) && lazy == NULL) {
+            code = inline_procedures(code, &code_length, DEFAULT_INLINE_THRESHOLD);
+            code = eliminate_dead_code(code, &code_length, flags);
+            if (session == NULL) {
+                code = optimize_ssa(code, &code_length, flags, 1);
+                code = optimize_loops(code, &code_length, flags);
+            } else {
+                code = incremental_ssa(session, code, &code_length, 1);
+                code = incremental_loops(session, code, &code_length);
+            }
+        }
+        // Programs can count on tail calls for their stack space, so they're always made
+        code = optimize_tail_calls(code, &code_length);
+        // Anything the compiler emits should verify, if not it's a compiler bug
+        const char *message;
+        program = program_from_code(code, code_length, flags, &message);
+        if (program == NULL) {
+            snprintf(compile_message, sizeof(compile_message), "Verifier Error: %s", message);
+            if (error != NULL && error_size > 0) {
+                snprintf(error, error_size, "%s", compile_message);
+            }
+        }
+        if (lazy != NULL && program != NULL) {
+            // The program keeps the tokens and symbols
+            program->lazy = lazy_create(current_version(program), lazy);
+        } else if (lazy != NULL) {
+            free_codegen_state(lazy);
+        } else {
+            free(table);
+            free_tokens(list);
+        }
+    } else {
+        // Each stage frees its own arrays before reporting an error, but a
+        // lexer error in the middle of parsing leaves the symbol table behind
+        parse_abort();
+        if (error != NULL && error_size > 0) {
+            snprintf(error, error_size, "%s", compile_message);
+        }
+    }
+    compile_recovery = NULL;
+    pthread_mutex_unlock(&compile_lock);
+    return program;
+}
+
+instruction *compile_procedure(codegen_state *codegen, int stub, int *length) {
+    pthread_mutex_lock(&compile_lock);
+    instruction *code = generate_procedure(codegen, stub, length);
+    pthread_mutex_unlock(&compile_lock);
+    return code;
+}
@@ -0,0 +1,500 @@
+/*
+    Loop Optimizer for PL/0
+    Author: Ryan Doherty
+
+    Rewrites the while loops in generated code. The code generator lowers
+        while <condition> do <statement>
+    to
+        L: <condition>; JPC exit; <statement>; JMP L; exit:
+    which this pass turns into
+        <condition>; JPC exit; <preheader>; B: <statement>; <inverted condition>; JPC B; exit:
+
+    - Rotation: the test moves to the bottom of the loop, which saves the
+      JMP on every iteration. JPC only jumps on false so the copied
+      condition uses the opposite relational operator.
+    - Invariant code motion: expressions that don't depend on anything the
+      loop stores are computed once in the preheader into a temporary in
+      the procedure's frame. Constant expressions are folded instead, and
+      loads from outer levels are hoisted to skip the static link walk.
+      Any call in the loop could store to any variable, so only constants
+      are moved out of loops that call procedures.
+    - Strength reduction: for a variable only changed by i := i + c, uses
+      of i * k are replaced by a temporary that is bumped by c * k right
+      after the store. This is only done when it saves instructions.
+
+    The preheader only runs once the loop's first test has passed and only
+    operations that can't fail are moved there (no division by a variable).
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "compiler.h"
+
+// Strength reduction costs 4 instructions per iteration to save 2 per use
+#define MIN_REDUCED_USES 3
+
+typedef struct expr_entry {
+    int start;
+    int end;
+    int invariant;
+    int constant;
+    int64_t value;
+    int has_op;
+} expr_entry;
+
+typedef struct induction_temp {
+    int store;
+    int temp;
+    int64_t step;
+    int64_t factor;
+} induction_temp;
+
+// The procedures optimize_loops() hands out to parallel_for()
+typedef struct loop_batch {
+    code_block *blocks;
+    int num_blocks;
+    int main_block;
+    int flags;
+} loop_batch;
+
+void optimize_batch_block(void *context, int item);
+int find_next_loop(instruction *code, int code_length);
+int loop_test(instruction *code, int head, int latch);
+instruction *rewrite_loop(instruction *code, int *code_length, int latch, int flags);
+int is_stored(instruction *code, int head, int latch, int l, int64_t m);
+int is_scaled_load(instruction *code, int index, instruction store, int64_t factor);
+
+instruction *optimize_loops(instruction *code, int *code_length, int flags) {
+    // Each procedure is rewritten on its own so the work grows with its size, not the
+    // program's, and big programs rewrite several at once
+    loop_batch batch;
+    batch.blocks = split_blocks(code, *code_length, &batch.num_blocks, &batch.main_block);
+    batch.flags = flags;
+    parallel_for(batch.num_blocks, parallel_threads(*code_length), optimize_batch_block, &batch);
+    free(code);
+    return link_blocks(batch.blocks, batch.num_blocks, batch.main_block, code_length);
+}
+
+void optimize_batch_block(void *context, int item) {
+    loop_batch *batch = context;
+    code_block *block = &batch->blocks[item];
+    if (block->is_procedure) {
+        block->code = optimize_block_loops(block->code, &block->length, batch->flags);
+    }
+}
+
+// Rewrites the loops in one procedure's block from split_blocks()
+instruction *optimize_block_loops(instruction *code, int *code_length, int flags) {
+    int latch = find_next_loop(code, *code_length);
+    while (latch != -1) {
+        code = rewrite_loop(code, code_length, latch, flags);
+        latch = find_next_loop(code, *code_length);
+    }
+    return code;
+}
+
+// Returns the backward JMP of the first (so innermost) loop we can rewrite or -1.
+// Rewritten loops end in a JPC so they are never found again.
+int find_next_loop(instruction *code, int code_length) {
+    for (int i = 0; i < code_length; ++i) {
+        if (code[i].opcode == JMP && code[i].m < i && code[i].m > 0 &&
+            loop_test(code, code[i].m, i) != -1) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Finds the loop's exit test. Conditions are straight line code, so it's the
+// first JPC after the head and it must jump just past the loop.
+// Returns -1 if the condition can't be inverted (odd).
+int loop_test(instruction *code, int head, int latch) {
+    int test = head;
+    while (test < latch && code[test].opcode != JPC) {
+        test++;
+    }
+    if (test == latch || test == head || code[test].m != latch + 1) {
+        return -1;
+    }
+    if (code[test - 1].opcode != OPR || inverted_relation(code[test - 1].m) == -1) {
+        return -1;
+    }
+    return test;
+}
+
+instruction *rewrite_loop(instruction *code, int *code_length, int latch, int flags) {
+    int length = *code_length;
+    int head = code[latch].m;
+    int test = loop_test(code, head, latch);
+    int region = latch - head;
+
+    // The block starts with the procedure's INC
+    int next_temp = code[0].m;
+
+    int has_call = 0;
+    for (int k = head; k < latch; ++k) {
+        if (code[k].opcode == CAL) {
+            has_call = 1;
+        }
+    }
+
+    // Each instruction in the loop may start a span that gets replaced by one instruction
+    int *replaced_length = calloc(region, sizeof(int));
+    instruction *replacement = malloc(region * sizeof(instruction));
+    induction_temp *inductions = malloc(region * sizeof(induction_temp));
+    int num_inductions = 0;
+
+    // Strength reduction: find stores of the form i := i + c / i := i - c.
+    // The temporary may overflow where i * k never would, so not when trapping.
+    for (int k = head + 3; k < latch && !has_call && !(flags & MODE_TRAP); ++k) {
+        if (code[k].opcode != STO || is_stored(code, head, latch, code[k].l, code[k].m) != 1) {
+            continue;
+        }
+        int l = code[k].l;
+        int64_t m = code[k].m;
+        if (code[k - 3].opcode != LOD || code[k - 3].l != l || code[k - 3].m != m || code[k - 2].opcode != LIT
+            || code[k - 1].opcode != OPR || (code[k - 1].m != 2 && code[k - 1].m != 3)) {
+            continue;
+        }
+        int64_t step = code[k - 1].m == 2 ? code[k - 2].m : -code[k - 2].m;
+
+        // Group the uses of i * factor by factor
+        for (int p = head; p + 2 < latch; ++p) {
+            if (replaced_length[p - head] || code[p + 2].opcode != OPR || code[p + 2].m != 4) {
+                continue;
+            }
+            int64_t factor;
+            if (code[p].opcode == LOD && code[p].l == l && code[p].m == m && code[p + 1].opcode == LIT) {
+                factor = code[p + 1].m;
+            } else if (code[p].opcode == LIT && code[p + 1].opcode == LOD && code[p + 1].l == l && code[p + 1].m == m) {
+                factor = code[p].m;
+            } else {
+                continue;
+            }
+
+            int uses = 0;
+            for (int q = p; q + 2 < latch; ++q) {
+                uses += is_scaled_load(code, q, code[k], factor);
+            }
+            if (uses < MIN_REDUCED_USES) {
+                continue;
+            }
+
+            int temp = next_temp++;
+            inductions[num_inductions].store = k;
+            inductions[num_inductions].temp = temp;
+            fold(4, step, factor, flags, &inductions[num_inductions].step);
+            inductions[num_inductions].factor = factor;
+            num_inductions++;
+            for (int q = p; q + 2 < latch; ++q) {
+                if (is_scaled_load(code, q, code[k], factor)) {
+                    replaced_length[q - head] = 3;
+                    replacement[q - head].opcode = LOD;
+                    replacement[q - head].l = 0;
+                    replacement[q - head].m = temp;
+                }
+            }
+        }
+    }
+
+    // Invariant code motion: simulate the operand stack to find the largest
+    // invariant subexpressions. Expressions never span a jump.
+    expr_entry *stack = malloc((region + 1) * sizeof(expr_entry));
+    int top = 0;
+    int *hoisted = malloc(region * sizeof(int));
+    int num_hoisted = 0;
+    int *hoisted_temp = malloc(region * sizeof(int));
+    for (int k = head; k < latch; ++k) {
+        instruction ir = code[k];
+        int pops = 0;
+        int finalize = 0;
+        expr_entry result = {k, k + 1, 0, 0, 0, 0};
+
+        if (replaced_length[k - head]) {
+            // Already strength reduced, depends on the induction variable
+            result.end = k + replaced_length[k - head];
+            stack[top++] = result;
+            k = result.end - 1;
+            continue;
+        }
+        switch (ir.opcode) {
+            case LIT:
+                result.invariant = 1;
+                result.constant = 1;
+                result.value = ir.m;
+                stack[top++] = result;
+                break;
+            case LOD:
+                result.invariant = !has_call && !is_stored(code, head, latch, ir.l, ir.m);
+                stack[top++] = result;
+                break;
+            case OPR:
+                if ((ir.m == 1 || ir.m == 6) && top >= 1) {
+                    // NEG and ODD
+                    result = stack[top - 1];
+                    result.end = k + 1;
+                    result.has_op = 1;
+                    if (ir.m == 6) {
+                        result.value = !(result.value % 2);
+                    } else if (!result.constant || !fold(3, 0, result.value, flags, &result.value)) {
+                        // Trapping negation can only be moved if it's folded without overflowing
+                        result.constant = 0;
+                        result.invariant = result.invariant && !(flags & MODE_TRAP);
+                    }
+                    stack[top - 1] = result;
+                } else if (ir.m >= 2 && ir.m <= 7 && top >= 2) {
+                    expr_entry left = stack[top - 2];
+                    expr_entry right = stack[top - 1];
+                    result.start = left.start;
+                    result.has_op = 1;
+                    result.invariant = left.invariant && right.invariant;
+                    result.constant = left.constant && right.constant;
+                    // Division can fail so it's only moved if the divisor is a nonzero constant
+                    if ((ir.m == 5 || ir.m == 7) && !(right.constant && right.value != 0 && right.value != -1)) {
+                        result.invariant = 0;
+                        result.constant = 0;
+                    }
+                    if (result.constant && !fold(ir.m, left.value, right.value, flags, &result.value)) {
+                        result.constant = 0;
+                    }
+                    // When overflow traps, moving arithmetic could trap where the loop wouldn't
+                    if (flags & MODE_TRAP && !result.constant) {
+                        result.invariant = 0;
+                    }
+                    if (!result.invariant) {
+                        pops = 2;
+                        finalize = 1;
+                    } else {
+                        top -= 2;
+                        stack[top++] = result;
+                    }
+                } else {
+                    // Relational operators are left for the loop test
+                    pops = top >= 2 ? 2 : top;
+                    finalize = 1;
+                }
+                break;
+            case STO:
+            case JPC:
+            case CHK:
+            case LODX:
+                // A checked index or an array element is never invariant,
+                // the loop could store to the array, but the index can be
+                pops = top >= 1 ? 1 : 0;
+                finalize = 1;
+                break;
+            case STOX:
+                pops = top >= 2 ? 2 : top;
+                finalize = 1;
+                break;
+            case SYS:
+                if (ir.m == 1 && top >= 1) {
+                    pops = 1;
+                    finalize = 1;
+                } else if (ir.m == 2) {
+                    stack[top++] = result;
+                }
+                break;
+            default:
+                // JMP/INC only happen between statements. A CAL takes its arguments
+                // and may leave a function's value, which is never invariant
+                top = 0;
+                break;
+        }
+        // A function inlined into an expression leaves the operands before its call
+        // under its stores, writes and branches. Joined with what comes after they'd
+        // span those, which can't be moved out of the loop.
+        if (ir.opcode == STO || ir.opcode == STOX || ir.opcode == SYS || ir.opcode == JPC) {
+            for (int e = 0; e < top - pops; ++e) {
+                stack[e].invariant = 0;
+            }
+        }
+        if (!finalize) {
+            continue;
+        }
+
+        // The popped entries are as large as they get, replace the worthwhile ones
+        for (int e = top - pops; e < top; ++e) {
+            expr_entry entry = stack[e];
+            int span = entry.end - entry.start;
+            int far_load = code[entry.start].opcode == LOD && code[entry.start].l > 0;
+            if (!entry.invariant || (!entry.has_op && !far_load)) {
+                continue;
+            }
+            replaced_length[entry.start - head] = span;
+            if (entry.constant) {
+                replacement[entry.start - head].opcode = LIT;
+                replacement[entry.start - head].l = 0;
+                replacement[entry.start - head].m = entry.value;
+                continue;
+            }
+            // Identical expressions share one temporary
+            int temp = -1;
+            for (int h = 0; h < num_hoisted && temp == -1; ++h) {
+                int other = hoisted[h];
+                int same = replaced_length[other - head] == span;
+                for (int s = 0; s < span && same; ++s) {
+                    same = code[other + s].opcode == code[entry.start + s].opcode
+                           && code[other + s].l == code[entry.start + s].l
+                           && code[other + s].m == code[entry.start + s].m;
+                }
+                if (same) {
+                    temp = hoisted_temp[h];
+                }
+            }
+            if (temp == -1) {
+                temp = next_temp++;
+                hoisted[num_hoisted] = entry.start;
+                hoisted_temp[num_hoisted] = temp;
+                num_hoisted++;
+            }
+            replacement[entry.start - head].opcode = LOD;
+            replacement[entry.start - head].l = 0;
+            replacement[entry.start - head].m = temp;
+        }
+        top -= pops;
+        if ((ir.opcode == OPR && ir.m >= 2 && ir.m <= 7 && pops == 2) || ir.opcode == CHK || ir.opcode == LODX) {
+            stack[top++] = result;
+        }
+    }
+
+    // Lay the new code out. Jumps keep their old targets until the end
+    // unless they point at code that only exists in the new layout.
+    int new_capacity = length + 3 * region + 8 * num_inductions + 2;
+    instruction *new_code = malloc(new_capacity * sizeof(instruction));
+    int *resolved = calloc(new_capacity, sizeof(int));
+    int *map = malloc((length + 1) * sizeof(int));
+    int index = 0;
+    for (int i = 0; i < head; ++i) {
+        map[i] = index;
+        new_code[index++] = code[i];
+    }
+    // The first test, unchanged
+    for (int k = head; k <= test; ++k) {
+        map[k] = index;
+        new_code[index++] = code[k];
+    }
+    // Preheader
+    for (int h = 0; h < num_hoisted; ++h) {
+        for (int s = 0; s < replaced_length[hoisted[h] - head]; ++s) {
+            new_code[index++] = code[hoisted[h] + s];
+        }
+        new_code[index++] = (instruction) {STO, 0, hoisted_temp[h]};
+    }
+    for (int n = 0; n < num_inductions; ++n) {
+        int store = inductions[n].store;
+        new_code[index++] = (instruction) {LOD, code[store].l, code[store].m};
+        new_code[index++] = (instruction) {LIT, 0, inductions[n].factor};
+        new_code[index++] = (instruction) {OPR, 0, 4};
+        new_code[index++] = (instruction) {STO, 0, inductions[n].temp};
+    }
+    // Body
+    int body = index;
+    for (int k = test + 1; k < latch; ++k) {
+        map[k] = index;
+        if (replaced_length[k - head]) {
+            for (int s = 1; s < replaced_length[k - head]; ++s) {
+                map[k + s] = index;
+            }
+            new_code[index++] = replacement[k - head];
+            k += replaced_length[k - head] - 1;
+            continue;
+        }
+        new_code[index++] = code[k];
+        for (int n = 0; n < num_inductions; ++n) {
+            if (inductions[n].store == k) {
+                new_code[index++] = (instruction) {LOD, 0, inductions[n].temp};
+                new_code[index++] = (instruction) {LIT, 0, inductions[n].step};
+                new_code[index++] = (instruction) {OPR, 0, 2};
+                new_code[index++] = (instruction) {STO, 0, inductions[n].temp};
+            }
+        }
+    }
+    // Bottom test jumps back to the body while the condition holds
+    map[latch] = index;
+    for (int k = head; k < test; ++k) {
+        if (replaced_length[k - head]) {
+            new_code[index++] = replacement[k - head];
+            k += replaced_length[k - head] - 1;
+        } else {
+            new_code[index++] = code[k];
+        }
+    }
+    new_code[index - 1].m = inverted_relation(new_code[index - 1].m);
+    resolved[index] = 1;
+    new_code[index++] = (instruction) {JPC, 0, body};
+    for (int i = latch + 1; i < length; ++i) {
+        map[i] = index;
+        new_code[index++] = code[i];
+    }
+    map[length] = index;
+
+    for (int i = 0; i < index; ++i) {
+        int op = new_code[i].opcode;
+        if (!resolved[i] && (op == JMP || op == JPC)) {
+            new_code[i].m = map[new_code[i].m];
+        }
+    }
+    // Make room for the temporaries
+    new_code[0].m = next_temp;
+
+    *code_length = index;
+    free(replaced_length);
+    free(replacement);
+    free(inductions);
+    free(stack);
+    free(hoisted);
+    free(hoisted_temp);
+    free(resolved);
+    free(map);
+    free(code);
+    return new_code;
+}
+
+// Returns how many times the loop stores to the variable at level l offset m
+int is_stored(instruction *code, int head, int latch, int l, int64_t m) {
+    int stores = 0;
+    for (int k = head; k < latch; ++k) {
+        if (code[k].opcode == STO && code[k].l == l && code[k].m == m) {
+            stores++;
+        }
+    }
+    return stores;
+}
+
+// Checks for LOD i; LIT factor; MUL or LIT factor; LOD i; MUL at index
+// where i is the variable written by store
+int is_scaled_load(instruction *code, int index, instruction store, int64_t factor) {
+    instruction first = code[index];
+    instruction second = code[index + 1];
+    if (code[index + 2].opcode != OPR || code[index + 2].m != 4) {
+        return 0;
+    }
+    if (first.opcode == LIT) {
+        instruction swap = first;
+        first = second;
+        second = swap;
+    }
+    return first.opcode == LOD && first.l == store.l && first.m == store.m
+           && second.opcode == LIT && second.m == factor;
+}
+
+// Returns the relational OPR that is true exactly when op is false or -1
+int inverted_relation(int op) {
+    switch (op) {
+        case 8:
+            return 9;
+        case 9:
+            return 8;
+        case 10:
+            return 13;
+        case 13:
+            return 10;
+        case 11:
+            return 12;
+        case 12:
+            return 11;
+        default:
+            return -1;
+    }
+}
@@ -0,0 +1,439 @@
+/*
+    Object Modules and Linker for PL/0
+    Author: Ryan Doherty
+
+    Lets a program be split over several files that are compiled on their
+    own and linked together afterwards, so a library only has to be
+    compiled once however many programs use it.
+
+    A module is an ordinary PL/0 program that can start with extern
+    declarations for globals and procedures another module defines:
+
+        extern var total;
+        extern procedure sort, print;
+
+    extern procedure and extern function give the number of parameters
+    the same way a declaration does, extern function square(x), and the
+    linker makes sure the procedure it finds agrees.
+
+    Every global and procedure declared at the top of a module is exported.
+    Constants aren't, they're only known at compile time, and neither are
+    arrays, since an extern var is a single word. A module is
+    compiled like a whole program except that every instruction the linker
+    has to change gets a relocation: jumps and calls to its own code, its
+    globals, and the externs, which are left as 0 until the linker finds
+    the module that exports them.
+
+    Linking lays out every module's procedures one after another and puts
+    all of their globals in main's frame, each module's after the last.
+    The modules' main statements run one after the other in link order,
+    so libraries that set up their globals go before the program using them.
+    The result is an ordinary program. It's verified straight away because
+    an object file could hold anything, then optimized like any other.
+
+    Names are kept once per module in its name table and the relocations
+    and exports refer to them by index, so they can be any length.
+
+    Layout (in host byte order):
+    header: magic | format version | mode flags | instruction count |
+            global count | relocation count | export count | name count (32-bit each)
+    then the instructions encoded like bytecode,
+    the names: length (32-bit) | its characters,
+    the relocations: index | kind | name or -1 | parameters | returns (32-bit each),
+    and the exports: name | kind (32-bit each) | value (64-bit)
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "vm.h"
+
+#define OBJECT_MAGIC 0x4f304c50 // "PL0O"
+#define OBJECT_VERSION 4
+
+int valid_object(object_module *module);
+int linked_index(object_module *module, int code_base, int main_base, int index);
+call_signature exported_signature(object_module *module, int start);
+int find_export(module_export **exports, name_index *names, int name, int kind);
+int read_names(FILE *file, object_module *module, int count, long remaining);
+void link_error(char *error, int error_size, const char *format, char *name);
+
+// Compiles a parsed module, the tokens and symbols are still the caller's to free
+object_module *compile_object(token_stream *tokens, symbol *symbols, int flags) {
+    object_module *module = calloc(1, sizeof(object_module));
+    module->flags = flags;
+    // The same names in the same order, so the symbols' indexes still work
+    for (int name = 0; name < tokens->names.count; ++name) {
+        char *text = name_text(&tokens->names, name);
+        intern_name(&module->names, text, strlen(text));
+    }
+    module->code = generate_code(tokens, symbols, &module->code_length, NULL, module);
+    // Jumps are all inside the module, the code generator noted everything else.
+    // The jump to main at 0 is replaced when linking.
+    for (int i = 1; i < module->code_length; ++i) {
+        if (module->code[i].opcode == JMP || module->code[i].opcode == JPC) {
+            add_relocation(module, i, RELOC_CODE, -1);
+        }
+    }
+    module->num_globals = (int) module->code[module->code[0].m].m - 3;
+
+    int num_symbols = 0;
+    while (symbols[num_symbols].kind != 0) {
+        num_symbols++;
+    }
+    module->exports = calloc(num_symbols + 1, sizeof(module_export));
+    // Main is symbol 0 and isn't exported
+    for (int i = 1; i < num_symbols; ++i) {
+        symbol *declared = &symbols[i];
+        if (declared->level != 0 || declared->external || declared->kind == 1 || declared->length > 0) {
+            continue;
+        }
+        module_export *exported = &module->exports[module->num_exports++];
+        exported->name = declared->name;
+        exported->kind = declared->kind;
+        exported->value = declared->kind == 2 ? declared->addr : declared->val;
+    }
+    return module;
+}
+
+relocation *add_relocation(object_module *module, int index, int kind, int name) {
+    if (module->num_relocations == module->relocation_capacity) {
+        module->relocation_capacity = module->relocation_capacity == 0 ? 64 : 2 * module->relocation_capacity;
+        module->relocations = realloc(module->relocations, module->relocation_capacity * sizeof(relocation));
+    }
+    relocation *added = &module->relocations[module->num_relocations++];
+    added->index = index;
+    added->kind = kind;
+    added->name = name;
+    added->call = (call_signature) {0, 0};
+    return added;
+}
+
+void free_object(object_module *module) {
+    if (module == NULL) {
+        return;
+    }
+    free(module->code);
+    free(module->relocations);
+    free(module->exports);
+    name_table_free(&module->names);
+    free(module);
+}
+
+// Checks the magic number and leaves the file where it was
+int is_object_file(FILE *file) {
+    int32_t magic = 0;
+    long position = ftell(file);
+    size_t count = fread(&magic, sizeof(int32_t), 1, file);
+    fseek(file, position, SEEK_SET);
+    return count == 1 && magic == OBJECT_MAGIC;
+}
+
+int write_object(FILE *file, object_module *module) {
+    int32_t header[8] = {OBJECT_MAGIC, OBJECT_VERSION, module->flags, module->code_length, module->num_globals,
+                         module->num_relocations, module->num_exports, module->names.count};
+    if (fwrite(header, sizeof(int32_t), 8, file) != 8 || !write_instructions(file, module->code, module->code_length)) {
+        return 0;
+    }
+    for (int i = 0; i < module->names.count; ++i) {
+        char *text = name_text(&module->names, i);
+        int32_t length = strlen(text);
+        if (fwrite(&length, sizeof(int32_t), 1, file) != 1 || fwrite(text, 1, length, file) != (size_t) length) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < module->num_relocations; ++i) {
+        relocation *written = &module->relocations[i];
+        int32_t fields[5] = {written->index, written->kind, written->name, written->call.params, written->call.returns};
+        if (fwrite(fields, sizeof(int32_t), 5, file) != 5) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < module->num_exports; ++i) {
+        int32_t fields[2] = {module->exports[i].name, module->exports[i].kind};
+        int64_t value = module->exports[i].value;
+        if (fwrite(fields, sizeof(int32_t), 2, file) != 2 || fwrite(&value, sizeof(int64_t), 1, file) != 1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Returns NULL if the file isn't an object module we could link
+object_module *read_object(FILE *file) {
+    int32_t header[8];
+    if (fread(header, sizeof(int32_t), 8, file) != 8) {
+        return NULL;
+    }
+    if (header[0] != OBJECT_MAGIC || header[1] != OBJECT_VERSION || header[3] < 0 || header[5] < 0 ||
+        header[6] < 0 || header[7] < 0) {
+        return NULL;
+    }
+    // Don't trust the counts with an allocation until the file is known to be that long
+    long start = ftell(file);
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, start, SEEK_SET);
+    if (16 * (int64_t) header[3] + 20 * (int64_t) header[5] + 16 * (int64_t) header[6] + 4 * (int64_t) header[7] >
+        size - start) {
+        return NULL;
+    }
+    object_module *module = calloc(1, sizeof(object_module));
+    module->flags = header[2];
+    module->code_length = header[3];
+    module->num_globals = header[4];
+    module->code = malloc((header[3] + 1) * sizeof(instruction));
+    module->relocations = malloc((header[5] + 1) * sizeof(relocation));
+    module->relocation_capacity = header[5] + 1;
+    module->exports = malloc((header[6] + 1) * sizeof(module_export));
+    int ok = read_instructions(file, module->code, header[3]) && read_names(file, module, header[7], size - start);
+    for (int i = 0; i < header[5] && ok; ++i) {
+        int32_t fields[5] = {0, 0, 0, 0, 0};
+        relocation *read = &module->relocations[i];
+        ok = fread(fields, sizeof(int32_t), 5, file) == 5;
+        read->index = fields[0];
+        read->kind = fields[1];
+        read->name = fields[2];
+        read->call = (call_signature) {fields[3], fields[4]};
+        module->num_relocations++;
+    }
+    for (int i = 0; i < header[6] && ok; ++i) {
+        int32_t fields[2] = {0, 0};
+        module_export *read = &module->exports[i];
+        ok = fread(fields, sizeof(int32_t), 2, file) == 2 && fread(&read->value, sizeof(int64_t), 1, file) == 1;
+        read->name = fields[0];
+        read->kind = fields[1];
+        module->num_exports++;
+    }
+    if (!ok || !valid_object(module)) {
+        free_object(module);
+        return NULL;
+    }
+    return module;
+}
+
+// Reads count names into the module's table, they have to all be different
+// and can't be longer than what's left of the file
+int read_names(FILE *file, object_module *module, int count, long remaining) {
+    char *text = NULL;
+    int ok = 1;
+    for (int i = 0; i < count && ok; ++i) {
+        int32_t length = 0;
+        ok = fread(&length, sizeof(int32_t), 1, file) == 1 && length > 0 && length <= remaining;
+        if (ok) {
+            text = realloc(text, length);
+            ok = fread(text, 1, length, file) == (size_t) length && memchr(text, '\0', length) == NULL &&
+                 intern_name(&module->names, text, length) == i;
+        }
+    }
+    free(text);
+    return ok;
+}
+
+// The linker relies on a module looking like the code generator made it:
+// a jump to main, then the procedures, then main from its INC to the halt
+int valid_object(object_module *module) {
+    instruction *code = module->code;
+    int length = module->code_length;
+    if (length < 3 || code[0].opcode != JMP || code[0].m < 1 || code[0].m >= length - 1) {
+        return 0;
+    }
+    int main_start = (int) code[0].m;
+    if (code[main_start].opcode != INC || code[main_start].m != module->num_globals + 3 || module->num_globals < 0 ||
+        code[length - 1].opcode != SYS || code[length - 1].m != 3) {
+        return 0;
+    }
+    for (int i = 0; i < module->num_relocations; ++i) {
+        relocation *r = &module->relocations[i];
+        if (r->index < 0 || r->index >= length || r->kind < RELOC_CODE || r->kind > RELOC_EXTERN_PROC ||
+            r->name < -1 || r->name >= module->names.count) {
+            return 0;
+        }
+        if ((r->kind == RELOC_EXTERN_VAR || r->kind == RELOC_EXTERN_PROC) && r->name == -1) {
+            return 0;
+        }
+        int64_t m = code[r->index].m;
+        if (r->kind == RELOC_CODE && (m < 1 || m >= length || m == main_start)) {
+            return 0;
+        }
+        if (r->kind == RELOC_GLOBAL && (m < 3 || m >= module->num_globals + 3)) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < module->num_exports; ++i) {
+        module_export *e = &module->exports[i];
+        if (e->name < 0 || e->name >= module->names.count) {
+            return 0;
+        }
+        if ((e->kind == 2 && (e->value < 3 || e->value >= module->num_globals + 3)) ||
+            (e->kind == 3 && (e->value < 1 || e->value >= main_start)) || (e->kind != 2 && e->kind != 3)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Links the modules into one program, or returns NULL and puts the reason in error
+instruction *link_modules(object_module **modules, int num_modules, int *code_length, char *error, int error_size) {
+    // Where each module's procedures, main statement and globals go
+    int *code_base = malloc(num_modules * sizeof(int));
+    int *main_base = malloc(num_modules * sizeof(int));
+    int *global_base = malloc(num_modules * sizeof(int));
+    int length = 1;
+    int num_globals = 0;
+    int num_exports = 0;
+    for (int k = 0; k < num_modules; ++k) {
+        code_base[k] = length;
+        length += modules[k]->code[0].m - 1;
+        global_base[k] = 3 + num_globals;
+        num_globals += modules[k]->num_globals;
+        num_exports += modules[k]->num_exports;
+    }
+    // Then main's INC and every module's main statement without its own INC and halt
+    int main_start = length++;
+    for (int k = 0; k < num_modules; ++k) {
+        main_base[k] = length;
+        length += modules[k]->code_length - modules[k]->code[0].m - 2;
+    }
+    int halt = length++;
+
+    // Every module's exports, looked up by name. Each module numbers its names
+    // itself so they're put in one table for all of them.
+    module_export **exports = malloc((num_exports + 1) * sizeof(module_export *));
+    int *owners = malloc((num_exports + 1) * sizeof(int));
+    name_table export_names;
+    name_table_init(&export_names);
+    name_index names;
+    name_index_init(&names);
+    int count = 0;
+    int ok = 1;
+    for (int k = 0; k < num_modules && ok; ++k) {
+        for (int i = 0; i < modules[k]->num_exports && ok; ++i) {
+            module_export *exported = &modules[k]->exports[i];
+            char *text = name_text(&modules[k]->names, exported->name);
+            int name = intern_name(&export_names, text, strlen(text));
+            if (find_export(exports, &names, name, exported->kind) != -1) {
+                link_error(error, error_size, "Linker Error: %s Is Defined More Than Once", text);
+                ok = 0;
+            } else {
+                exports[count] = exported;
+                owners[count] = k;
+                name_index_add(&names, name, count++);
+            }
+        }
+    }
+
+    instruction *code = malloc((length + 1) * sizeof(instruction));
+    code[0] = (instruction) {JMP, 0, main_start};
+    code[main_start] = (instruction) {INC, 0, num_globals + 3};
+    code[halt] = (instruction) {SYS, 0, 3};
+    for (int k = 0; k < num_modules && ok; ++k) {
+        object_module *module = modules[k];
+        int module_main = (int) module->code[0].m;
+        int module_halt = module->code_length - 1;
+        for (int i = 1; i < module_halt; ++i) {
+            if (i != module_main) {
+                code[linked_index(module, code_base[k], main_base[k], i)] = module->code[i];
+            }
+        }
+        // The module's halt becomes the start of the next module's main statement
+        int next_main = k + 1 < num_modules ? main_base[k + 1] : halt;
+        for (int r = 0; r < module->num_relocations && ok; ++r) {
+            relocation *fix = &module->relocations[r];
+            // Its jump to main, main's INC and the halt were replaced
+            if (fix->index == 0 || fix->index == module_main || fix->index == module_halt) {
+                continue;
+            }
+            instruction *linked = &code[linked_index(module, code_base[k], main_base[k], fix->index)];
+            if (fix->kind == RELOC_CODE) {
+                int target = (int) linked->m;
+                linked->m = target == module_halt ? next_main
+                                                  : linked_index(module, code_base[k], main_base[k], target);
+            } else if (fix->kind == RELOC_GLOBAL) {
+                linked->m += global_base[k] - 3;
+            } else {
+                int kind = fix->kind == RELOC_EXTERN_VAR ? 2 : 3;
+                char *text = name_text(&module->names, fix->name);
+                int found = find_export(exports, &names, find_name(&export_names, text), kind);
+                if (found == -1) {
+                    link_error(error, error_size, "Linker Error: Undefined Symbol %s", text);
+                    ok = 0;
+                } else if (kind == 2) {
+                    linked->m = exports[found]->value - 3 + global_base[owners[found]];
+                } else {
+                    int owner = owners[found];
+                    call_signature call = exported_signature(modules[owner], (int) exports[found]->value);
+                    if (call.params != fix->call.params || call.returns != fix->call.returns) {
+                        link_error(error, error_size, "Linker Error: Extern %s Doesn't Match Its Definition", text);
+                        ok = 0;
+                    }
+                    linked->m = linked_index(modules[owner], code_base[owner], main_base[owner],
+                                             (int) exports[found]->value);
+                }
+            }
+        }
+    }
+    // A module only has to look right to be linked, its instructions could
+    // still be anything. The optimizer trusts what it's given, so check now.
+    if (ok) {
+        verified_code verified;
+        const char *message;
+        verified.depths = malloc(length * sizeof(int));
+        verified.procedure = malloc(length * sizeof(int));
+        verified.parent = malloc(length * sizeof(int));
+        if (!verify_program(code, length, NULL, 0, VM_STACK_SIZE, &verified, &message)) {
+            link_error(error, error_size, "Verifier Error: %s", (char *) message);
+            ok = 0;
+        }
+        free(verified.depths);
+        free(verified.procedure);
+        free(verified.parent);
+    }
+    if (!ok) {
+        free(code);
+        code = NULL;
+    }
+    *code_length = length;
+
+    name_index_free(&names);
+    name_table_free(&export_names);
+    free(exports);
+    free(owners);
+    free(code_base);
+    free(main_base);
+    free(global_base);
+    return code;
+}
+
+// Where instruction index of a module ends up, procedures and main statement are moved separately
+int linked_index(object_module *module, int code_base, int main_base, int index) {
+    int module_main = (int) module->code[0].m;
+    return index < module_main ? code_base + index - 1 : main_base + index - module_main - 1;
+}
+
+// The parameters and return of the module's procedure starting at start,
+// which ends at its first return like find_procedures() has it
+call_signature exported_signature(object_module *module, int start) {
+    instruction *code = module->code;
+    int end = start;
+    while (end < module->code_length - 1 && !(code[end].opcode == OPR && (code[end].m == 0 || code[end].m == 14))) {
+        end++;
+    }
+    return procedure_signature(code, (procedure) {start, end});
+}
+
+// Returns the export with this name and kind or -1
+int find_export(module_export **exports, name_index *names, int name, int kind) {
+    for (int i = name_index_first(names, name); i != -1; i = names->next[i]) {
+        if (exports[i]->kind == kind) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void link_error(char *error, int error_size, const char *format, char *name) {
+    if (error != NULL && error_size > 0) {
+        snprintf(error, error_size, format, name);
+    }
+}
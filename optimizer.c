@@ -0,0 +1,216 @@
+/*
+    Optimizer Utilities for PL/0
+    Author: Ryan Doherty
+
+    Helpers shared by the passes that rewrite generated code.
+    The code generator emits every procedure as one contiguous run of
+    instructions starting with its INC, so procedures can be recovered
+    from the instruction array alone (including code loaded from the cache).
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include "compiler.h"
+
+int compare_ints(const void *a, const void *b);
+
+// Fills procs with every procedure reachable through CAL or TCL sorted by start index.
+// procs needs room for code_length entries. Returns the number found.
+int find_procedures(instruction *code, int code_length, procedure *procs) {
+    return find_base_procedures(code, code_length, code_length, procs);
+}
+
+// Same for the first base_length instructions of code with copies after them
+// (see procedure_copy), counting the calls the copies make too
+int find_base_procedures(instruction *code, int base_length, int code_length, procedure *procs) {
+    int *starts = malloc((code_length + 1) * sizeof(int));
+    int num_starts = 0;
+    // Main's start is the target of the first jump
+    starts[num_starts++] = code[0].m;
+    for (int i = 0; i < code_length; ++i) {
+        if ((code[i].opcode == CAL || code[i].opcode == TCL) && code[i].m < base_length) {
+            starts[num_starts++] = code[i].m;
+        }
+    }
+    qsort(starts, num_starts, sizeof(int), compare_ints);
+
+    int num_procs = 0;
+    for (int i = 0; i < num_starts; ++i) {
+        if (num_procs > 0 && procs[num_procs - 1].start == starts[i]) {
+            continue;
+        }
+        procs[num_procs].start = starts[i];
+        // Main ends at the halt, every other procedure at its return (RTV for a function)
+        if (starts[i] == code[0].m) {
+            procs[num_procs].end = base_length - 1;
+        } else {
+            int end = starts[i];
+            while (end < base_length - 1 && !(code[end].opcode == OPR && (code[end].m == 0 || code[end].m == 14))) {
+                end++;
+            }
+            procs[num_procs].end = end;
+        }
+        num_procs++;
+    }
+    free(starts);
+    return num_procs;
+}
+
+// How many arguments a procedure takes, from its INC, and whether it's a
+// function, which ends by returning a value with RTV
+call_signature procedure_signature(instruction *code, procedure proc) {
+    call_signature signature = {0, 0};
+    if (code[proc.start].opcode == INC) {
+        signature.params = code[proc.start].l;
+    }
+    signature.returns = code[proc.end].opcode == OPR && code[proc.end].m == 14;
+    return signature;
+}
+
+// Returns the index of the procedure whose code contains the given instruction or -1
+int procedure_containing(procedure *procs, int num_procs, int index) {
+    // find_procedures() sorts them by start, so look for the last one starting at or before index
+    int low = 0;
+    int high = num_procs - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (procs[middle].start <= index) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    if (num_procs > 0 && procs[low].start <= index && index <= procs[low].end) {
+        return low;
+    }
+    return -1;
+}
+
+// How many slots from its M the LODX or STOX at index can reach: the length
+// the CHK in front of it allows or one past the constant index it's given.
+// 0 if neither is in front, which the verifier doesn't let through.
+int indexed_extent(instruction *code, int index) {
+    instruction before = code[index - 1];
+    if (before.opcode == CHK && before.m >= 1) {
+        return before.m > INT32_MAX ? INT32_MAX : (int) before.m;
+    }
+    if (before.opcode == LIT && before.m >= 0 && before.m < INT32_MAX) {
+        return (int) before.m + 1;
+    }
+    return 0;
+}
+
+// Evaluates an arithmetic OPR (ADD, SUB, MUL, DIV, MOD) at compile time the way
+// the machine would for the given mode flags. Returns 0 if it can't be folded
+// because it divides by zero or overflows when the machine traps.
+int fold(int op, int64_t a, int64_t b, int flags, int64_t *result) {
+    int64_t value;
+    int overflow = 0;
+    switch (op) {
+        case 2:
+            overflow = __builtin_add_overflow(a, b, &value);
+            break;
+        case 3:
+            overflow = __builtin_sub_overflow(a, b, &value);
+            break;
+        case 4:
+            overflow = __builtin_mul_overflow(a, b, &value);
+            break;
+        case 5:
+        case 7:
+            if (b == 0 || (b == -1 && a == INT64_MIN)) {
+                return 0;
+            }
+            value = op == 5 ? a / b : a % b;
+            break;
+        default:
+            return 0;
+    }
+    if (!(flags & MODE_INT64)) {
+        overflow = overflow || value != (int32_t) value;
+        value = (int32_t) value;
+    }
+    if (overflow && flags & MODE_TRAP) {
+        return 0;
+    }
+    *result = value;
+    return 1;
+}
+
+int compare_ints(const void *a, const void *b) {
+    return *(int *) a - *(int *) b;
+}
+
+// Splits the program into blocks that can be rewritten on their own and put
+// back together with link_blocks(). Every procedure becomes a block and any
+// code between them (procedures nothing calls) is kept as blocks that aren't
+// procedures. Jump targets are made relative to the block's first instruction
+// and a CAL's m is the index of the block it calls.
+// code[0] isn't in any block, main_block is the block it jumps to.
+code_block *split_blocks(instruction *code, int code_length, int *num_blocks, int *main_block) {
+    procedure *procs = malloc(code_length * sizeof(procedure));
+    int num_procs = find_procedures(code, code_length, procs);
+    code_block *blocks = malloc((2 * num_procs + 1) * sizeof(code_block));
+    // The block each procedure start begins, for calls
+    int *block_at = malloc(code_length * sizeof(int));
+    int count = 0;
+    int next = 1;
+    for (int p = 0; p <= num_procs; ++p) {
+        int start = p < num_procs ? procs[p].start : code_length;
+        if (next < start) {
+            blocks[count++] = (code_block) {NULL, next, start - next, 0};
+        }
+        if (p < num_procs) {
+            block_at[procs[p].start] = count;
+            blocks[count++] = (code_block) {NULL, procs[p].start, procs[p].end - procs[p].start + 1, 1};
+            next = procs[p].end + 1;
+        }
+    }
+
+    for (int b = 0; b < count; ++b) {
+        int start = blocks[b].start;
+        blocks[b].code = malloc(blocks[b].length * sizeof(instruction));
+        for (int i = 0; i < blocks[b].length; ++i) {
+            instruction ir = code[start + i];
+            if (ir.opcode == JMP || ir.opcode == JPC) {
+                ir.m -= start;
+            } else if (ir.opcode == CAL || ir.opcode == TCL) {
+                ir.m = block_at[ir.m];
+            }
+            blocks[b].code[i] = ir;
+        }
+    }
+    *main_block = block_at[code[0].m];
+    *num_blocks = count;
+    free(procs);
+    free(block_at);
+    return blocks;
+}
+
+// Lays the blocks out one after another behind a jump to main_block and turns
+// their relative jumps and block calls back into instruction addresses.
+// The blocks are freed.
+instruction *link_blocks(code_block *blocks, int num_blocks, int main_block, int *code_length) {
+    int length = 1;
+    for (int b = 0; b < num_blocks; ++b) {
+        blocks[b].start = length;
+        length += blocks[b].length;
+    }
+    instruction *code = malloc((length + 1) * sizeof(instruction));
+    code[0] = (instruction) {JMP, 0, blocks[main_block].start};
+    for (int b = 0; b < num_blocks; ++b) {
+        int start = blocks[b].start;
+        for (int i = 0; i < blocks[b].length; ++i) {
+            instruction ir = blocks[b].code[i];
+            if (ir.opcode == JMP || ir.opcode == JPC) {
+                ir.m += start;
+            } else if (ir.opcode == CAL || ir.opcode == TCL) {
+                ir.m = blocks[ir.m].start;
+            }
+            code[start + i] = ir;
+        }
+        free(blocks[b].code);
+    }
+    free(blocks);
+    *code_length = length;
+    return code;
+}
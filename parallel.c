@@ -0,0 +1,80 @@
+/*
+    Parallel Compilation for PL/0
+    Author: Ryan Doherty
+
+    Procedures are generated and optimized on their own, so big programs
+    spread that work over several threads. Each pass hands parallel_for()
+    a list of items (one per procedure) and the workers take the next item
+    off a shared counter until there are none left. The calling thread
+    works through the list too, and small programs never start a thread.
+
+    Items have to be independent: every item writes only its own results
+    and the caller puts them together in order afterwards, so the code
+    comes out the same however many threads there are.
+*/
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "compiler.h"
+
+// Starting a thread costs about as much as generating a few thousand
+// instructions, so each one needs at least this much work (tokens or instructions)
+#define MIN_WORK_PER_THREAD 20000
+
+typedef struct parallel_batch {
+    void (*work)(void *context, int item);
+    void *context;
+    int count;
+    atomic_int next;
+} parallel_batch;
+
+// 0 until set_compile_threads() is called, which means one per core
+static atomic_int compile_threads = 0;
+
+void *parallel_worker(void *argument);
+
+void set_compile_threads(int threads) {
+    atomic_store(&compile_threads, threads < 0 ? 0 : threads);
+}
+
+// How many threads are worth using for work of the given size
+int parallel_threads(long work) {
+    long threads = atomic_load(&compile_threads);
+    if (threads == 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > work / MIN_WORK_PER_THREAD) {
+        threads = work / MIN_WORK_PER_THREAD;
+    }
+    return threads < 1 ? 1 : (int) threads;
+}
+
+// Calls work(context, item) for every item from 0 to count - 1 on up to
+// threads threads and returns once they're all done
+void parallel_for(int count, int threads, void (*work)(void *context, int item), void *context) {
+    parallel_batch batch = {work, context, count, 0};
+    if (threads > count) {
+        threads = count;
+    }
+    pthread_t *workers = malloc((threads > 1 ? threads - 1 : 1) * sizeof(pthread_t));
+    int started = 0;
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, parallel_worker, &batch) == 0) {
+        started++;
+    }
+    // If a thread couldn't be started the others just take more items
+    parallel_worker(&batch);
+    for (int i = 0; i < started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+}
+
+void *parallel_worker(void *argument) {
+    parallel_batch *batch = argument;
+    int item;
+    while ((item = atomic_fetch_add(&batch->next, 1)) < batch->count) {
+        batch->work(batch->context, item);
+    }
+    return NULL;
+}
@@ -2,8 +2,8 @@
     Parser for PL/0
     Author: Ryan Doherty
 
-    This program accepts input from the lexer in the
-    form of a lexeme array and checks the grammar of the
+    This program pulls lexemes from the lexer as it
+    needs them and checks the grammar of the
     file given to the lexer against the given grammar for
     PL/0 and creates a symbol table.
 */
@@ -13,99 +13,158 @@
 #include <stdbool.h>
 #include "compiler.h"
 
+// Longest array a var declaration can have
+#define MAX_ARRAY_LENGTH 65536
+
 symbol *table;
+int table_capacity;
+name_index parser_names;
 int parser_sym_index;
 int error;
-lexeme *parser_token_list;
 lexeme token;
-int parser_token_index = 0;
 int parser_level = 0;
 int level_current_addr = 3;
+// The procedure whose block is being parsed, 0 for main
+int parser_proc = 0;
 
 void printtable();
-void errorend(int x);
+char *errorend(int x);
 lexeme get_next_token();
-void add_to_sym_table(token_type type, char *name, int parameter);
-bool find_in_sym_table(char *name, token_type type, int declaring);
-void parser_mark_level();
+void add_to_sym_table(token_type type, int name, int64_t parameter);
+bool find_in_sym_table(int name, token_type type, int declaring);
+int find_symbol(int name, token_type type, int declaring);
+void parser_mark_level(int first);
 
 void program_declaration();
 void block_declaration();
+void extern_declaration();
 void const_declaration();
 void var_declaration();
 void proc_declaration();
+int param_declaration(int declaring);
+void argument_declaration(int proc);
 void statement_declaration();
 void expression_declaration();
 void condition_declaration();
 void term_declaration();
 void factor_declaration();
+void index_declaration(int symbol);
 void end_on_error(int i);
 
-symbol *parse(lexeme *input) {
-    table = malloc(1000 * sizeof(symbol));
+// Parses the lexemes from the lexer started with lex_begin()
+symbol *parse() {
+    // Zeroed so the code generator sees a kind of 0 after the last symbol
+    table_capacity = 1000;
+    table = calloc(table_capacity, sizeof(symbol));
     parser_sym_index = 0;
+    name_index_init(&parser_names);
     error = 0;
-    parser_token_list = input;
+    parser_level = 0;
+    level_current_addr = 3;
+    parser_proc = 0;
 
     // Main is implicit so add it to symbol table
-    add_to_sym_table(procsym, "main", 0);
+    add_to_sym_table(procsym, intern_name(lex_names(), "main", 4), 0);
     get_next_token();
     // Start parse tree
     program_declaration();
+    // Read to the end so lexical errors after the period are still reported
+    while (token.type != 0) {
+        get_next_token();
+    }
 
     // We stop execution and print errors using end_on_error()
 //    printtable();
+    name_index_free(&parser_names);
     return table;
 }
 
-void errorend(int x) {
+char *errorend(int x) {
+    char *message;
     switch (x) {
         case 1:
-            printf("Parser Error: Competing Symbol Declarations\n");
+            message = "Parser Error: Competing Symbol Declarations";
             break;
         case 2:
-            printf("Parser Error: Unrecognized Statement Form\n");
+            message = "Parser Error: Unrecognized Statement Form";
             break;
         case 3:
-            printf("Parser Error: Programs Must Close with a Period\n");
+            message = "Parser Error: Programs Must Close with a Period";
             break;
         case 4:
-            printf("Parser Error: Symbols Must Be Declared with an Identifier\n");
+            message = "Parser Error: Symbols Must Be Declared with an Identifier";
             break;
         case 5:
-            printf("Parser Error: Constants Must Be Assigned a Value at Declaration\n");
+            message = "Parser Error: Constants Must Be Assigned a Value at Declaration";
             break;
         case 6:
-            printf("Parser Error: Symbol Declarations Must Be Followed By a Semicolon\n");
+            message = "Parser Error: Symbol Declarations Must Be Followed By a Semicolon";
             break;
         case 7:
-            printf("Parser Error: Undeclared Symbol\n");
+            message = "Parser Error: Undeclared Symbol";
             break;
         case 8:
-            printf("Parser Error: while Must Be Followed By do\n");
+            message = "Parser Error: while Must Be Followed By do";
             break;
         case 9:
-            printf("Parser Error: if Must Be Followed By then\n");
+            message = "Parser Error: if Must Be Followed By then";
             break;
         case 10:
-            printf("Parser Error: begin Must Be Followed By end\n");
+            message = "Parser Error: begin Must Be Followed By end";
             break;
         case 11:
-            printf("Parser Error: while and if Statements Must Contain Conditions\n");
+            message = "Parser Error: while and if Statements Must Contain Conditions";
             break;
         case 12:
-            printf("Parser Error: Conditions Must Contain a Relational-Operator\n");
+            message = "Parser Error: Conditions Must Contain a Relational-Operator";
             break;
         case 13:
-            printf("Parser Error: ( Must Be Followed By )\n");
+            message = "Parser Error: ( Must Be Followed By )";
             break;
         case 14:
-            printf("Parser Error: call and read Must Be Followed By an Identifier\n");
+            message = "Parser Error: call and read Must Be Followed By an Identifier";
+            break;
+        case 15:
+            message = "Parser Error: Expressions Must Contain an Identifier, Number or (";
+            break;
+        case 16:
+            message = "Parser Error: extern Must Be Followed By var, procedure or function";
+            break;
+        case 17:
+            message = "Parser Error: extern Declarations Must Come First in the Program";
+            break;
+        case 18:
+            message = "Parser Error: Array Lengths Must Be a Number or Constant from 1 to 65536";
+            break;
+        case 19:
+            message = "Parser Error: [ Must Be Followed By ]";
+            break;
+        case 20:
+            message = "Parser Error: Arrays Must Be Indexed";
+            break;
+        case 21:
+            message = "Parser Error: Only Arrays Can Be Indexed";
+            break;
+        case 22:
+            message = "Parser Error: Calls Must Pass One Argument for Each Parameter";
+            break;
+        case 23:
+            message = "Parser Error: return Can Only Be Used in a Function";
+            break;
+        case 24:
+            message = "Parser Error: Functions Must Be Called from an Expression";
+            break;
+        case 25:
+            message = "Parser Error: Only Functions Can Be Called from an Expression";
+            break;
+        case 26:
+            message = "Parser Error: A Procedure's Variables Must Fit in the 2048 Word Stack";
             break;
         default:
-            printf("Implementation Error: Unrecognized Error Code\n");
+            message = "Implementation Error: Unrecognized Error Code";
             break;
     }
+    return message;
 }
 
 void printtable() {
@@ -114,25 +173,74 @@ void printtable() {
     printf("Kind | Name        | Value | Level | Address\n");
     printf("--------------------------------------------\n");
     for (i = 0; i < parser_sym_index; i++)
-        printf("%4d | %11s | %5d | %5d | %5d\n", table[i].kind, table[i].name, table[i].val, table[i].level,
-               table[i].addr);
+        printf("%4d | %11s | %5lld | %5d | %5d\n", table[i].kind, name_text(lex_names(), table[i].name),
+               (long long) table[i].val, table[i].level, table[i].addr);
 }
 
 void end_on_error(int i) {
     if (error == 0) {
         error = i;
     }
-    // Print error and exit program
-    errorend(i);
+    // Report the error and stop compiling
+    parse_abort();
+    lex_abort();
+    compile_error(errorend(i));
+}
+
+// Frees the symbol table after an error, it's safe to call more than once
+void parse_abort() {
     free(table);
-    exit(0);
+    table = NULL;
+    name_index_free(&parser_names);
 }
 
-lexeme get_next_token() {
-    // almost definitely unnecessary but to cover our bases
-    if (parser_token_index < 500){
-        token = parser_token_list[parser_token_index++];
+void name_index_init(name_index *index) {
+    index->num_heads = 0;
+    index->heads = NULL;
+    index->capacity = 1000;
+    index->next = malloc(index->capacity * sizeof(int));
+}
+
+// Symbols have to be added in table order
+void name_index_add(name_index *index, int name, int symbol) {
+    if (symbol >= index->capacity) {
+        index->capacity = 2 * symbol;
+        index->next = realloc(index->next, index->capacity * sizeof(int));
+    }
+    if (name >= index->num_heads) {
+        int num_heads = index->num_heads == 0 ? 64 : index->num_heads;
+        while (num_heads <= name) {
+            num_heads *= 2;
+        }
+        index->heads = realloc(index->heads, num_heads * sizeof(int));
+        for (int i = index->num_heads; i < num_heads; ++i) {
+            index->heads[i] = -1;
+        }
+        index->num_heads = num_heads;
+    }
+    index->next[symbol] = index->heads[name];
+    index->heads[name] = symbol;
+}
+
+// The newest symbol with this name, follow next for older ones until -1
+int name_index_first(name_index *index, int name) {
+    if (name < 0 || name >= index->num_heads) {
+        return -1;
     }
+    return index->heads[name];
+}
+
+void name_index_free(name_index *index) {
+    free(index->heads);
+    free(index->next);
+    index->heads = NULL;
+    index->next = NULL;
+    index->num_heads = 0;
+}
+
+lexeme get_next_token() {
+    // The lexer keeps returning the end marker (type 0) after the last lexeme
+    token = lex_next();
     return token;
 }
 
@@ -153,14 +261,20 @@ int is_relation(token_type symbol) {
     return 0;
 }
 
-void add_to_sym_table(token_type type, char *name, int parameter) {
+void add_to_sym_table(token_type type, int name, int64_t parameter) {
     // Make sure a symbol with a matching type isn't already in the table
     if (find_in_sym_table(name, type, 1)) {
         end_on_error(1);
     }
 
+    if (parser_sym_index + 1 >= table_capacity) {
+        table = realloc(table, 2 * table_capacity * sizeof(symbol));
+        memset(table + table_capacity, 0, table_capacity * sizeof(symbol));
+        table_capacity *= 2;
+    }
+
     // Otherwise add it to table with appropriate values per type
-    strcpy(table[parser_sym_index].name, name);
+    table[parser_sym_index].name = name;
     table[parser_sym_index].level = parser_level;
     table[parser_sym_index].addr = 0;
     switch (type) {
@@ -171,6 +285,9 @@ void add_to_sym_table(token_type type, char *name, int parameter) {
         case varsym:
             table[parser_sym_index].kind = 2;
             table[parser_sym_index].addr = level_current_addr++;
+            if (level_current_addr > VM_STACK_SIZE) {
+                end_on_error(26);
+            }
             break;
         case procsym:
             table[parser_sym_index].kind = 3;
@@ -178,37 +295,45 @@ void add_to_sym_table(token_type type, char *name, int parameter) {
         default:
             break;
     }
+    name_index_add(&parser_names, name, parser_sym_index);
     parser_sym_index++;
 }
 
-bool find_in_sym_table(char *name, token_type type, int declaring) {
-    for (int i = 0; i < parser_sym_index; ++i) {
-        if (strcmp(name, table[i].name) == 0) {
-            // We can have procedures with the same name as consts/vars
-            // So skip the "found" condition if the types are wrong
-            if (type == procsym){
-                if (table[i].kind != 3){
-                    continue;
-                }
-            } else if (type == varsym || type == constsym){
-                if (table[i].kind == 3){
-                    continue;
-                }
+bool find_in_sym_table(int name, token_type type, int declaring) {
+    return find_symbol(name, type, declaring) != -1;
+}
+
+// The index of the symbol find_in_sym_table() finds, -1 if there isn't one
+int find_symbol(int name, token_type type, int declaring) {
+    // Every symbol on the chain has this name
+    for (int i = name_index_first(&parser_names, name); i != -1; i = parser_names.next[i]) {
+        // We can have procedures with the same name as consts/vars
+        // So skip the "found" condition if the types are wrong
+        if (type == procsym){
+            if (table[i].kind != 3){
+                continue;
             }
-            // We can't declare symbols with the same name on the same parser_level
-            // We can't use variables from other levels that are marked
-            if ((declaring && parser_level == table[i].level) || (!declaring && !table[i].mark)) {
-                return 1;
+        } else if (type == varsym || type == constsym){
+            if (table[i].kind == 3){
+                continue;
             }
         }
+        // We can't declare symbols with the same name on the same parser_level,
+        // unless the other one is in a procedure that's already finished (two
+        // procedures can both have a parameter n)
+        // We can't use variables from other levels that are marked
+        if ((declaring && parser_level == table[i].level && !table[i].mark) || (!declaring && !table[i].mark)) {
+            return i;
+        }
     }
-    return 0;
+    return -1;
 }
 
-void parser_mark_level() {
+void parser_mark_level(int first) {
     // When finished with a procedure, mark its variables so they can't be accessed
-    // from the same parser_level in another procedure
-    for (int i = 0; i < parser_sym_index; ++i) {
+    // from the same parser_level in another procedure. Symbols on this level from
+    // before the procedure belong to earlier siblings and are marked already.
+    for (int i = first; i < parser_sym_index; ++i) {
         if (table[i].level == parser_level) {
             table[i].mark = 1;
         }
@@ -225,26 +350,64 @@ void program_declaration() {
 }
 
 void block_declaration() {
+    while (is_token(externsym)) {
+        extern_declaration();
+    }
     if (is_token(constsym)) {
         const_declaration();
     }
     if (is_token(varsym)) {
         var_declaration();
     }
-    if (is_token(procsym)) {
+    if (is_token(procsym) || is_token(functionsym)) {
         proc_declaration();
     }
     statement_declaration();
 }
 
+// Globals and procedures defined in another module, see object.c
+void extern_declaration() {
+    if (parser_level != 0) {
+        end_on_error(17);
+    }
+    get_next_token();
+    token_type type = token.type;
+    if (type != varsym && type != procsym && type != functionsym) {
+        end_on_error(16);
+    }
+    do {
+        get_next_token();
+        if (!is_token(identsym)) {
+            end_on_error(4);
+        }
+        add_to_sym_table(type == varsym ? varsym : procsym, token.value, 0);
+        int declared = parser_sym_index - 1;
+        // They don't take up a slot in this module's frame
+        table[declared].external = 1;
+        table[declared].returns = type == functionsym;
+        if (type == varsym) {
+            table[declared].addr = 0;
+            level_current_addr--;
+        }
+        get_next_token();
+        // Calls are checked against the parameters it's declared with here
+        if (type != varsym && is_token(lparentsym)) {
+            table[declared].params = param_declaration(0);
+        }
+    } while (is_token(commasym));
+    if (!is_token(semicolonsym)) {
+        end_on_error(6);
+    }
+    get_next_token();
+}
+
 void const_declaration() {
     do {
         get_next_token();
         if (!is_token(identsym)) {
             end_on_error(4);
         }
-        char *name = malloc(12);
-        strcpy(name, token.name);
+        int name = token.value;
         get_next_token();
         if (!is_token(becomessym)) {
             end_on_error(5);
@@ -271,10 +434,37 @@ void var_declaration() {
         if (!is_token(identsym)) {
             end_on_error(4);
         }
-        char *name = malloc(12);
-        strcpy(name, token.name);
+        int name = token.value;
         get_next_token();
         add_to_sym_table(varsym, name, 0);
+        if (is_token(lbracketsym)) {
+            // An array, its elements take the slots after its own
+            get_next_token();
+            int64_t length = 0;
+            if (is_token(numbersym)) {
+                length = token.value;
+            } else if (is_token(identsym)) {
+                int constant = find_symbol(token.value, constsym, 0);
+                if (constant == -1 || table[constant].kind != 1) {
+                    end_on_error(18);
+                }
+                length = table[constant].val;
+            }
+            if (length < 1 || length > MAX_ARRAY_LENGTH) {
+                end_on_error(18);
+            }
+            table[parser_sym_index - 1].length = (int) length;
+            level_current_addr += (int) length - 1;
+            // The frame is reserved all at once, it can't be bigger than the stack
+            if (level_current_addr > VM_STACK_SIZE) {
+                end_on_error(26);
+            }
+            get_next_token();
+            if (!is_token(rbracketsym)) {
+                end_on_error(19);
+            }
+            get_next_token();
+        }
     } while (is_token(commasym));
     if (!is_token(semicolonsym)) {
         // Var declarations must end with ;
@@ -284,30 +474,41 @@ void var_declaration() {
 }
 
 void proc_declaration() {
-    while (is_token(procsym)) {
+    while (is_token(procsym) || is_token(functionsym)) {
+        int is_function = is_token(functionsym);
         get_next_token();
         // Procedures must be named
         if (!is_token(identsym)) {
             end_on_error(4);
         }
-        char *name = malloc(12);
-        strcpy(name, token.name);
-        add_to_sym_table(procsym, name, 0);
-        get_next_token();
-        // must be followed by a ;
-        if (!is_token(semicolonsym)) {
-            end_on_error(6);
-        }
+        add_to_sym_table(procsym, token.value, 0);
+        int proc = parser_sym_index - 1;
+        table[proc].returns = is_function;
         get_next_token();
 
         // Increment the parser_level until we exit the parser_level
         parser_level++;
         int prev_level_addr = level_current_addr;
         level_current_addr = 3;
+        int first_symbol = parser_sym_index;
+        int prev_proc = parser_proc;
+        parser_proc = proc;
+        // The parameters are its first variables
+        if (is_token(lparentsym)) {
+            // Declaring them can grow the table, so it's indexed after
+            int params = param_declaration(1);
+            table[proc].params = params;
+        }
+        // must be followed by a ;
+        if (!is_token(semicolonsym)) {
+            end_on_error(6);
+        }
+        get_next_token();
         block_declaration();
+        parser_proc = prev_proc;
         level_current_addr = prev_level_addr;
         // Mark parser_level when done
-        parser_mark_level();
+        parser_mark_level(first_symbol);
         parser_level--;
 
         // proc declaration must end with ;
@@ -318,20 +519,73 @@ void proc_declaration() {
     }
 }
 
+// The (name, ...) after a procedure's name, declaring is 0 for an extern's,
+// which only says how many there are. Returns how many there are.
+int param_declaration(int declaring) {
+    int num_params = 0;
+    get_next_token();
+    while (is_token(identsym)) {
+        if (declaring) {
+            add_to_sym_table(varsym, token.value, 0);
+        }
+        num_params++;
+        get_next_token();
+        if (!is_token(commasym)) {
+            break;
+        }
+        get_next_token();
+        if (!is_token(identsym)) {
+            end_on_error(4);
+        }
+    }
+    if (!is_token(rparentsym)) {
+        end_on_error(13);
+    }
+    get_next_token();
+    return num_params;
+}
+
+// The (expression, ...) a call passes, one for each of the procedure's
+// parameters. A call to a procedure without any can leave it out.
+void argument_declaration(int proc) {
+    int num_args = 0;
+    if (is_token(lparentsym)) {
+        get_next_token();
+        if (!is_token(rparentsym)) {
+            expression_declaration();
+            num_args++;
+            while (is_token(commasym)) {
+                get_next_token();
+                expression_declaration();
+                num_args++;
+            }
+        }
+        if (!is_token(rparentsym)) {
+            end_on_error(13);
+        }
+        get_next_token();
+    }
+    if (num_args != table[proc].params) {
+        end_on_error(22);
+    }
+}
+
 void statement_declaration() {
     if (is_token(identsym)) {
         // Look for var with matching name
-        if (!find_in_sym_table(token.name, varsym, 0)) {
+        int symbol = find_symbol(token.value, varsym, 0);
+        if (symbol == -1) {
             end_on_error(7);
         }
         get_next_token();
+        index_declaration(symbol);
         if (!is_token(becomessym)) {
             end_on_error(2);
         }
         get_next_token();
         expression_declaration();
         // Handle weird statements that don't match the parse tree
-        if (!is_token(semicolonsym) && !is_token(endsym) && !is_token(periodsym)) {
+        if (!is_token(semicolonsym) && !is_token(endsym) && !is_token(periodsym) && !is_token(elsesym)) {
             end_on_error(2);
         }
     } else if (is_token(callsym)) {
@@ -340,20 +594,34 @@ void statement_declaration() {
             end_on_error(14);
         }
         // We can only call procedures
-        if (!find_in_sym_table(token.name, procsym, 0)) {
+        int proc = find_symbol(token.value, procsym, 0);
+        if (proc == -1) {
             end_on_error(7);
         }
+        // A function's value has to go somewhere
+        if (table[proc].returns) {
+            end_on_error(24);
+        }
+        get_next_token();
+        argument_declaration(proc);
+    } else if (is_token(returnsym)) {
+        if (!table[parser_proc].returns) {
+            end_on_error(23);
+        }
         get_next_token();
+        expression_declaration();
     } else if (is_token(readsym)) {
         get_next_token();
         if (!is_token(identsym)) {
             end_on_error(14);
         }
         // We can only read into variables
-        if (!find_in_sym_table(token.name, varsym, 0)) {
+        int symbol = find_symbol(token.value, varsym, 0);
+        if (symbol == -1) {
             end_on_error(7);
         }
         get_next_token();
+        index_declaration(symbol);
     } else if (is_token(writesym)) {
         get_next_token();
         expression_declaration();
@@ -376,6 +644,10 @@ void statement_declaration() {
         }
         get_next_token();
         statement_declaration();
+        if (is_token(elsesym)) {
+            get_next_token();
+            statement_declaration();
+        }
     } else if (is_token(whilesym)) {
         get_next_token();
         condition_declaration();
@@ -424,10 +696,25 @@ void term_declaration() {
 
 void factor_declaration() {
     if (is_token(identsym)) {
-        if (!find_in_sym_table(token.name, varsym, 0)) {
-            end_on_error(7);
-        }
+        int name = token.value;
         get_next_token();
+        if (is_token(lparentsym)) {
+            // A call to a function, which is what it returns
+            int proc = find_symbol(name, procsym, 0);
+            if (proc == -1) {
+                end_on_error(7);
+            }
+            if (!table[proc].returns) {
+                end_on_error(25);
+            }
+            argument_declaration(proc);
+        } else {
+            int symbol = find_symbol(name, varsym, 0);
+            if (symbol == -1) {
+                end_on_error(7);
+            }
+            index_declaration(symbol);
+        }
     } else if (is_token(numbersym)) {
         get_next_token();
     } else if (is_token(lparentsym)) {
@@ -437,5 +724,26 @@ void factor_declaration() {
             end_on_error(13);
         }
         get_next_token();
+    } else {
+        end_on_error(15);
     }
 }
+
+// The [expression] after an array's name, anything else can't have one
+void index_declaration(int symbol) {
+    if (table[symbol].length == 0) {
+        if (is_token(lbracketsym)) {
+            end_on_error(21);
+        }
+        return;
+    }
+    if (!is_token(lbracketsym)) {
+        end_on_error(20);
+    }
+    get_next_token();
+    expression_declaration();
+    if (!is_token(rbracketsym)) {
+        end_on_error(19);
+    }
+    get_next_token();
+}
@@ -0,0 +1,146 @@
+/*
+    libpl0: embeddable PL/0 compiler and virtual machine
+
+    Compile a program once, then create as many machines from it as you
+    like. Any number of machines on any number of threads can run a
+    program at the same time, it only ever changes when a tiered program
+    adds optimized code or a lazy one generates a procedure, and machines
+    pick that up safely as they go.
+    Each machine has its own stack and registers and can be reset and
+    run again. A single machine must only be used by one thread at a time.
+
+        pl0_program *program = pl0_compile(source, 0, error, sizeof(error));
+        pl0_vm *vm = pl0_instantiate(program, &host);
+        while (pl0_run(vm, 100000) == PL0_PAUSED) {
+            // do other work, then continue where it stopped
+        }
+        pl0_vm_free(vm);
+        pl0_program_free(program);
+
+    Programs must outlive every machine created from them.
+*/
+#ifndef PL0_H
+#define PL0_H
+
+#include <stdint.h>
+
+#if defined(PL0_SHARED_BUILD)
+#define PL0_API __attribute__((visibility("default")))
+#else
+#define PL0_API
+#endif
+
+// Compile flags, same as the --int64 and --overflow trap command line options
+#define PL0_INT64 1 // 64-bit integers instead of 32-bit
+#define PL0_TRAP 2  // Stop with an error on overflow instead of wrapping around
+// Start running without optimizing and optimize the procedures and loops that
+// run often once they do, same as --tiered. Cold code costs nothing to start.
+#define PL0_TIERED 4
+// Only generate main up front and each other procedure the first time it's
+// called, for big programs that only run a few of theirs. The procedures
+// aren't optimized, apart from tail calls, and the program isn't tiered.
+// One with externs is compiled as usual.
+#define PL0_LAZY 8
+
+typedef struct pl0_program pl0_program;
+typedef struct pl0_vm pl0_vm;
+typedef struct pl0_incremental pl0_incremental;
+
+typedef enum pl0_status {
+    PL0_HALTED,  // The program finished
+    PL0_PAUSED,  // The budget ran out, run again to continue where it stopped
+    PL0_ERROR,   // The program stopped with a runtime error, see pl0_vm_error()
+    PL0_WAITING  // A read has no input yet, run again once it does
+} pl0_status;
+
+// Callbacks for the program's read and write statements.
+// read returns 1 and sets value on success, 0 if there will never be any
+// input (a runtime error) or -1 if there's no input yet (pl0_run() then
+// returns PL0_WAITING and retries the read when it's run again).
+// Leaving a callback NULL uses stdin/stdout.
+typedef struct pl0_host {
+    void *context;
+    int (*read)(void *context, int64_t *value);
+    void (*write)(void *context, int64_t value);
+} pl0_host;
+
+// Returns NULL on a compile error and copies the message into error if it isn't NULL
+PL0_API pl0_program *pl0_compile(const char *source, int flags, char *error, int error_size);
+// Same as pl0_compile() but reads the source from a file as it's needed
+PL0_API pl0_program *pl0_compile_file(const char *path, int flags, char *error, int error_size);
+
+// An incremental session keeps the code it generated for each procedure, so
+// compiling an edited version of the same program only regenerates the
+// procedures that changed and those that depend on them
+PL0_API pl0_incremental *pl0_incremental_create(int flags);
+PL0_API pl0_program *pl0_incremental_compile(pl0_incremental *session, const char *source, char *error,
+                                             int error_size);
+// How many procedures the last compile reused and generated
+PL0_API void pl0_incremental_stats(pl0_incremental *session, int *reused, int *generated);
+PL0_API void pl0_incremental_free(pl0_incremental *session);
+// Loads a bytecode file written by the compiler's -o option. Programs are
+// verified when they're loaded, NULL means it couldn't be read or failed.
+PL0_API pl0_program *pl0_load(const char *path, char *error, int error_size);
+PL0_API void pl0_program_free(pl0_program *program);
+
+// host may be NULL to use stdin/stdout
+PL0_API pl0_vm *pl0_instantiate(pl0_program *program, const pl0_host *host);
+// Runs about budget instructions (or until done if budget is negative).
+// The budget is checked at backward jumps and calls, so a program without
+// loops or calls always runs to the end, and a runaway loop pauses within
+// one iteration of running out. Running a paused machine again resumes it.
+PL0_API pl0_status pl0_run(pl0_vm *vm, long budget);
+// Runs exactly one instruction
+PL0_API pl0_status pl0_step(pl0_vm *vm);
+// Puts the machine back at the start of the program
+PL0_API void pl0_reset(pl0_vm *vm);
+PL0_API const char *pl0_vm_error(pl0_vm *vm);
+// The context from the host the machine was created with
+PL0_API void *pl0_vm_context(pl0_vm *vm);
+PL0_API void pl0_vm_free(pl0_vm *vm);
+// Makes a running pl0_run() return PL0_PAUSED soon, safe to call from a signal handler
+PL0_API void pl0_interrupt(pl0_vm *vm);
+
+// Copies the machine's state into buffer if it's big enough, returns the size needed.
+// Take snapshots while the machine isn't running, it's always between instructions then.
+PL0_API long pl0_snapshot(pl0_vm *vm, void *buffer, long size);
+// Puts the machine in the state from a snapshot of the same program.
+// Returns 0 and leaves the machine alone if the snapshot doesn't fit.
+PL0_API int pl0_restore(pl0_vm *vm, const void *buffer, long size);
+// Creates a new machine in the same state as vm, for starting many machines
+// from one that already ran its setup (for example up to its first read)
+PL0_API pl0_vm *pl0_fork(pl0_vm *vm, const pl0_host *host);
+
+// Starts the machine over counting how often each instruction runs and each
+// branch is taken, for compiling the program again with pl0 --profile-use.
+// A profiled machine of a tiered program runs the code as compiled. Machines
+// of lazy programs can't be profiled, this does nothing for them.
+PL0_API void pl0_profile(pl0_vm *vm);
+// Adds the counts to the profile in path, which is replaced if it's a
+// profile of different code. Returns 0 if it can't be written.
+PL0_API int pl0_save_profile(pl0_vm *vm, const char *path);
+
+/*
+    Scheduler: runs many machines on a pool of worker threads, switching
+    between them every slice instructions. Each worker has its own run
+    queue and steals from the others when it runs dry. Machines waiting
+    for input are parked until pl0_wake() and don't take up a worker.
+*/
+typedef struct pl0_scheduler pl0_scheduler;
+
+// Called on a worker thread when a machine halts or stops with an error
+typedef void (*pl0_done_callback)(void *context, pl0_vm *vm, pl0_status status);
+
+// threads <= 0 starts one worker per CPU, slice <= 0 uses a default
+PL0_API pl0_scheduler *pl0_scheduler_create(int threads, long slice, pl0_done_callback done, void *context);
+// The machine belongs to the scheduler until done is called for it
+PL0_API void pl0_schedule(pl0_scheduler *scheduler, pl0_vm *vm);
+// Queues a machine that's waiting for input again, call it once the input is there.
+// Safe to call from any thread, even before the machine has finished parking.
+PL0_API void pl0_wake(pl0_scheduler *scheduler, pl0_vm *vm);
+// Blocks until every scheduled machine is done
+PL0_API void pl0_scheduler_wait(pl0_scheduler *scheduler);
+// Stops the workers, machines that aren't done yet are left as they are
+PL0_API void pl0_scheduler_free(pl0_scheduler *scheduler);
+
+#endif
@@ -0,0 +1,276 @@
+/*
+    Profile Guided Optimization for PL/0
+    Author: Ryan Doherty
+
+    A profiled machine (pl0_profile(), vm --profile) counts how often each
+    instruction runs and how often each JPC jumps. The counts are saved
+    keyed by procedure and offset, with a hash of the code they were
+    counted on, and the runs of one program add up in the same file:
+
+        pl0 profile <hash> <instructions>
+        <procedure start> <offset> <times run> <times a JPC jumped>
+
+    A procedure is called as often as its INC runs, and a loop goes around
+    as often as its backward jump is taken (or runs, for a JMP).
+
+    pl0 --profile-use compiles the program the same way as before, which
+    gives the code the profile was counted on, and then:
+    - Lays out each if with an else so the side that runs more often comes
+      second. The first side ends with a JMP over the second, so the
+      likely side falls through to what follows without it. Swapping the
+      sides inverts the condition, like rotating a loop does.
+    - Inlines the calls that make up 1/PROFILE_HOT_SHARE or more of all
+      calls made, to leaf procedures of up to PROFILE_INLINE_THRESHOLD
+      instructions, well past what's inlined everywhere without a profile.
+    A profile of different code, like that of an older version of the
+    source, is left out with a warning.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "vm.h"
+
+// Largest procedure the inliner copies into a call that's hot in the profile
+#define PROFILE_INLINE_THRESHOLD (4 * DEFAULT_INLINE_THRESHOLD)
+// A call site is hot if it makes at least 1 in this many of the calls
+#define PROFILE_HOT_SHARE 100
+
+int read_counts(FILE *file, uint64_t hash, int code_length, uint64_t *executed, uint64_t *taken);
+void swap_branches(instruction *code, int code_length, code_profile *profile);
+int can_swap(instruction *code, int code_length, int test, int second, int end);
+void swap_sides(instruction *code, code_profile *profile, int test, int second, int end);
+
+void pl0_profile(pl0_vm *vm) {
+    // A lazy program's code as compiled is mostly stubs
+    if (vm->program->lazy != NULL) {
+        return;
+    }
+    free_vm_profile(vm->profile);
+    // The oldest version is the code as compiled
+    program_version *version = current_version(vm->program);
+    while (version->older != NULL) {
+        version = version->older;
+    }
+    vm_profile *profile = malloc(sizeof(vm_profile));
+    profile->version = version;
+    // One more for the halt after the code
+    profile->executed = calloc(version->code_length + 1, sizeof(uint64_t));
+    profile->taken = calloc(version->code_length + 1, sizeof(uint64_t));
+    vm->profile = profile;
+    pl0_reset(vm);
+}
+
+void free_vm_profile(vm_profile *profile) {
+    if (profile == NULL) {
+        return;
+    }
+    free(profile->executed);
+    free(profile->taken);
+    free(profile);
+}
+
+int pl0_save_profile(pl0_vm *vm, const char *path) {
+    if (vm->profile == NULL) {
+        return 0;
+    }
+    program_version *version = vm->profile->version;
+    int length = version->code_length;
+    uint64_t hash = hash_code(version->code, length);
+    uint64_t *executed = malloc(length * sizeof(uint64_t));
+    uint64_t *taken = malloc(length * sizeof(uint64_t));
+    memcpy(executed, vm->profile->executed, length * sizeof(uint64_t));
+    memcpy(taken, vm->profile->taken, length * sizeof(uint64_t));
+    FILE *file = fopen(path, "r");
+    if (file != NULL) {
+        read_counts(file, hash, length, executed, taken);
+        fclose(file);
+    }
+
+    file = fopen(path, "w");
+    int saved = file != NULL;
+    if (saved) {
+        fprintf(file, "pl0 profile %016llx %d\n", (unsigned long long) hash, length);
+        for (int i = 0; i < length; ++i) {
+            int proc = version->verified.procedure[i];
+            if (executed[i] > 0 && proc >= 0) {
+                fprintf(file, "%d %d %llu %llu\n", proc, i - proc, (unsigned long long) executed[i],
+                        (unsigned long long) taken[i]);
+            }
+        }
+        saved = !ferror(file);
+        saved = fclose(file) == 0 && saved;
+    }
+    free(executed);
+    free(taken);
+    return saved;
+}
+
+// Adds the counts in a profile file to executed and taken if it's a profile
+// of the code with this hash and length. Returns 0 if it isn't.
+int read_counts(FILE *file, uint64_t hash, int code_length, uint64_t *executed, uint64_t *taken) {
+    unsigned long long file_hash;
+    int file_length;
+    if (fscanf(file, "pl0 profile %llx %d", &file_hash, &file_length) != 2 || file_hash != hash ||
+        file_length != code_length) {
+        return 0;
+    }
+    int proc;
+    int offset;
+    unsigned long long runs;
+    unsigned long long jumps;
+    while (fscanf(file, "%d %d %llu %llu", &proc, &offset, &runs, &jumps) == 4) {
+        if (proc >= 0 && offset >= 0 && offset < code_length - proc) {
+            executed[proc + offset] += runs;
+            taken[proc + offset] += jumps;
+        }
+    }
+    return 1;
+}
+
+// Identifies the code a profile was counted on
+uint64_t hash_code(instruction *code, int code_length) {
+    uint64_t hash = HASH_SEED;
+    for (int i = 0; i < code_length; ++i) {
+        hash = hash_word(hash, (uint64_t) code[i].opcode << 32 | (uint32_t) code[i].l);
+        hash = hash_word(hash, code[i].m);
+    }
+    return hash;
+}
+
+// Returns NULL and sets error if the profile can't be read or is of different code
+code_profile *read_profile(const char *path, instruction *code, int code_length, const char **error) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        *error = "can't open the profile";
+        return NULL;
+    }
+    code_profile *profile = malloc(sizeof(code_profile));
+    profile->executed = calloc(code_length, sizeof(uint64_t));
+    profile->taken = calloc(code_length, sizeof(uint64_t));
+    int matches = read_counts(file, hash_code(code, code_length), code_length, profile->executed, profile->taken);
+    fclose(file);
+    if (!matches) {
+        *error = "the profile is of different code";
+        free_profile(profile);
+        return NULL;
+    }
+    return profile;
+}
+
+void free_profile(code_profile *profile) {
+    free(profile->executed);
+    free(profile->taken);
+    free(profile);
+}
+
+// Sets inlined if it inlined calls, which leaves work for the other passes
+instruction *optimize_with_profile(instruction *code, int *code_length, code_profile *profile, int *inlined) {
+    swap_branches(code, *code_length, profile);
+
+    uint64_t calls = 0;
+    for (int i = 0; i < *code_length; ++i) {
+        if (code[i].opcode == CAL || code[i].opcode == TCL) {
+            calls += profile->executed[i];
+        }
+    }
+    char *hot = malloc(*code_length);
+    for (int i = 0; i < *code_length; ++i) {
+        hot[i] = code[i].opcode == CAL && profile->executed[i] > 0 &&
+                 profile->executed[i] * PROFILE_HOT_SHARE >= calls;
+    }
+    *inlined = 0;
+    code = inline_calls(code, code_length, PROFILE_INLINE_THRESHOLD, hot, inlined);
+    free(hot);
+    return code;
+}
+
+// The code generator lowers if <condition> then <first> else <second> to
+//     <condition>; JPC second; <first>; JMP end; second: <second>; end:
+// and when <first> runs more often this turns it into
+//     <inverted condition>; JPC first; <second>; JMP end; first: <first>; end:
+// The counts move along with their instructions.
+void swap_branches(instruction *code, int code_length, code_profile *profile) {
+    procedure *procs = malloc(code_length * sizeof(procedure));
+    int num_procs = find_procedures(code, code_length, procs);
+    for (int i = 1; i < code_length; ++i) {
+        if (code[i].opcode != JPC || profile->executed[i] - profile->taken[i] <= profile->taken[i]) {
+            continue;
+        }
+        int second = (int) code[i].m;
+        if (second <= i + 1 || second >= code_length || code[second - 1].opcode != JMP) {
+            continue;
+        }
+        int end = (int) code[second - 1].m;
+        int p = procedure_containing(procs, num_procs, i);
+        if (end < second || p == -1 || end > procs[p].end || i - 1 <= procs[p].start ||
+            code[i - 1].opcode != OPR || inverted_relation((int) code[i - 1].m) == -1 ||
+            !can_swap(code, code_length, i, second, end)) {
+            continue;
+        }
+        swap_sides(code, profile, i, second, end);
+    }
+    free(procs);
+}
+
+// Only the JPC can jump into either side from outside it, and nothing can
+// jump to the JPC past the condition it's about to invert
+int can_swap(instruction *code, int code_length, int test, int second, int end) {
+    for (int j = 0; j < code_length; ++j) {
+        if ((code[j].opcode != JMP && code[j].opcode != JPC) || j == test) {
+            continue;
+        }
+        int target = (int) code[j].m;
+        int in_first = j > test && j < second - 1;
+        int in_second = j >= second && j < end;
+        if (target == test || (target > test && target < end && !(in_first && target < second) &&
+                               !(in_second && target >= second))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void swap_sides(instruction *code, code_profile *profile, int test, int second, int end) {
+    int length = end - test - 1;
+    int second_length = end - second;
+    int first = test + 2 + second_length;
+    instruction *swapped = malloc(length * sizeof(instruction));
+    uint64_t *executed = malloc(length * sizeof(uint64_t));
+    uint64_t *taken = malloc(length * sizeof(uint64_t));
+    // Where each instruction between the JPC and end goes, relative to the JPC
+    int *moved = malloc(length * sizeof(int));
+    for (int k = test + 1; k < end; ++k) {
+        if (k >= second) {
+            moved[k - test - 1] = k - second;
+        } else if (k == second - 1) {
+            moved[k - test - 1] = second_length;
+        } else {
+            moved[k - test - 1] = first - test - 1 + k - test - 1;
+        }
+    }
+    for (int k = test + 1; k < end; ++k) {
+        instruction ir = code[k];
+        if ((ir.opcode == JMP || ir.opcode == JPC) && ir.m > test && ir.m < end) {
+            // The first side falls through to end now instead of going through the JMP
+            if (k < second && ir.m == second - 1) {
+                ir.m = end;
+            } else {
+                ir.m = test + 1 + moved[ir.m - test - 1];
+            }
+        }
+        int to = moved[k - test - 1];
+        swapped[to] = ir;
+        executed[to] = profile->executed[k];
+        taken[to] = profile->taken[k];
+    }
+    memcpy(code + test + 1, swapped, length * sizeof(instruction));
+    memcpy(profile->executed + test + 1, executed, length * sizeof(uint64_t));
+    memcpy(profile->taken + test + 1, taken, length * sizeof(uint64_t));
+    code[test - 1].m = inverted_relation((int) code[test - 1].m);
+    code[test].m = first;
+    profile->taken[test] = profile->executed[test] - profile->taken[test];
+    free(swapped);
+    free(executed);
+    free(taken);
+    free(moved);
+}
@@ -0,0 +1,292 @@
+/*
+    Scheduler for PL/0
+    Author: Ryan Doherty
+
+    Runs many machines on a few worker threads. Every worker owns a run
+    queue: it takes machines from the front, runs each one for a slice and
+    puts it back at the end if it isn't done. A worker whose queue is empty
+    steals from the back of another worker's queue, so a burst of jobs
+    landing on one queue spreads out across the pool. Workers with nothing
+    to do sleep until a machine is queued.
+
+    A machine whose read has no input yet is parked: the scheduler simply
+    doesn't queue it again until pl0_wake(). The wake can race with the
+    worker that is parking it, so each machine has a small state machine
+    (wake_state) that makes sure exactly one of them queues it.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "vm.h"
+
+// Instructions run before switching to another machine
+#define DEFAULT_SLICE 10000
+
+// wake_state values
+#define WAKE_NONE 0    // running, queued or never parked
+#define WAKE_PARKED 1  // waiting for pl0_wake()
+#define WAKE_PENDING 2 // woken while still running, queue it again when it parks
+
+typedef struct run_queue {
+    pthread_mutex_t lock;
+    pl0_vm **jobs; // ring buffer
+    int head;
+    int count;
+    int capacity;
+} run_queue;
+
+typedef struct worker {
+    pl0_scheduler *scheduler;
+    int index;
+    pthread_t thread;
+} worker;
+
+struct pl0_scheduler {
+    int num_workers;
+    long slice;
+    worker *workers;
+    run_queue *queues;
+    pl0_done_callback done;
+    void *context;
+
+    // Idle workers sleep on this until something is queued
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+    atomic_int queued;
+    atomic_int sleeping;
+    atomic_int stopping;
+    // Spreads machines from outside the pool across the queues
+    atomic_uint next_queue;
+
+    // Machines scheduled but not done, for pl0_scheduler_wait()
+    pthread_mutex_t done_lock;
+    pthread_cond_t all_done;
+    long outstanding;
+};
+
+void *worker_main(void *argument);
+void enqueue(pl0_scheduler *scheduler, int queue, pl0_vm *vm);
+pl0_vm *dequeue(pl0_scheduler *scheduler, int queue);
+pl0_vm *steal(pl0_scheduler *scheduler, int thief);
+void park(pl0_scheduler *scheduler, int queue, pl0_vm *vm);
+void finish(pl0_scheduler *scheduler, pl0_vm *vm, pl0_status status);
+
+pl0_scheduler *pl0_scheduler_create(int threads, long slice, pl0_done_callback done, void *context) {
+    if (threads <= 0) {
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads <= 0) {
+            threads = 1;
+        }
+    }
+    pl0_scheduler *scheduler = malloc(sizeof(pl0_scheduler));
+    scheduler->num_workers = threads;
+    scheduler->slice = slice > 0 ? slice : DEFAULT_SLICE;
+    scheduler->done = done;
+    scheduler->context = context;
+    pthread_mutex_init(&scheduler->idle_lock, NULL);
+    pthread_cond_init(&scheduler->idle, NULL);
+    atomic_init(&scheduler->queued, 0);
+    atomic_init(&scheduler->sleeping, 0);
+    atomic_init(&scheduler->stopping, 0);
+    atomic_init(&scheduler->next_queue, 0);
+    pthread_mutex_init(&scheduler->done_lock, NULL);
+    pthread_cond_init(&scheduler->all_done, NULL);
+    scheduler->outstanding = 0;
+
+    scheduler->queues = malloc(threads * sizeof(run_queue));
+    for (int i = 0; i < threads; ++i) {
+        pthread_mutex_init(&scheduler->queues[i].lock, NULL);
+        scheduler->queues[i].capacity = 64;
+        scheduler->queues[i].jobs = malloc(64 * sizeof(pl0_vm *));
+        scheduler->queues[i].head = 0;
+        scheduler->queues[i].count = 0;
+    }
+    scheduler->workers = malloc(threads * sizeof(worker));
+    for (int i = 0; i < threads; ++i) {
+        scheduler->workers[i].scheduler = scheduler;
+        scheduler->workers[i].index = i;
+        pthread_create(&scheduler->workers[i].thread, NULL, worker_main, &scheduler->workers[i]);
+    }
+    return scheduler;
+}
+
+void pl0_schedule(pl0_scheduler *scheduler, pl0_vm *vm) {
+    pthread_mutex_lock(&scheduler->done_lock);
+    scheduler->outstanding++;
+    pthread_mutex_unlock(&scheduler->done_lock);
+    atomic_store(&vm->wake_state, WAKE_NONE);
+    enqueue(scheduler, atomic_fetch_add(&scheduler->next_queue, 1) % scheduler->num_workers, vm);
+}
+
+void pl0_wake(pl0_scheduler *scheduler, pl0_vm *vm) {
+    int state = atomic_load(&vm->wake_state);
+    while (1) {
+        if (state == WAKE_PARKED) {
+            // Parked for good, so we're the one who queues it
+            if (atomic_compare_exchange_weak(&vm->wake_state, &state, WAKE_NONE)) {
+                enqueue(scheduler, atomic_fetch_add(&scheduler->next_queue, 1) % scheduler->num_workers, vm);
+                return;
+            }
+        } else if (state == WAKE_NONE) {
+            // Still running, leave a note for the worker that parks it
+            if (atomic_compare_exchange_weak(&vm->wake_state, &state, WAKE_PENDING)) {
+                return;
+            }
+        } else {
+            return;
+        }
+    }
+}
+
+void pl0_scheduler_wait(pl0_scheduler *scheduler) {
+    pthread_mutex_lock(&scheduler->done_lock);
+    while (scheduler->outstanding > 0) {
+        pthread_cond_wait(&scheduler->all_done, &scheduler->done_lock);
+    }
+    pthread_mutex_unlock(&scheduler->done_lock);
+}
+
+void pl0_scheduler_free(pl0_scheduler *scheduler) {
+    if (scheduler == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&scheduler->idle_lock);
+    atomic_store(&scheduler->stopping, 1);
+    pthread_cond_broadcast(&scheduler->idle);
+    pthread_mutex_unlock(&scheduler->idle_lock);
+    for (int i = 0; i < scheduler->num_workers; ++i) {
+        pthread_join(scheduler->workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < scheduler->num_workers; ++i) {
+        pthread_mutex_destroy(&scheduler->queues[i].lock);
+        free(scheduler->queues[i].jobs);
+    }
+    pthread_mutex_destroy(&scheduler->idle_lock);
+    pthread_cond_destroy(&scheduler->idle);
+    pthread_mutex_destroy(&scheduler->done_lock);
+    pthread_cond_destroy(&scheduler->all_done);
+    free(scheduler->queues);
+    free(scheduler->workers);
+    free(scheduler);
+}
+
+void *worker_main(void *argument) {
+    worker *self = argument;
+    pl0_scheduler *scheduler = self->scheduler;
+
+    while (!atomic_load(&scheduler->stopping)) {
+        pl0_vm *vm = dequeue(scheduler, self->index);
+        if (vm == NULL) {
+            vm = steal(scheduler, self->index);
+        }
+        if (vm == NULL) {
+            // Announce we're sleeping before checking queued, enqueue() does the
+            // opposite, so one of us always sees the other and no wakeup is lost
+            pthread_mutex_lock(&scheduler->idle_lock);
+            atomic_fetch_add(&scheduler->sleeping, 1);
+            while (atomic_load(&scheduler->queued) == 0 && !atomic_load(&scheduler->stopping)) {
+                pthread_cond_wait(&scheduler->idle, &scheduler->idle_lock);
+            }
+            atomic_fetch_sub(&scheduler->sleeping, 1);
+            pthread_mutex_unlock(&scheduler->idle_lock);
+            continue;
+        }
+
+        pl0_status status = pl0_run(vm, scheduler->slice);
+        if (status == PL0_PAUSED) {
+            enqueue(scheduler, self->index, vm);
+        } else if (status == PL0_WAITING) {
+            park(scheduler, self->index, vm);
+        } else {
+            finish(scheduler, vm, status);
+        }
+    }
+    return NULL;
+}
+
+void park(pl0_scheduler *scheduler, int queue, pl0_vm *vm) {
+    int state = WAKE_NONE;
+    if (atomic_compare_exchange_strong(&vm->wake_state, &state, WAKE_PARKED)) {
+        return;
+    }
+    // pl0_wake() came in while it was running so its input may be there already
+    atomic_store(&vm->wake_state, WAKE_NONE);
+    enqueue(scheduler, queue, vm);
+}
+
+void finish(pl0_scheduler *scheduler, pl0_vm *vm, pl0_status status) {
+    if (scheduler->done != NULL) {
+        scheduler->done(scheduler->context, vm, status);
+    }
+    pthread_mutex_lock(&scheduler->done_lock);
+    scheduler->outstanding--;
+    if (scheduler->outstanding == 0) {
+        pthread_cond_broadcast(&scheduler->all_done);
+    }
+    pthread_mutex_unlock(&scheduler->done_lock);
+}
+
+void enqueue(pl0_scheduler *scheduler, int queue, pl0_vm *vm) {
+    run_queue *q = &scheduler->queues[queue];
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->capacity) {
+        // Unroll the ring into a bigger buffer
+        pl0_vm **jobs = malloc(2 * q->capacity * sizeof(pl0_vm *));
+        for (int i = 0; i < q->count; ++i) {
+            jobs[i] = q->jobs[(q->head + i) % q->capacity];
+        }
+        free(q->jobs);
+        q->jobs = jobs;
+        q->head = 0;
+        q->capacity *= 2;
+    }
+    q->jobs[(q->head + q->count) % q->capacity] = vm;
+    q->count++;
+    pthread_mutex_unlock(&q->lock);
+
+    // Only pay for the idle lock when somebody is actually asleep
+    atomic_fetch_add(&scheduler->queued, 1);
+    if (atomic_load(&scheduler->sleeping) > 0) {
+        pthread_mutex_lock(&scheduler->idle_lock);
+        pthread_cond_signal(&scheduler->idle);
+        pthread_mutex_unlock(&scheduler->idle_lock);
+    }
+}
+
+// Takes the oldest machine from a worker's own queue
+pl0_vm *dequeue(pl0_scheduler *scheduler, int queue) {
+    run_queue *q = &scheduler->queues[queue];
+    pl0_vm *vm = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        vm = q->jobs[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        atomic_fetch_sub(&scheduler->queued, 1);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return vm;
+}
+
+// Takes the newest machine from the first other queue that has one,
+// leaving the front of the queue to its owner
+pl0_vm *steal(pl0_scheduler *scheduler, int thief) {
+    for (int i = 1; i < scheduler->num_workers; ++i) {
+        run_queue *q = &scheduler->queues[(thief + i) % scheduler->num_workers];
+        pl0_vm *vm = NULL;
+        pthread_mutex_lock(&q->lock);
+        if (q->count > 0) {
+            q->count--;
+            vm = q->jobs[(q->head + q->count) % q->capacity];
+            atomic_fetch_sub(&scheduler->queued, 1);
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (vm != NULL) {
+            return vm;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,253 @@
+/*
+    Machine Snapshots for PL/0
+    Author: Ryan Doherty
+
+    Saves the complete state of a machine between instructions so it can
+    be restored later, in another process if need be, and carry on where
+    it stopped. Only the live part of the stack is saved: addresses 0 to
+    sp, or to the top frame's links if a call just happened and its INC
+    hasn't run. Everything above that is dead and comes back as 0.
+
+    A tiered program's code only ever grows, so a snapshot taken before it
+    added a copy restores into it after, checked against the newest code.
+    The snapshot lists where the copies the machine had took over, so a
+    fresh process makes the same copies (tier.c always makes the same copy
+    from the same code) before restoring into them. A lazy program's
+    procedures are copies too and are generated again the same way. A
+    profiled machine only ever runs the code as compiled, so it only takes
+    snapshots of that.
+
+    The machine only skips its checks because the verifier vouched for the
+    program, and a snapshot could come from anywhere, so restoring one
+    checks every frame is one the program could have built: each return
+    address, dynamic and static link, and the stack depth at every pc,
+    have to agree with what the verifier worked out, and an index about
+    to be used by an array access has to be inside the array.
+
+    Layout (in host byte order):
+    header: magic | format version | mode flags | instruction count |
+            pc | bp | sp | status | copy count (32-bit each) |
+            program hash (64-bit)
+    then each copy's target (32-bit each), oldest first
+    then the live stack words in the program's word size
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "vm.h"
+
+#define SNAPSHOT_MAGIC 0x53304c50 // "PL0S"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_HEADER (9 * sizeof(int32_t) + sizeof(uint64_t))
+
+int live_words(int bp, int sp);
+int valid_frames(pl0_program *program, program_version *version, int stack_size, int pc, int bp, int sp,
+                 const char *words);
+int64_t snapshot_word(pl0_program *program, const char *words, int i);
+
+long pl0_snapshot(pl0_vm *vm, void *buffer, long size) {
+    // The machine's pc is in this version or an older one
+    program_version *version = machine_version(vm);
+    size_t word_size = WORD_SIZE(vm->program->flags);
+    long targets = version->num_copies * sizeof(int32_t);
+    long needed = SNAPSHOT_HEADER + targets + live_words(vm->bp, vm->sp) * word_size;
+    if (buffer == NULL || size < needed) {
+        return needed;
+    }
+
+    int32_t header[9] = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, vm->program->flags, version->code_length,
+                         vm->pc, vm->bp, vm->sp, vm->status, version->num_copies};
+    char *bytes = buffer;
+    memcpy(bytes, header, sizeof(header));
+    memcpy(bytes + sizeof(header), &version->hash, sizeof(uint64_t));
+    for (int c = 0; c < version->num_copies; ++c) {
+        int32_t target = version->copies[c].target;
+        memcpy(bytes + SNAPSHOT_HEADER + c * sizeof(int32_t), &target, sizeof(int32_t));
+    }
+    memcpy(bytes + SNAPSHOT_HEADER + targets, vm->stack, live_words(vm->bp, vm->sp) * word_size);
+    return needed;
+}
+
+int pl0_restore(pl0_vm *vm, const void *buffer, long size) {
+    int32_t header[9];
+    uint64_t hash;
+    if (size < (long) SNAPSHOT_HEADER) {
+        return 0;
+    }
+    const char *bytes = buffer;
+    memcpy(header, bytes, sizeof(header));
+    memcpy(&hash, bytes + sizeof(header), sizeof(uint64_t));
+    pl0_program *program = vm->program;
+    int num_copies = header[8];
+    if (header[0] != SNAPSHOT_MAGIC || header[1] != SNAPSHOT_VERSION || header[2] != program->flags ||
+        num_copies < 0 || num_copies > (size - (long) SNAPSHOT_HEADER) / (long) sizeof(int32_t) ||
+        (num_copies > 0 && ((program->tiers == NULL && program->lazy == NULL) || vm->profile != NULL))) {
+        return 0;
+    }
+    long targets = num_copies * sizeof(int32_t);
+
+    // Make any copies the machine had that this process hasn't made yet, the
+    // ones it has already are left alone
+    int base_length = program->tiers != NULL ? program->tiers->base_length : 0;
+    if (program->lazy != NULL) {
+        base_length = program->lazy->base_length;
+    }
+    for (int c = 0; c < num_copies; ++c) {
+        int32_t target;
+        memcpy(&target, bytes + SNAPSHOT_HEADER + c * sizeof(int32_t), sizeof(int32_t));
+        if (target < 0 || target >= base_length) {
+            return 0;
+        }
+        if (program->lazy != NULL) {
+            lazy_up(program, target);
+        } else {
+            tier_up(program, target);
+        }
+    }
+
+    // Only the exact program the snapshot was taken from can carry on from it
+    program_version *version = machine_version(vm);
+    program_version *taken = version;
+    while (taken != NULL && (taken->code_length != header[3] || taken->hash != hash)) {
+        taken = taken->older;
+    }
+    if (taken == NULL) {
+        return 0;
+    }
+    int pc = header[4];
+    int bp = header[5];
+    int sp = header[6];
+    int status = header[7];
+    size_t word_size = WORD_SIZE(program->flags);
+    if (pc < 0 || pc > taken->code_length || sp < -1 || sp >= vm->stack_size ||
+        bp < 0 || bp > sp + 1 || bp + 2 >= vm->stack_size || status < PL0_HALTED || status > PL0_WAITING ||
+        size != (long) (SNAPSHOT_HEADER + targets + live_words(bp, sp) * word_size)) {
+        return 0;
+    }
+    bytes += targets;
+    // A finished machine never runs again so its frames don't matter
+    if ((status == PL0_PAUSED || status == PL0_WAITING) &&
+        !valid_frames(program, version, vm->stack_size, pc, bp, sp, bytes + SNAPSHOT_HEADER)) {
+        return 0;
+    }
+
+    pl0_reset(vm);
+    memcpy(vm->stack, bytes + SNAPSHOT_HEADER, live_words(bp, sp) * word_size);
+    vm->pc = pc;
+    vm->bp = bp;
+    vm->sp = sp;
+    vm->status = status;
+    // The message itself isn't saved
+    if (status == PL0_ERROR) {
+        vm->error = "Restored Error";
+    }
+    return 1;
+}
+
+pl0_vm *pl0_fork(pl0_vm *vm, const pl0_host *host) {
+    pl0_vm *child = pl0_instantiate(vm->program, host);
+    size_t word_size = WORD_SIZE(vm->program->flags);
+    // Dead stack stays zeroed, so only the live part is copied
+    memcpy(child->stack, vm->stack, live_words(vm->bp, vm->sp) * word_size);
+    child->pc = vm->pc;
+    child->bp = vm->bp;
+    child->sp = vm->sp;
+    child->status = vm->status;
+    child->error = vm->error;
+    return child;
+}
+
+int live_words(int bp, int sp) {
+    return (sp > bp + 2 ? sp : bp + 2) + 1;
+}
+
+// Walks the frames from the top one down to main's at address 0
+int valid_frames(pl0_program *program, program_version *version, int stack_size, int pc, int bp, int sp,
+                 const char *words) {
+    verified_code *verified = &version->verified;
+    instruction *code = version->code;
+    int code_length = version->code_length;
+    // Nothing has run yet, pc is on the jump to main
+    if (pc == 0) {
+        return bp == 0 && sp == -1;
+    }
+    if (pc >= code_length || verified->depths[pc] != sp - bp + 1) {
+        return 0;
+    }
+    // Stepping can stop a machine between a bounds check and the access it
+    // guards, the index on top has to be one the check would have let through
+    int opcode = code[pc].opcode;
+    if (opcode == LODX || opcode == STOX) {
+        int64_t index = snapshot_word(program, words, sp);
+        if (index < 0 || index >= indexed_extent(code, pc)) {
+            return 0;
+        }
+    }
+
+    // Frame bases and the procedure running in each, newest first
+    int *bases = malloc((bp / 3 + 1) * sizeof(int));
+    int *procs = malloc((bp / 3 + 1) * sizeof(int));
+    int num_frames = 0;
+    int base = bp;
+    int proc = verified->procedure[pc];
+    // The top frame's arguments are still under its links until its INC
+    // (maybe a copy's) runs
+    int pending = code[pc].opcode == INC ? (int) code[pc].l : 0;
+    int valid = 1;
+    while (valid) {
+        bases[num_frames] = base;
+        procs[num_frames] = proc;
+        num_frames++;
+        if (base + verified->max_frame > stack_size) {
+            valid = 0;
+        } else if (base == 0) {
+            // Main's frame and it has to be running main
+            valid = verified->parent[proc] < 0;
+            break;
+        } else if (verified->parent[proc] < 0) {
+            valid = 0;
+        } else {
+            int64_t caller = snapshot_word(program, words, base + 1);
+            int64_t return_address = snapshot_word(program, words, base + 2);
+            // The caller's stack ended just below this frame when it made the call,
+            // less the arguments the callee's INC moved into its frame
+            if (caller < 0 || caller > base - 3 || return_address < 2 || return_address >= code_length ||
+                code[return_address - 1].opcode != CAL ||
+                verified->depths[return_address - 1] - code[code[return_address - 1].m].l + pending !=
+                base - caller) {
+                valid = 0;
+            } else {
+                base = (int) caller;
+                proc = verified->procedure[return_address];
+                pending = 0;
+            }
+        }
+    }
+
+    // Every static link has to be a frame of the procedure's parent further down
+    for (int i = 0; i < num_frames - 1 && valid; ++i) {
+        int64_t link = snapshot_word(program, words, bases[i]);
+        int found = 0;
+        for (int j = i + 1; j < num_frames; ++j) {
+            if (bases[j] == link && procs[j] == verified->parent[procs[i]]) {
+                found = 1;
+            }
+        }
+        valid = found;
+    }
+    free(bases);
+    free(procs);
+    return valid;
+}
+
+int64_t snapshot_word(pl0_program *program, const char *words, int i) {
+    if (program->flags & MODE_INT64) {
+        int64_t word;
+        memcpy(&word, words + i * sizeof(int64_t), sizeof(int64_t));
+        return word;
+    }
+    int32_t word;
+    memcpy(&word, words + i * sizeof(int32_t), sizeof(int32_t));
+    return word;
+}
@@ -0,0 +1,158 @@
+/*
+    Variable Promotion for PL/0
+    Author: Ryan Doherty
+
+    Takes every procedure through the SSA form in ir.c, which keeps the
+    frame variables no other procedure can see in values instead of
+    memory. On the way:
+
+    - A load of a variable uses the value last stored to it, so values
+      used once go straight from where they're computed to where they're
+      used without a trip through the frame.
+    - Stores nothing reads again are dropped, even when the variable is
+      read elsewhere in the procedure.
+    - Constants propagate through variables, and through if/while when
+      every path agrees, into the expressions that use them.
+    - Repeated expressions and loads reuse the earlier value where that's
+      shorter (gvn.c), unless --no-cse turned it off.
+
+    A variable is seen by another procedure if a procedure nested in its
+    own (at any depth) loads or stores it with a level above 0. Arrays are
+    never promoted, an indexed load or store could be to any element. Parents are
+    found walking the call graph from main like the dead code pass does,
+    so anything main never calls is left alone, as are procedures whose
+    code would come back longer than it went in.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include "compiler.h"
+
+// The procedures optimize_ssa() hands out to parallel_for()
+typedef struct ssa_batch {
+    code_block *blocks;
+    int num_blocks;
+    int main_block;
+    char **escaped; // per block and frame slot, NULL for blocks that aren't promoted
+    call_signature *callees; // per block, what calling it takes and leaves on the stack
+    int flags;
+    int cse; // reuse repeated values, see gvn.c
+} ssa_batch;
+
+void optimize_ssa_block(void *context, int item);
+
+instruction *optimize_ssa(instruction *code, int *code_length, int flags, int cse) {
+    ssa_batch batch;
+    batch.blocks = split_blocks(code, *code_length, &batch.num_blocks, &batch.main_block);
+    batch.escaped = find_escaped(batch.blocks, batch.num_blocks, batch.main_block);
+    // Worked out before any block is rewritten, the threads read them
+    batch.callees = malloc((batch.num_blocks + 1) * sizeof(call_signature));
+    for (int b = 0; b < batch.num_blocks; ++b) {
+        procedure whole = {0, batch.blocks[b].length - 1};
+        batch.callees[b] = procedure_signature(batch.blocks[b].code, whole);
+    }
+    batch.flags = flags;
+    batch.cse = cse;
+    parallel_for(batch.num_blocks, parallel_threads(*code_length), optimize_ssa_block, &batch);
+    for (int b = 0; b < batch.num_blocks; ++b) {
+        free(batch.escaped[b]);
+    }
+    free(batch.escaped);
+    free(batch.callees);
+    free(code);
+    return link_blocks(batch.blocks, batch.num_blocks, batch.main_block, code_length);
+}
+
+// Marks the frame slots of each procedure that procedures nested in it use,
+// and every array's
+char **find_escaped(code_block *blocks, int num_blocks, int main_block) {
+    char **escaped = calloc(num_blocks, sizeof(char *));
+    int *parent = malloc(num_blocks * sizeof(int));
+    int *order = malloc(num_blocks * sizeof(int));
+    int num_reached = 0;
+    order[num_reached++] = main_block;
+    parent[main_block] = -1;
+    escaped[main_block] = calloc(blocks[main_block].code[0].m, 1);
+    for (int next = 0; next < num_reached; ++next) {
+        int p = order[next];
+        code_block *block = &blocks[p];
+        for (int i = 0; i < block->length; ++i) {
+            instruction ir = block->code[i];
+            if ((ir.opcode != CAL && ir.opcode != TCL) || escaped[ir.m] != NULL) {
+                continue;
+            }
+            // The callee's parent is the procedure l static links up from the caller
+            int up = p;
+            for (int l = ir.l; l > 0 && up != -1; --l) {
+                up = parent[up];
+            }
+            if (blocks[ir.m].code[0].opcode == INC && blocks[ir.m].code[0].m >= 3) {
+                parent[ir.m] = up;
+                escaped[ir.m] = calloc(blocks[ir.m].code[0].m, 1);
+                order[num_reached++] = (int) ir.m;
+            }
+        }
+    }
+    for (int k = 0; k < num_reached; ++k) {
+        code_block *block = &blocks[order[k]];
+        for (int i = 0; i < block->length; ++i) {
+            instruction ir = block->code[i];
+            int indexed = ir.opcode == LODX || ir.opcode == STOX;
+            if ((ir.opcode != LOD && ir.opcode != STO && !indexed) || (ir.l == 0 && !indexed)) {
+                continue;
+            }
+            int up = order[k];
+            for (int l = ir.l; l > 0 && up != -1; --l) {
+                up = parent[up];
+            }
+            // Arrays stay in memory wherever they're used, the index picks the slot
+            int extent = indexed ? indexed_extent(block->code, i) : 1;
+            for (int m = 0; m < extent && up != -1; ++m) {
+                if (ir.m + m >= 0 && ir.m + m < blocks[up].code[0].m) {
+                    escaped[up][ir.m + m] = 1;
+                }
+            }
+        }
+    }
+    free(parent);
+    free(order);
+    return escaped;
+}
+
+void optimize_ssa_block(void *context, int item) {
+    ssa_batch *batch = context;
+    code_block *block = &batch->blocks[item];
+    if (!block->is_procedure || batch->escaped[item] == NULL) {
+        return;
+    }
+    int length;
+    instruction *code = promote_variables(block->code, block->length, batch->escaped[item], batch->callees,
+                                          item == batch->main_block, batch->flags, batch->cse, &length);
+    if (code != NULL) {
+        free(block->code);
+        block->code = code;
+        block->length = length;
+    }
+}
+
+// Takes one procedure's block through the IR and back. Returns the new code,
+// or NULL if the IR can't take it or it would come back longer.
+instruction *promote_variables(instruction *code, int code_length, char *escaped, call_signature *callees,
+                               int is_main, int flags, int cse, int *new_length) {
+    ir_procedure *proc = build_ir(code, code_length, escaped, callees, is_main, flags);
+    if (proc == NULL) {
+        return NULL;
+    }
+    simplify_ir(proc);
+    if (cse) {
+        // Loads that turn out to be constants can fold
+        number_values(proc);
+        simplify_ir(proc);
+    }
+    instruction *promoted = lower_ir(proc, new_length);
+    free_ir(proc);
+    if (promoted != NULL && *new_length > code_length) {
+        free(promoted);
+        return NULL;
+    }
+    return promoted;
+}
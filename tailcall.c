@@ -0,0 +1,65 @@
+/*
+    Tail Calls for PL/0
+    Author: Ryan Doherty
+
+    A call that's the last thing a procedure does, like the recursive call in
+        procedure down; begin if n > 0 then begin n := n - 1; call down end end;
+    has nothing left to come back to. This pass turns it into a TCL, which
+    puts the callee's frame where the caller's was instead of on top of it:
+    the callee gets the caller's return address and dynamic link and
+    returns straight to the caller's caller. Recursion like the above then
+    runs in constant stack space however deep it goes.
+
+    - A call is in tail position if a return comes next, possibly after
+      jumps (an if/else whose branches both end in calls)
+    - Calls to a procedure declared inside the caller (level 0) are left
+      alone, their static link is the caller's frame, which has to stay
+    - Main ends with a halt rather than a return so it never tail calls
+    - Calls that pass arguments or to functions are left alone too, the
+      arguments would have to move into the frame being replaced and a
+      function's value would be left for the caller's caller
+
+    It runs after every other pass since the others only know about CAL.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include "compiler.h"
+
+int returns_next(instruction *code, int code_length, int index);
+
+instruction *optimize_tail_calls(instruction *code, int *code_length) {
+    make_tail_calls(code, *code_length, 1);
+    return code;
+}
+
+// Turns the calls from index from on that can be into tail calls, for a
+// lazy program's procedures as they're added after its code (lazy.c)
+void make_tail_calls(instruction *code, int code_length, int from) {
+    procedure *procs = malloc(code_length * sizeof(procedure));
+    int num_procs = find_procedures(code, code_length, procs);
+    for (int i = from; i < code_length; ++i) {
+        if (code[i].opcode != CAL || code[i].l == 0 || !returns_next(code, code_length, i + 1)) {
+            continue;
+        }
+        call_signature callee = procedure_signature(code, procs[procedure_containing(procs, num_procs, code[i].m)]);
+        if (callee.params == 0 && !callee.returns) {
+            code[i].opcode = TCL;
+        }
+    }
+    free(procs);
+}
+
+// Whether control reaching index goes straight to a return
+int returns_next(instruction *code, int code_length, int index) {
+    // Jumps to jumps are rare, the limit only stops a loop of them
+    for (int hops = 0; hops < 8 && index < code_length; ++hops) {
+        if (code[index].opcode == OPR && code[index].m == 0) {
+            return 1;
+        }
+        if (code[index].opcode != JMP) {
+            return 0;
+        }
+        index = (int) code[index].m;
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+# Compiles each program with the optimizer and without it (no SSA, no loop
+# passes, nothing inlined) in every arithmetic mode, and checks vm -q prints
+# the same for both. It's also compiled --tiered and run on vm and on
+# VM_EARLY, a machine that tiers up after a few calls or loops instead of
+# TIER_THRESHOLD, which must print the same again. The programs are
+# examples/, tests/regress/ and the ones genprog prints for seeds 1 to SEEDS.
+# cmake -DPL0=<pl0> -DVM=<vm> -DVM_EARLY=<vm> -DGENPROG=<genprog> -DSEEDS=<n> -DSOURCE_DIR=<repo>
+#       -DWORK=<dir> -P differential.cmake
+file(MAKE_DIRECTORY ${WORK})
+file(GLOB programs ${SOURCE_DIR}/examples/*.pl0 ${SOURCE_DIR}/tests/regress/*.pl0)
+foreach(seed RANGE 1 ${SEEDS})
+    execute_process(COMMAND ${GENPROG} ${seed} OUTPUT_FILE ${WORK}/gen${seed}.pl0 RESULT_VARIABLE generated)
+    if(NOT generated EQUAL 0)
+        message(FATAL_ERROR "genprog ${seed} failed")
+    endif()
+    list(APPEND programs ${WORK}/gen${seed}.pl0)
+endforeach()
+
+set(modes "wrap" "trap" "int64")
+set(mode_wrap --overflow wrap)
+set(mode_trap --overflow trap)
+set(mode_int64 --int64)
+set(failed "")
+foreach(program ${programs})
+    get_filename_component(name ${program} NAME_WE)
+    foreach(mode ${modes})
+        set(finished 1)
+        foreach(build plain optimized tiered early)
+            set(options ${mode_${mode}})
+            set(vm ${VM})
+            if(build STREQUAL "plain")
+                list(APPEND options --no-ssa --no-loop-opt --inline-threshold 0)
+            elseif(NOT build STREQUAL "optimized")
+                list(APPEND options --tiered)
+            endif()
+            if(build STREQUAL "early")
+                set(vm ${VM_EARLY})
+            endif()
+            set(code ${WORK}/${name}.${mode}.${build}.pm0)
+            file(REMOVE ${code})
+            execute_process(COMMAND ${PL0} --no-cache ${options} ${program} -o ${code} OUTPUT_QUIET ERROR_QUIET)
+            if(NOT EXISTS ${code})
+                set(output "does not compile")
+            elseif(finished)
+                execute_process(COMMAND ${vm} -q ${code} INPUT_FILE ${SOURCE_DIR}/tests/input.txt
+                                OUTPUT_VARIABLE output ERROR_VARIABLE output RESULT_VARIABLE result TIMEOUT 3)
+                # What a program that doesn't finish prints by then can't be compared,
+                # but the optimizer mustn't be what keeps it from finishing
+                if(result MATCHES "timeout" AND build STREQUAL "plain")
+                    set(finished 0)
+                elseif(result MATCHES "timeout")
+                    string(APPEND output "\ndoes not finish")
+                endif()
+            endif()
+            file(WRITE ${WORK}/${name}.${mode}.${build}.out "${output}")
+            set(output_${build} "${output}")
+        endforeach()
+        if(NOT finished)
+            message("${name} (${mode}): does not finish, skipped")
+        elseif(output_plain STREQUAL "does not compile")
+            message("${name} (${mode}): does not compile")
+            list(APPEND failed "${name}/${mode}")
+        else()
+            foreach(build optimized tiered early)
+                if(NOT output_${build} STREQUAL output_plain)
+                    message("${name} (${mode}): see ${WORK}/${name}.${mode}.${build}.out and .plain.out")
+                    list(APPEND failed "${name}/${mode}/${build}")
+                endif()
+            endforeach()
+        endif()
+    endforeach()
+endforeach()
+if(failed)
+    message(FATAL_ERROR "Failed: ${failed}")
+endif()
@@ -0,0 +1,385 @@
+/*
+    Test Program Generator for PL/0
+    Author: Ryan Doherty
+
+    Prints a random program for the seed given, for tests/differential.cmake
+    to compile with and without the optimizer and compare. The programs
+    nest procedures and functions with parameters, call them from inside
+    expressions (so functions that write or store get inlined into them),
+    loop a few times over expressions that are partly invariant, index an
+    array and read input. Every loop is counted and procedures stop doing
+    anything after 40 calls, so they always finish.
+
+        genprog <seed>
+*/
+#include <stdlib.h>
+#include <stdio.h>
+
+#define MAX_NAMES 64
+
+// Names are a letter and a number, unique across the program
+typedef struct name {
+    char kind;
+    int id;
+} name;
+
+// A procedure that can be called from where the code is being generated
+typedef struct callee {
+    int id;
+    int params;
+    int returns;
+} callee;
+
+typedef struct scope {
+    name vars[MAX_NAMES];    // can be read
+    int num_vars;
+    name targets[MAX_NAMES]; // can be assigned
+    int num_targets;
+    callee procs[MAX_NAMES];
+    int num_procs;
+    int loop_vars[MAX_NAMES];
+    int num_loop_vars;
+    int is_function;
+} scope;
+
+unsigned long long rng_state;
+int next_id = 0;
+
+int chance(int percent);
+int below(int n);
+int between(int low, int high);
+void print_name(name n);
+void gen_expr(scope *s, int depth);
+int gen_call(scope *s, int depth);
+void gen_index(scope *s, int depth);
+void gen_args(scope *s, int params, int depth);
+void gen_condition(scope *s);
+void gen_statement(scope *s, int depth, int indent);
+void gen_block(scope *outer, int level, int indent, int is_main, name *params, int num_params, int is_function);
+void gen_leaf(scope *outer, int indent, name *params, int num_params);
+void pad(int indent);
+
+int main(int argc, char **argv) {
+    rng_state = argc > 1 ? strtoull(argv[1], NULL, 10) * 2654435761ULL + 1 : 1;
+    scope globals = {0};
+    gen_block(&globals, 0, 0, 1, NULL, 0, 0);
+    printf(".\n");
+    return 0;
+}
+
+int chance(int percent) {
+    return below(100) < percent;
+}
+
+// Uniform from 0 to n - 1, by xorshift64*
+int below(int n) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (int) (((rng_state * 2685821657736338717ULL) >> 33) % (unsigned) n);
+}
+
+// Leans toward low, each step up is a coin flip
+int between(int low, int high) {
+    int value = low;
+    while (value < high && chance(50)) {
+        value++;
+    }
+    return value;
+}
+
+void print_name(name n) {
+    printf("%c%d", n.kind, n.id);
+}
+
+void pad(int indent) {
+    printf("%*s", indent * 4, "");
+}
+
+void gen_expr(scope *s, int depth) {
+    if (depth > 2 || chance(30)) {
+        if (depth < 3 && chance(30) && gen_call(s, depth)) {
+            return;
+        } else if (chance(10)) {
+            gen_index(s, depth + 1);
+        } else if (s->num_vars > 0 && chance(70)) {
+            print_name(s->vars[below(s->num_vars)]);
+        } else {
+            printf("%d", below(21) * (chance(5) ? 997 : 1));
+        }
+        return;
+    }
+    const char *ops[] = {"+", "-", "*", "/", "%", "+", "-", "*"};
+    const char *op = ops[below(8)];
+    int parenthesized = chance(30);
+    if (parenthesized) {
+        printf("(");
+    }
+    gen_expr(s, depth + 1);
+    printf(" %s ", op);
+    if (op[0] == '/' || op[0] == '%') {
+        // Mostly kept from dividing by zero, which ends the run
+        if (chance(60)) {
+            printf("%d", between(1, 9));
+        } else {
+            printf("((");
+            gen_expr(s, depth + 1);
+            printf(chance(98) ? ") %% 7 + 8)" : "))");
+        }
+    } else if (!(chance(25) && gen_call(s, depth + 1))) {
+        // A call after operands that can be invariant in a loop
+        gen_expr(s, depth + 1);
+    }
+    if (parenthesized) {
+        printf(")");
+    }
+}
+
+// Calls a function if there are any in scope, false if not
+int gen_call(scope *s, int depth) {
+    callee functions[MAX_NAMES];
+    int num_functions = 0;
+    for (int p = 0; p < s->num_procs; ++p) {
+        if (s->procs[p].returns) {
+            functions[num_functions++] = s->procs[p];
+        }
+    }
+    if (num_functions == 0) {
+        return 0;
+    }
+    callee f = functions[below(num_functions)];
+    printf("f%d", f.id);
+    gen_args(s, f.params, depth);
+    return 1;
+}
+
+// The global array, the index is out of bounds once in a while on purpose
+void gen_index(scope *s, int depth) {
+    printf("arr[((");
+    gen_expr(s, depth);
+    printf(chance(95) ? ") %% 9 + 9) %% 9]" : ")) %% 9]");
+}
+
+void gen_args(scope *s, int params, int depth) {
+    if (params == 0) {
+        printf("()");
+        return;
+    }
+    printf("(");
+    for (int a = 0; a < params; ++a) {
+        gen_expr(s, depth + 1);
+        printf(a + 1 < params ? ", " : ")");
+    }
+}
+
+void gen_condition(scope *s) {
+    const char *relations[] = {"==", "<>", "<", "<=", ">", ">="};
+    gen_expr(s, 0);
+    printf(" %s ", relations[below(6)]);
+    gen_expr(s, 0);
+}
+
+void gen_statement(scope *s, int depth, int indent) {
+    pad(indent);
+    if (depth > 2 || chance(30)) {
+        if (s->num_targets > 0 && chance(85)) {
+            print_name(s->targets[below(s->num_targets)]);
+        } else {
+            gen_index(s, 1);
+        }
+        printf(" := ");
+        gen_expr(s, 0);
+    } else if (chance(25)) {
+        printf("write ");
+        gen_expr(s, 0);
+    } else if (s->is_function && chance(8)) {
+        printf("return ");
+        gen_expr(s, 0);
+    } else if (s->num_targets > 0 && chance(5)) {
+        printf("read ");
+        print_name(s->targets[below(s->num_targets)]);
+    } else if (s->num_procs > 0 && chance(25)) {
+        callee p = s->procs[below(s->num_procs)];
+        if (p.returns) {
+            // A function's value can be dropped only by assigning it
+            printf("g0 := f%d", p.id);
+        } else {
+            printf("call f%d", p.id);
+        }
+        if (p.params > 0 || p.returns || chance(30)) {
+            gen_args(s, p.params, 0);
+        }
+    } else if (chance(40)) {
+        printf("if ");
+        gen_condition(s);
+        printf(" then\n");
+        gen_statement(s, depth + 1, indent + 1);
+        if (chance(50)) {
+            printf("\n");
+            pad(indent);
+            printf("else\n");
+            gen_statement(s, depth + 1, indent + 1);
+        }
+    } else if (s->num_loop_vars > 0 && chance(70)) {
+        int counter = s->loop_vars[--s->num_loop_vars];
+        printf("begin l%d := 0;\n", counter);
+        pad(indent);
+        printf("while l%d < %d do begin\n", counter, 1 + below(4));
+        int statements = between(1, 3);
+        for (int i = 0; i < statements; ++i) {
+            gen_statement(s, depth + 1, indent + 1);
+            printf(";\n");
+        }
+        pad(indent + 1);
+        printf("l%d := l%d + 1\n", counter, counter);
+        pad(indent);
+        printf("end end");
+    } else {
+        printf("begin\n");
+        int statements = between(1, 3);
+        for (int i = 0; i < statements; ++i) {
+            gen_statement(s, depth + 1, indent + 1);
+            printf(i + 1 < statements ? ";\n" : "\n");
+        }
+        pad(indent);
+        printf("end");
+    }
+}
+
+void gen_block(scope *outer, int level, int indent, int is_main, name *params, int num_params, int is_function) {
+    scope s = *outer;
+    s.is_function = is_function;
+    s.num_loop_vars = 0;
+    name vars[3];
+    int num_vars = between(0, 3);
+    pad(indent);
+    printf("var ");
+    for (int v = 0; v < num_vars; ++v) {
+        vars[v] = (name) {'v', ++next_id};
+        s.vars[s.num_vars++] = vars[v];
+        s.targets[s.num_targets++] = vars[v];
+        printf("v%d, ", vars[v].id);
+    }
+    for (int l = 0; l < 3; ++l) {
+        s.loop_vars[s.num_loop_vars++] = ++next_id;
+        printf("l%d%s", next_id, l < 2 ? ", " : "");
+    }
+    if (is_main) {
+        // dd counts calls, g0 takes the values of functions called as statements
+        printf(", dd, g0, arr[9]");
+        s.vars[s.num_vars++] = (name) {'g', 0};
+        s.targets[s.num_targets++] = (name) {'g', 0};
+    }
+    printf(";\n");
+    int assignable = chance(50);
+    for (int p = 0; p < num_params; ++p) {
+        s.vars[s.num_vars++] = params[p];
+        if (assignable) {
+            s.targets[s.num_targets++] = params[p];
+        }
+    }
+
+    if (level < 3) {
+        int procs = between(is_main ? 2 : 0, 4);
+        for (int p = 0; p < procs; ++p) {
+            callee declared = {++next_id, between(0, 3), chance(50)};
+            name declared_params[3];
+            pad(indent);
+            printf("%s f%d", declared.returns ? "function" : "procedure", declared.id);
+            for (int a = 0; a < declared.params; ++a) {
+                declared_params[a] = (name) {'a', ++next_id};
+                printf("%s%d", a == 0 ? "(a" : ", a", declared_params[a].id);
+            }
+            printf("%s;\n", declared.params > 0 ? ")" : "");
+            if (declared.returns && chance(40)) {
+                gen_leaf(&s, indent + 1, declared_params, declared.params);
+                s.procs[s.num_procs++] = declared;
+            } else {
+                // It can call itself
+                s.procs[s.num_procs++] = declared;
+                gen_block(&s, level + 1, indent + 1, 0, declared_params, declared.params, declared.returns);
+            }
+            printf(";\n");
+        }
+    }
+
+    pad(indent);
+    printf("begin\n");
+    if (is_main) {
+        pad(indent + 1);
+        printf("dd := 0;\n");
+    } else {
+        pad(indent + 1);
+        printf("if dd < 40 then begin\n");
+        pad(indent + 1);
+        printf("dd := dd + 1;\n");
+        for (int v = 0; v < num_vars; ++v) {
+            pad(indent + 1);
+            printf("v%d := %d;\n", vars[v].id, between(0, 9));
+        }
+    }
+    // Locals written at the end make what the loops store to them matter
+    int written[3];
+    int num_written = 0;
+    for (int v = 0; v < num_vars; ++v) {
+        if (is_main || chance(50)) {
+            written[num_written++] = vars[v].id;
+        }
+    }
+    int statements = between(is_main ? 4 : 1, 8);
+    for (int i = 0; i < statements; ++i) {
+        gen_statement(&s, 0, indent + 2);
+        printf(i + 1 < statements || num_written > 0 ? ";\n" : "\n");
+    }
+    for (int v = 0; v < num_written; ++v) {
+        pad(indent + 1);
+        printf("write v%d%s\n", written[v], v + 1 < num_written ? ";" : "");
+    }
+    if (!is_main) {
+        pad(indent + 1);
+        printf("end");
+        if (is_function && chance(50)) {
+            printf(";\n");
+            pad(indent + 1);
+            printf("return dd * 3 + 1");
+        }
+        printf("\n");
+    }
+    pad(indent);
+    printf("end");
+}
+
+// A function small enough to be inlined, that writes or stores before it
+// returns and calls nothing
+void gen_leaf(scope *outer, int indent, name *params, int num_params) {
+    scope s = *outer;
+    s.num_procs = 0;
+    s.num_loop_vars = 0;
+    s.is_function = 1;
+    for (int p = 0; p < num_params; ++p) {
+        s.vars[s.num_vars++] = params[p];
+    }
+    pad(indent);
+    printf("begin\n");
+    // Without a return it gives 0
+    int returns = chance(40);
+    int statements = between(1, 2);
+    for (int i = 0; i < statements; ++i) {
+        if (chance(70)) {
+            pad(indent + 1);
+            printf("write ");
+            gen_expr(&s, 1);
+        } else {
+            gen_statement(&s, 3, indent + 1);
+        }
+        printf(i + 1 < statements || returns ? ";\n" : "\n");
+    }
+    if (returns) {
+        pad(indent + 1);
+        printf("return ");
+        gen_expr(&s, 1);
+        printf("\n");
+    }
+    pad(indent);
+    printf("end");
+}
@@ -0,0 +1,33 @@
+# Compiles each program in tests/regress with the default options, or the ones
+# in the .options file next to it, and checks what vm -q prints against the
+# .expected file next to it. The .pm0 files there are bytecode no compiler
+# would write, they're run as they are.
+# cmake -DPL0=<pl0> -DVM=<vm> -DSOURCE_DIR=<repo> -DWORK=<dir> -P regress.cmake
+file(MAKE_DIRECTORY ${WORK})
+file(GLOB programs ${SOURCE_DIR}/tests/regress/*.pl0 ${SOURCE_DIR}/tests/regress/*.pm0)
+set(failed "")
+foreach(program ${programs})
+    get_filename_component(name ${program} NAME_WE)
+    set(options "")
+    if(EXISTS ${SOURCE_DIR}/tests/regress/${name}.options)
+        file(STRINGS ${SOURCE_DIR}/tests/regress/${name}.options options)
+        separate_arguments(options)
+    endif()
+    if(program MATCHES "[.]pm0$")
+        configure_file(${program} ${WORK}/${name}.pm0 COPYONLY)
+        set(compiled 0)
+    else()
+        execute_process(COMMAND ${PL0} --no-cache ${options} ${program} -o ${WORK}/${name}.pm0
+                        OUTPUT_QUIET ERROR_QUIET RESULT_VARIABLE compiled)
+    endif()
+    execute_process(COMMAND ${VM} -q ${WORK}/${name}.pm0 INPUT_FILE ${SOURCE_DIR}/tests/input.txt
+                    OUTPUT_VARIABLE output ERROR_VARIABLE output TIMEOUT 10)
+    file(READ ${SOURCE_DIR}/tests/regress/${name}.expected expected)
+    if(NOT compiled EQUAL 0 OR NOT output STREQUAL expected)
+        message("${name}: expected\n${expected}\ngot\n${output}")
+        list(APPEND failed ${name})
+    endif()
+endforeach()
+if(failed)
+    message(FATAL_ERROR "Failed: ${failed}")
+endif()
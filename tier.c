@@ -0,0 +1,248 @@
+/*
+    Tiered Execution for PL/0
+    Author: Ryan Doherty
+
+    Most of a program runs a handful of times and isn't worth optimizing,
+    while a few loops go around millions of times. A program compiled with
+    --tiered (PL0_TIERED) skips the optimizer so it starts right away, and
+    the machine counts where calls and backward jumps land (vm_run.h).
+    Once a count reaches TIER_THRESHOLD, tier_up() optimizes the procedure
+    there the way optimize_ssa() and optimize_loops() would and adds the
+    result to the end of the program as a copy (see procedure_copy):
+
+    - A procedure that's called often gets a call copy. Calls in the code
+      go straight to it from then on, and its INC becomes a TIER_CALL for
+      any that don't (wide ones). A call is a safe point to switch at,
+      the new frame has nothing in it yet but its links and arguments.
+    - A loop that goes around often gets a loop copy: its procedure with a
+      jump to the loop right after the INC, which takes no arguments. The
+      loop's first instruction becomes a TIER_LOOP, so the next time
+      around the running frame moves into the copy and carries on there
+      (on-stack replacement). That's a safe point too, nothing is on the
+      stack at the top of a loop but the frame's variables, and the copy
+      loads its promoted variables from their slots on entry like any
+      procedure does (main is optimized as if it weren't main for this).
+      A hot loop inside another is taken over at the outermost one, the
+      only way into the copy's loops that goes through their preheaders.
+
+    A copy keeps every slot of the original where it was, so procedures
+    nested in it that reach into its frame don't notice, and can't need
+    more stack than the program as compiled, so a call's stack check and
+    where programs run out of stack stay the same. Each version of the
+    code is verified before machines see it, a copy that doesn't verify
+    (a compiler bug) is dropped and the original keeps running.
+
+    Only passes that work on one procedure at a time run on copies. The
+    inliner and the dead code pass need the whole program and the tail
+    call pass already ran when it was compiled.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "vm.h"
+
+int add_copy(pl0_program *program, int target);
+void split_for_copies(tier_state *tiers, program_version *version);
+
+tier_state *tier_create(program_version *version) {
+    tier_state *tiers = calloc(1, sizeof(tier_state));
+    pthread_mutex_init(&tiers->lock, NULL);
+    tiers->base_length = version->code_length;
+    tiers->max_frame = version->verified.max_frame;
+    tiers->copy_at = calloc(version->code_length, sizeof(int));
+    return tiers;
+}
+
+// Called by a machine when the calls or backward jumps to target got hot.
+// Other machines may be doing the same, whoever's first makes the copy.
+void tier_up(pl0_program *program, int target) {
+    tier_state *tiers = program->tiers;
+    pthread_mutex_lock(&tiers->lock);
+    if (tiers->copy_at[target] == 0) {
+        tiers->copy_at[target] = add_copy(program, target);
+    }
+    pthread_mutex_unlock(&tiers->lock);
+}
+
+// Publishes a version of the code with a copy taking over at target and
+// returns where the copy starts, or -1 if there's no copy to be had
+int add_copy(pl0_program *program, int target) {
+    tier_state *tiers = program->tiers;
+    // Versions are only published with the lock held, so this is the newest
+    program_version *version = current_version(program);
+    if (tiers->blocks == NULL) {
+        split_for_copies(tiers, version);
+    }
+    int start = version->verified.procedure[target];
+    if (start < 0) {
+        return -1;
+    }
+    int b = tiers->block_at[start];
+    code_block *block = &tiers->blocks[b];
+    // A loop inside another is taken over at the outermost one around it.
+    // Jumping into the middle would skip the outer loops' preheaders, and
+    // what the optimizer hoisted there would never be worked out.
+    int header = target - start;
+    for (int i = header + 1; i < block->length && header > 0; ++i) {
+        instruction ir = block->code[i];
+        if ((ir.opcode == JMP || ir.opcode == JPC) && ir.m < header) {
+            header = ir.m;
+        }
+    }
+    if (start + header != target) {
+        target = start + header;
+        if (tiers->copy_at[target] != 0) {
+            return -1;
+        }
+    }
+    int loop = target != start;
+    int frame = (int) block->code[0].m;
+    // Main is never called, and a loop can only be taken over at its top
+    if (!block->is_procedure || (!loop && b == tiers->main_block) ||
+        (loop && version->verified.depths[target] != frame) ||
+        version->code_length + block->length + loop > PACKED_OPERAND_MAX) {
+        return -1;
+    }
+
+    // The copy, still relative to its first instruction and calling blocks
+    int length = block->length + loop;
+    instruction *code = malloc(length * sizeof(instruction));
+    if (loop) {
+        code[0] = (instruction) {INC, 0, frame};
+        code[1] = (instruction) {JMP, 0, target - start + 1};
+        for (int i = 1; i < block->length; ++i) {
+            instruction ir = block->code[i];
+            if (ir.opcode == JMP || ir.opcode == JPC) {
+                ir.m++;
+            }
+            code[i + 1] = ir;
+        }
+    } else {
+        memcpy(code, block->code, length * sizeof(instruction));
+    }
+    instruction *before = malloc(length * sizeof(instruction));
+    memcpy(before, code, length * sizeof(instruction));
+    int before_length = length;
+    if (tiers->escaped[b] != NULL) {
+        int promoted_length;
+        instruction *promoted = promote_variables(code, length, tiers->escaped[b], tiers->callees, 0,
+                                                  program->flags, 1, &promoted_length);
+        if (promoted != NULL) {
+            free(code);
+            code = promoted;
+            length = promoted_length;
+        }
+    }
+    code = optimize_block_loops(code, &length, program->flags);
+    // A call copy the optimizer couldn't do anything with is just the original
+    int unchanged = !loop && length == before_length && memcmp(code, before, length * sizeof(instruction)) == 0;
+    free(before);
+    if (unchanged || code[0].m > PACKED_OPERAND_MAX) {
+        free(code);
+        return -1;
+    }
+    // The promoted slots may have shrunk the frame, nested procedures can still reach all of it
+    if (code[0].m < frame) {
+        code[0].m = frame;
+    }
+
+    program_version *next = malloc(sizeof(program_version));
+    int copy_start = version->code_length;
+    next->code_length = copy_start + length;
+    next->code = malloc(next->code_length * sizeof(instruction));
+    memcpy(next->code, version->code, copy_start * sizeof(instruction));
+    for (int i = 0; i < length; ++i) {
+        instruction ir = code[i];
+        if (ir.opcode == JMP || ir.opcode == JPC) {
+            ir.m += copy_start;
+        } else if (ir.opcode == CAL || ir.opcode == TCL) {
+            ir.m = tiers->blocks[ir.m].start;
+        }
+        next->code[copy_start + i] = ir;
+    }
+    free(code);
+    next->num_copies = version->num_copies + 1;
+    next->copies = malloc(next->num_copies * sizeof(procedure_copy));
+    if (version->num_copies > 0) {
+        memcpy(next->copies, version->copies, version->num_copies * sizeof(procedure_copy));
+    }
+    next->copies[version->num_copies] = (procedure_copy) {copy_start, next->code_length - 1, start, target};
+
+    verified_code *verified = &next->verified;
+    verified->depths = malloc(next->code_length * sizeof(int));
+    verified->procedure = malloc(next->code_length * sizeof(int));
+    verified->parent = malloc(next->code_length * sizeof(int));
+    const char *error;
+    int ok = verify_program(next->code, next->code_length, next->copies, next->num_copies, VM_STACK_SIZE, verified,
+                            &error);
+    // Frames were made room for with the stack check as compiled, main's is the whole stack
+    for (int i = copy_start; i < next->code_length && ok && verified->parent[start] >= 0; ++i) {
+        ok = verified->depths[i] <= tiers->max_frame;
+    }
+    if (!ok) {
+        free(next->code);
+        free(next->copies);
+        free(verified->depths);
+        free(verified->procedure);
+        free(verified->parent);
+        free(next);
+        return -1;
+    }
+    verified->max_frame = tiers->max_frame;
+
+    next->text = malloc((next->code_length + 1) * sizeof(uint32_t));
+    memcpy(next->text, version->text, copy_start * sizeof(uint32_t));
+    next->wide = malloc((version->num_wide + 1) * sizeof(instruction));
+    if (version->num_wide > 0) {
+        memcpy(next->wide, version->wide, version->num_wide * sizeof(instruction));
+    }
+    next->num_wide = version->num_wide;
+    pack_code(next, copy_start, program->flags);
+    next->text[target] = PACK(loop ? TIER_LOOP : TIER_CALL, 0, copy_start);
+    // Calls to procedures with call copies skip the TIER_CALL, the copy's own included
+    tiers->copy_at[target] = copy_start;
+    for (int i = 0; i < next->code_length; ++i) {
+        int opcode = PACKED_OPCODE(next->text[i]);
+        int m = PACKED_OPERAND(next->text[i]);
+        if ((opcode == CAL || opcode == TCL) && m < tiers->base_length && tiers->copy_at[m] > 0) {
+            next->text[i] = PACK(opcode, PACKED_LEVEL(next->text[i]), tiers->copy_at[m]);
+        }
+    }
+    hash_version(next);
+    next->older = version;
+    atomic_store_explicit(&program->current, next, memory_order_release);
+    return copy_start;
+}
+
+// Splits the code as compiled into blocks and works out what the optimizer
+// needs to know about each, once for every copy the program will make
+void split_for_copies(tier_state *tiers, program_version *version) {
+    tiers->blocks = split_blocks(version->code, tiers->base_length, &tiers->num_blocks, &tiers->main_block);
+    tiers->escaped = find_escaped(tiers->blocks, tiers->num_blocks, tiers->main_block);
+    tiers->callees = malloc((tiers->num_blocks + 1) * sizeof(call_signature));
+    tiers->block_at = malloc(tiers->base_length * sizeof(int));
+    for (int b = 0; b < tiers->num_blocks; ++b) {
+        procedure whole = {0, tiers->blocks[b].length - 1};
+        tiers->callees[b] = procedure_signature(tiers->blocks[b].code, whole);
+        tiers->block_at[tiers->blocks[b].start] = b;
+    }
+}
+
+void tier_free(tier_state *tiers) {
+    if (tiers == NULL) {
+        return;
+    }
+    if (tiers->blocks != NULL) {
+        for (int b = 0; b < tiers->num_blocks; ++b) {
+            free(tiers->blocks[b].code);
+            free(tiers->escaped[b]);
+        }
+        free(tiers->blocks);
+        free(tiers->escaped);
+        free(tiers->callees);
+        free(tiers->block_at);
+    }
+    pthread_mutex_destroy(&tiers->lock);
+    free(tiers->copy_at);
+    free(tiers);
+}
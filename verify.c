@@ -0,0 +1,407 @@
+/*
+    Bytecode Verifier for PL/0
+    Author: Ryan Doherty
+
+    Checks a program once when it's loaded so the machine doesn't have to
+    check anything while it runs. A verified program can't jump outside
+    its code, read or write outside the frames it can see, pop below its
+    own locals or push past the stack space it was given.
+
+    - every opcode and OPR/SYS number is one the machine knows
+    - jump and call targets land on instructions, and jumps stay inside
+      the procedure they're in
+    - every procedure starts with its only INC, which reserves at least
+      the three link words and its arguments, and main takes none
+    - each procedure is always called at the same nesting depth and with
+      the same static parent, and LOD/STO levels never go above main
+    - tail calls don't fall through and are never to a procedure nested
+      in the caller, since the callee's frame replaces the caller's, or
+      to one that takes arguments or returns differently than the caller
+    - a call pops the callee's arguments and pushes the value a function
+      returns
+    - LOD/STO offsets are inside the frame they address
+    - every LODX/STOX comes straight after a CHK or a LIT of a
+      non-negative index, which nothing jumps past, and the whole array
+      that allows is inside the frame it addresses. Indexes the CHK lets
+      through and constant ones are then always in bounds.
+    - every instruction is reached with the same stack depth on every path
+      and control never falls off the end of a procedure
+
+    A tiered program's optimized copies of its procedures (tier.c) come
+    after its code and are checked like the procedures they're copies of,
+    as if called from the same place. A copy reserves at least the frame
+    of the original, since procedures nested in it can reach that far, and
+    takes and returns the same, except that a loop copy takes over a
+    frame that already holds its arguments. A lazy program's procedures
+    (lazy.c) are copies of their stubs the same way, and can be the only
+    code that calls other stubs.
+
+    Besides the yes or no answer it works out how deep each instruction's
+    stack is (the words above the frame base) and the deepest any frame
+    gets, which is all the machine checks on a call.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include "compiler.h"
+
+int verify_procedure(instruction *code, procedure *procs, int num_procs, int p, int *nesting, int *parent,
+                     char *targets, int *depths, int stack_size, int *max_depth, const char **error);
+int ancestor(int *parent, int p, int levels);
+
+// The arrays in verified need room for code_length entries. copies are in
+// order and make up the end of the code, the rest is the program as compiled.
+int verify_program(instruction *code, int code_length, procedure_copy *copies, int num_copies, int stack_size,
+                   verified_code *verified, const char **error) {
+    int *depths = verified->depths;
+    if (code_length < 2 || code[0].opcode != JMP) {
+        *error = "Program Must Start with a Jump to Main";
+        return 0;
+    }
+
+    for (int i = 0; i < code_length; ++i) {
+        instruction ir = code[i];
+        depths[i] = -1;
+        verified->procedure[i] = -1;
+        verified->parent[i] = -1;
+        if (ir.opcode < LIT || ir.opcode > CHK || ir.l < 0) {
+            *error = "Invalid Instruction";
+            return 0;
+        }
+        if ((ir.opcode == OPR && (ir.m < 0 || ir.m > 14)) || (ir.opcode == SYS && (ir.m < 1 || ir.m > 3)) ||
+            (ir.opcode == CHK && ir.m < 1)) {
+            *error = "Invalid Instruction";
+            return 0;
+        }
+        if ((ir.opcode == JMP || ir.opcode == JPC || ir.opcode == CAL || ir.opcode == TCL) &&
+            (ir.m < 1 || ir.m >= code_length)) {
+            *error = "Jump Target Outside the Program";
+            return 0;
+        }
+    }
+    // Where jumps land, an indexed access there could skip its bounds check
+    char *targets = calloc(code_length, 1);
+    for (int i = 0; i < code_length; ++i) {
+        if (code[i].opcode == JMP || code[i].opcode == JPC) {
+            targets[code[i].m] = 1;
+        }
+    }
+
+    // Copies go after the procedures they were made from, found like any others
+    procedure *procs = malloc(code_length * sizeof(procedure));
+    int base_length = num_copies > 0 ? copies[0].start : code_length;
+    int num_procs = find_base_procedures(code, base_length, code_length, procs);
+    for (int c = 0; c < num_copies; ++c) {
+        procs[num_procs + c] = (procedure) {copies[c].start, copies[c].end};
+    }
+    int num_all = num_procs + num_copies;
+    for (int p = 0; p < num_all; ++p) {
+        if ((p + 1 < num_all && procs[p].end >= procs[p + 1].start) || procs[p].end < procs[p].start ||
+            procs[p].end >= code_length) {
+            *error = "Procedures Overlap";
+            free(procs);
+            free(targets);
+            return 0;
+        }
+    }
+    int *nesting = malloc(num_all * sizeof(int));
+    int *parent = malloc(num_all * sizeof(int));
+    int *order = malloc(num_all * sizeof(int));
+    // The procedure each one is a copy of, itself for the rest
+    int *original = malloc(num_all * sizeof(int));
+    for (int p = 0; p < num_all; ++p) {
+        nesting[p] = -1;
+        original[p] = p;
+    }
+
+    // Walk the call graph from main, the order doubles as the work queue
+    int main_proc = procedure_containing(procs, num_procs, code[0].m);
+    nesting[main_proc] = 0;
+    parent[main_proc] = -1;
+    order[0] = main_proc;
+    int num_reached = 1;
+    int ok = 1;
+    int walked = 0;
+    // Each copy is reached once everything before it has been, what it's a copy
+    // of was called by the code as compiled or by an earlier copy
+    for (int c = -1; c < num_copies && ok; ++c) {
+        if (c >= 0) {
+            int p = num_procs + c;
+            int of = procedure_containing(procs, num_procs, copies[c].original);
+            if (of < 0 || procs[of].start != copies[c].original || nesting[of] < 0) {
+                *error = "Copy of a Procedure That Never Runs";
+                ok = 0;
+                break;
+            }
+            call_signature copy = procedure_signature(code, procs[p]);
+            call_signature from = procedure_signature(code, procs[of]);
+            if (code[procs[p].start].opcode != INC || code[procs[p].start].m < code[procs[of].start].m ||
+                copy.returns != from.returns || copy.params != (copies[c].target != copies[c].original ? 0 : from.params)) {
+                *error = "Copy Doesn't Match Its Procedure";
+                ok = 0;
+                break;
+            }
+            original[p] = of;
+            nesting[p] = nesting[of];
+            parent[p] = parent[of];
+            order[num_reached++] = p;
+        }
+        for (; walked < num_reached && ok; ++walked) {
+            int p = order[walked];
+            for (int i = procs[p].start; i <= procs[p].end && ok; ++i) {
+                if (code[i].opcode != CAL && code[i].opcode != TCL) {
+                    continue;
+                }
+                // Copies are only ever entered by the machine, never called
+                int callee = procedure_containing(procs, num_procs, code[i].m);
+                if (callee < 0 || procs[callee].start != code[i].m) {
+                    *error = "Call Target Isn't a Procedure";
+                    ok = 0;
+                } else if (code[i].l > nesting[p]) {
+                    *error = "Call Level Deeper Than Nesting";
+                    ok = 0;
+                } else if (code[i].opcode == TCL && code[i].l == 0) {
+                    // The callee's static link would be the frame it replaces
+                    *error = "Tail Call to a Nested Procedure";
+                    ok = 0;
+                }
+                if (!ok) {
+                    break;
+                }
+                // The callee's static link is the frame l levels up from the caller,
+                // which for a copy's own frame means the original's
+                int scope = original[ancestor(parent, p, code[i].l)];
+                if (nesting[callee] < 0) {
+                    nesting[callee] = nesting[p] - code[i].l + 1;
+                    parent[callee] = scope;
+                    order[num_reached++] = callee;
+                } else if (parent[callee] != scope) {
+                    *error = "Procedure Called from Different Scopes";
+                    ok = 0;
+                }
+            }
+        }
+    }
+
+    // Procedures nothing calls can never run, so only reached ones are checked
+    verified->max_frame = 0;
+    depths[0] = 0;
+    for (int next = 0; next < num_reached && ok; ++next) {
+        int p = order[next];
+        int max_depth;
+        ok = verify_procedure(code, procs, num_procs, p, nesting, parent, targets, depths, stack_size, &max_depth, error);
+        if (max_depth > verified->max_frame) {
+            verified->max_frame = max_depth;
+        }
+        for (int i = procs[p].start; i <= procs[p].end; ++i) {
+            if (depths[i] >= 0) {
+                verified->procedure[i] = procs[original[p]].start;
+            }
+        }
+        verified->parent[procs[p].start] = parent[p] < 0 ? -1 : procs[parent[p]].start;
+    }
+
+    free(procs);
+    free(nesting);
+    free(parent);
+    free(order);
+    free(original);
+    free(targets);
+    return ok;
+}
+
+// Follows the stack depth through one procedure, filling in depths for its instructions
+int verify_procedure(instruction *code, procedure *procs, int num_procs, int p, int *nesting, int *parent,
+                     char *targets, int *depths, int stack_size, int *max_depth, const char **error) {
+    int start = procs[p].start;
+    int end = procs[p].end;
+    *max_depth = 0;
+    if (code[start].opcode != INC || code[start].m < 3 + code[start].l) {
+        *error = "Procedure Must Start by Reserving Its Frame";
+        return 0;
+    }
+    if (code[start].m > stack_size) {
+        *error = "Frame Larger Than the Stack";
+        return 0;
+    }
+    int frame = (int) code[start].m;
+    int is_main = parent[p] < 0;
+    if (is_main && code[start].l != 0) {
+        *error = "Main Can't Take Arguments";
+        return 0;
+    }
+    int returns = procedure_signature(code, procs[p]).returns;
+
+    int *worklist = malloc((end - start + 1) * sizeof(int));
+    int num_work = 0;
+    depths[start] = 0;
+    worklist[num_work++] = start;
+    while (num_work > 0) {
+        int i = worklist[--num_work];
+        instruction ir = code[i];
+        int depth = depths[i];
+        // Words popped and pushed, and whether control goes on to i + 1 and/or jumps
+        int pops = 0;
+        int pushes = 0;
+        int falls_through = 1;
+        int jumps = 0;
+        switch (ir.opcode) {
+            case LIT:
+                pushes = 1;
+                break;
+            case OPR:
+                if (ir.m == 0 || ir.m == 14) {
+                    if (is_main) {
+                        *error = "Main Can't Return";
+                        free(worklist);
+                        return 0;
+                    }
+                    // A function's value is the last thing popped off its frame
+                    pops = ir.m == 14;
+                    falls_through = 0;
+                } else if (ir.m == 1 || ir.m == 6) {
+                    pops = 1;
+                    pushes = 1;
+                } else {
+                    pops = 2;
+                    pushes = 1;
+                }
+                break;
+            case LOD:
+            case STO:
+            case LODX:
+            case STOX: {
+                if (ir.l > nesting[p]) {
+                    *error = "Variable Level Deeper Than Nesting";
+                    free(worklist);
+                    return 0;
+                }
+                int owner = ancestor(parent, p, ir.l);
+                // A LOD or STO reaches one slot, an indexed one as far as its index can go
+                int64_t extent = 1;
+                if (ir.opcode == LODX || ir.opcode == STOX) {
+                    extent = i - 1 > start && !targets[i] ? indexed_extent(code, i) : 0;
+                    if (extent == 0) {
+                        *error = "Array Access Without a Bounds Check";
+                        free(worklist);
+                        return 0;
+                    }
+                }
+                if (ir.m < 3 || ir.m > code[procs[owner].start].m - extent) {
+                    *error = "Variable Outside Its Frame";
+                    free(worklist);
+                    return 0;
+                }
+                if (ir.opcode == LOD) {
+                    pushes = 1;
+                } else if (ir.opcode == STO) {
+                    pops = 1;
+                } else if (ir.opcode == LODX) {
+                    pops = 1;
+                    pushes = 1;
+                } else {
+                    pops = 2;
+                }
+                break;
+            }
+            case CHK:
+                pops = 1;
+                pushes = 1;
+                break;
+            case CAL:
+            case TCL: {
+                int callee_proc = procedure_containing(procs, num_procs, (int) ir.m);
+                call_signature callee = procedure_signature(code, procs[callee_proc]);
+                if (ir.opcode == CAL) {
+                    pops = callee.params;
+                    pushes = callee.returns;
+                } else if (callee.params > 0 || callee.returns != returns) {
+                    // Nothing is left to move the arguments in or take the value
+                    *error = "Tail Call Changes the Signature";
+                    free(worklist);
+                    return 0;
+                } else {
+                    falls_through = 0;
+                }
+                break;
+            }
+            case INC:
+                if (i != start) {
+                    *error = "Procedure Must Start by Reserving Its Frame";
+                    free(worklist);
+                    return 0;
+                }
+                pushes = frame;
+                break;
+            case JMP:
+                falls_through = 0;
+                jumps = 1;
+                break;
+            case JPC:
+                pops = 1;
+                jumps = 1;
+                break;
+            case SYS:
+                if (ir.m == 1) {
+                    pops = 1;
+                } else if (ir.m == 2) {
+                    pushes = 1;
+                } else {
+                    falls_through = 0;
+                }
+                break;
+        }
+
+        // Popping into the locals (or the links) would let code overwrite them
+        if (i != start && depth - pops < frame) {
+            *error = "Stack Underflow";
+            free(worklist);
+            return 0;
+        }
+        depth = depth - pops + pushes;
+        if (depth > stack_size) {
+            *error = "Stack Overflow";
+            free(worklist);
+            return 0;
+        }
+        if (depth > *max_depth) {
+            *max_depth = depth;
+        }
+
+        int successors[2];
+        int num_successors = 0;
+        if (falls_through) {
+            successors[num_successors++] = i + 1;
+        }
+        if (jumps) {
+            successors[num_successors++] = (int) ir.m;
+        }
+        for (int s = 0; s < num_successors; ++s) {
+            int target = successors[s];
+            if (target <= start || target > end) {
+                *error = falls_through && s == 0 ? "Control Falls Off the End of a Procedure"
+                                                 : "Jump Target Outside Its Procedure";
+                free(worklist);
+                return 0;
+            }
+            if (depths[target] < 0) {
+                depths[target] = depth;
+                worklist[num_work++] = target;
+            } else if (depths[target] != depth) {
+                *error = "Stack Depth Differs Between Paths";
+                free(worklist);
+                return 0;
+            }
+        }
+    }
+    free(worklist);
+    return 1;
+}
+
+// The procedure whose frame is levels static links up from p's
+int ancestor(int *parent, int p, int levels) {
+    while (levels > 0) {
+        p = parent[p];
+        levels--;
+    }
+    return p;
+}
@@ -3,7 +3,8 @@
   Author: Ryan Doherty
 
   An implementation of a virtual PM/0 CPU, a stack machine that runs
-  instructions given in an input file from a command line argument.
+  compiled PL/0 programs. This is the machine behind pl0_instantiate()
+  and friends in pl0.h, the standalone vm executable is in vm_main.c.
 
   It has 4 registers, a program counter (pc), stack pointer (sp),
   base pointer (bp), and a instruction register (ir).
@@ -25,286 +26,353 @@
      #11 = LEQ: 0 if less than or equal to
      #12 = GTR: 0 if greater
      #13 = GEQ: 0 if greater than or equal to
+     #14 = RTV: Return from a function, leaving the value on top of the
+           stack as the caller's new top
   3: LOD L, M: Loads value M from level L to sp (top of stack)
   4: STO L, M: Stores value at sp at M in level L
-  5: CAL L, M: Calls subroutine from L starting at program counter M
-  6: INC 0, M: Increments sp by M (allocates memory on the stack)
-  7: JMP 0, M: Jump to instruction at program counter M
+  5: CAL L, M: Calls subroutine from L starting at instruction M
+  6: INC L, M: Increments sp by M (allocates memory on the stack). The L
+     arguments the caller pushed before calling are moved into slots 3
+     to L + 2 of the frame, so they're popped when it returns
+  7: JMP 0, M: Jump to instruction M
   8: JPC 0, M: Jump if sp == 1
   9: SYS 0, #: Interacts with system.
      #1 = print sp to stdout
      #2 = input to sp from stdin
      #3 = halt machine
+  10: TCL L, M: Tail call, like CAL but the callee's frame replaces the
+      current one so it returns to the current procedure's caller
+  11: LODX L, M: Replaces the index on top of the stack with element index
+      of the array at M in level L
+  12: STOX L, M: Stores the value under the index on top of the stack in
+      element index of the array at M in level L, popping both
+  13: CHK 0, M: Halts with an error unless the index on top of the stack
+      is from 0 to M - 1, leaving it there
+
+  Every LODX and STOX comes straight after either the CHK that bounds its
+  index or a LIT of an index the verifier can see is inside the array.
+
+  Jump and call targets, pc and return addresses count instructions.
+  Instructions are packed into 32-bit words when the program is loaded
+  (see PACK in vm.h), so the machine fetches one word per instruction.
+
+  Programs compiled with --int64 run with 64-bit words, everything else
+  with 32-bit words. Overflow either wraps around or halts the machine
+  with an error (--overflow trap), and division by zero always halts.
+  The mode is read from the bytecode header. The old text format of one
+  "op l m" instruction per line is still accepted and runs as 32-bit,
+  its targets counting 3 words to an instruction as they always have.
+
+  Each machine has its own stack starting at address 0 and reads the
+  program's text without modifying it, so machines never share state.
 */
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#define MAX_PAS_LENGTH 500
+#include <stdint.h>
+#include <limits.h>
+#include "vm.h"
+
+// Most instructions pl0_run() goes without checking for pl0_interrupt()
+#define INTERRUPT_CHUNK (1L << 20)
 
-int base(int L);
+// One fetch execute loop per word size and overflow mode
+#define WORD int32_t
+#define UWORD uint32_t
+#define WORD_MIN INT32_MIN
+#define TRAP 0
+#define VARIANT int32_wrap
+#include "vm_run.h"
+#undef TRAP
+#undef VARIANT
+#define TRAP 1
+#define VARIANT int32_trap
+#include "vm_run.h"
+#undef WORD
+#undef UWORD
+#undef WORD_MIN
+#undef TRAP
+#undef VARIANT
+#define WORD int64_t
+#define UWORD uint64_t
+#define WORD_MIN INT64_MIN
+#define TRAP 0
+#define VARIANT int64_wrap
+#include "vm_run.h"
+#undef TRAP
+#undef VARIANT
+#define TRAP 1
+#define VARIANT int64_trap
+#include "vm_run.h"
 
-int pc = 0;
-int sp;
-int bp;
-int *pas;
-int *ir;
+int stdio_read(void *context, int64_t *value);
+void stdio_write(void *context, int64_t value);
 
-int main(int argc, char **args) {
-    // Allocate machine state
-    pas = calloc(sizeof(int), MAX_PAS_LENGTH);
-    ir = malloc(sizeof(int) * 3);
+pl0_program *program_from_code(instruction *code, int code_length, int flags, const char **error) {
+    // Everything the machine doesn't check while running is checked here
+    verified_code verified;
+    verified.depths = malloc(code_length * sizeof(int));
+    verified.procedure = malloc(code_length * sizeof(int));
+    verified.parent = malloc(code_length * sizeof(int));
+    if (!verify_program(code, code_length, NULL, 0, VM_STACK_SIZE, &verified, error)) {
+        free(verified.depths);
+        free(verified.procedure);
+        free(verified.parent);
+        free(code);
+        return NULL;
+    }
+
+    program_version *version = malloc(sizeof(program_version));
+    version->code_length = code_length;
+    version->code = code;
+    version->verified = verified;
+    version->text = malloc((code_length + 1) * sizeof(uint32_t));
+    version->wide = NULL;
+    version->num_wide = 0;
+    version->copies = NULL;
+    version->num_copies = 0;
+    version->older = NULL;
+    pack_code(version, 0, flags);
+    hash_version(version);
+
+    pl0_program *program = malloc(sizeof(pl0_program));
+    program->flags = flags;
+    atomic_init(&program->current, version);
+    program->tiers = flags & MODE_TIERED ? tier_create(version) : NULL;
+    program->lazy = NULL;
+    return program;
+}
 
-    // Input file into process address space and initialize bp and sp
-    if (argc < 2){
-        printf("No input file given\n");
-        exit(1);
+// Packs the instructions from index from on into the version's text, which
+// has room for them and the halt after them in case pc runs off the end
+void pack_code(program_version *version, int from, int flags) {
+    int wide_capacity = version->num_wide;
+    for (int i = from; i < version->code_length; ++i) {
+        instruction ir = version->code[i];
+        if (!(flags & MODE_INT64)) {
+            ir.m = (int32_t) ir.m;
+        }
+        if (ir.opcode == OPR) {
+            ir.opcode = PACKED_OPR + (int) ir.m;
+        } else if (ir.opcode == SYS) {
+            ir.opcode = PACKED_SYS + (int) ir.m;
+        }
+        if (ir.l >= 0 && ir.l < PACKED_LEVEL_WIDE && ir.m >= PACKED_OPERAND_MIN && ir.m <= PACKED_OPERAND_MAX) {
+            version->text[i] = PACK(ir.opcode, ir.l, ir.m);
+        } else {
+            if (version->num_wide == wide_capacity) {
+                wide_capacity = wide_capacity * 2 + 16;
+                version->wide = realloc(version->wide, wide_capacity * sizeof(instruction));
+            }
+            version->wide[version->num_wide] = ir;
+            version->text[i] = PACK(WIDE, 0, version->num_wide);
+            version->num_wide++;
+        }
     }
+    version->text[version->code_length] = PACK(PACKED_SYS + 3, 0, 3);
+}
+
+// Snapshots record this so they're only restored into the same program
+void hash_version(program_version *version) {
+    version->hash = hash_bytes(HASH_SEED, (char *) version->text, (version->code_length + 1) * sizeof(uint32_t));
+    version->hash = hash_bytes(version->hash, (char *) version->wide, version->num_wide * sizeof(instruction));
+}
+
+// The code machines starting now run, it only changes if the program is tiered or lazy
+program_version *current_version(pl0_program *program) {
+    return atomic_load_explicit(&program->current, memory_order_acquire);
+}
 
-    FILE *inputFile = fopen(args[1], "r");
+program_version *machine_version(pl0_vm *vm) {
+    return vm->profile != NULL ? vm->profile->version : current_version(vm->program);
+}
+
+pl0_program *pl0_load(const char *path, char *error, int error_size) {
+    FILE *inputFile = fopen(path, "rb");
     if (inputFile == NULL) {
-        printf("Can't open file\n");
-        exit(1);
+        if (error != NULL && error_size > 0) {
+            snprintf(error, error_size, "Can't open %s", path);
+        }
+        return NULL;
+    }
+
+    // Bytecode from the compiler starts with a magic number, anything else is text
+    int code_length;
+    int flags = 0;
+    instruction *code = read_bytecode(inputFile, &code_length, &flags);
+    if (code == NULL) {
+        rewind(inputFile);
+        code = read_text_program(inputFile, &code_length);
+    }
+    fclose(inputFile);
+
+    const char *message;
+    pl0_program *program = program_from_code(code, code_length, flags, &message);
+    if (program == NULL && error != NULL && error_size > 0) {
+        snprintf(error, error_size, "Verifier Error: %s", message);
+    }
+    return program;
+}
+
+void pl0_program_free(pl0_program *program) {
+    if (program == NULL) {
+        return;
+    }
+    program_version *version = current_version(program);
+    while (version != NULL) {
+        program_version *older = version->older;
+        free(version->code);
+        free(version->text);
+        free(version->wide);
+        free(version->verified.depths);
+        free(version->verified.procedure);
+        free(version->verified.parent);
+        free(version->copies);
+        free(version);
+        version = older;
+    }
+    tier_free(program->tiers);
+    lazy_free(program->lazy);
+    free(program);
+}
+
+pl0_vm *pl0_instantiate(pl0_program *program, const pl0_host *host) {
+    pl0_vm *vm = malloc(sizeof(pl0_vm));
+    vm->program = program;
+    vm->host.context = host != NULL ? host->context : NULL;
+    vm->host.read = host != NULL && host->read != NULL ? host->read : stdio_read;
+    vm->host.write = host != NULL && host->write != NULL ? host->write : stdio_write;
+    vm->stack_size = VM_STACK_SIZE;
+    vm->stack = malloc(VM_STACK_SIZE * WORD_SIZE(program->flags));
+    vm->heat = program->tiers != NULL ? calloc(program->tiers->base_length, sizeof(uint32_t)) : NULL;
+    vm->profile = NULL;
+    pl0_reset(vm);
+    return vm;
+}
+
+pl0_status pl0_run(pl0_vm *vm, long budget) {
+    static pl0_status (*const run[3][4])(pl0_vm *, long) = {
+        {run_int32_wrap, run_int64_wrap, run_int32_trap, run_int64_trap},
+        {run_tiered_int32_wrap, run_tiered_int64_wrap, run_tiered_int32_trap, run_tiered_int64_trap},
+        {run_profiled_int32_wrap, run_profiled_int64_wrap, run_profiled_int32_trap, run_profiled_int64_trap}};
+    // Finished machines stay finished until they're reset
+    if (vm->status != PL0_PAUSED && vm->status != PL0_WAITING) {
+        return vm->status;
     }
+    // Run in chunks so pl0_interrupt() is noticed even without a budget
+    pl0_status status;
+    do {
+        if (atomic_exchange(&vm->interrupted, 0)) {
+            return vm->status;
+        }
+        long chunk = budget >= 0 && budget < INTERRUPT_CHUNK ? budget : INTERRUPT_CHUNK;
+        int loop = vm->profile != NULL ? 2 : vm->heat != NULL;
+        status = run[loop][vm->program->flags & (MODE_INT64 | MODE_TRAP)](vm, chunk);
+        if (budget > 0) {
+            budget -= chunk;
+        }
+    } while (status == PL0_PAUSED && budget != 0);
+    return status;
+}
+
+pl0_status pl0_step(pl0_vm *vm) {
+    static pl0_status (*const step[])(pl0_vm *) = {step_int32_wrap, step_int64_wrap, step_int32_trap,
+                                                   step_int64_trap};
+    if (vm->status != PL0_PAUSED && vm->status != PL0_WAITING) {
+        return vm->status;
+    }
+    return step[vm->program->flags & (MODE_INT64 | MODE_TRAP)](vm);
+}
+
+void pl0_interrupt(pl0_vm *vm) {
+    atomic_store(&vm->interrupted, 1);
+}
+
+void pl0_reset(pl0_vm *vm) {
+    // Variables start out as 0 like they always have
+    memset(vm->stack, 0, vm->stack_size * WORD_SIZE(vm->program->flags));
+    vm->pc = 0;
+    vm->bp = 0;
+    vm->sp = -1;
+    vm->status = PL0_PAUSED;
+    vm->error = NULL;
+    atomic_store(&vm->wake_state, 0);
+    atomic_store(&vm->interrupted, 0);
+}
+
+const char *pl0_vm_error(pl0_vm *vm) {
+    return vm->error;
+}
+
+void *pl0_vm_context(pl0_vm *vm) {
+    return vm->host.context;
+}
 
+void pl0_vm_free(pl0_vm *vm) {
+    if (vm == NULL) {
+        return;
+    }
+    free(vm->stack);
+    free(vm->heat);
+    free_vm_profile(vm->profile);
+    free(vm);
+}
+
+int64_t vm_stack_word(pl0_vm *vm, int i) {
+    if (vm->program->flags & MODE_INT64) {
+        return ((int64_t *) vm->stack)[i];
+    }
+    return ((int32_t *) vm->stack)[i];
+}
+
+int stdio_read(void *context, int64_t *value) {
+    (void) context;
+    long long input;
+    if (scanf("%lld", &input) != 1) {
+        return 0;
+    }
+    *value = input;
+    return 1;
+}
+
+void stdio_write(void *context, int64_t value) {
+    (void) context;
+    printf("%lld\n", (long long) value);
+}
+
+instruction *read_text_program(FILE *inputFile, int *code_length) {
     int instructionCount = 0;
-    char *currentLine = malloc(11);
-    while (fgets(currentLine, 10, inputFile) != NULL) {
+    int capacity = 64;
+    instruction *code = malloc(capacity * sizeof(instruction));
+    char currentLine[100];
+    while (fgets(currentLine, sizeof(currentLine), inputFile) != NULL) {
         // Chop off newlines
         currentLine[strcspn(currentLine, "\n\r")] = 0;
 
         // Each instruction is assumed to be in the format "opCode level M"
         char *separatedCurrentLine = strtok(currentLine, " ");
-        int op = atoi(separatedCurrentLine);
-        int l = atoi(strtok(NULL, " "));
-        int m = atoi(strtok(NULL, " "));
-
-        // Initialize text section (code section) of our machine
-        pas[instructionCount] = op;
-        pas[instructionCount + 1] = l;
-        pas[instructionCount + 2] = m;
-        instructionCount += 3;
-
-        // Stack pointer is set to first index after text section
-        sp = instructionCount - 1;
-    }
-    bp = sp + 1;
-    int halt = 1;
-
-    printf("\t\t\t\tPC\tBP\tSP\tstack\n");
-    printf("Initial values:\t%d\t%d\t%d\n", pc, bp, sp);
-
-    // Fetch Execute cycle
-    while (pc < bp && halt) {
-        // Fetch
-        int initialPc = pc;
-        ir[0] = pas[pc];
-        ir[1] = pas[pc + 1];
-        ir[2] = pas[pc + 2];
-        pc = pc + 3;
-
-        // Execute
-        char* decodedInstruction = "";
-        switch (ir[0]) {
-            // LIT 0, M: Stores integer M on the top of the stack
-            case 1:
-                decodedInstruction = "LIT";
-                sp = sp + 1;
-                pas[sp] = ir[2];
-                break;
-            // OPR 0, #: Executes various math and function operations
-            case 2:
-                switch (ir[2]) {
-                    case 0: // ReTurN
-                        decodedInstruction = "RTN";
-                        sp = bp - 1;
-                        bp = pas[sp + 2];
-                        pc = pas[sp + 3];
-                        break;
-                    case 1: // NEGative
-                        decodedInstruction = "NEG";
-                        pas[sp] = -1 * pas[sp];
-                        break;
-                    case 2: // ADD
-                        decodedInstruction = "ADD";
-                        sp--;
-                        pas[sp] = pas[sp] + pas[sp + 1];
-                        break;
-                    case 3: // SUBtract
-                        decodedInstruction = "SUB";
-                        sp--;
-                        pas[sp] = pas[sp] - pas[sp + 1];
-                        break;
-                    case 4: // MULtiply
-                        decodedInstruction = "MUL";
-                        sp--;
-                        pas[sp] = pas[sp] * pas[sp + 1];
-                        break;
-                    case 5: // DIVide
-                        decodedInstruction = "DIV";
-                        sp--;
-                        pas[sp] = pas[sp] / pas[sp + 1];
-                        break;
-                    case 6: // ODD
-                        decodedInstruction = "ODD";
-                        pas[sp] = !(pas[sp] % 2);
-                        break;
-                    case 7: // MODulous
-                        decodedInstruction = "MOD";
-                        sp--;
-                        pas[sp] = pas[sp] % pas[sp + 1];
-                        break;
-                    case 8: // EQuaL
-                        decodedInstruction = "EQL";
-                        sp--;
-                        pas[sp] = !(pas[sp] == pas[sp + 1]);
-                        break;
-                    case 9: // NotEQual
-                        decodedInstruction = "NEQ";
-                        sp--;
-                        pas[sp] = !(pas[sp] != pas[sp + 1]);
-                        break;
-                    case 10: // LeSS
-                        decodedInstruction = "LSS";
-                        sp--;
-                        pas[sp] = !(pas[sp] < pas[sp + 1]);
-                        break;
-                    case 11: // Less or EQual to
-                        decodedInstruction = "LEQ";
-                        sp--;
-                        pas[sp] = !(pas[sp] <= pas[sp + 1]);
-                        break;
-                    case 12: // GreaTeR
-                        decodedInstruction = "GTR";
-                        sp--;
-                        pas[sp] = !(pas[sp] > pas[sp + 1]);
-                        break;
-                    case 13: // Greater or EQual to
-                        decodedInstruction = "GEQ";
-                        sp--;
-                        pas[sp] = !(pas[sp] >= pas[sp + 1]);
-                        break;
-                }
-                break;
-            //LOD L, M: Loads M from level L into sp + 1
-            case 3:
-                decodedInstruction = "LOD";
-                sp++;
-                pas[sp] = pas[base(ir[1]) + ir[2]];
-                break;
-            //STO L, M: Stores sp at M in level L
-            case 4:
-                decodedInstruction = "STO";
-                pas[base(ir[1]) + ir[2]] = pas[sp];
-                sp--;
-                break;
-            //CAL L, M: Calls a subroutine from level L starting at instruction M
-            case 5:
-                decodedInstruction = "CAL";
-                pas[sp + 1] = base(ir[1]); // static link
-                pas[sp + 2] = bp; // dynamic link
-                pas[sp + 3] = pc; // return address
-                bp = sp + 1; // move to new activation record
-                pc = ir[2]; // jump to subroutine's instructions
-                break;
-            //INC 0, M: increments sp by M
-            case 6:
-                decodedInstruction = "INC";
-                sp = sp + ir[2];
-                break;
-            // JMP 0, M: jumps to M
-            case 7:
-                decodedInstruction = "JMP";
-                pc = ir[2];
-                break;
-            // JPC 0, M: conditionally jumps to M
-            case 8:
-                decodedInstruction = "JPC";
-                if(pas[sp] == 1){
-                    pc = ir[2];
-                }
-                sp--;
-                break;
-            // SYS 0, #: Interactions with the system
-            case 9:
-                decodedInstruction = "SYS";
-                switch (ir[2]) {
-                    // Outputs top of stack to stdout
-                    case 1:
-                        printf("\nOutput result is: %d", pas[sp]);
-                        sp--;
-                        break;
-                    // Inputs an integer from stdin to the top of the stack
-                    case 2:
-                        sp++;
-                        printf("\nPlease Enter an Integer: ");
-                        scanf("%d", &pas[sp]);
-                        break;
-                    // Halts program
-                    case 3:
-                        halt = 0;
-                        break;
-                }
-                break;
-        }
-        printf("\n%d\t%s   %d\t%d\t%d\t%d\t%d\t", initialPc, decodedInstruction, ir[1], ir[2], pc, bp, sp);
-
-        // Find deepest Activation Record to print in proper format
-        int levelCount = 0;
-        int numStaticLinks = 0;
-
-        // Some ARs have the same static link (as in fact.txt) so we count by dynamic links
-        while (base(numStaticLinks) != 0){
-            int index = pas[base(numStaticLinks) + 1];
-            while (index != pas[base(numStaticLinks)]){
-                index = pas[index + 1];
-                levelCount++;
-            }
-            numStaticLinks++;
-            levelCount++;
+        char *level = strtok(NULL, " ");
+        char *m = strtok(NULL, " ");
+        if (separatedCurrentLine == NULL || level == NULL || m == NULL) {
+            continue;
         }
 
-        for(int i = levelCount; i > 0; i--){
-            // Find the sp for each AR. The sp for the current AR is the bp of the AR above it
-            int topOfCurrentAR = sp;
-            int bottom = bp;
-            if(i != 1){
-                // Some ARs have the same static link (as in fact.txt) so we count by dynamic links
-                int count = 0;
-                int arIndex = bp;
-                int lastArIndex = sp;
-                while (count != i - 1){
-                    lastArIndex = arIndex;
-                    arIndex = pas[arIndex + 1];
-                    count++;
-                }
-                topOfCurrentAR = lastArIndex - 1;
-                bottom = arIndex;
-            }
-            for(int j = bottom; j < topOfCurrentAR + 1; j++){
-                printf("%d ", pas[j]);
-            }
-            if (i != 1){
-                // Don't print extra | if CAL
-                if(!(ir[0] == 5 && i == 2)){
-                    printf("| ");
-                }
-            }
+        if (instructionCount == capacity) {
+            capacity *= 2;
+            code = realloc(code, capacity * sizeof(instruction));
         }
+        code[instructionCount].opcode = atoi(separatedCurrentLine);
+        code[instructionCount].l = atoi(level);
+        code[instructionCount].m = strtoll(m, NULL, 10);
+        // Targets in the text format count words, 3 to an instruction. One that
+        // falls inside an instruction is made negative so the verifier rejects it.
+        int opcode = code[instructionCount].opcode;
+        if (opcode == JMP || opcode == JPC || opcode == CAL || opcode == TCL) {
+            int64_t target = code[instructionCount].m;
+            code[instructionCount].m = target % 3 == 0 ? target / 3 : -1;
+        }
+        instructionCount++;
     }
-    printf("\n");
-    // Being good and freeing my memory
-    fclose(inputFile);
-    free(currentLine);
-    free(pas);
+    *code_length = instructionCount;
+    return code;
 }
-
-int base(int L)
-{
-    int arb = bp; // arb = activation record base
-    while (L > 0) //find base L levels down
-    {
-        arb = pas[arb];
-        L--;
-    }
-    return arb;
-}
\ No newline at end of file
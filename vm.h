@@ -0,0 +1,151 @@
+/*
+    Virtual Machine Internals for PL/0
+    Author: Ryan Doherty
+
+    The structures behind the opaque handles in pl0.h, shared by the
+    library and the standalone vm so it can print traces.
+*/
+#ifndef VM_H
+#define VM_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include "pl0.h"
+#include "compiler.h"
+
+// Calls or backward jumps landing on an instruction before a tiered program
+// optimizes the code there, the differential test builds a machine with a low one
+#ifndef TIER_THRESHOLD
+#define TIER_THRESHOLD 1000
+#endif
+// Bytes in a machine word for the given mode flags
+#define WORD_SIZE(flags) ((flags) & MODE_INT64 ? sizeof(int64_t) : sizeof(int32_t))
+
+// The machine runs instructions packed into 32 bits each: the opcode in the
+// low 8 bits, then L in 4 bits (up to 14) and M as a signed 20-bit number.
+// OPR and SYS get an opcode per operation so the machine only dispatches
+// once. One that doesn't fit is packed as a WIDE instruction whose M indexes
+// the program's wide table, where the whole instruction is kept.
+#define WIDE 0
+#define PACKED_OPR 16 // OPR 0, # is opcode PACKED_OPR + #
+#define PACKED_SYS 32 // SYS 0, # is opcode PACKED_SYS + #
+#define PACKED_LEVEL_WIDE 15 // L is never packed as this, it stands for the L in the wide table
+#define PACKED_OPERAND_MIN (-(1 << 19))
+#define PACKED_OPERAND_MAX ((1 << 19) - 1)
+#define PACK(opcode, l, m) ((uint32_t) (opcode) | (uint32_t) (l) << 8 | (uint32_t) (m) << 12)
+#define PACKED_OPCODE(word) ((int) ((word) & 0xFF))
+#define PACKED_LEVEL(word) ((int) ((word) >> 8 & 0xF))
+#define PACKED_OPERAND(word) ((int32_t) (word) >> 12)
+// Only ever packed, tier.c puts them where a tiered program's optimized copies take over
+#define TIER_CALL 14 // in place of a procedure's INC, goes on to the call copy at M
+#define TIER_LOOP 15 // in place of a loop's first instruction, moves the frame into the loop copy at M
+// OPR's number, which is free once OPR is packed as PACKED_OPR + #. lazy.c puts it
+// in place of a lazy program's stubs until the procedure they stand for is generated.
+#define LAZY_CALL 2
+
+// The code a program runs. A tiered program gets a new version each time it
+// adds a copy, which only ever adds code, replaces packed words with
+// TIER_CALL and TIER_LOOP and points packed calls at call copies, and a lazy
+// program each time it generates a procedure, the same way. It keeps the
+// older ones for machines that are still running them until it's freed.
+typedef struct program_version {
+    int code_length;
+    instruction *code;
+    // Every instruction packed into a word followed by a halt, so pc indexes it directly
+    uint32_t *text;
+    // Instructions too wide to pack, with M already cut to the word size
+    instruction *wide;
+    int num_wide;
+    uint64_t hash; // of text and wide
+    verified_code verified;
+    procedure_copy *copies;
+    int num_copies;
+    struct program_version *older;
+} program_version;
+
+// What a tiered program keeps for making copies, see tier.c
+typedef struct tier_state {
+    pthread_mutex_t lock; // held while a copy is made
+    int base_length;      // instructions as compiled, the ones machines count
+    int max_frame;        // the deepest any frame got as compiled, no copy goes deeper
+    int *copy_at;         // per instruction, the copy that takes over there, 0 for none yet or -1 for none ever
+    code_block *blocks;   // the code as compiled in blocks, split on the first copy
+    int num_blocks;
+    int main_block;
+    int *block_at;        // per procedure start, its block
+    char **escaped;
+    call_signature *callees;
+} tier_state;
+
+// What a lazy program keeps for generating its procedures, see lazy.c
+typedef struct lazy_state {
+    pthread_mutex_t lock;   // held while a procedure is generated
+    int base_length;        // instructions as compiled, main and the stubs
+    int *body_at;           // per stub, where its procedure starts, 0 for not yet or -1 for never
+    codegen_state *codegen; // the parse and declarations the procedures are generated from
+} lazy_state;
+
+// What a machine counts after pl0_profile(), per instruction of the code
+// as compiled, which is what a profiled machine runs (see profile.c)
+typedef struct vm_profile {
+    program_version *version;
+    uint64_t *executed; // times each instruction ran
+    uint64_t *taken;    // times each JPC jumped
+} vm_profile;
+
+struct pl0_program {
+    int flags;
+    _Atomic(program_version *) current;
+    tier_state *tiers; // NULL unless the program is tiered
+    lazy_state *lazy;  // NULL unless procedures are generated as they're called
+};
+
+struct pl0_vm {
+    pl0_program *program;
+    pl0_host host;
+    void *stack;
+    int stack_size;
+    int pc;
+    int bp;
+    int sp;
+    pl0_status status;
+    const char *error;
+    // For tiered programs, how many calls and backward jumps landed on each instruction
+    uint32_t *heat;
+    vm_profile *profile; // NULL unless pl0_profile() was called
+    // Handshake between a scheduler parking the machine and pl0_wake()
+    atomic_int wake_state;
+    // Set by pl0_interrupt(), possibly from a signal handler
+    atomic_int interrupted;
+};
+
+struct pl0_incremental {
+    int flags;
+    memo_table blocks; // generated procedures by source
+    memo_table ssa;    // promoted procedures by their code before and what they call
+    memo_table loops;  // loop optimized procedures by their code before
+};
+
+// Takes ownership of code. Returns NULL and sets error if the code doesn't verify.
+pl0_program *program_from_code(instruction *code, int code_length, int flags, const char **error);
+void pack_code(program_version *version, int from, int flags);
+void hash_version(program_version *version);
+program_version *current_version(pl0_program *program);
+instruction *read_text_program(FILE *inputFile, int *code_length);
+// Reads stack word i of the machine whatever its word size
+int64_t vm_stack_word(pl0_vm *vm, int i);
+instruction *incremental_ssa(pl0_incremental *session, instruction *code, int *code_length, int cse);
+instruction *incremental_loops(pl0_incremental *session, instruction *code, int *code_length);
+tier_state *tier_create(program_version *version);
+void tier_up(pl0_program *program, int target);
+void tier_free(tier_state *tiers);
+lazy_state *lazy_create(program_version *version, codegen_state *codegen);
+void lazy_up(pl0_program *program, int stub);
+void lazy_free(lazy_state *lazy);
+// Generates the procedure at a lazy program's stub, behind the compile lock
+instruction *compile_procedure(codegen_state *codegen, int stub, int *length);
+// The code a machine runs, the code as compiled for a profiled one
+program_version *machine_version(pl0_vm *vm);
+void free_vm_profile(vm_profile *profile);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+  P-machine (PM/0) Command Line
+  Author: Ryan Doherty
+
+  Runs a program given in an input file from a command line argument
+  on the machine in vm.c, printing the registers and stack after every
+  instruction. Pass -q before the file to only print the program's output.
+
+  --checkpoint <file> saves a snapshot of the machine to file and stops
+  when the vm gets SIGINT or SIGTERM, --resume <file> carries on from one.
+  --profile <file> adds how often each instruction ran to the profile in
+  file, for compiling the program again with pl0 --profile-use.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include "vm.h"
+
+pl0_vm *running_vm;
+volatile sig_atomic_t stop_requested = 0;
+
+int console_read(void *context, int64_t *value);
+void console_write(void *context, int64_t value);
+char *instruction_name(instruction ir);
+void print_trace(pl0_vm *vm, int pc);
+void request_stop(int signal_number);
+int save_snapshot(pl0_vm *vm, char *path);
+int load_snapshot(pl0_vm *vm, char *path);
+
+int main(int argc, char **args) {
+    int trace = 1;
+    char *filename = NULL;
+    char *checkpoint = NULL;
+    char *resume = NULL;
+    char *profile = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(args[i], "-q") == 0) {
+            trace = 0;
+        } else if (strcmp(args[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint = args[++i];
+        } else if (strcmp(args[i], "--resume") == 0 && i + 1 < argc) {
+            resume = args[++i];
+        } else if (strcmp(args[i], "--profile") == 0 && i + 1 < argc) {
+            profile = args[++i];
+        } else {
+            filename = args[i];
+        }
+    }
+
+    if (filename == NULL){
+        printf("No input file given\n");
+        exit(1);
+    }
+
+    char error[256];
+    pl0_program *program = pl0_load(filename, error, sizeof(error));
+    if (program == NULL) {
+        printf("%s\n", error);
+        exit(1);
+    }
+
+    pl0_host host = {NULL, console_read, console_write};
+    pl0_vm *vm = pl0_instantiate(program, &host);
+    if (profile != NULL) {
+        pl0_profile(vm);
+    }
+    if (resume != NULL && !load_snapshot(vm, resume)) {
+        printf("Can't resume from %s\n", resume);
+        exit(1);
+    }
+    if (checkpoint != NULL) {
+        running_vm = vm;
+        signal(SIGINT, request_stop);
+        signal(SIGTERM, request_stop);
+    }
+
+    pl0_status status;
+    if (trace) {
+        printf("\t\t\t\tPC\tBP\tSP\tstack\n");
+        printf("Initial values:\t%d\t%d\t%d\n", vm->pc, vm->bp, vm->sp);
+        do {
+            int pc = vm->pc;
+            status = pl0_step(vm);
+            if (status == PL0_ERROR) {
+                printf("\nRuntime Error: %s", pl0_vm_error(vm));
+            }
+            print_trace(vm, pc);
+        } while (status == PL0_PAUSED && !stop_requested);
+    } else {
+        // Only comes back early when interrupted
+        status = pl0_run(vm, -1);
+        if (status == PL0_ERROR) {
+            printf("\nRuntime Error: %s", pl0_vm_error(vm));
+        }
+    }
+    printf("\n");
+
+    if (stop_requested && status == PL0_PAUSED) {
+        if (save_snapshot(vm, checkpoint)) {
+            printf("Saved snapshot to %s\n", checkpoint);
+        } else {
+            printf("Can't write %s\n", checkpoint);
+        }
+    }
+
+    if (profile != NULL && !pl0_save_profile(vm, profile)) {
+        printf("Can't write %s\n", profile);
+    }
+
+    // Being good and freeing my memory
+    pl0_vm_free(vm);
+    pl0_program_free(program);
+    return 0;
+}
+
+void request_stop(int signal_number) {
+    (void) signal_number;
+    stop_requested = 1;
+    pl0_interrupt(running_vm);
+}
+
+int save_snapshot(pl0_vm *vm, char *path) {
+    long size = pl0_snapshot(vm, NULL, 0);
+    char *buffer = malloc(size);
+    pl0_snapshot(vm, buffer, size);
+    FILE *file = fopen(path, "wb");
+    int saved = file != NULL && fwrite(buffer, 1, size, file) == (size_t) size;
+    if (file != NULL && fclose(file) != 0) {
+        saved = 0;
+    }
+    free(buffer);
+    return saved;
+}
+
+int load_snapshot(pl0_vm *vm, char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    int capacity = 4096;
+    long size = 0;
+    char *buffer = malloc(capacity);
+    size_t read;
+    while ((read = fread(buffer + size, 1, capacity - size, file)) > 0) {
+        size += read;
+        if (size == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+    }
+    fclose(file);
+    int restored = pl0_restore(vm, buffer, size);
+    free(buffer);
+    return restored;
+}
+
+int console_read(void *context, int64_t *value) {
+    (void) context;
+    long long input;
+    printf("\nPlease Enter an Integer: ");
+    if (scanf("%lld", &input) != 1) {
+        return 0;
+    }
+    *value = input;
+    return 1;
+}
+
+void console_write(void *context, int64_t value) {
+    (void) context;
+    printf("\nOutput result is: %lld", (long long) value);
+}
+
+char *instruction_name(instruction ir) {
+    static char *opr_names[] = {"RTN", "NEG", "ADD", "SUB", "MUL", "DIV", "ODD",
+                                "MOD", "EQL", "NEQ", "LSS", "LEQ", "GTR", "GEQ", "RTV"};
+    static char *names[] = {"", "LIT", "OPR", "LOD", "STO", "CAL", "INC", "JMP", "JPC", "SYS", "TCL", "LODX", "STOX", "CHK"};
+    if (ir.opcode == OPR && ir.m >= 0 && ir.m <= 14) {
+        return opr_names[ir.m];
+    }
+    if (ir.opcode >= LIT && ir.opcode <= CHK) {
+        return names[ir.opcode];
+    }
+    return "";
+}
+
+// Prints the instruction at pc and the registers and stack after it ran
+void print_trace(pl0_vm *vm, int pc) {
+    instruction ir = {0, 0, 0};
+    program_version *version = current_version(vm->program);
+    if (pc < version->code_length) {
+        ir = version->code[pc];
+    }
+    printf("\n%d\t%s   %d\t%lld\t%d\t%d\t%d\t", pc, instruction_name(ir), ir.l, (long long) ir.m,
+           vm->pc, vm->bp, vm->sp);
+    if (vm->status == PL0_ERROR) {
+        return;
+    }
+
+    // Collect activation record bases by following dynamic links down to main
+    int num_frames = 1;
+    for (int bp = vm->bp; bp > 0; bp = (int) vm_stack_word(vm, bp + 1)) {
+        num_frames++;
+    }
+    int *frames = malloc(num_frames * sizeof(int));
+    int frame = num_frames - 1;
+    for (int bp = vm->bp; bp > 0; bp = (int) vm_stack_word(vm, bp + 1)) {
+        frames[frame--] = bp;
+    }
+    frames[0] = 0;
+
+    // Each record runs up to the next one, the newest up to sp
+    for (int i = 0; i < num_frames; ++i) {
+        int top = i + 1 < num_frames ? frames[i + 1] - 1 : vm->sp;
+        if (i > 0 && top >= frames[i]) {
+            printf("| ");
+        }
+        for (int j = frames[i]; j <= top; ++j) {
+            printf("%lld ", (long long) vm_stack_word(vm, j));
+        }
+    }
+    free(frames);
+}
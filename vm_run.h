@@ -0,0 +1,463 @@
+/*
+  Fetch Execute cycle of the P-machine.
+
+  vm.c includes this file once for each word size and overflow mode so
+  every combination gets its own loop and 32-bit programs don't pay for
+  64-bit words or overflow checks. The includer defines:
+  WORD, UWORD  signed and unsigned machine word
+  WORD_MIN     smallest word, the one value whose negation overflows
+  TRAP         1 to halt with an error on overflow, 0 to wrap around
+  VARIANT      suffix for this variant's function names
+
+  Programs are verified before they can be run (verify.c), so jumps,
+  variable addresses and stack depths are known to be good and the only
+  runtime checks left are that a called procedure's frame fits on the
+  stack and the CHK in front of an array access the verifier couldn't
+  prove was in bounds.
+
+  Each instruction is one packed word (PACK in vm.h), decoded as it's
+  fetched. The few too wide to pack have their opcode, L and M read from
+  the wide table instead.
+
+  The top of the stack lives in a local (tos) rather than in stack[sp],
+  so operations take one operand from memory instead of two and don't
+  write their result back. Everything below the top is always in memory.
+  The top is written out before anything that could read stack[sp] from
+  memory (a load of a variable, a call, and leaving the loop) and read
+  back whenever sp drops to a word that's in memory.
+
+  The budget is only checked at backward jumps and calls (tail calls
+  included), the only ways a program can run for long, so straight-line
+  code runs without checks. A backward jump charges the length of the
+  loop it closes and a call charges 1, which keeps the count close to the
+  instructions executed.
+
+  Tiered programs run a loop of their own that also counts, at the same
+  places, where each call and backward jump lands in the code as it was
+  compiled. When a count reaches TIER_THRESHOLD tier_up() adds an
+  optimized copy of the procedure there (tier.c) and the machine carries
+  on in the new version of the code, whose TIER_CALL or TIER_LOOP at that
+  instruction sends it into the copy.
+
+  A profiled machine (pl0_profile()) runs a third loop, which counts every
+  instruction it runs and every JPC that jumps and never tiers up.
+
+  A lazy program's procedures are generated when they're first called, in
+  any loop: calling one that hasn't been yet runs the LAZY_CALL at its stub,
+  which has lazy_up() generate it (lazy.c), and the machine carries on in
+  the new version of the code at the same stub, now a TIER_CALL.
+*/
+#define VM_CONCAT_(a, b) a##_##b
+#define VM_CONCAT(a, b) VM_CONCAT_(a, b)
+#define VM_NAME(name) VM_CONCAT(name, VARIANT)
+// Status while the loop is still going, never returned
+#define VM_RUNNING -1
+// L of the instruction being run. It's only decoded by the instructions that
+// use it, and one too deep to pack was left in wide_level by the wide table.
+#define VM_LEVEL(word) (PACKED_LEVEL(word) == PACKED_LEVEL_WIDE ? wide_level : PACKED_LEVEL(word))
+// Counts a call or backward jump to target in a tiered program, and when it
+// gets hot switches to the version with a copy that takes over there
+#define VM_COUNT(target)                                                             \
+    if (tiered && (target) < base_length && ++heat[target] == TIER_THRESHOLD) {      \
+        tier_up(vm->program, (int) (target));                                        \
+        version = current_version(vm->program);                                     \
+        text = version->text;                                                        \
+        wide = version->wide;                                                        \
+    }
+
+static int VM_NAME(base)(WORD *stack, int bp, int L) {
+    int arb = bp; // arb = activation record base
+    while (L > 0) //find base L levels down
+    {
+        arb = (int) stack[arb];
+        L--;
+    }
+    return arb;
+}
+
+// single_step, tiered and profiled are constants in the run functions so their checks fold away
+static inline __attribute__((always_inline)) pl0_status VM_NAME(execute)(pl0_vm *vm, long budget,
+                                                                        const int single_step, const int tiered,
+                                                                        const int profiled) {
+    // Registers live in locals while running and go back in the machine after
+    program_version *version = machine_version(vm);
+    const uint32_t *text = version->text;
+    const instruction *wide = version->wide;
+    WORD *stack = vm->stack;
+    int stack_size = vm->stack_size;
+    // Copies never go deeper than this, so it only changes when a lazy program adds a procedure
+    int max_frame = version->verified.max_frame;
+    uint32_t *heat = vm->heat;
+    int base_length = tiered ? vm->program->tiers->base_length : 0;
+    uint64_t *executed = profiled ? vm->profile->executed : NULL;
+    uint64_t *taken = profiled ? vm->profile->taken : NULL;
+    int pc = vm->pc;
+    int sp = vm->sp;
+    int bp = vm->bp;
+    // sp is -1 until main reserves its frame
+    WORD tos = sp >= 0 ? stack[sp] : 0;
+    int status = VM_RUNNING;
+    const char *error = NULL;
+    long fuel = budget < 0 ? LONG_MAX : budget;
+    int wide_level = 0;
+
+    while (status == VM_RUNNING) {
+        // Fetch and decode
+        uint32_t word = text[pc];
+        if (profiled) {
+            executed[pc]++;
+        }
+        pc = pc + 1;
+        int opcode = PACKED_OPCODE(word);
+        WORD m = PACKED_OPERAND(word);
+
+        // An instruction too wide to pack comes from the wide table
+        if (__builtin_expect(opcode == WIDE, 0)) {
+            wide_level = wide[m].l;
+            word = PACK(WIDE, PACKED_LEVEL_WIDE, 0);
+            opcode = wide[m].opcode;
+            m = (WORD) wide[m].m;
+        }
+
+        // Execute
+        switch (opcode) {
+            // LIT 0, M: Stores integer M on the top of the stack
+            case 1:
+                stack[sp] = tos;
+                sp = sp + 1;
+                tos = m;
+                break;
+            // OPR 0, #: Executes various math and function operations, one opcode each
+            case PACKED_OPR + 0: // ReTurN
+                sp = bp - 1;
+                bp = (int) stack[sp + 2];
+                pc = (int) stack[sp + 3];
+                tos = stack[sp];
+                break;
+            case PACKED_OPR + 14: // ReTurn Value
+                // The value on top takes the place of the frame, so the caller
+                // finds it where the static link was
+                sp = bp;
+                bp = (int) stack[sp + 1];
+                pc = (int) stack[sp + 2];
+                break;
+            case PACKED_OPR + 1: // NEGative
+#if TRAP
+                if (tos == WORD_MIN) {
+                    status = PL0_ERROR;
+                    error = "Integer Overflow";
+                    break;
+                }
+#endif
+                tos = (WORD) (0 - (UWORD) tos);
+                break;
+            case PACKED_OPR + 2: // ADD
+                sp--;
+#if TRAP
+                if (__builtin_add_overflow(stack[sp], tos, &tos)) {
+                    status = PL0_ERROR;
+                    error = "Integer Overflow";
+                }
+#else
+                tos = (WORD) ((UWORD) stack[sp] + (UWORD) tos);
+#endif
+                break;
+            case PACKED_OPR + 3: // SUBtract
+                sp--;
+#if TRAP
+                if (__builtin_sub_overflow(stack[sp], tos, &tos)) {
+                    status = PL0_ERROR;
+                    error = "Integer Overflow";
+                }
+#else
+                tos = (WORD) ((UWORD) stack[sp] - (UWORD) tos);
+#endif
+                break;
+            case PACKED_OPR + 4: // MULtiply
+                sp--;
+#if TRAP
+                if (__builtin_mul_overflow(stack[sp], tos, &tos)) {
+                    status = PL0_ERROR;
+                    error = "Integer Overflow";
+                }
+#else
+                tos = (WORD) ((UWORD) stack[sp] * (UWORD) tos);
+#endif
+                break;
+            case PACKED_OPR + 5: // DIVide
+            case PACKED_OPR + 7: // MODulous
+                sp--;
+                if (tos == 0) {
+                    // The dividend is left on top like it was before the check
+                    status = PL0_ERROR;
+                    error = "Division by Zero";
+                    tos = stack[sp];
+                } else if (stack[sp] == WORD_MIN && tos == -1) {
+                    // The only quotient that doesn't fit in a word
+#if TRAP
+                    status = PL0_ERROR;
+                    error = "Integer Overflow";
+                    tos = stack[sp];
+#else
+                    tos = opcode == PACKED_OPR + 5 ? WORD_MIN : 0;
+#endif
+                } else if (opcode == PACKED_OPR + 5) {
+                    tos = stack[sp] / tos;
+                } else {
+                    tos = stack[sp] % tos;
+                }
+                break;
+            case PACKED_OPR + 6: // ODD
+                tos = !(tos % 2);
+                break;
+            case PACKED_OPR + 8: // EQuaL
+                sp--;
+                tos = !(stack[sp] == tos);
+                break;
+            case PACKED_OPR + 9: // NotEQual
+                sp--;
+                tos = !(stack[sp] != tos);
+                break;
+            case PACKED_OPR + 10: // LeSS
+                sp--;
+                tos = !(stack[sp] < tos);
+                break;
+            case PACKED_OPR + 11: // Less or EQual to
+                sp--;
+                tos = !(stack[sp] <= tos);
+                break;
+            case PACKED_OPR + 12: // GreaTeR
+                sp--;
+                tos = !(stack[sp] > tos);
+                break;
+            case PACKED_OPR + 13: // Greater or EQual to
+                sp--;
+                tos = !(stack[sp] >= tos);
+                break;
+            //LOD L, M: Loads M from level L into sp + 1
+            case 3:
+                stack[sp] = tos;
+                sp++;
+                tos = stack[VM_NAME(base)(stack, bp, VM_LEVEL(word)) + m];
+                break;
+            //STO L, M: Stores sp at M in level L
+            case 4:
+                // The store can land on the word that becomes the top, so it goes first
+                stack[VM_NAME(base)(stack, bp, VM_LEVEL(word)) + m] = tos;
+                sp--;
+                tos = stack[sp];
+                break;
+            //LODX L, M: Replaces the index on top with element index of the array at M in level L
+            case 11:
+                // The verifier made sure the element is inside the frame and below the index
+                tos = stack[VM_NAME(base)(stack, bp, VM_LEVEL(word)) + m + tos];
+                break;
+            //STOX L, M: Stores the value under the index into element index of the array at M in level L
+            case 12:
+                stack[VM_NAME(base)(stack, bp, VM_LEVEL(word)) + m + tos] = stack[sp - 1];
+                sp = sp - 2;
+                tos = stack[sp];
+                break;
+            //CHK 0, M: Halts unless the index on top is from 0 to M - 1
+            case 13:
+                if ((UWORD) tos >= (UWORD) m) {
+                    status = PL0_ERROR;
+                    error = "Array Index Out of Bounds";
+                }
+                break;
+            //CAL L, M: Calls a subroutine from level L starting at instruction M
+            case 5:
+                // The only stack check: the callee's whole frame has to fit
+                if (sp + max_frame >= stack_size) {
+                    status = PL0_ERROR;
+                    error = "Stack Overflow";
+                    break;
+                }
+                stack[sp] = tos; // the callee can see the caller's variables
+                stack[sp + 1] = VM_NAME(base)(stack, bp, VM_LEVEL(word)); // static link
+                stack[sp + 2] = bp; // dynamic link
+                stack[sp + 3] = pc; // return address
+                bp = sp + 1; // move to new activation record
+                pc = (int) m; // jump to subroutine's instructions
+                if (--fuel <= 0) {
+                    status = PL0_PAUSED;
+                }
+                VM_COUNT(m);
+                break;
+            //TCL L, M: Calls M from level L in place of the current procedure
+            case 10:
+                // The frame is reused as is, so it's already known to fit. The dynamic
+                // link and return address stay so the callee returns to our caller.
+                stack[bp] = VM_NAME(base)(stack, bp, VM_LEVEL(word));
+                sp = bp - 1;
+                tos = stack[sp];
+                pc = (int) m;
+                if (--fuel <= 0) {
+                    status = PL0_PAUSED;
+                }
+                VM_COUNT(m);
+                break;
+            //INC L, M: moves the L arguments under the frame into it and increments sp by M
+            case 6: {
+                if (sp >= 0) {
+                    stack[sp] = tos;
+                }
+                int params = VM_LEVEL(word);
+                if (params > 0) {
+                    // The links go under the arguments so they end up in slots 3 on
+                    WORD static_link = stack[bp];
+                    WORD dynamic_link = stack[bp + 1];
+                    WORD return_address = stack[bp + 2];
+                    for (int i = params - 1; i >= 0; --i) {
+                        stack[bp - params + 3 + i] = stack[bp - params + i];
+                    }
+                    bp = bp - params;
+                    stack[bp] = static_link;
+                    stack[bp + 1] = dynamic_link;
+                    stack[bp + 2] = return_address;
+                }
+                sp = sp + (int) m - params;
+                tos = stack[sp];
+                break;
+            }
+            // JMP 0, M: jumps to M
+            case 7:
+                if (m < pc) {
+                    fuel -= pc - m;
+                    if (fuel <= 0) {
+                        status = PL0_PAUSED;
+                    }
+                    VM_COUNT(m);
+                }
+                pc = (int) m;
+                break;
+            // JPC 0, M: conditionally jumps to M
+            case 8: {
+                WORD condition = tos;
+                sp--;
+                tos = stack[sp];
+                if (condition == 1) {
+                    if (profiled) {
+                        taken[pc - 1]++;
+                    }
+                    if (m < pc) {
+                        fuel -= pc - m;
+                        if (fuel <= 0) {
+                            status = PL0_PAUSED;
+                        }
+                        VM_COUNT(m);
+                    }
+                    pc = (int) m;
+                }
+                break;
+            }
+            // TIER_CALL: the procedure has a call copy, which starts at M
+            case TIER_CALL:
+                pc = (int) m;
+                break;
+            // LAZY_CALL: the procedure called hasn't been generated yet. It may need more stack
+            // than any before it, which the call didn't make room for.
+            case LAZY_CALL:
+                lazy_up(vm->program, pc - 1);
+                version = current_version(vm->program);
+                text = version->text;
+                wide = version->wide;
+                max_frame = version->verified.max_frame;
+                pc = pc - 1;
+                if (bp - 1 + max_frame >= stack_size) {
+                    status = PL0_ERROR;
+                    error = "Stack Overflow";
+                } else if (PACKED_OPCODE(text[pc]) == LAZY_CALL) {
+                    status = PL0_ERROR;
+                    error = "Procedure Failed to Compile";
+                }
+                break;
+            // TIER_LOOP: the loop starting here has a loop copy at M. Nothing is on the
+            // stack but the frame, which the copy starts with, so only the slots its INC
+            // adds on top are left to reserve.
+            case TIER_LOOP:
+                stack[sp] = tos;
+                sp = bp + PACKED_OPERAND(text[m]) - 1;
+                tos = stack[sp];
+                pc = (int) m + 1;
+                break;
+            // SYS 0, #: Interactions with the system, one opcode each
+            // Outputs top of stack
+            case PACKED_SYS + 1:
+                vm->host.write(vm->host.context, tos);
+                sp--;
+                tos = stack[sp];
+                break;
+            // Inputs an integer to the top of the stack
+            case PACKED_SYS + 2: {
+                int64_t input;
+                int got = vm->host.read(vm->host.context, &input);
+                if (got < 0) {
+                    // Try the read again when the machine is resumed
+                    pc = pc - 1;
+                    status = PL0_WAITING;
+                    break;
+                }
+                if (got == 0) {
+                    status = PL0_ERROR;
+                    error = "No Input";
+                    break;
+                }
+#if TRAP
+                if (input != (WORD) input) {
+                    status = PL0_ERROR;
+                    error = "Integer Overflow";
+                    break;
+                }
+#endif
+                stack[sp] = tos;
+                sp++;
+                tos = (WORD) input;
+                break;
+            }
+            // Halts program
+            case PACKED_SYS + 3:
+                status = PL0_HALTED;
+                break;
+            default:
+                __builtin_unreachable();
+        }
+        if (single_step && status == VM_RUNNING) {
+            status = PL0_PAUSED;
+        }
+    }
+
+    // Everything needed to pick up where we left off is in the registers and stack
+    if (sp >= 0) {
+        stack[sp] = tos;
+    }
+    vm->pc = pc;
+    vm->sp = sp;
+    vm->bp = bp;
+    vm->status = (pl0_status) status;
+    vm->error = error;
+    return vm->status;
+}
+
+static pl0_status VM_NAME(run)(pl0_vm *vm, long budget) {
+    return VM_NAME(execute)(vm, budget, 0, 0, 0);
+}
+
+static pl0_status VM_NAME(run_tiered)(pl0_vm *vm, long budget) {
+    return VM_NAME(execute)(vm, budget, 0, 1, 0);
+}
+
+static pl0_status VM_NAME(run_profiled)(pl0_vm *vm, long budget) {
+    return VM_NAME(execute)(vm, budget, 0, 0, 1);
+}
+
+static pl0_status VM_NAME(step)(pl0_vm *vm) {
+    return VM_NAME(execute)(vm, -1, 1, vm->heat != NULL && vm->profile == NULL, vm->profile != NULL);
+}
+
+#undef VM_CONCAT_
+#undef VM_CONCAT
+#undef VM_NAME
+#undef VM_RUNNING
+#undef VM_LEVEL
+#undef VM_COUNT